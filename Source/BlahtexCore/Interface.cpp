@@ -49,6 +49,77 @@ wstring Interface::GetPurifiedTexOnly()
     return mManager->GeneratePurifiedTexOnly();
 }
 
+wstring Interface::GetImageKey()
+{
+    return mManager->GenerateImageKey(mPurifiedTexOptions);
+}
+
+wstring Interface::GetCanonicalKey()
+{
+    wstring key = mManager->GenerateCanonicalKey(
+        mPurifiedTexOptions, mMathmlOptions, mEncodingOptions
+    );
+    if (mIndented)
+        key += L"indented\n";
+    return key;
+}
+
+// Runs "action" (a call to one of the methods above), turning the
+// blahtex::Exception it may throw into a Status.
+template <class Action> static bool Try(Status& status, Action action)
+{
+    try
+    {
+        action();
+    }
+    catch (TokenException& e)
+    {
+        status.SetError(e);
+        return false;
+    }
+    catch (Exception& e)
+    {
+        status.SetError(e);
+        return false;
+    }
+    status.Clear();
+    return true;
+}
+
+bool Interface::TryProcessInput(
+    const wstring& input,
+    bool displayStyle,
+    Status& status
+)
+{
+    return Try(status, [&]() { ProcessInput(input, displayStyle); });
+}
+
+bool Interface::TryGetMathml(wstring& output, Status& status)
+{
+    return Try(status, [&]() { output = GetMathml(); });
+}
+
+bool Interface::TryGetPurifiedTex(wstring& output, Status& status)
+{
+    return Try(status, [&]() { output = GetPurifiedTex(); });
+}
+
+bool Interface::TryGetPurifiedTexOnly(wstring& output, Status& status)
+{
+    return Try(status, [&]() { output = GetPurifiedTexOnly(); });
+}
+
+bool Interface::TryGetImageKey(wstring& output, Status& status)
+{
+    return Try(status, [&]() { output = GetImageKey(); });
+}
+
+bool Interface::TryGetCanonicalKey(wstring& output, Status& status)
+{
+    return Try(status, [&]() { output = GetCanonicalKey(); });
+}
+
 #ifdef BLAHTEXML_USING_XERCES
 void Interface::PrintAsSAX2(ContentHandler& sax, const wstring& prefix, bool ignoreFirstmrow) const
 {
@@ -46,6 +46,12 @@ namespace blahtex
 // (4) Call GetMathml() to get the MathML output
 // (5) Call GetPurifiedTex() to get a complete TeX file that could be sent
 //     to latex to generate graphical output
+//
+// Invalid input makes these methods throw a blahtex::Exception; the Try...
+// variants report it in a Status object instead.
+//
+// Each thread that converts formulas needs an Interface of its own (see the
+// note on reentrancy in Manager.h).
 
 class Interface
 {
@@ -74,6 +80,26 @@ public:
     std::wstring GetMathml();
     std::wstring GetPurifiedTex();
     std::wstring GetPurifiedTexOnly();
+    // See Manager::GenerateImageKey.
+    std::wstring GetImageKey();
+    // See Manager::GenerateCanonicalKey; also covers mIndented.
+    std::wstring GetCanonicalKey();
+
+    // The same as the methods above, except that instead of throwing a
+    // blahtex::Exception they return false and describe the error in
+    // "status"; on success they return true and clear "status". They suit
+    // callers that expect a lot of invalid input, or that can't let
+    // exceptions through.
+    bool TryProcessInput(
+        const std::wstring& input,
+        bool displayStyle,
+        Status& status
+    );
+    bool TryGetMathml(std::wstring& output, Status& status);
+    bool TryGetPurifiedTex(std::wstring& output, Status& status);
+    bool TryGetPurifiedTexOnly(std::wstring& output, Status& status);
+    bool TryGetImageKey(std::wstring& output, Status& status);
+    bool TryGetCanonicalKey(std::wstring& output, Status& status);
 #ifdef BLAHTEXML_USING_XERCES
     void PrintAsSAX2(ContentHandler& sax, const std::wstring& prefix, bool ignoreFirstmrow) const;
 #endif
@@ -16,6 +16,7 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 */
 
 #include <iterator>
+#include <stdexcept>
 #include "MacroProcessor.h"
 
 using namespace std;
@@ -52,6 +53,52 @@ MacroProcessor::MacroProcessor(const vector<Token>& input)
 	
     mCostIncurred = input.size();
     mIsTokenReady = false;
+    mInheritedMacros = NULL;
+    mHighestCost = 0;
+}
+
+MacroProcessor::MacroProcessor(
+    const vector<Token>& input,
+    const MacroProcessor& definitions
+)
+{
+    if (definitions.mBackIndex != -1 || definitions.mInheritedMacros)
+        throw logic_error(
+            "Unexpected definitions in MacroProcessor::MacroProcessor"
+        );
+
+    mTokens.assign(input.rbegin(), input.rend());
+    mBackIndex = mTokens.size() - 1;
+
+    // Processing the definitions ahead of the input would have cost the
+    // same, since each token costs one unit whether it is consumed before
+    // or after the definitions. Each check made while processing them
+    // would have counted the input twice (as tokens left, and as cost).
+    mCostIncurred = definitions.mCostIncurred + input.size();
+    mHighestCost = definitions.mHighestCost + 2 * input.size();
+    if (mHighestCost >= cMaxParseCost)
+        throw Exception(L"TooManyTokens");
+
+    mIsTokenReady = false;
+    mInheritedMacros = &definitions.mMacros;
+}
+
+const MacroProcessor::Macro* MacroProcessor::FindMacro(
+    const wstring& name
+) const
+{
+    wishful_hash_map<wstring, Macro>::const_iterator
+        macroPtr = mMacros.find(name);
+    if (macroPtr != mMacros.end())
+        return &macroPtr->second;
+
+    if (mInheritedMacros)
+    {
+        macroPtr = mInheritedMacros->find(name);
+        if (macroPtr != mInheritedMacros->end())
+            return &macroPtr->second;
+    }
+    return NULL;
 }
 
 void MacroProcessor::Advance()
@@ -150,7 +197,7 @@ void MacroProcessor::HandleNewcommand()
     )
         throw Exception(L"MissingCommandAfterNewcommand");
     wstring newCommand = mTokens[mBackIndex].getValue();
-    if (mMacros.count(newCommand) || IsInTokenTables(newCommand))
+    if (FindMacro(newCommand) || IsInTokenTables(newCommand))
         throw Exception(
             L"IllegalRedefinition",
             StripReservedSuffix(newCommand)
@@ -198,8 +245,11 @@ Token & MacroProcessor::Peek()
     {
         // This is the only place that we check that the user hasn't
         // exceeded the token limit.
-        if ((mBackIndex + 1) + (++mCostIncurred) >= cMaxParseCost)
+        unsigned long long cost = (mBackIndex + 1) + (++mCostIncurred);
+        if (cost >= cMaxParseCost)
             throw Exception(L"TooManyTokens");
+        if (cost > mHighestCost)
+            mHighestCost = cost;
 
         if (mIsTokenReady)
             return mTokens[mBackIndex];
@@ -274,9 +324,8 @@ Token & MacroProcessor::Peek()
         else
         {
             wstring token = mTokens[mBackIndex].getValue();
-            wishful_hash_map<wstring, Macro>::const_iterator
-                macroPtr = mMacros.find(token);
-            if (macroPtr == mMacros.end())
+            const Macro* macroPtr = FindMacro(token);
+            if (!macroPtr)
             {
                 // In this case it's not "\sqrt" and not a macro, so
                 // we're finished here.
@@ -284,7 +333,7 @@ Token & MacroProcessor::Peek()
                 return mTokens[mBackIndex];
             }
 
-            const Macro& macro = macroPtr->second;
+            const Macro& macro = *macroPtr;
             mBackIndex--;
 
             // It's a macro. Determines the arguments to substitute in....
@@ -49,6 +49,18 @@ public:
     // Input is a vector of strings, one for each input token.
     MacroProcessor(const std::vector<Token>& input);
 
+    // Same as above, but starts out as if the input that "definitions"
+    // was constructed with had been prepended to this input: its macros
+    // are visible (and may not be redefined), and the cost it incurred is
+    // carried over. "definitions" must have consumed all of its input, and
+    // must outlive this object; it is only read from, so several
+    // MacroProcessors may share it. (Manager uses this to process the
+    // standard macros once, instead of once per input.)
+    MacroProcessor(
+        const std::vector<Token>& input,
+        const MacroProcessor& definitions
+    );
+
     // Returns the next token on the stack (without removing it), after
     // expanding macros.
     // Returns empty string if there are no tokens left.
@@ -95,6 +107,13 @@ private:
     // List of all currently recognised macros.
     wishful_hash_map<std::wstring, Macro> mMacros;
 
+    // Macros inherited from the "definitions" constructor argument, or
+    // NULL if there aren't any. They are looked up after mMacros.
+    const wishful_hash_map<std::wstring, Macro>* mInheritedMacros;
+
+    // Returns the macro called "name", or NULL if there isn't one.
+    const Macro* FindMacro(const std::wstring& name) const;
+
     // The token stack; the top of the stack is mTokens.back().
     std::vector<Token> mTokens;
 	long long mBackIndex;
@@ -118,6 +137,12 @@ private:
     // Total approximate cost of parsing activity so far.
     // (See cMaxParseCost.)
     unsigned mCostIncurred;
+
+    // The highest value compared against cMaxParseCost so far. (Peek
+    // compares the cost plus the number of tokens left, which the
+    // definitions carried over by the second constructor need in order to
+    // fail on exactly the same inputs as unshared definitions would.)
+    unsigned long long mHighestCost;
 };
 
 }
@@ -19,6 +19,7 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 #include <sstream>
 #include <stdexcept>
 #include <iterator>
+#include <mutex>
 #include "Manager.h"
 #include "Parser.h"
 
@@ -314,24 +315,34 @@ wstring Manager::gStandardMacros =
     L"\\newcommand{\\cyrReserved}     [1]{{\\cyr{#1}}}"
 ;
 
-vector<Token> Manager::gStandardMacrosTokenised;
-vector<Token> Manager::gTexvcCompatibilityMacrosTokenised;
+const MacroProcessor* Manager::gStandardDefinitions = NULL;
+const MacroProcessor* Manager::gTexvcCompatibilityDefinitions = NULL;
+
+// Runs "macros" through a parser, and returns the resulting definitions.
+static const MacroProcessor* ProcessDefinitions(const wstring& macros)
+{
+    vector<Token> tokens;
+    Tokenise(macros, tokens);
+    Parser P;
+    P.DoParse(tokens);
+    return P.ReleaseMacroProcessor().release();
+}
 
 Manager::Manager()
 {
     if (sizeof(RGBColour) != 4)
         throw runtime_error("The \"unsigned\" type is not 4 bytes wide!");
 
-    // Tokenise the standard macros if it hasn't been done already.
-
-    if (gTexvcCompatibilityMacrosTokenised.empty())
-        Tokenise(
-            gTexvcCompatibilityMacros,
-            gTexvcCompatibilityMacrosTokenised
+    // Process the standard macros if it hasn't been done already. Several
+    // threads may construct a Manager at the same time; call_once makes the
+    // others wait until the first one is done.
+    static once_flag macrosProcessed;
+    call_once(macrosProcessed, []() {
+        gStandardDefinitions = ProcessDefinitions(gStandardMacros);
+        gTexvcCompatibilityDefinitions = ProcessDefinitions(
+            gTexvcCompatibilityMacros + gStandardMacros
         );
-
-    if (gStandardMacrosTokenised.empty())
-        Tokenise(gStandardMacros, gStandardMacrosTokenised);
+    });
 
     mStrictSpacingRequested = false;
 }
@@ -407,23 +418,15 @@ void Manager::ProcessInput(const wstring& input, bool texvcCompatibility, bool d
         }
     }
 
-    vector<Token> tokens;
-
-    // Append the texvc-compatibility and standard macros where appropriate.
-
-    if (texvcCompatibility)
-        tokens = gTexvcCompatibilityMacrosTokenised;
-
-    copy(
-        gStandardMacrosTokenised.begin(),
-        gStandardMacrosTokenised.end(),
-        back_inserter(tokens)
-    );
-    copy(inputTokens.begin(), inputTokens.end(), back_inserter(tokens));
-
-    // Generate the parse tree and the layout tree.
+    // Generate the parse tree and the layout tree. The texvc-compatibility
+    // and standard macros, where appropriate, are already defined.
     Parser P;
-    mParseTree = P.DoParse(tokens);
+    mParseTree = P.DoParse(
+        inputTokens,
+        texvcCompatibility
+            ? gTexvcCompatibilityDefinitions
+            : gStandardDefinitions
+    );
     mHasDelayedMathmlError = false;
     
     try
@@ -601,6 +604,44 @@ wstring Manager::GeneratePurifiedTexOnly() const
     return result;
 }
 
+wstring Manager::GenerateImageKey(
+    const PurifiedTexOptions& purifiedTexOptions
+) const
+{
+    // The version number changes whenever the format of the key changes,
+    // or the image for the same key would.
+    wostringstream key;
+    key << L"blahtex-image-key-1\n"
+        << GeneratePurifiedTexOnly() << L"\n"
+        << L"display=" << purifiedTexOptions.mDisplayMath
+        << L" ucs=" << purifiedTexOptions.mAllowUcs
+        << L" cjk=" << purifiedTexOptions.mAllowCJK
+        << L" preview=" << purifiedTexOptions.mAllowPreview << L"\n"
+        << purifiedTexOptions.mJapaneseFont << L"\n"
+        << purifiedTexOptions.mLaTeXPreamble << L"\n"
+        << purifiedTexOptions.mLaTeXBeforeMath << L"\n";
+    return key.str();
+}
+
+wstring Manager::GenerateCanonicalKey(
+    const PurifiedTexOptions& purifiedTexOptions,
+    const MathmlOptions& mathmlOptions,
+    const EncodingOptions& encodingOptions
+) const
+{
+    wostringstream key;
+    key << L"blahtex-key-2\n"
+        << GenerateImageKey(purifiedTexOptions)
+        << L"strict=" << mStrictSpacingRequested
+        << L" spacing=" << mathmlOptions.mSpacingControl
+        << L" fonts1=" << mathmlOptions.mUseVersion1FontAttributes
+        << L" plane1=" << mathmlOptions.mAllowPlane1
+        << L" encoding=" << encodingOptions.mMathmlEncoding
+        << L" otherraw=" << encodingOptions.mOtherEncodingRaw
+        << L" plane1enc=" << encodingOptions.mAllowPlane1 << L"\n";
+    return key.str();
+}
+
 }
 
 // end of file @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
@@ -30,6 +30,8 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 namespace blahtex
 {
 
+class MacroProcessor;
+
 // The Manager class coordinates all the bits and pieces required to convert
 // the given TeX input into MathML and purified TeX output, including
 // tokenising, texvc-compatiblity macros, building the parse and layout
@@ -39,6 +41,12 @@ namespace blahtex
 // The Manager class could be used as an interface between the blahtex core
 // and an external program; alternatively, the Interface class (see
 // Interface.h) provides a simpler interface.
+//
+// The core is reentrant: its tables are either built before main() runs or
+// built once under call_once, and never modified afterwards. Different
+// threads may use different Manager (or Interface) objects at the same time
+// without locking; a single object must only be used by one thread at a
+// time.
 
 class Manager
 {
@@ -75,6 +83,25 @@ public:
     // the equation in LaTeX
     std::wstring GeneratePurifiedTexOnly() const;
 
+    // GenerateImageKey returns a string that identifies the rendered
+    // image for this input: the normalised purified TeX body, followed by
+    // every option that affects the purified TeX document. Inputs that
+    // only differ on the surface (whitespace, "\frac12" vs "\frac{1}{2}",
+    // texvc aliases, ...) get the same key, and so do their images. It is
+    // meant to be hashed (e.g. with md5) to name cached images.
+    std::wstring GenerateImageKey(
+        const PurifiedTexOptions& purifiedTexOptions
+    ) const;
+
+    // GenerateCanonicalKey returns a string that identifies all of the
+    // output for this input: the image key, followed by every option that
+    // only affects the MathML.
+    std::wstring GenerateCanonicalKey(
+        const PurifiedTexOptions& purifiedTexOptions,
+        const MathmlOptions& mathmlOptions,
+        const EncodingOptions& encodingOptions
+    ) const;
+
     // A few accessor functions.
     const ParseTree::MathNode* GetParseTree() const
     {
@@ -116,10 +143,14 @@ private:
     // AMS-LaTeX. (See also the texvcCompatibility flag.)
     static std::wstring gTexvcCompatibilityMacros;
 
-    // Tokenised version of gStandardMacros and gTexvcCompatibilityMacros
-    // (computed only once, when first used):
-    static std::vector<Token> gStandardMacrosTokenised;
-    static std::vector<Token> gTexvcCompatibilityMacrosTokenised;
+    // gStandardMacros, and gTexvcCompatibilityMacros followed by
+    // gStandardMacros, already run through the parser (computed only once,
+    // by the first Manager constructed, and never modified or freed
+    // afterwards). ProcessInput hands them to Parser::DoParse as the
+    // definitions preceding the input, so that the macros don't get
+    // tokenised and defined all over again for every input.
+    static const MacroProcessor* gStandardDefinitions;
+    static const MacroProcessor* gTexvcCompatibilityDefinitions;
 };
 
 }
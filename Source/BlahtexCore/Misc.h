@@ -116,6 +116,75 @@ public:
 };
 
 
+// Status is the non-throwing counterpart of Exception, filled in by the
+// Try... methods of Interface. It is either OK, or holds the error (as an
+// Exception, so that it can be formatted like one) together with the span
+// of input it refers to, for errors that carry a token.
+class Status
+{
+private:
+    Exception mError;
+    bool mHasSpan;
+    unsigned long long mStartPos;
+    unsigned long long mLength;
+
+public:
+    Status() :
+        mHasSpan(false),
+        mStartPos(0),
+        mLength(0)
+    {
+    }
+
+    bool IsOk() const
+    {
+        return mError.GetCode().empty();
+    }
+
+    const Exception& GetError() const
+    {
+        return mError;
+    }
+
+    // Whether the error carries a span; the start position and length are
+    // counted in characters of the input. (The length may be zero, for
+    // tokens that came out of macro expansion.)
+    bool HasSpan() const
+    {
+        return mHasSpan;
+    }
+
+    unsigned long long GetStartPos() const
+    {
+        return mStartPos;
+    }
+
+    unsigned long long GetLength() const
+    {
+        return mLength;
+    }
+
+    void Clear()
+    {
+        *this = Status();
+    }
+
+    void SetError(const Exception& error)
+    {
+        Clear();
+        mError = error;
+    }
+
+    void SetError(const TokenException& error)
+    {
+        mError = error;
+        mHasSpan = true;
+        mStartPos = error.getToken().getStartPos();
+        mLength = error.getToken().getLength();
+    }
+};
+
+
 // EncodingOptions describes output character encoding options.
 struct EncodingOptions
 {
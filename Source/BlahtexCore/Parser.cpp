@@ -943,9 +943,15 @@ Parser::TokenCode Parser::GetTextTokenCode(const Token& token) const
     throw Exception(L"UnrecognisedCommand", value);
 }
 
-auto_ptr<ParseTree::MathNode> Parser::DoParse(const vector<Token>& input)
+auto_ptr<ParseTree::MathNode> Parser::DoParse(
+    const vector<Token>& input,
+    const MacroProcessor* definitions
+)
 {
-    mTokenSource.reset(new MacroProcessor(input));
+    if (definitions)
+        mTokenSource.reset(new MacroProcessor(input, *definitions));
+    else
+        mTokenSource.reset(new MacroProcessor(input));
 
     // Parse until we hit a closing token of some kind...
     auto_ptr<ParseTree::MathNode> output = ParseMathList();
@@ -33,10 +33,23 @@ class Parser
 public:
     // Main function that the caller should use to do a parsing job.
     // Input is a TeX string, output is the root of a parse tree.
+    //
+    // If "definitions" is not NULL, the input is parsed as if the input
+    // that produced it (see ReleaseMacroProcessor) came first; see the
+    // corresponding MacroProcessor constructor.
     std::auto_ptr<ParseTree::MathNode> DoParse(
-        const std::vector<Token>& input
+        const std::vector<Token>& input,
+        const MacroProcessor* definitions = NULL
     );
 
+    // Hands over the MacroProcessor used by the last DoParse call, holding
+    // every macro defined by its input. It can then be passed as the
+    // "definitions" argument of later DoParse calls.
+    std::auto_ptr<MacroProcessor> ReleaseMacroProcessor()
+    {
+        return mTokenSource;
+    }
+
     // The parser uses GetMathTokenCode (in math mode) or GetTextTokenCode
     // (in text mode) to translate each incoming token into one of the
     // following values:
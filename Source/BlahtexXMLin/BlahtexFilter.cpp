@@ -18,6 +18,7 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 #include "AttributesImpl.h"
 #include "BlahtexFilter.h"
 #include "mainPng.h"
+#include "UnicodeConverter.h"
 #include "XercesString.h"
 #include <iostream>
 #include <xercesc/framework/StdInInputSource.hpp>
@@ -37,7 +38,7 @@ using namespace std;
 extern wstring GetErrorMessage(const blahtex::Exception& e);
 
 BlahtexFilter::BlahtexFilter(SAX2XMLReader* parent, blahtex::Interface& anInterface)
-    : SAX2XMLFilterImpl(parent), interface(anInterface), numberOfErrors(0)
+    : SAX2XMLFilterImpl(parent), interface(anInterface), numberOfErrors(0), useCanonicalKey(false), pngRenderPool(0)
 {
 }
 
@@ -126,11 +127,24 @@ void BlahtexFilter::startElement(const XMLCh* const uri, const XMLCh* const loca
                 if (annotatePNG) {
                     static XercesString PNG("image-file-PNG");
                     wstring purifiedTex = interface.GetPurifiedTex();
-                    PngInfo info = MakePngFile(purifiedTex, "", pngParams);
+                    string key;
+                    if (useCanonicalKey)
+                        key = ImageKeyMd5(interface.GetImageKey());
+                    string fullFileName;
+                    if (pngRenderPool) {
+                        // The file name only depends on the md5, so we can write it out
+                        // now, and let the image be rendered in the background.
+                        string md5;
+                        shared_future<PngInfo> png = pngRenderPool->Submit(purifiedTex, "", &md5, key);
+                        fullFileName = PngFullFileName(md5, pngParams);
+                        pendingPngs.insert(make_pair(fullFileName, png));
+                    }
+                    else
+                        fullFileName = MakePngFile(purifiedTex, "", pngParams, key).fullFileName;
                     AttributesImpl annotationAttributes;
                     annotationAttributes.addAttribute(encoding.c_str(), empty.c_str(), encoding.c_str(), PNG.c_str(), empty.c_str());
                     SAX2XMLFilterImpl::startElement(MathMLnamespace.c_str(), unprefixedAnnotation.c_str(), prefixedAnnotation.c_str(), annotationAttributes);
-                    XercesString fileName(info.fullFileName.c_str());
+                    XercesString fileName(fullFileName.c_str());
                     SAX2XMLFilterImpl::characters(fileName.data(), fileName.size());
                     SAX2XMLFilterImpl::endElement(MathMLnamespace.c_str(), unprefixedAnnotation.c_str(), prefixedAnnotation.c_str());
                 }
@@ -214,7 +228,36 @@ void BlahtexFilter::setAnnotateTeX(bool anAnnotateTeX)
     annotateTeX = anAnnotateTeX;
 }
 
+void BlahtexFilter::setUseCanonicalKey(bool aUseCanonicalKey)
+{
+    useCanonicalKey = aUseCanonicalKey;
+}
+
 void BlahtexFilter::setPngParams(const PngParams& aPngParams)
 {
     pngParams = aPngParams;
 }
+
+void BlahtexFilter::setPngRenderPool(PngRenderPool* aPngRenderPool)
+{
+    pngRenderPool = aPngRenderPool;
+}
+
+// Waits for the PNG renders queued by startElement. Failed renders are
+// reported on cerr; returns their number.
+int BlahtexFilter::waitForPngs()
+{
+    int numberOfPngErrors = 0;
+    for (map<string, shared_future<PngInfo> >::iterator i = pendingPngs.begin(); i != pendingPngs.end(); ++i) {
+        try {
+            i->second.get();
+        }
+        catch (blahtex::Exception& e) {
+            cerr << "Cannot render " << i->first << ": "
+                << gUnicodeConverter.ConvertOut(GetErrorMessage(e)) << endl;
+            numberOfPngErrors++;
+        }
+    }
+    pendingPngs.clear();
+    return numberOfPngErrors;
+}
@@ -16,11 +16,13 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 */
 
 #include <list>
+#include <map>
 #include <string>
 #include <utility>
 #include <xercesc/parsers/SAX2XMLFilterImpl.hpp>
 #include "../BlahtexCore/Interface.h"
 #include "mainPng.h"
+#include "PngRenderPool.h"
 
 XERCES_CPP_NAMESPACE_USE
 
@@ -37,7 +39,12 @@ protected:
     PrefixType desiredMathMLPrefixType;
     wstring desiredMathMLPrefix;
     bool annotatePNG, annotateTeX;
+    // If set, images are named after the canonical key (see "--canonical-key").
+    bool useCanonicalKey;
     PngParams pngParams;
+    PngRenderPool* pngRenderPool;
+    // Renders queued on pngRenderPool that nobody waited for yet, by file name.
+    map<string, shared_future<PngInfo> > pendingPngs;
 public:
     BlahtexFilter(SAX2XMLReader* parent, blahtex::Interface& anInterface);
     ~BlahtexFilter();
@@ -49,7 +56,10 @@ public:
     void setDesiredMathMLPrefixType(PrefixType aPrefixType, const wstring& aPrefix);
     void setAnnotatePNG(bool anAnnotatePNG);
     void setAnnotateTeX(bool anAnnotateTeX);
+    void setUseCanonicalKey(bool aUseCanonicalKey);
     void setPngParams(const PngParams& aPngParams);
+    void setPngRenderPool(PngRenderPool* aPngRenderPool);
+    int waitForPngs();
 protected:
     bool getMathMLprefix(wstring& prefix);
 };
@@ -0,0 +1,499 @@
+/*
+blahtex: a TeX to MathML converter designed with MediaWiki in mind
+blahtexml: an extension of blahtex with XML processing in mind
+http://gva.noekeon.org/blahtexml
+
+Copyright (c) 2006, David Harvey
+Copyright (c) 2010, Gilles Van Assche
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the names of the authors nor the names of their affiliation may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "HttpServer.h"
+#include "Server.h"
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#endif
+
+using namespace std;
+
+
+string HttpRequest::GetHeader(const string& name) const
+{
+    map<string, string>::const_iterator header = mHeaders.find(name);
+    return header == mHeaders.end() ? "" : header->second;
+}
+
+
+HttpServer::HttpServer(
+    int port,
+    const Handler& handler,
+    unsigned numberOfWorkers,
+    double idleTimeout
+) :
+    mPort(port),
+    mHandler(handler),
+    mNumberOfWorkers(numberOfWorkers),
+    mIdleTimeout(idleTimeout),
+    mStopping(false)
+{
+    if (mNumberOfWorkers == 0)
+        mNumberOfWorkers = thread::hardware_concurrency();
+    if (mNumberOfWorkers == 0)
+        mNumberOfWorkers = 1;
+}
+
+
+#ifdef _WIN32
+
+void HttpServer::Run()
+{
+    throw runtime_error("The HTTP server is not available on Windows");
+}
+
+void HttpServer::Work(unsigned worker) { }
+void HttpServer::Serve(int fd, unsigned worker) { }
+bool HttpServer::WaitForData(int fd, bool idle) { return false; }
+
+bool HttpServer::SendResponse(
+    int fd,
+    const HttpRequest& request,
+    HttpResponse response,
+    bool keepAlive
+)
+{
+    return false;
+}
+
+#else
+
+static bool SendAll(int fd, const char* buffer, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t count = send(fd, buffer, size, 0);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return false;
+        buffer += count;
+        size -= count;
+    }
+    return true;
+}
+
+// Copies size bytes of the file to the socket, without going through
+// user space where possible.
+static bool SendFile(int fd, int fileFd, size_t size)
+{
+#ifdef __linux__
+    off_t offset = 0;
+    while (size > 0)
+    {
+        ssize_t count = sendfile(fd, fileFd, &offset, size);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return false;
+        size -= count;
+    }
+    return true;
+#else
+    char buffer[65536];
+    while (size > 0)
+    {
+        ssize_t count = read(fileFd, buffer, min(size, sizeof(buffer)));
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0 || !SendAll(fd, buffer, count))
+            return false;
+        size -= count;
+    }
+    return true;
+#endif
+}
+
+static const char* StatusText(int status)
+{
+    switch (status)
+    {
+        case 200: return "OK";
+        case 304: return "Not Modified";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 411: return "Length Required";
+        case 413: return "Payload Too Large";
+        case 500: return "Internal Server Error";
+        case 501: return "Not Implemented";
+        case 503: return "Service Unavailable";
+        default:  return "Unknown";
+    }
+}
+
+static string ToLower(string s)
+{
+    for (size_t i = 0; i < s.size(); i++)
+        if (s[i] >= 'A' && s[i] <= 'Z')
+            s[i] += 'a' - 'A';
+    return s;
+}
+
+static string Trim(const string& s)
+{
+    size_t begin = s.find_first_not_of(" \t");
+    if (begin == string::npos)
+        return "";
+    return s.substr(begin, s.find_last_not_of(" \t") - begin + 1);
+}
+
+// Parses the request line and the headers; returns false if they are
+// malformed.
+static bool ParseRequestHead(const string& head, HttpRequest& request, string& version)
+{
+    istringstream lines(head);
+    string line;
+    if (!getline(lines, line))
+        return false;
+    if (!line.empty() && line[line.size() - 1] == '\r')
+        line.erase(line.size() - 1);
+
+    istringstream requestLine(line);
+    string target;
+    if (!(requestLine >> request.mMethod >> target >> version)
+        || version.compare(0, 5, "HTTP/") != 0
+        || target.empty() || target[0] != '/'
+    )
+        return false;
+
+    size_t question = target.find('?');
+    request.mPath = target.substr(0, question);
+    if (question != string::npos)
+        request.mQuery = target.substr(question + 1);
+
+    while (getline(lines, line))
+    {
+        if (!line.empty() && line[line.size() - 1] == '\r')
+            line.erase(line.size() - 1);
+        if (line.empty())
+            continue;
+        size_t colon = line.find(':');
+        if (colon == string::npos)
+            return false;
+        request.mHeaders[ToLower(Trim(line.substr(0, colon)))] =
+            Trim(line.substr(colon + 1));
+    }
+    return true;
+}
+
+
+void HttpServer::Run()
+{
+    int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenFd < 0)
+        throw runtime_error("Cannot create a socket");
+    fcntl(listenFd, F_SETFD, FD_CLOEXEC);
+
+    int yes = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(mPort);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(listenFd, (sockaddr*) &address, sizeof(address)) != 0
+        || listen(listenFd, 64) != 0
+    )
+    {
+        close(listenFd);
+        ostringstream message;
+        message << "Cannot listen on port " << mPort;
+        throw runtime_error(message.str());
+    }
+
+    unique_ptr<StopSignals> stopSignals;
+    try
+    {
+        stopSignals.reset(new StopSignals);
+    }
+    catch (runtime_error&)
+    {
+        close(listenFd);
+        throw;
+    }
+
+    mStopping = false;
+    vector<thread> workers;
+    for (unsigned worker = 0; worker < mNumberOfWorkers; worker++)
+        workers.push_back(thread(&HttpServer::Work, this, worker));
+
+    while (true)
+    {
+        pollfd fds[2];
+        fds[0].fd = listenFd;
+        fds[0].events = POLLIN;
+        fds[1].fd = stopSignals->GetFd();
+        fds[1].events = POLLIN;
+
+        int ready = poll(fds, 2, -1);
+        if (ready < 0 && errno != EINTR)
+            break;
+        if (ready <= 0)
+            continue;
+
+        if (fds[1].revents)
+            break;
+
+        if (fds[0].revents & POLLIN)
+        {
+            int fd = accept(listenFd, NULL, NULL);
+            if (fd < 0)
+            {
+                if (errno == EMFILE || errno == ENFILE)
+                    usleep(100000);
+                continue;
+            }
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+            lock_guard<mutex> lock(mMutex);
+            mConnections.push_back(fd);
+            mConnectionAvailable.notify_one();
+        }
+    }
+
+    close(listenFd);
+    {
+        lock_guard<mutex> lock(mMutex);
+        mStopping = true;
+    }
+    mConnectionAvailable.notify_all();
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+}
+
+
+void HttpServer::Work(unsigned worker)
+{
+    while (true)
+    {
+        int fd;
+        {
+            unique_lock<mutex> lock(mMutex);
+            while (mConnections.empty() && !mStopping)
+                mConnectionAvailable.wait(lock);
+            if (mConnections.empty())
+                return;
+            fd = mConnections.front();
+            mConnections.pop_front();
+        }
+
+        Serve(fd, worker);
+        close(fd);
+    }
+}
+
+
+// Waits until there is something to read on fd. Returns false if the
+// client took too long, or if the server is stopping. An idle connection
+// (between requests) is also given up when other connections are waiting
+// for a worker.
+bool HttpServer::WaitForData(int fd, bool idle)
+{
+    for (double waited = 0; waited < mIdleTimeout; waited += 0.1)
+    {
+        pollfd pollFd;
+        pollFd.fd = fd;
+        pollFd.events = POLLIN;
+        int ready = poll(&pollFd, 1, 100);
+        if (ready > 0)
+            return true;
+        if (ready < 0 && errno != EINTR)
+            return false;
+
+        if (idle)
+        {
+            lock_guard<mutex> lock(mMutex);
+            if (mStopping || !mConnections.empty())
+                return false;
+        }
+    }
+    return false;
+}
+
+
+void HttpServer::Serve(int fd, unsigned worker)
+{
+    string buffer;
+    while (true)
+    {
+        // Read the request line and the headers.
+        size_t headEnd;
+        while ((headEnd = buffer.find("\r\n\r\n")) == string::npos)
+        {
+            if (buffer.size() > cMaxRequestSize)
+            {
+                SendResponse(fd, HttpRequest(), HttpResponse(413), false);
+                return;
+            }
+            if (!WaitForData(fd, buffer.empty()))
+                return;
+            char chunk[8192];
+            ssize_t count = recv(fd, chunk, sizeof(chunk), 0);
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count <= 0)
+                return;
+            buffer.append(chunk, count);
+        }
+
+        HttpRequest request;
+        string version;
+        if (!ParseRequestHead(buffer.substr(0, headEnd), request, version))
+        {
+            SendResponse(fd, request, HttpResponse(400), false);
+            return;
+        }
+        buffer.erase(0, headEnd + 4);
+
+        if (!request.GetHeader("transfer-encoding").empty())
+        {
+            SendResponse(fd, request, HttpResponse(411), false);
+            return;
+        }
+
+        size_t contentLength = 0;
+        string lengthHeader = request.GetHeader("content-length");
+        if (!lengthHeader.empty()
+            && (lengthHeader.find_first_not_of("0123456789") != string::npos
+                || !(istringstream(lengthHeader) >> contentLength))
+        )
+        {
+            SendResponse(fd, request, HttpResponse(400), false);
+            return;
+        }
+        if (contentLength > cMaxRequestSize)
+        {
+            SendResponse(fd, request, HttpResponse(413), false);
+            return;
+        }
+
+        while (buffer.size() < contentLength)
+        {
+            if (!WaitForData(fd, false))
+                return;
+            char chunk[8192];
+            ssize_t count = recv(fd, chunk, sizeof(chunk), 0);
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count <= 0)
+                return;
+            buffer.append(chunk, count);
+        }
+        request.mBody = buffer.substr(0, contentLength);
+        buffer.erase(0, contentLength);
+
+        string connection = ToLower(request.GetHeader("connection"));
+        bool keepAlive = version == "HTTP/1.0"
+            ? connection == "keep-alive" : connection != "close";
+        {
+            lock_guard<mutex> lock(mMutex);
+            if (mStopping)
+                keepAlive = false;
+        }
+
+        HttpResponse response;
+        try
+        {
+            response = mHandler(request, worker);
+        }
+        catch (std::exception& e)
+        {
+            response = HttpResponse(500);
+            response.mContentType = "text/plain";
+            response.mBody = e.what();
+        }
+
+        if (!SendResponse(fd, request, response, keepAlive) || !keepAlive)
+            return;
+    }
+}
+
+
+bool HttpServer::SendResponse(
+    int fd,
+    const HttpRequest& request,
+    HttpResponse response,
+    bool keepAlive
+)
+{
+    int fileFd = -1;
+    size_t size = response.mBody.size();
+    if (!response.mFile.empty())
+    {
+        struct stat info;
+        fileFd = open(response.mFile.c_str(), O_RDONLY);
+        if (fileFd < 0 || fstat(fileFd, &info) != 0)
+        {
+            if (fileFd >= 0)
+                close(fileFd);
+            fileFd = -1;
+            response = HttpResponse(404);
+            size = 0;
+        }
+        else
+            size = info.st_size;
+    }
+
+    ostringstream head;
+    head << "HTTP/1.1 " << response.mStatus << " "
+        << StatusText(response.mStatus) << "\r\n";
+    if (!response.mContentType.empty())
+        head << "Content-Type: " << response.mContentType << "\r\n";
+    if (response.mStatus != 304)
+        head << "Content-Length: " << size << "\r\n";
+    for (size_t i = 0; i < response.mHeaders.size(); i++)
+        head << response.mHeaders[i].first << ": "
+            << response.mHeaders[i].second << "\r\n";
+    head << "Connection: " << (keepAlive ? "keep-alive" : "close") << "\r\n";
+    head << "\r\n";
+
+    bool sendBody = request.mMethod != "HEAD" && response.mStatus != 304;
+    string text = head.str();
+    if (sendBody && fileFd < 0)
+        text += response.mBody;
+
+    bool sent = SendAll(fd, text.data(), text.size());
+    if (sent && sendBody && fileFd >= 0)
+        sent = SendFile(fd, fileFd, size);
+
+    if (fileFd >= 0)
+        close(fileFd);
+    return sent;
+}
+
+#endif
+
+// end of file @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
@@ -0,0 +1,130 @@
+/*
+blahtex: a TeX to MathML converter designed with MediaWiki in mind
+blahtexml: an extension of blahtex with XML processing in mind
+http://gva.noekeon.org/blahtexml
+
+Copyright (c) 2006, David Harvey
+Copyright (c) 2010, Gilles Van Assche
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the names of the authors nor the names of their affiliation may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef BLAHTEX_HTTP_SERVER_H
+#define BLAHTEX_HTTP_SERVER_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// A request received by HttpServer.
+struct HttpRequest
+{
+    std::string mMethod;
+    std::string mPath;          // without the query string
+    std::string mQuery;         // after the '?', if any
+    std::string mBody;
+
+    // Header names are lowercase.
+    std::map<std::string, std::string> mHeaders;
+
+    // Returns the value of the given (lowercase) header, or "".
+    std::string GetHeader(const std::string& name) const;
+};
+
+// The response to an HttpRequest. Its body is either mBody or, if mFile is
+// set, the contents of that file, which are copied to the socket by the
+// kernel (with sendfile(2) where available).
+struct HttpResponse
+{
+    int mStatus;
+    std::string mContentType;
+    std::vector<std::pair<std::string, std::string> > mHeaders;
+    std::string mBody;
+    std::string mFile;
+
+    HttpResponse(int status = 200) :
+        mStatus(status)
+    { }
+};
+
+// HttpServer is a minimal HTTP/1.1 server (see "--http"), listening on the
+// loopback interface only. It supports keep-alive and pipelined requests
+// with a Content-Length body; chunked request bodies are refused. A fixed
+// set of worker threads serve the connections, one connection at a time
+// each; a connection that stays idle for idleTimeout seconds, or for a
+// moment while other connections are waiting, is closed.
+//
+// SIGTERM (or SIGINT) stops the server gracefully: it stops accepting
+// connections, finishes the requests being handled, and returns from Run.
+//
+// Not available on Windows, where Run throws.
+class HttpServer
+{
+public:
+    // Makes the response to a request; called on a worker thread, with the
+    // worker's number (from 0 to numberOfWorkers - 1), so that it can use
+    // per-worker objects.
+    typedef std::function<HttpResponse (const HttpRequest& request, unsigned worker)> Handler;
+
+    // Larger requests get "413 Payload Too Large".
+    static const size_t cMaxRequestSize = 1024 * 1024;
+
+    // If numberOfWorkers is 0, there is one worker per processor core.
+    HttpServer(
+        int port,
+        const Handler& handler,
+        unsigned numberOfWorkers = 0,
+        double idleTimeout = 5
+    );
+
+    // Listens on 127.0.0.1:port until SIGTERM or SIGINT arrives. Throws
+    // std::runtime_error if the socket can't be set up.
+    void Run();
+
+    unsigned GetNumberOfWorkers() const
+    {
+        return mNumberOfWorkers;
+    }
+
+private:
+    void Work(unsigned worker);
+    void Serve(int fd, unsigned worker);
+    bool WaitForData(int fd, bool idle);
+    bool SendResponse(
+        int fd,
+        const HttpRequest& request,
+        HttpResponse response,
+        bool keepAlive
+    );
+
+    int mPort;
+    Handler mHandler;
+    unsigned mNumberOfWorkers;
+    double mIdleTimeout;
+
+    std::mutex mMutex;
+    std::condition_variable mConnectionAvailable;
+    std::deque<int> mConnections;      // accepted, not yet served
+    bool mStopping;
+
+    // Not copyable.
+    HttpServer(const HttpServer&);
+    HttpServer& operator=(const HttpServer&);
+};
+
+#endif
+
+// end of file @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
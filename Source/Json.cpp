@@ -0,0 +1,326 @@
+/*
+blahtex: a TeX to MathML converter designed with MediaWiki in mind
+blahtexml: an extension of blahtex with XML processing in mind
+http://gva.noekeon.org/blahtexml
+
+Copyright (c) 2006, David Harvey
+Copyright (c) 2010, Gilles Van Assche
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the names of the authors nor the names of their affiliation may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Json.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace std;
+
+
+const JsonValue* JsonValue::Find(const string& name) const
+{
+    for (size_t i = 0; i < mObject.size(); i++)
+        if (mObject[i].first == name)
+            return &mObject[i].second;
+    return NULL;
+}
+
+
+// Recursive descent parser over a string.
+class JsonParser
+{
+public:
+    JsonParser(const string& text) :
+        mText(text),
+        mPos(0),
+        mDepth(0)
+    { }
+
+    JsonValue ParseDocument()
+    {
+        JsonValue value = ParseValue();
+        SkipWhitespace();
+        if (mPos != mText.size())
+            Fail("unexpected text after the value");
+        return value;
+    }
+
+private:
+    const string& mText;
+    size_t mPos;
+    int mDepth;
+
+    void Fail(const string& message)
+    {
+        char position[32];
+        sprintf(position, " at offset %u", static_cast<unsigned>(mPos));
+        throw JsonException(message + position);
+    }
+
+    void SkipWhitespace()
+    {
+        while (mPos < mText.size()
+            && (mText[mPos] == ' ' || mText[mPos] == '\t'
+                || mText[mPos] == '\n' || mText[mPos] == '\r')
+        )
+            mPos++;
+    }
+
+    bool Consume(const char* word)
+    {
+        size_t length = string(word).size();
+        if (mText.compare(mPos, length, word) != 0)
+            return false;
+        mPos += length;
+        return true;
+    }
+
+    void Expect(char c)
+    {
+        SkipWhitespace();
+        if (mPos >= mText.size() || mText[mPos] != c)
+            Fail(string("expected '") + c + "'");
+        mPos++;
+    }
+
+    JsonValue ParseValue()
+    {
+        SkipWhitespace();
+        if (mPos >= mText.size())
+            Fail("unexpected end of input");
+
+        // Deeply nested input could otherwise overflow the stack.
+        if (++mDepth > 64)
+            Fail("nested too deeply");
+
+        size_t start = mPos;
+        JsonValue value;
+        char c = mText[mPos];
+
+        if (c == '{')
+        {
+            value.mType = JsonValue::cObject;
+            mPos++;
+            SkipWhitespace();
+            if (mPos < mText.size() && mText[mPos] == '}')
+                mPos++;
+            else
+            {
+                while (true)
+                {
+                    SkipWhitespace();
+                    if (mPos >= mText.size() || mText[mPos] != '"')
+                        Fail("expected a member name");
+                    string name = ParseString();
+                    Expect(':');
+                    value.mObject.push_back(make_pair(name, ParseValue()));
+                    SkipWhitespace();
+                    if (mPos < mText.size() && mText[mPos] == ',')
+                        mPos++;
+                    else
+                    {
+                        Expect('}');
+                        break;
+                    }
+                }
+            }
+        }
+        else if (c == '[')
+        {
+            value.mType = JsonValue::cArray;
+            mPos++;
+            SkipWhitespace();
+            if (mPos < mText.size() && mText[mPos] == ']')
+                mPos++;
+            else
+            {
+                while (true)
+                {
+                    value.mArray.push_back(ParseValue());
+                    SkipWhitespace();
+                    if (mPos < mText.size() && mText[mPos] == ',')
+                        mPos++;
+                    else
+                    {
+                        Expect(']');
+                        break;
+                    }
+                }
+            }
+        }
+        else if (c == '"')
+        {
+            value.mType = JsonValue::cString;
+            value.mString = ParseString();
+        }
+        else if (Consume("true"))
+        {
+            value.mType = JsonValue::cBool;
+            value.mBool = true;
+        }
+        else if (Consume("false"))
+            value.mType = JsonValue::cBool;
+        else if (Consume("null"))
+            value.mType = JsonValue::cNull;
+        else if (c == '-' || (c >= '0' && c <= '9'))
+        {
+            const char* begin = mText.c_str() + mPos;
+            char* end;
+            value.mType = JsonValue::cNumber;
+            value.mNumber = strtod(begin, &end);
+            if (end == begin)
+                Fail("malformed number");
+            mPos += end - begin;
+        }
+        else
+            Fail("unexpected character");
+
+        value.mText = mText.substr(start, mPos - start);
+        mDepth--;
+        return value;
+    }
+
+    // Reads four hex digits of a "\u" escape.
+    unsigned ParseHex4()
+    {
+        if (mPos + 4 > mText.size())
+            Fail("truncated \\u escape");
+        unsigned code = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            char c = mText[mPos++];
+            code <<= 4;
+            if (c >= '0' && c <= '9')
+                code |= c - '0';
+            else if (c >= 'a' && c <= 'f')
+                code |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F')
+                code |= c - 'A' + 10;
+            else
+                Fail("malformed \\u escape");
+        }
+        return code;
+    }
+
+    static void AppendUtf8(string& output, unsigned code)
+    {
+        if (code < 0x80)
+            output += static_cast<char>(code);
+        else if (code < 0x800)
+        {
+            output += static_cast<char>(0xC0 | (code >> 6));
+            output += static_cast<char>(0x80 | (code & 0x3F));
+        }
+        else if (code < 0x10000)
+        {
+            output += static_cast<char>(0xE0 | (code >> 12));
+            output += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            output += static_cast<char>(0x80 | (code & 0x3F));
+        }
+        else
+        {
+            output += static_cast<char>(0xF0 | (code >> 18));
+            output += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+            output += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            output += static_cast<char>(0x80 | (code & 0x3F));
+        }
+    }
+
+    string ParseString()
+    {
+        mPos++;     // opening quote
+        string result;
+        while (true)
+        {
+            if (mPos >= mText.size())
+                Fail("unterminated string");
+            char c = mText[mPos++];
+            if (c == '"')
+                return result;
+            if (static_cast<unsigned char>(c) < 0x20)
+                Fail("control character in string");
+            if (c != '\\')
+            {
+                result += c;
+                continue;
+            }
+
+            if (mPos >= mText.size())
+                Fail("unterminated string");
+            c = mText[mPos++];
+            switch (c)
+            {
+                case '"':  result += '"';  break;
+                case '\\': result += '\\'; break;
+                case '/':  result += '/';  break;
+                case 'b':  result += '\b'; break;
+                case 'f':  result += '\f'; break;
+                case 'n':  result += '\n'; break;
+                case 'r':  result += '\r'; break;
+                case 't':  result += '\t'; break;
+                case 'u':
+                {
+                    unsigned code = ParseHex4();
+                    if (code >= 0xD800 && code < 0xDC00)
+                    {
+                        // A surrogate pair.
+                        if (!Consume("\\u"))
+                            Fail("unpaired surrogate");
+                        unsigned low = ParseHex4();
+                        if (low < 0xDC00 || low >= 0xE000)
+                            Fail("unpaired surrogate");
+                        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                    }
+                    else if (code >= 0xDC00 && code < 0xE000)
+                        Fail("unpaired surrogate");
+                    AppendUtf8(result, code);
+                    break;
+                }
+                default:
+                    Fail("unknown escape");
+            }
+        }
+    }
+};
+
+
+JsonValue ParseJson(const string& text)
+{
+    return JsonParser(text).ParseDocument();
+}
+
+
+string JsonQuote(const string& utf8)
+{
+    string result = "\"";
+    for (size_t i = 0; i < utf8.size(); i++)
+    {
+        unsigned char c = utf8[i];
+        switch (c)
+        {
+            case '"':  result += "\\\""; break;
+            case '\\': result += "\\\\"; break;
+            case '\n': result += "\\n";  break;
+            case '\r': result += "\\r";  break;
+            case '\t': result += "\\t";  break;
+            default:
+                if (c < 0x20)
+                {
+                    char escape[8];
+                    sprintf(escape, "\\u%04x", c);
+                    result += escape;
+                }
+                else
+                    result += c;
+        }
+    }
+    return result + "\"";
+}
+
+// end of file @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
@@ -0,0 +1,79 @@
+/*
+blahtex: a TeX to MathML converter designed with MediaWiki in mind
+blahtexml: an extension of blahtex with XML processing in mind
+http://gva.noekeon.org/blahtexml
+
+Copyright (c) 2006, David Harvey
+Copyright (c) 2010, Gilles Van Assche
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the names of the authors nor the names of their affiliation may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef BLAHTEX_JSON_H
+#define BLAHTEX_JSON_H
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// Just enough JSON for the requests and results of "--batch" mode (see
+// main.cpp). Strings are kept in UTF-8.
+struct JsonValue
+{
+    enum Type
+    {
+        cNull,
+        cBool,
+        cNumber,
+        cString,
+        cArray,
+        cObject
+    }
+    mType;
+
+    bool mBool;
+    double mNumber;
+    std::string mString;
+    std::vector<JsonValue> mArray;
+    std::vector<std::pair<std::string, JsonValue> > mObject;
+
+    // The value exactly as it appeared in the input, so that it can be
+    // echoed back (e.g. a request id).
+    std::string mText;
+
+    JsonValue() :
+        mType(cNull),
+        mBool(false),
+        mNumber(0)
+    { }
+
+    // Returns the member with the given name of an object, or NULL.
+    const JsonValue* Find(const std::string& name) const;
+};
+
+// Thrown by ParseJson on malformed input.
+struct JsonException
+{
+    std::string mMessage;
+
+    JsonException(const std::string& message) :
+        mMessage(message)
+    { }
+};
+
+// Parses a complete JSON text.
+extern JsonValue ParseJson(const std::string& text);
+
+// Returns the given UTF-8 string as a JSON string literal, with quotes.
+extern std::string JsonQuote(const std::string& utf8);
+
+#endif
+
+// end of file @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
@@ -0,0 +1,169 @@
+/*
+blahtex: a TeX to MathML converter designed with MediaWiki in mind
+blahtexml: an extension of blahtex with XML processing in mind
+http://gva.noekeon.org/blahtexml
+
+Copyright (c) 2006, David Harvey
+Copyright (c) 2010, Gilles Van Assche
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the names of the authors nor the names of their affiliation may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "LatexEngine.h"
+#include <sstream>
+#include <unistd.h>
+
+using namespace std;
+
+// The engine is restarted after this many formulas.
+static const int cMaxFormulas = 256;
+
+// How long to wait for the engine to typeset one formula, in seconds, if
+// PngParams::timeout isn't set. (A TeX waiting for input that never comes
+// shouldn't hold up its worker forever.)
+static const double cDefaultTimeout = 30;
+
+// Printed by the engine once it's done with the input sent so far.
+static const string cDoneMarker = "blahtex-engine-done";
+
+
+LatexEngine::LatexEngine(const PngParams& params) :
+    mParams(params),
+    mPages(0),
+    mFormulas(0)
+{ }
+
+
+string LatexEngine::GetDviFilename() const
+{
+    return "engine.dvi";
+}
+
+
+void LatexEngine::Stop()
+{
+    mProcess.Stop();
+    mPreamble.clear();
+}
+
+
+// Reads the engine's output up to the next done marker. Returns false if
+// TeX reported an error, or didn't get there in time.
+static bool WaitUntilDone(ChildProcess& process, double timeout, int count)
+{
+    ostringstream marker;
+    marker << cDoneMarker << "-" << count;
+
+    string line;
+    while (process.ReadLine(line, timeout))
+    {
+        if (line == marker.str())
+            return true;
+        // TeX error messages start with "! ". In scroll mode TeX carries
+        // on after them, but its state can no longer be trusted.
+        if (line.size() >= 2 && line[0] == '!' && line[1] == ' ')
+            return false;
+    }
+    return false;
+}
+
+
+bool LatexEngine::Start(const string& preamble)
+{
+    Stop();
+
+    vector<string> arguments = SplitCommandLine(mParams.shellLatex);
+    arguments.push_back("-jobname=engine");
+
+    ProcessOptions options;
+    if (mParams.tempDirectory != "./")
+        options.mDirectory = mParams.tempDirectory;
+    options.mMemoryLimit = mParams.memoryLimit;
+    if (!mProcess.Start(arguments, options))
+        return false;
+
+    // The purified TeX asks for nonstop mode, in which TeX refuses to read
+    // any more input from the terminal; scroll mode doesn't stop at errors
+    // either, but lets us go on feeding it. \blahtexshipout ships a page
+    // even when the preview package intercepts \shipout. \blahtexpad holds
+    // 16384 bytes, as much as TeX's whole DVI buffer.
+    string setup =
+        "\\scrollmode\n"
+        "\\ifx\\pdfprimitive\\undefined\\let\\blahtexshipout\\shipout"
+        "\\else\\def\\blahtexshipout{\\pdfprimitive\\shipout}\\fi\n"
+        "\\def\\blahtexpad{blahtex-padding.}\n";
+    for (int i = 0; i < 10; i++)
+        setup += "\\edef\\blahtexpad{\\blahtexpad\\blahtexpad}\n";
+
+    string body = preamble;
+    string::size_type nonstop = body.find("\\nonstopmode");
+    if (nonstop != string::npos)
+        body.replace(nonstop, 12, "\\scrollmode");
+
+    ostringstream done;
+    done << "\\immediate\\write16{" << cDoneMarker << "-0}\n";
+
+    double timeout = (mParams.timeout > 0) ? mParams.timeout : cDefaultTimeout;
+    if (!mProcess.Write(setup + body + done.str())
+        || !WaitUntilDone(mProcess, timeout, 0)
+    )
+    {
+        Stop();
+        return false;
+    }
+
+    mPreamble = preamble;
+    mPages = 0;
+    mFormulas = 0;
+    return true;
+}
+
+
+bool LatexEngine::Typeset(const string& purifiedTexUtf8, int& page)
+{
+    string preamble, body;
+    if (!SplitPurifiedTex(purifiedTexUtf8, preamble, body))
+        return false;
+
+    if (!mProcess.IsRunning()
+        || preamble != mPreamble
+        || mFormulas >= cMaxFormulas
+    )
+    {
+        if (!Start(preamble))
+            return false;
+    }
+
+    // The body makes one page: with the preview package, at
+    // \end{preview}; without it, at \clearpage. The padding page after it
+    // pushes it into the DVI file.
+    mFormulas++;
+    ostringstream input;
+    input
+        << body
+        << "\\clearpage\n"
+        << "\\blahtexshipout\\hbox{\\special{\\blahtexpad}}\n"
+        << "\\immediate\\write16{" << cDoneMarker << "-" << mFormulas << "}\n";
+
+    double timeout = (mParams.timeout > 0) ? mParams.timeout : cDefaultTimeout;
+    if (!mProcess.Write(input.str())
+        || !WaitUntilDone(mProcess, timeout, mFormulas)
+    )
+    {
+        Stop();
+        return false;
+    }
+
+    page = mPages + 1;
+    mPages += 2;
+    return true;
+}
+
+// end of file @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
@@ -0,0 +1,71 @@
+/*
+blahtex: a TeX to MathML converter designed with MediaWiki in mind
+blahtexml: an extension of blahtex with XML processing in mind
+http://gva.noekeon.org/blahtexml
+
+Copyright (c) 2006, David Harvey
+Copyright (c) 2010, Gilles Van Assche
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the names of the authors nor the names of their affiliation may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef BLAHTEX_LATEXENGINE_H
+#define BLAHTEX_LATEXENGINE_H
+
+#include <string>
+#include "mainPng.h"
+#include "Process.h"
+
+// LatexEngine keeps one latex process running in a private directory (the
+// tempDirectory of its PngParams), and typesets formulas by feeding their
+// bodies to it over its standard input, so that latex doesn't have to be
+// started, and the preamble loaded, for every formula. See
+// "--png-persistent-latex".
+//
+// Every formula becomes one page of the growing DVI file "engine.dvi",
+// followed by a padding page made of a large \special, which pushes the
+// formula's page out of TeX's DVI buffer and onto disk. dvipng can then
+// render that page while latex waits for the next formula.
+//
+// After a TeX error, a timeout, a change of preamble, or a few hundred
+// formulas (to keep the DVI file and TeX's memory in check), the engine is
+// killed and started again.
+//
+// A LatexEngine must only be used from one thread at a time.
+class LatexEngine
+{
+public:
+    LatexEngine(const PngParams& params);
+
+    // Typesets the given purified TeX (see MakePngFile) as a new page of
+    // GetDviFilename(), whose number is stored in page. Returns false if
+    // that failed for any reason; the caller should then run latex the
+    // usual way, which reports the error properly.
+    bool Typeset(const std::string& purifiedTexUtf8, int& page);
+
+    // The DVI file written by the engine, relative to tempDirectory.
+    std::string GetDviFilename() const;
+
+    // Kills the engine; the next Typeset starts a new one.
+    void Stop();
+
+private:
+    bool Start(const std::string& preamble);
+
+    PngParams mParams;
+    ChildProcess mProcess;
+    std::string mPreamble;
+    int mPages;
+    int mFormulas;
+};
+
+#endif
+
+// end of file @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
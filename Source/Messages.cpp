@@ -255,6 +255,10 @@ pair<wstring, wstring> gEnglishMessagesArray[] =
     make_pair(L"CannotRunDvipng",
         L"Cannot run dvipng"
     ),
+
+    make_pair(L"RenderLimitExceeded",
+        L"Rendering was stopped: $0 exceeded its $1 limit ($2)"
+    ),
     
     make_pair(L"CannotWritePngDirectory",
         L"Cannot write to output PNG directory"
@@ -0,0 +1,279 @@
+/*
+blahtex: a TeX to MathML converter designed with MediaWiki in mind
+blahtexml: an extension of blahtex with XML processing in mind
+http://gva.noekeon.org/blahtexml
+
+Copyright (c) 2006, David Harvey
+Copyright (c) 2010, Gilles Van Assche
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the names of the authors nor the names of their affiliation may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "PngRenderPool.h"
+#include "LatexEngine.h"
+#include "UnicodeConverter.h"
+#include "md5Wrapper.h"
+#include <algorithm>
+#include <cerrno>
+#include <dirent.h>
+#include <sstream>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+using namespace std;
+
+
+
+// Deletes the given directory and the files in it.
+static void RemoveDirectory(const string& directory)
+{
+    DIR* dir = opendir(directory.c_str());
+    if (dir)
+    {
+        while (struct dirent* entry = readdir(dir))
+        {
+            string name = entry->d_name;
+            if (name != "." && name != "..")
+                unlink((directory + name).c_str());
+        }
+        closedir(dir);
+    }
+    rmdir(directory.c_str());
+}
+
+
+PngRenderPool::PngRenderPool(
+    const PngParams& params,
+    unsigned numberOfWorkers,
+    bool privateDirectories
+) :
+    mParams(params),
+    mStopping(false)
+{
+    if (numberOfWorkers == 0)
+        numberOfWorkers = thread::hardware_concurrency();
+    if (numberOfWorkers == 0)
+        numberOfWorkers = 1;
+
+    if (mParams.lockDirectory.empty())
+        mParams.lockDirectory = mParams.tempDirectory;
+
+    string parent = mParams.tempDirectory;
+    if (!mParams.workspaceDirectory.empty())
+    {
+        parent = mParams.workspaceDirectory;
+        mParams.reuseTempFiles = true;
+    }
+
+    // The process id is part of the name, so that several blahtex processes
+    // can share the parent directory.
+    for (unsigned worker = 0; worker < numberOfWorkers; worker++)
+    {
+        if (!privateDirectories && mParams.workspaceDirectory.empty())
+        {
+            mWorkerDirectories.push_back("");
+            continue;
+        }
+
+        ostringstream directory;
+        directory << parent << "worker-" << getpid() << "-" << worker << "/";
+
+#ifdef _WIN32
+        int status = mkdir(directory.str().c_str());
+#else
+        int status = mkdir(directory.str().c_str(), 0700);
+#endif
+        if (status == 0 || errno == EEXIST)
+            mWorkerDirectories.push_back(directory.str());
+        else
+            mWorkerDirectories.push_back("");
+    }
+
+    for (unsigned worker = 0; worker < numberOfWorkers; worker++)
+        mThreads.push_back(thread(&PngRenderPool::Work, this, worker));
+}
+
+
+PngRenderPool::~PngRenderPool()
+{
+    {
+        lock_guard<mutex> lock(mMutex);
+        mStopping = true;
+    }
+    mJobAvailable.notify_all();
+
+    for (size_t i = 0; i < mThreads.size(); i++)
+        mThreads[i].join();
+
+    if (mParams.deleteTempFiles)
+        for (size_t i = 0; i < mWorkerDirectories.size(); i++)
+            if (!mWorkerDirectories[i].empty())
+                RemoveDirectory(mWorkerDirectories[i]);
+}
+
+
+shared_future<PngInfo> PngRenderPool::Submit(
+    const wstring& purifiedTex,
+    const string& pngFilename,
+    string* md5,
+    const string& key
+)
+{
+    return SubmitUtf8(
+        gUnicodeConverter.ConvertOut(purifiedTex), pngFilename, md5, key
+    );
+}
+
+
+shared_future<PngInfo> PngRenderPool::SubmitUtf8(
+    const string& purifiedTexUtf8,
+    const string& pngFilename,
+    string* md5,
+    const string& key
+)
+{
+    shared_ptr<Job> job(new Job);
+    job->mPurifiedTexUtf8 = purifiedTexUtf8;
+    job->mPngFilename = pngFilename;
+
+    job->mMd5 = key.empty() ? ComputeMd5(job->mPurifiedTexUtf8) : key;
+    if (md5)
+        *md5 = job->mMd5;
+    job->mKey = job->mMd5 + "/" + pngFilename;
+
+    lock_guard<mutex> lock(mMutex);
+
+    map<string, shared_future<PngInfo> >::const_iterator
+        pending = mPending.find(job->mKey);
+    if (pending != mPending.end())
+        return pending->second;
+
+    shared_future<PngInfo> result = job->mResult.get_future().share();
+    mPending[job->mKey] = result;
+    mQueue.push_back(job);
+    mJobAvailable.notify_one();
+
+    return result;
+}
+
+
+void PngRenderPool::Wait()
+{
+    unique_lock<mutex> lock(mMutex);
+    while (!mPending.empty())
+        mAllDone.wait(lock);
+}
+
+
+void PngRenderPool::Work(unsigned worker)
+{
+    // A worker without a private directory of its own shares
+    // tempDirectory, with unique file names.
+    PngParams params = mParams;
+    if (mWorkerDirectories[worker].empty())
+        params.reuseTempFiles = false;
+    else
+        params.tempDirectory = mWorkerDirectories[worker];
+
+    // The engine's files have fixed names, so it needs a private directory.
+    unique_ptr<LatexEngine> engine;
+    if (params.persistentLatex && !mWorkerDirectories[worker].empty())
+        engine.reset(new LatexEngine(params));
+
+    while (true)
+    {
+        vector<shared_ptr<Job> > jobs;
+        {
+            unique_lock<mutex> lock(mMutex);
+            while (mQueue.empty() && !mStopping)
+                mJobAvailable.wait(lock);
+            if (mQueue.empty())
+                return;
+            jobs.push_back(mQueue.front());
+            mQueue.pop_front();
+
+            // Images named after their md5 can be typeset together with
+            // others queued behind them (see MakePngFiles), leaving a fair
+            // share of the queue to the other workers. The engine already
+            // saves the latex start-ups that batches would.
+            if (!engine && jobs[0]->mPngFilename.empty())
+            {
+                size_t batchSize = min<size_t>(
+                    max(params.batchSize, 1),
+                    1 + mQueue.size() / mWorkerDirectories.size()
+                );
+                for (deque<shared_ptr<Job> >::iterator job = mQueue.begin();
+                    job != mQueue.end() && jobs.size() < batchSize;
+                )
+                {
+                    if ((*job)->mPngFilename.empty())
+                    {
+                        jobs.push_back(*job);
+                        job = mQueue.erase(job);
+                    }
+                    else
+                        ++job;
+                }
+            }
+        }
+
+        if (jobs.size() == 1)
+        {
+            try
+            {
+                jobs[0]->mResult.set_value(
+                    MakePngFileUtf8(
+                        jobs[0]->mPurifiedTexUtf8, jobs[0]->mPngFilename,
+                        params, jobs[0]->mMd5, engine.get()
+                    )
+                );
+            }
+            catch (...)
+            {
+                jobs[0]->mResult.set_exception(current_exception());
+            }
+        }
+        else
+        {
+            vector<PngBatchItem> items(jobs.size());
+            for (size_t i = 0; i < jobs.size(); i++)
+            {
+                items[i].mPurifiedTexUtf8 = jobs[i]->mPurifiedTexUtf8;
+                items[i].mMd5 = jobs[i]->mMd5;
+            }
+            try
+            {
+                MakePngFiles(items, params);
+            }
+            catch (...)
+            {
+                for (size_t i = 0; i < items.size(); i++)
+                    items[i].mError = current_exception();
+            }
+
+            for (size_t i = 0; i < jobs.size(); i++)
+            {
+                if (items[i].mError)
+                    jobs[i]->mResult.set_exception(items[i].mError);
+                else
+                    jobs[i]->mResult.set_value(items[i].mInfo);
+            }
+        }
+
+        lock_guard<mutex> lock(mMutex);
+        for (size_t i = 0; i < jobs.size(); i++)
+            mPending.erase(jobs[i]->mKey);
+        if (mPending.empty())
+            mAllDone.notify_all();
+    }
+}
+
+// end of file @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
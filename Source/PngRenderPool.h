@@ -0,0 +1,128 @@
+/*
+blahtex: a TeX to MathML converter designed with MediaWiki in mind
+blahtexml: an extension of blahtex with XML processing in mind
+http://gva.noekeon.org/blahtexml
+
+Copyright (c) 2006, David Harvey
+Copyright (c) 2010, Gilles Van Assche
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the names of the authors nor the names of their affiliation may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef BLAHTEX_PNGRENDERPOOL_H
+#define BLAHTEX_PNGRENDERPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "mainPng.h"
+
+// PngRenderPool runs MakePngFile for queued formulas on a fixed number of
+// worker threads, so that several latex/dvipng pipelines run at once.
+//
+// Each worker keeps its temporary files in a subdirectory of tempDirectory
+// of its own, or, if workspaceDirectory is set, of workspaceDirectory; in
+// the latter case the files are reused from one render to the next (see
+// PngParams::reuseTempFiles). The private directories are emptied and
+// removed when the pool is destroyed. The ".lock" files stay in
+// tempDirectory itself, so that the workers, and other blahtex processes
+// sharing tempDirectory, still agree on who renders which md5.
+//
+// A worker that finds several formulas queued (to be named after their
+// md5) takes up to batchSize of them, and renders them with MakePngFiles.
+//
+// If persistentLatex is set, each worker instead keeps a LatexEngine
+// running in its private directory, and renders one formula at a time.
+//
+// Without private directories (and without workspaceDirectory), the
+// workers render in tempDirectory itself, with unique file names, as a
+// single render on the command line does; "--keep-temp-files" then leaves
+// the files there.
+class PngRenderPool
+{
+public:
+    // If numberOfWorkers is 0, there is one worker per processor core.
+    PngRenderPool(
+        const PngParams& params,
+        unsigned numberOfWorkers = 0,
+        bool privateDirectories = true
+    );
+
+    // Waits for all queued renders to finish.
+    ~PngRenderPool();
+
+    // Queues the given purified TeX for rendering (see MakePngFile). The
+    // returned future delivers the PngInfo, or rethrows the
+    // blahtex::Exception raised while rendering. Submitting a formula that
+    // is already queued returns the future of the queued render.
+    //
+    // If md5 is non-NULL, the md5 of the purified TeX (which names the
+    // image, see PngFullFileName) is stored there straight away. If key is
+    // not empty, it names the image instead (see MakePngFile).
+    //
+    // Submit and SubmitUtf8 may be called from any thread.
+    std::shared_future<PngInfo> Submit(
+        const std::wstring& purifiedTex,
+        const std::string& pngFilename = "",
+        std::string* md5 = NULL,
+        const std::string& key = ""
+    );
+
+    // Same as Submit, but takes the purified TeX in UTF-8.
+    std::shared_future<PngInfo> SubmitUtf8(
+        const std::string& purifiedTexUtf8,
+        const std::string& pngFilename = "",
+        std::string* md5 = NULL,
+        const std::string& key = ""
+    );
+
+    // Waits until every render submitted so far has finished.
+    void Wait();
+
+    unsigned GetNumberOfWorkers() const
+    {
+        return mThreads.size();
+    }
+
+private:
+    struct Job
+    {
+        std::string mKey;
+        std::string mMd5;
+        std::string mPurifiedTexUtf8;
+        std::string mPngFilename;
+        std::promise<PngInfo> mResult;
+    };
+
+    void Work(unsigned worker);
+
+    PngParams mParams;
+    std::vector<std::string> mWorkerDirectories;
+    std::vector<std::thread> mThreads;
+
+    std::mutex mMutex;
+    std::condition_variable mJobAvailable;
+    std::condition_variable mAllDone;
+    std::deque<std::shared_ptr<Job> > mQueue;
+
+    // Futures of the renders that are queued or running, by key.
+    std::map<std::string, std::shared_future<PngInfo> > mPending;
+    bool mStopping;
+};
+
+#endif
+
+// end of file @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
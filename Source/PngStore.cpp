@@ -0,0 +1,415 @@
+/*
+blahtex: a TeX to MathML converter designed with MediaWiki in mind
+blahtexml: an extension of blahtex with XML processing in mind
+http://gva.noekeon.org/blahtexml
+
+Copyright (c) 2006, David Harvey
+Copyright (c) 2010, Gilles Van Assche
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the names of the authors nor the names of their affiliation may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "PngStore.h"
+#include <algorithm>
+#include <cerrno>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <sstream>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/file.h>
+#endif
+
+using namespace std;
+
+#ifndef _WIN32
+
+static const char* cIndexFilename = "blahtex-store.idx";
+
+// Every this many records, the renderer that appended the last one runs
+// an eviction pass (unless somebody else is already doing so).
+static const off_t cEvictionInterval = 256;
+
+// Highest scale (see PngParams::scales) that the index can record.
+static const int cMaxScale = 15;
+
+// Access records only decide the order of eviction, which needn't be
+// exact, so a process writes at most one per image every this many
+// seconds; a busy image then doesn't cost an append on every cache hit.
+static const time_t cAccessRecordInterval = 60;
+
+// Beyond this many images, RecordedRecently starts over rather than grow.
+static const size_t cMaxRecentImages = 65536;
+
+enum
+{
+    cRenderRecord = 'R',
+    cAccessRecord = 'A'
+};
+
+// One record of the index file.
+struct StoreRecord
+{
+    unsigned char mMd5[16];
+    uint32_t mTime;         // seconds since the epoch
+    uint32_t mSize;         // total size of the image's files, in bytes
+    int32_t mHeight;
+    int32_t mDepth;
+    uint16_t mScales;       // bit N is set if X@Nx.png exists
+    uint8_t mType;          // cRenderRecord or cAccessRecord
+    uint8_t mDimensionsValid;
+    uint32_t mChecksum;     // of everything above
+};
+
+
+// FNV-1a over the record up to mChecksum.
+static uint32_t Checksum(const StoreRecord& record)
+{
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(&record);
+    uint32_t hash = 2166136261U;
+    for (size_t k = 0; k < offsetof(StoreRecord, mChecksum); k++)
+    {
+        hash ^= data[k];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+
+static bool IsValid(const StoreRecord& record)
+{
+    return (record.mType == cRenderRecord || record.mType == cAccessRecord)
+        && record.mChecksum == Checksum(record);
+}
+
+
+// Appends the record, with its checksum, to the index. Returns false if
+// it could not be written in full.
+static bool WriteRecord(int fd, StoreRecord& record)
+{
+    record.mChecksum = Checksum(record);
+    return write(fd, &record, sizeof(record)) == sizeof(record);
+}
+
+
+static bool Md5ToBytes(const string& md5, unsigned char* bytes)
+{
+    if (md5.size() != 32)
+        return false;
+    for (int i = 0; i < 16; i++)
+    {
+        unsigned value;
+        if (sscanf(md5.c_str() + 2 * i, "%2x", &value) != 1)
+            return false;
+        bytes[i] = value;
+    }
+    return true;
+}
+
+
+static string BytesToMd5(const unsigned char* bytes)
+{
+    char md5[33];
+    for (int i = 0; i < 16; i++)
+        sprintf(md5 + 2 * i, "%02x", bytes[i]);
+    return string(md5, 32);
+}
+
+
+// Returns the size of the given file, or 0 if it doesn't exist.
+static off_t FileSize(const string& filename)
+{
+    struct stat status;
+    return (stat(filename.c_str(), &status) == 0) ? status.st_size : 0;
+}
+
+
+// Opens the index file, and applies the given flock() operation to it.
+// Returns the file descriptor, or -1.
+static int OpenIndex(const PngParams& params, int operation)
+{
+    string filename = params.pngDirectory + cIndexFilename;
+    int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_APPEND, 0666);
+    if (fd < 0)
+        return -1;
+
+    int result;
+    do
+        result = flock(fd, operation);
+    while (result != 0 && errno == EINTR);
+    if (result != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+static void AppendRecord(StoreRecord& record, const PngParams& params)
+{
+    record.mTime = time(NULL);
+
+    int fd = OpenIndex(params, LOCK_SH);
+    if (fd < 0)
+        return;
+
+    bool evict = false;
+    if (WriteRecord(fd, record))
+    {
+        off_t end = lseek(fd, 0, SEEK_CUR);
+        evict = (end / sizeof(record)) % cEvictionInterval == 0;
+    }
+    close(fd);
+
+    if (evict)
+        EvictPngStore(params, false);
+}
+
+
+// Returns true if this process wrote a record for md5 less than
+// cAccessRecordInterval seconds ago. Otherwise returns false, and counts
+// a record as written now.
+static bool RecordedRecently(const string& md5)
+{
+    static mutex recentMutex;
+    static map<string, time_t> recent;
+
+    time_t now = time(NULL);
+    lock_guard<mutex> lock(recentMutex);
+    map<string, time_t>::iterator entry = recent.find(md5);
+    if (entry != recent.end() && now - entry->second < cAccessRecordInterval)
+        return true;
+
+    if (recent.size() >= cMaxRecentImages)
+        recent.clear();
+    recent[md5] = now;
+    return false;
+}
+
+
+void RecordPngRender(const PngInfo& info, const PngParams& params)
+{
+    if (params.storeBudget <= 0)
+        return;
+
+    RecordedRecently(info.mMd5);
+
+    StoreRecord record;
+    memset(&record, 0, sizeof(record));
+    if (!Md5ToBytes(info.mMd5, record.mMd5))
+        return;
+
+    record.mType = cRenderRecord;
+    record.mDimensionsValid = info.mDimensionsValid;
+    record.mHeight = info.mHeight;
+    record.mDepth = info.mDepth;
+
+    off_t size = FileSize(info.fullFileName) + FileSize(
+        StoreDirectory(info.mMd5, params, false) + info.mMd5 + ".dim"
+    );
+    for (size_t i = 0; i < info.mScaledImages.size(); i++)
+    {
+        int scale = info.mScaledImages[i].mScale;
+        if (scale <= cMaxScale)
+            record.mScales |= 1 << scale;
+        size += FileSize(info.mScaledImages[i].fullFileName);
+    }
+    record.mSize = size;
+
+    AppendRecord(record, params);
+}
+
+
+void RecordPngAccess(const string& md5, const PngParams& params)
+{
+    if (params.storeBudget <= 0)
+        return;
+
+    StoreRecord record;
+    memset(&record, 0, sizeof(record));
+    if (!Md5ToBytes(md5, record.mMd5) || RecordedRecently(md5))
+        return;
+    record.mType = cAccessRecord;
+
+    AppendRecord(record, params);
+}
+
+
+// Deletes the files of the image with the given md5. The .dim file goes
+// first, so that the cache stops using the entry before the images
+// disappear. Returns false, and leaves the image alone, if somebody holds
+// its render lock, e.g. because it is being rendered right now.
+static bool RemoveImage(const string& md5, unsigned scales, const PngParams& params)
+{
+    RenderLock lock(LockDirectory(params) + md5 + ".lock", false);
+    if (lock.IsBusy())
+        return false;
+
+    string base = StoreDirectory(md5, params, false) + md5;
+    unlink((base + ".dim").c_str());
+    unlink((base + ".png").c_str());
+    for (int scale = 2; scale <= cMaxScale; scale++)
+        if (scales & (1 << scale))
+        {
+            ostringstream filename;
+            filename << base << "@" << scale << "x.png";
+            unlink(filename.str().c_str());
+        }
+    return true;
+}
+
+
+// Orders records by time of last use.
+static bool UsedEarlier(const StoreRecord& x, const StoreRecord& y)
+{
+    return x.mTime < y.mTime;
+}
+
+
+int EvictPngStore(const PngParams& params, bool wait)
+{
+    if (params.storeBudget <= 0)
+        return 0;
+
+    int fd = OpenIndex(params, wait ? LOCK_EX : (LOCK_EX | LOCK_NB));
+    if (fd < 0)
+        return -1;
+
+    string log;
+    lseek(fd, 0, SEEK_SET);
+    char buffer[65536];
+    ssize_t count;
+    while ((count = read(fd, buffer, sizeof(buffer))) > 0)
+        log.append(buffer, count);
+
+    // Gather the latest information for each md5. An append that was cut
+    // short (by a crash, or a full disk) leaves part of a record behind and
+    // shifts everything written after it; where a record doesn't check
+    // out, we move on a byte at a time until they line up again.
+    map<string, StoreRecord> entries;
+    StoreRecord record;
+    for (size_t offset = 0; offset + sizeof(record) <= log.size(); )
+    {
+        memcpy(&record, log.data() + offset, sizeof(record));
+        if (!IsValid(record))
+        {
+            offset++;
+            continue;
+        }
+        offset += sizeof(record);
+
+        string md5 = BytesToMd5(record.mMd5);
+        map<string, StoreRecord>::iterator entry = entries.find(md5);
+        if (entry == entries.end())
+            entries[md5] = record;
+        else if (record.mType == cRenderRecord)
+        {
+            uint32_t time = max(entry->second.mTime, record.mTime);
+            entry->second = record;
+            entry->second.mTime = time;
+        }
+        else
+            entry->second.mTime = max(entry->second.mTime, record.mTime);
+    }
+
+    // Drop images that have gone, and measure the ones that were only
+    // seen as cache hits (e.g. rendered before the index existed).
+    vector<StoreRecord> images;
+    long long total = 0;
+    for (map<string, StoreRecord>::iterator
+        entry = entries.begin(); entry != entries.end(); ++entry
+    )
+    {
+        string base = StoreDirectory(entry->first, params, false) + entry->first;
+        off_t pngSize = FileSize(base + ".png");
+        if (pngSize == 0)
+            continue;
+
+        StoreRecord& image = entry->second;
+        if (image.mType == cAccessRecord)
+        {
+            image.mType = cRenderRecord;
+            off_t size = pngSize + FileSize(base + ".dim");
+            for (int scale = 2; scale <= cMaxScale; scale++)
+            {
+                ostringstream filename;
+                filename << base << "@" << scale << "x.png";
+                off_t scaledSize = FileSize(filename.str());
+                if (scaledSize > 0)
+                {
+                    image.mScales |= 1 << scale;
+                    size += scaledSize;
+                }
+            }
+            image.mSize = size;
+        }
+
+        images.push_back(image);
+        total += image.mSize;
+    }
+
+    // Evict the least recently used images, skipping the busy ones.
+    sort(images.begin(), images.end(), UsedEarlier);
+    vector<StoreRecord> remaining;
+    int evicted = 0;
+    for (size_t i = 0; i < images.size(); i++)
+    {
+        if (total > params.storeBudget
+            && RemoveImage(BytesToMd5(images[i].mMd5), images[i].mScales, params)
+        )
+        {
+            total -= images[i].mSize;
+            evicted++;
+        }
+        else
+            remaining.push_back(images[i]);
+    }
+
+    // Write back one record per remaining image, which also drops any
+    // damaged ones. (The file was opened with O_APPEND, so after
+    // truncating it, this writes from the start.)
+    if (ftruncate(fd, 0) == 0)
+        for (size_t i = 0; i < remaining.size(); i++)
+            if (!WriteRecord(fd, remaining[i]))
+                break;
+
+    close(fd);
+    return evicted;
+}
+
+#else
+
+// No flock() on Windows; the store is not managed there.
+
+void RecordPngRender(const PngInfo& info, const PngParams& params)
+{
+}
+
+void RecordPngAccess(const string& md5, const PngParams& params)
+{
+}
+
+int EvictPngStore(const PngParams& params, bool wait)
+{
+    return 0;
+}
+
+#endif
+
+// end of file @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
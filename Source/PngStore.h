@@ -0,0 +1,59 @@
+/*
+blahtex: a TeX to MathML converter designed with MediaWiki in mind
+blahtexml: an extension of blahtex with XML processing in mind
+http://gva.noekeon.org/blahtexml
+
+Copyright (c) 2006, David Harvey
+Copyright (c) 2010, Gilles Van Assche
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the names of the authors nor the names of their affiliation may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef BLAHTEX_PNGSTORE_H
+#define BLAHTEX_PNGSTORE_H
+
+#include <string>
+#include "mainPng.h"
+
+// The store index keeps track of the images in pngDirectory, so that the
+// directory can be kept under a byte budget (PngParams::storeBudget) by
+// evicting the least recently used images.
+//
+// It is the file "blahtex-store.idx" in pngDirectory: a log of fixed-size
+// binary records (in host byte order, each with a checksum), appended to
+// whenever an image is rendered (md5, total size of its files, dimensions,
+// scales) or found in the cache (md5 and time only). Eviction reads the
+// whole log (skipping damaged records), keeps the latest information for
+// each md5, deletes images until the budget is met, and rewrites the log
+// with one record per remaining image. Appends take a shared lock and
+// eviction an exclusive one, so any number of blahtex processes may share
+// the store.
+//
+// The index is only used for eviction: cache hits still take their
+// dimensions from the image's .dim file (see LookupRenderCache), which is
+// read anyway to check that the entry is complete. Each process records an
+// access to an image at most once a minute.
+
+// Records that the given image has just been rendered into the store.
+extern void RecordPngRender(const PngInfo& info, const PngParams& params);
+
+// Records that the image with the given md5 has just been used, unless
+// this process recorded it less than a minute ago.
+extern void RecordPngAccess(const std::string& md5, const PngParams& params);
+
+// Evicts the least recently used images until the files listed in the
+// index take at most params.storeBudget bytes. If wait is false and
+// another process is evicting, returns -1 at once. Otherwise returns the
+// number of images evicted.
+extern int EvictPngStore(const PngParams& params, bool wait);
+
+#endif
+
+// end of file @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
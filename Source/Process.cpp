@@ -0,0 +1,705 @@
+/*
+blahtex: a TeX to MathML converter designed with MediaWiki in mind
+blahtexml: an extension of blahtex with XML processing in mind
+http://gva.noekeon.org/blahtexml
+
+Copyright (c) 2006, David Harvey
+Copyright (c) 2010, Gilles Van Assche
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the names of the authors nor the names of their affiliation may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Process.h"
+#include <cerrno>
+#include <fstream>
+#include <sstream>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#ifndef _WIN32
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+extern char** environ;
+#endif
+
+using namespace std;
+
+
+vector<string> SplitCommandLine(const string& commandLine)
+{
+    vector<string> words;
+    string word;
+    bool inWord = false;
+    char quote = 0;
+
+    for (string::const_iterator ptr = commandLine.begin();
+        ptr != commandLine.end(); ptr++
+    )
+    {
+        if (quote)
+        {
+            if (*ptr == quote)
+                quote = 0;
+            else
+                word += *ptr;
+        }
+        else if (*ptr == '"' || *ptr == '\'')
+        {
+            quote = *ptr;
+            inWord = true;
+        }
+        else if (*ptr == ' ' || *ptr == '\t' || *ptr == '\n')
+        {
+            if (inWord)
+                words.push_back(word);
+            word.clear();
+            inWord = false;
+        }
+        else
+        {
+            word += *ptr;
+            inWord = true;
+        }
+    }
+    if (inWord)
+        words.push_back(word);
+
+    return words;
+}
+
+
+#ifndef _WIN32
+
+// posix_spawn can only set the child's working directory through this
+// extension (glibc 2.29 and later). Elsewhere, and when resource limits
+// are needed, we fork and exec ourselves.
+#if defined(__GLIBC__) && defined(__GLIBC_PREREQ)
+#if __GLIBC_PREREQ(2, 29)
+#define BLAHTEX_SPAWN_ADDCHDIR
+#endif
+#endif
+
+
+// Returns a monotonic time in seconds.
+static double Now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+// Creates a pipe whose ends are not inherited by other children, which
+// may be started concurrently from other threads. (Otherwise we might
+// never see the end of our child's output.)
+static int MakePipe(int fds[2])
+{
+#ifdef __linux__
+    return pipe2(fds, O_CLOEXEC);
+#else
+    if (pipe(fds) != 0)
+        return -1;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+#endif
+}
+
+
+// The signals that a server ignores (see StopSignals and
+// ForkPool::RunZygote in Server.cpp), and
+// that would stay ignored in the programs it runs; they get the default
+// action there, so that a runaway latex can still be stopped.
+static void StopSignalSet(sigset_t& signals)
+{
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGPIPE);
+}
+
+
+#ifdef BLAHTEX_SPAWN_ADDCHDIR
+// Starts the child with posix_spawn, which avoids copying our address
+// space (as fork does), and which is cheaper from a big, threaded process.
+static pid_t SpawnChild(
+    vector<char*>& argv,
+    const ProcessOptions& options,
+    int inputFd,
+    int outputFd,
+    int errorFd
+)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (inputFd >= 0)
+        posix_spawn_file_actions_adddup2(&actions, inputFd, 0);
+    else
+        posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, outputFd, 1);
+    if (errorFd >= 0)
+        posix_spawn_file_actions_adddup2(&actions, errorFd, 2);
+    else
+        posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+    if (!options.mDirectory.empty())
+        posix_spawn_file_actions_addchdir_np(
+            &actions, options.mDirectory.c_str()
+        );
+
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setflags(
+        &attributes, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF
+    );
+    posix_spawnattr_setpgroup(&attributes, 0);
+    sigset_t defaults;
+    StopSignalSet(defaults);
+    posix_spawnattr_setsigdefault(&attributes, &defaults);
+
+    pid_t pid;
+    int error = posix_spawnp(
+        &pid, argv[0], &actions, &attributes, &argv[0], environ
+    );
+
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+    return (error == 0) ? pid : -1;
+}
+#endif
+
+
+// Starts the child with fork and exec.
+static pid_t ForkChild(
+    vector<char*>& argv,
+    const ProcessOptions& options,
+    int inputFd,
+    int outputFd,
+    int errorFd
+)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // Only async-signal-safe calls from here on.
+        setpgid(0, 0);
+
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = SIG_DFL;
+        sigemptyset(&action.sa_mask);
+        sigset_t defaults;
+        StopSignalSet(defaults);
+        for (int signal = 1; signal < NSIG; signal++)
+            if (sigismember(&defaults, signal) == 1)
+                sigaction(signal, &action, NULL);
+
+        if (options.mCpuLimit > 0)
+        {
+            // SIGXCPU at the soft limit; SIGKILL one second later in case
+            // it is ignored.
+            struct rlimit limit;
+            limit.rlim_cur = options.mCpuLimit;
+            limit.rlim_max = options.mCpuLimit + 1;
+            setrlimit(RLIMIT_CPU, &limit);
+        }
+        if (options.mMemoryLimit > 0)
+        {
+            struct rlimit limit;
+            limit.rlim_cur = limit.rlim_max = options.mMemoryLimit;
+            setrlimit(RLIMIT_AS, &limit);
+        }
+
+        int devNull = open("/dev/null", O_RDWR);
+        dup2((inputFd >= 0) ? inputFd : devNull, 0);
+        dup2(outputFd, 1);
+        dup2((errorFd >= 0) ? errorFd : devNull, 2);
+        if (!options.mDirectory.empty()
+            && chdir(options.mDirectory.c_str()) != 0
+        )
+            _exit(127);
+        execvp(argv[0], &argv[0]);
+        _exit(127);
+    }
+    if (pid > 0)
+        setpgid(pid, pid);
+    return pid;
+}
+
+
+// Starts the child process, in a process group of its own, with its
+// standard output going to outputFd, and its standard error to errorFd
+// (or nowhere if that is -1). Returns its pid, or -1.
+static pid_t StartChild(
+    const vector<string>& arguments,
+    const ProcessOptions& options,
+    int inputFd,
+    int outputFd,
+    int errorFd
+)
+{
+    vector<char*> argv;
+    for (size_t i = 0; i < arguments.size(); i++)
+        argv.push_back(const_cast<char*>(arguments[i].c_str()));
+    argv.push_back(NULL);
+
+#ifdef BLAHTEX_SPAWN_ADDCHDIR
+    // posix_spawn can't set resource limits.
+    if (options.mCpuLimit <= 0 && options.mMemoryLimit <= 0)
+        return SpawnChild(argv, options, inputFd, outputFd, errorFd);
+#endif
+    return ForkChild(argv, options, inputFd, outputFd, errorFd);
+}
+
+
+// Returns true if the text contains one of the messages that programs
+// print when they can't get more memory.
+static bool ShowsAllocationFailure(const string& text)
+{
+    static const char* const cMessages[] =
+    {
+        "memory exhausted",         // kpathsea's xmalloc (TeX, dvipng)
+        "out of memory",
+        "cannot allocate memory",   // strerror(ENOMEM)
+        "bad_alloc",                // an uncaught C++ exception
+        "memoryerror"               // Python
+    };
+
+    string lower(text);
+    for (size_t i = 0; i < lower.size(); i++)
+        lower[i] = tolower(static_cast<unsigned char>(lower[i]));
+    for (size_t i = 0; i < sizeof(cMessages) / sizeof(cMessages[0]); i++)
+        if (lower.find(cMessages[i]) != string::npos)
+            return true;
+    return false;
+}
+
+
+// Returns true for the signals that a program dies of when an allocation
+// fails and it doesn't check (or aborts on purpose), or when the kernel
+// kills it for lack of memory.
+static bool IsCrashSignal(int signal)
+{
+    return signal == SIGKILL || signal == SIGSEGV || signal == SIGABRT
+        || signal == SIGBUS;
+}
+
+
+ProcessResult RunProcess(
+    const vector<string>& arguments,
+    const ProcessOptions& options
+)
+{
+    ProcessResult result;
+    if (arguments.empty())
+        return result;
+
+    // The child's standard output always goes through a pipe, even if we
+    // discard it, since that is how we notice that it has finished. With a
+    // memory limit, we also keep the end of its standard error, to tell an
+    // allocation failure from other errors.
+    int fds[2];
+    if (MakePipe(fds) != 0)
+        return result;
+    int errorFds[2] = { -1, -1 };
+    if (options.mMemoryLimit > 0 && MakePipe(errorFds) != 0)
+        errorFds[0] = errorFds[1] = -1;
+
+    pid_t pid = StartChild(arguments, options, -1, fds[1], errorFds[1]);
+    close(fds[1]);
+    if (errorFds[1] >= 0)
+        close(errorFds[1]);
+    if (pid < 0)
+    {
+        close(fds[0]);
+        if (errorFds[0] >= 0)
+            close(errorFds[0]);
+        return result;
+    }
+
+    double deadline = (options.mTimeout > 0) ? Now() + options.mTimeout : 0;
+    bool timedOut = false;
+
+    string errors;
+    char buffer[4096];
+    while (fds[0] >= 0 || errorFds[0] >= 0)
+    {
+        int pollTimeout = -1;
+        if (deadline > 0)
+        {
+            double left = deadline - Now();
+            if (left <= 0)
+            {
+                timedOut = true;
+                break;
+            }
+            pollTimeout = static_cast<int>(left * 1000) + 1;
+        }
+
+        struct pollfd inputs[2];
+        int* owners[2];
+        nfds_t count = 0;
+        if (fds[0] >= 0)
+            owners[count++] = &fds[0];
+        if (errorFds[0] >= 0)
+            owners[count++] = &errorFds[0];
+        for (nfds_t i = 0; i < count; i++)
+        {
+            inputs[i].fd = *owners[i];
+            inputs[i].events = POLLIN;
+            inputs[i].revents = 0;
+        }
+        int ready = poll(inputs, count, pollTimeout);
+        if (ready < 0 && errno != EINTR)
+            break;
+        if (ready <= 0)
+            continue;
+
+        for (nfds_t i = 0; i < count; i++)
+        {
+            if (inputs[i].revents == 0)
+                continue;
+            ssize_t size = read(inputs[i].fd, buffer, sizeof(buffer));
+            if (size < 0 && (errno == EINTR || errno == EAGAIN))
+                continue;
+            if (size <= 0)
+            {
+                close(*owners[i]);
+                *owners[i] = -1;
+            }
+            else if (owners[i] == &errorFds[0])
+            {
+                errors.append(buffer, size);
+                if (errors.size() > sizeof(buffer))
+                    errors.erase(0, errors.size() - sizeof(buffer));
+            }
+            else if (options.mCaptureOutput)
+                result.mOutput.append(buffer, size);
+        }
+    }
+    if (fds[0] >= 0)
+        close(fds[0]);
+    if (errorFds[0] >= 0)
+        close(errorFds[0]);
+
+    // The child has closed its output, but may not have exited yet.
+    int status = 0;
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    while (true)
+    {
+        if (timedOut)
+        {
+            kill(-pid, SIGKILL);
+            kill(pid, SIGKILL);
+        }
+
+        pid_t waited = wait4(pid, &status, (deadline > 0) ? WNOHANG : 0, &usage);
+        if (waited == pid)
+            break;
+        if (waited < 0 && errno != EINTR)
+            return result;
+        if (waited == 0)
+        {
+            if (Now() >= deadline)
+            {
+                timedOut = true;
+                deadline = 0;
+            }
+            else
+                usleep(5000);
+        }
+    }
+
+    if (timedOut)
+        result.mStatus = ProcessResult::cTimedOut;
+    else if (WIFEXITED(status))
+    {
+        result.mStatus = ProcessResult::cExited;
+        result.mExitCode = WEXITSTATUS(status);
+    }
+    else
+    {
+        result.mStatus = ProcessResult::cKilled;
+        result.mSignal = WTERMSIG(status);
+    }
+
+    double cpuTime =
+        usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+        + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+#ifdef __APPLE__
+    long long maxResident = usage.ru_maxrss;
+#else
+    long long maxResident = usage.ru_maxrss * 1024LL;
+#endif
+
+    if (timedOut)
+        result.mLimitExceeded = ProcessResult::cTimeLimit;
+    else if (result.mStatus == ProcessResult::cKilled
+        && options.mCpuLimit > 0
+        && (result.mSignal == SIGXCPU
+            || (result.mSignal == SIGKILL && cpuTime >= options.mCpuLimit))
+    )
+        result.mLimitExceeded = ProcessResult::cCpuLimit;
+    else if (!result.Succeeded()
+        && options.mMemoryLimit > 0
+        && (ShowsAllocationFailure(errors)
+            || ShowsAllocationFailure(result.mOutput)
+            || (result.mStatus == ProcessResult::cKilled
+                && IsCrashSignal(result.mSignal)
+                && maxResident * 2 >= options.mMemoryLimit
+            )
+        )
+    )
+        result.mLimitExceeded = ProcessResult::cMemoryLimit;
+
+    return result;
+}
+
+
+
+ChildProcess::ChildProcess() :
+    mPid(-1),
+    mFd(-1)
+{ }
+
+
+ChildProcess::~ChildProcess()
+{
+    Stop();
+}
+
+
+bool ChildProcess::Start(
+    const vector<string>& arguments,
+    const ProcessOptions& options
+)
+{
+    Stop();
+    if (arguments.empty())
+        return false;
+
+    // One socket serves as both standard input and output. Unlike a pipe,
+    // it lets us write with MSG_NOSIGNAL, so that a child that died
+    // doesn't get us killed by SIGPIPE.
+    int fds[2];
+#ifdef __linux__
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
+        return false;
+#else
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        return false;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#endif
+
+    ProcessOptions childOptions;
+    childOptions.mDirectory = options.mDirectory;
+    childOptions.mMemoryLimit = options.mMemoryLimit;
+    mPid = StartChild(arguments, childOptions, fds[1], fds[1], -1);
+    close(fds[1]);
+    if (mPid < 0)
+    {
+        close(fds[0]);
+        return false;
+    }
+
+    mFd = fds[0];
+    mBuffer.clear();
+    return true;
+}
+
+
+bool ChildProcess::Write(const string& data)
+{
+    size_t written = 0;
+    while (mFd >= 0 && written < data.size())
+    {
+#ifdef MSG_NOSIGNAL
+        ssize_t count = send(
+            mFd, data.data() + written, data.size() - written, MSG_NOSIGNAL
+        );
+#else
+        ssize_t count = send(mFd, data.data() + written, data.size() - written, 0);
+#endif
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return false;
+        written += count;
+    }
+    return mFd >= 0;
+}
+
+
+bool ChildProcess::ReadLine(string& line, double timeout)
+{
+    double deadline = (timeout > 0) ? Now() + timeout : 0;
+
+    while (mFd >= 0)
+    {
+        string::size_type newline = mBuffer.find('\n');
+        if (newline != string::npos)
+        {
+            line = mBuffer.substr(0, newline);
+            mBuffer.erase(0, newline + 1);
+            return true;
+        }
+
+        int pollTimeout = -1;
+        if (deadline > 0)
+        {
+            double left = deadline - Now();
+            if (left <= 0)
+                return false;
+            pollTimeout = static_cast<int>(left * 1000) + 1;
+        }
+
+        struct pollfd input;
+        input.fd = mFd;
+        input.events = POLLIN;
+        input.revents = 0;
+        int ready = poll(&input, 1, pollTimeout);
+        if (ready < 0 && errno != EINTR)
+            return false;
+        if (ready <= 0)
+            continue;
+
+        char buffer[4096];
+        ssize_t count = read(mFd, buffer, sizeof(buffer));
+        if (count < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (count <= 0)
+            return false;
+        mBuffer.append(buffer, count);
+    }
+    return false;
+}
+
+
+void ChildProcess::Stop()
+{
+    if (mFd >= 0)
+    {
+        close(mFd);
+        mFd = -1;
+    }
+    if (mPid > 0)
+    {
+        kill(-mPid, SIGKILL);
+        kill(mPid, SIGKILL);
+        while (waitpid(mPid, NULL, 0) < 0 && errno == EINTR)
+            ;
+        mPid = -1;
+    }
+    mBuffer.clear();
+}
+
+#else
+
+// Windows has no posix_spawn, so here we still go through system() and
+// the shell, and temporarily change the working directory; this is not
+// safe for use from several threads. Timeouts are not supported.
+ProcessResult RunProcess(
+    const vector<string>& arguments,
+    const ProcessOptions& options
+)
+{
+    ProcessResult result;
+    if (arguments.empty())
+        return result;
+
+    string command;
+    for (size_t i = 0; i < arguments.size(); i++)
+        command += (i ? " \"" : "\"") + arguments[i] + "\"";
+
+    ostringstream outputFilename;
+    outputFilename << "blahtex-output-" << getpid() << ".txt";
+    command += options.mCaptureOutput
+        ? " > " + outputFilename.str() + " 2>NUL"
+        : " >NUL 2>NUL";
+
+    char buffer[5000];
+    bool needToChange =
+        (options.mDirectory != "" && options.mDirectory != "./");
+    if (needToChange)
+    {
+        if (getcwd(buffer, 5000) == NULL
+            || chdir(options.mDirectory.c_str()) != 0
+        )
+            return result;
+    }
+
+    result.mStatus = ProcessResult::cExited;
+    result.mExitCode = system(command.c_str());
+
+    if (options.mCaptureOutput)
+    {
+        ifstream outputFile(outputFilename.str().c_str(), ios::in | ios::binary);
+        ostringstream output;
+        output << outputFile.rdbuf();
+        result.mOutput = output.str();
+        outputFile.close();
+        unlink(outputFilename.str().c_str());
+    }
+
+    if (needToChange && chdir(buffer) != 0)
+        result.mStatus = ProcessResult::cNotStarted;
+
+    return result;
+}
+
+
+ChildProcess::ChildProcess() :
+    mPid(-1),
+    mFd(-1)
+{ }
+
+
+ChildProcess::~ChildProcess()
+{ }
+
+
+bool ChildProcess::Start(
+    const vector<string>& arguments,
+    const ProcessOptions& options
+)
+{
+    return false;
+}
+
+
+bool ChildProcess::Write(const string& data)
+{
+    return false;
+}
+
+
+bool ChildProcess::ReadLine(string& line, double timeout)
+{
+    return false;
+}
+
+
+void ChildProcess::Stop()
+{ }
+
+#endif
+
+// end of file @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
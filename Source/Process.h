@@ -0,0 +1,168 @@
+/*
+blahtex: a TeX to MathML converter designed with MediaWiki in mind
+blahtexml: an extension of blahtex with XML processing in mind
+http://gva.noekeon.org/blahtexml
+
+Copyright (c) 2006, David Harvey
+Copyright (c) 2010, Gilles Van Assche
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the names of the authors nor the names of their affiliation may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef BLAHTEX_PROCESS_H
+#define BLAHTEX_PROCESS_H
+
+#include <string>
+#include <vector>
+
+// Options for RunProcess.
+struct ProcessOptions
+{
+    // Working directory of the child process. If empty, the child runs in
+    // the current directory. (The current directory of blahtex itself is
+    // never changed, so this is safe to use from several threads.)
+    std::string mDirectory;
+
+    // If set, the child's standard output is collected into
+    // ProcessResult::mOutput; otherwise it is discarded.
+    bool mCaptureOutput;
+
+    // Wall-clock limit in seconds; 0 means no limit. A child that runs
+    // longer is killed (together with anything it started).
+    double mTimeout;
+
+    // Limits on the child's CPU time (in seconds) and address space (in
+    // bytes), applied with setrlimit(); 0 means no limit. A child that uses
+    // up its CPU time gets SIGXCPU, then SIGKILL; one that reaches the
+    // address space limit fails to allocate memory.
+    int mCpuLimit;
+    long long mMemoryLimit;
+
+    ProcessOptions() :
+        mCaptureOutput(false),
+        mTimeout(0),
+        mCpuLimit(0),
+        mMemoryLimit(0)
+    { }
+};
+
+// Records how a child process ended.
+struct ProcessResult
+{
+    enum Status
+    {
+        cNotStarted,    // the program could not be started at all
+        cExited,        // it exited normally, with status mExitCode
+        cKilled,        // it was terminated by a signal
+        cTimedOut       // it exceeded ProcessOptions::mTimeout
+    }
+    mStatus;
+
+    int mExitCode;
+
+    // The signal that terminated it, if mStatus is cKilled.
+    int mSignal;
+
+    // Which limit of ProcessOptions the child ran into, if any:
+    // cTimeLimit if RunProcess itself killed it at the timeout;
+    // cCpuLimit if it got SIGXCPU, or SIGKILL after using up its CPU time;
+    // cMemoryLimit if it failed with a message about running out of memory
+    // on its standard output or error, or died of SIGKILL, SIGSEGV,
+    // SIGABRT or SIGBUS with at least half the limit resident. (The limit
+    // is on address space, but all we learn afterwards is the peak
+    // resident size.) Any other failure counts as cNoLimit.
+    enum Limit
+    {
+        cNoLimit,
+        cTimeLimit,
+        cCpuLimit,
+        cMemoryLimit
+    }
+    mLimitExceeded;
+
+    std::string mOutput;
+
+    ProcessResult() :
+        mStatus(cNotStarted),
+        mExitCode(-1),
+        mSignal(0),
+        mLimitExceeded(cNoLimit)
+    { }
+
+    bool Succeeded() const
+    {
+        return mStatus == cExited && mExitCode == 0;
+    }
+};
+
+// Runs the program arguments[0] (searched for in PATH) with the given
+// arguments, and waits for it to finish. Standard input is /dev/null and
+// standard error is discarded (after looking for allocation failures, if
+// there is a memory limit). No shell is involved.
+extern ProcessResult RunProcess(
+    const std::vector<std::string>& arguments,
+    const ProcessOptions& options
+);
+
+// A child process that keeps running while we talk to it through its
+// standard input and output, e.g. a TeX engine fed one formula at a time
+// (see LatexEngine). Its standard error is discarded. Only mDirectory and
+// mMemoryLimit of ProcessOptions apply. Not available on Windows, where
+// Start always fails.
+class ChildProcess
+{
+public:
+    ChildProcess();
+
+    // Stops the child if it is still running.
+    ~ChildProcess();
+
+    // Starts arguments[0] (searched for in PATH), in a process group of its
+    // own. Returns false if it could not be started.
+    bool Start(
+        const std::vector<std::string>& arguments,
+        const ProcessOptions& options
+    );
+
+    bool IsRunning() const
+    {
+        return mPid > 0;
+    }
+
+    // Sends data to the child's standard input. Returns false if the child
+    // is gone.
+    bool Write(const std::string& data);
+
+    // Reads the next line of the child's standard output, without the
+    // newline. Returns false if the child closed its output, or if timeout
+    // seconds (if positive) went by first.
+    bool ReadLine(std::string& line, double timeout);
+
+    // Kills the child (and anything it started) and waits for it.
+    void Stop();
+
+private:
+    int mPid;
+    int mFd;
+    std::string mBuffer;
+
+    // Not copyable.
+    ChildProcess(const ChildProcess&);
+    ChildProcess& operator=(const ChildProcess&);
+};
+
+// Splits a command line such as the "--shell-latex" option into words, so
+// that it can be passed to RunProcess. Words are separated by whitespace;
+// single or double quotes may be used to include whitespace in a word.
+extern std::vector<std::string> SplitCommandLine(const std::string& commandLine);
+
+#endif
+
+// end of file @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
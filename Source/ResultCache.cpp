@@ -0,0 +1,254 @@
+/*
+blahtex: a TeX to MathML converter designed with MediaWiki in mind
+blahtexml: an extension of blahtex with XML processing in mind
+http://gva.noekeon.org/blahtexml
+
+Copyright (c) 2006, David Harvey
+Copyright (c) 2010, Gilles Van Assche
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the names of the authors nor the names of their affiliation may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "ResultCache.h"
+#include <algorithm>
+#include <iterator>
+
+using namespace std;
+
+
+// Bytes taken up by an entry besides its key and value: the list node, the
+// index node and the strings' own fields, roughly.
+const size_t cEntryOverhead = 48;
+
+// The average size assumed for an entry, which sets the size of the sketch.
+const size_t cAverageEntrySize = 1024;
+
+// Number of rows (hash functions) in the sketch.
+const unsigned cSketchDepth = 4;
+
+// Scrambles the bits of x (the finaliser of splitmix64), so that the rows of
+// the sketch get independent hashes.
+static uint64_t Mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+ResultCache::FrequencySketch::FrequencySketch(size_t expectedEntries) :
+    mAdditions(0)
+{
+    size_t words = 8;
+    while (words < expectedEntries)
+        words *= 2;
+    mTable.resize(words);
+    mSampleSize = 10 * words;
+}
+
+void ResultCache::FrequencySketch::Locate(
+    uint64_t hash,
+    unsigned i,
+    size_t& word,
+    unsigned& shift
+) const
+{
+    uint64_t h = Mix(hash + (i + 1) * 0x9e3779b97f4a7c15ULL);
+    word = h & (mTable.size() - 1);
+    shift = ((h >> 32) & 15) * 4;
+}
+
+void ResultCache::FrequencySketch::Increment(uint64_t hash)
+{
+    bool incremented = false;
+    for (unsigned i = 0; i < cSketchDepth; i++)
+    {
+        size_t word;
+        unsigned shift;
+        Locate(hash, i, word, shift);
+        if (((mTable[word] >> shift) & 15) != 15)
+        {
+            mTable[word] += uint64_t(1) << shift;
+            incremented = true;
+        }
+    }
+
+    if (incremented && ++mAdditions >= mSampleSize)
+        Halve();
+}
+
+unsigned ResultCache::FrequencySketch::Estimate(uint64_t hash) const
+{
+    unsigned frequency = 15;
+    for (unsigned i = 0; i < cSketchDepth; i++)
+    {
+        size_t word;
+        unsigned shift;
+        Locate(hash, i, word, shift);
+        frequency = min(frequency, unsigned((mTable[word] >> shift) & 15));
+    }
+    return frequency;
+}
+
+void ResultCache::FrequencySketch::Halve()
+{
+    for (size_t k = 0; k < mTable.size(); k++)
+        mTable[k] = (mTable[k] >> 1) & 0x7777777777777777ULL;
+    mAdditions /= 2;
+}
+
+ResultCache::Shard::Shard(size_t expectedEntries) :
+    mSketch(expectedEntries),
+    mBytes(0),
+    mStatistics()
+{
+}
+
+ResultCache::ResultCache(size_t capacity, unsigned numberOfShards)
+{
+    if (numberOfShards == 0)
+        numberOfShards = 1;
+    mShardCapacity = capacity / numberOfShards;
+    for (unsigned k = 0; k < numberOfShards; k++)
+        mShards.push_back(unique_ptr<Shard>(
+            new Shard(mShardCapacity / cAverageEntrySize)
+        ));
+}
+
+uint64_t ResultCache::Hash(const string& text)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t k = 0; k < text.size(); k++)
+    {
+        hash ^= (unsigned char) text[k];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+size_t ResultCache::EntrySize(const string& key, const string& value)
+{
+    return key.size() + value.size() + sizeof(Entry) + cEntryOverhead;
+}
+
+ResultCache::Shard& ResultCache::GetShard(uint64_t hash)
+{
+    return *mShards[(hash >> 32) % mShards.size()];
+}
+
+void ResultCache::Erase(Shard& shard, list<Entry>::iterator entry)
+{
+    shard.mBytes -= EntrySize(entry->mKey, entry->mValue);
+    shard.mIndex.erase(entry->mHash);
+    shard.mEntries.erase(entry);
+}
+
+bool ResultCache::Find(const string& key, string& value)
+{
+    uint64_t hash = Hash(key);
+    Shard& shard = GetShard(hash);
+    lock_guard<mutex> lock(shard.mMutex);
+
+    shard.mSketch.Increment(hash);
+
+    // The index goes by hash only; a different key with the same hash is a
+    // miss.
+    unordered_map<uint64_t, list<Entry>::iterator>::iterator
+        found = shard.mIndex.find(hash);
+    if (found == shard.mIndex.end() || found->second->mKey != key)
+    {
+        shard.mStatistics.mMisses++;
+        return false;
+    }
+
+    shard.mEntries.splice(
+        shard.mEntries.begin(), shard.mEntries, found->second
+    );
+    value = found->second->mValue;
+    shard.mStatistics.mHits++;
+    return true;
+}
+
+void ResultCache::Insert(const string& key, const string& value)
+{
+    uint64_t hash = Hash(key);
+    size_t size = EntrySize(key, value);
+    Shard& shard = GetShard(hash);
+    lock_guard<mutex> lock(shard.mMutex);
+
+    // Another thread may have inserted the same key meanwhile; or a key with
+    // the same hash, which makes way for this one.
+    unordered_map<uint64_t, list<Entry>::iterator>::iterator
+        found = shard.mIndex.find(hash);
+    if (found != shard.mIndex.end())
+        Erase(shard, found->second);
+
+    if (size > mShardCapacity)
+    {
+        shard.mStatistics.mRejections++;
+        return;
+    }
+
+    // Walk from the least recently used end over the entries that would
+    // have to go, and admit the new entry only if it is looked up more
+    // often than every one of them.
+    if (shard.mBytes + size > mShardCapacity)
+    {
+        unsigned frequency = shard.mSketch.Estimate(hash);
+        size_t needed = shard.mBytes + size - mShardCapacity;
+        size_t freed = 0, victims = 0;
+        list<Entry>::iterator victim = shard.mEntries.end();
+        while (freed < needed)
+        {
+            --victim;
+            if (shard.mSketch.Estimate(victim->mHash) >= frequency)
+            {
+                shard.mStatistics.mRejections++;
+                return;
+            }
+            freed += EntrySize(victim->mKey, victim->mValue);
+            victims++;
+        }
+
+        for (size_t k = 0; k < victims; k++)
+            Erase(shard, prev(shard.mEntries.end()));
+        shard.mStatistics.mEvictions += victims;
+    }
+
+    Entry entry;
+    entry.mHash = hash;
+    entry.mKey = key;
+    entry.mValue = value;
+    shard.mEntries.push_front(entry);
+    shard.mIndex[hash] = shard.mEntries.begin();
+    shard.mBytes += size;
+    shard.mStatistics.mInsertions++;
+}
+
+ResultCache::Statistics ResultCache::GetStatistics() const
+{
+    Statistics total = Statistics();
+    for (size_t k = 0; k < mShards.size(); k++)
+    {
+        Shard& shard = *mShards[k];
+        lock_guard<mutex> lock(shard.mMutex);
+        total.mHits += shard.mStatistics.mHits;
+        total.mMisses += shard.mStatistics.mMisses;
+        total.mInsertions += shard.mStatistics.mInsertions;
+        total.mEvictions += shard.mStatistics.mEvictions;
+        total.mRejections += shard.mStatistics.mRejections;
+        total.mEntries += shard.mIndex.size();
+        total.mBytes += shard.mBytes;
+    }
+    return total;
+}
+
+// end of file @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
@@ -0,0 +1,122 @@
+/*
+blahtex: a TeX to MathML converter designed with MediaWiki in mind
+blahtexml: an extension of blahtex with XML processing in mind
+http://gva.noekeon.org/blahtexml
+
+Copyright (c) 2006, David Harvey
+Copyright (c) 2010, Gilles Van Assche
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the names of the authors nor the names of their affiliation may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef BLAHTEX_RESULT_CACHE_H
+#define BLAHTEX_RESULT_CACHE_H
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// ResultCache keeps the outputs of recent conversions in memory, keyed by a
+// string that spells out the input and every option that affects the
+// output (see ResultCacheKey in main.cpp). Several threads may use it at
+// the same time.
+//
+// The entries are spread over shards by the hash of their key; each shard
+// is an LRU list with a lock of its own. When a new entry would push older
+// ones out, it is only admitted if its key has been looked up more often
+// than each entry it would evict (TinyLFU). The lookups are counted,
+// approximately, in a small count-min sketch per shard whose counters are
+// halved from time to time, so that old popularity fades. This way a bulk
+// job that converts many formulas once each doesn't flush the formulas that
+// keep coming back: a key has to be asked for twice to displace anything.
+class ResultCache
+{
+public:
+    struct Statistics
+    {
+        unsigned long long mHits;
+        unsigned long long mMisses;
+        unsigned long long mInsertions;
+        unsigned long long mEvictions;
+        unsigned long long mRejections;     // refused by the admission filter
+        size_t mEntries;
+        size_t mBytes;
+    };
+
+    // capacity is in bytes; it counts the keys, the values and a rough
+    // overhead per entry.
+    explicit ResultCache(size_t capacity, unsigned numberOfShards = 16);
+
+    // Looks up key, and copies its value into value if it's there.
+    bool Find(const std::string& key, std::string& value);
+
+    // Adds (or replaces) an entry, unless the admission filter turns it
+    // down. Meant to be called after Find missed the key.
+    void Insert(const std::string& key, const std::string& value);
+
+    Statistics GetStatistics() const;
+
+    // The 64-bit FNV-1a hash.
+    static uint64_t Hash(const std::string& text);
+
+private:
+    // A count-min sketch with 4-bit counters, 16 to a word.
+    class FrequencySketch
+    {
+    public:
+        explicit FrequencySketch(size_t expectedEntries);
+
+        void Increment(uint64_t hash);
+        unsigned Estimate(uint64_t hash) const;
+
+    private:
+        // The word and the shift of the counter for hash in row i.
+        void Locate(uint64_t hash, unsigned i, size_t& word, unsigned& shift)
+            const;
+        void Halve();
+
+        std::vector<uint64_t> mTable;
+        size_t mAdditions;
+        size_t mSampleSize;     // additions between two halvings
+    };
+
+    struct Entry
+    {
+        uint64_t mHash;
+        std::string mKey;
+        std::string mValue;
+    };
+
+    struct Shard
+    {
+        std::mutex mMutex;
+        std::list<Entry> mEntries;      // the most recently used first
+        std::unordered_map<uint64_t, std::list<Entry>::iterator> mIndex;
+        FrequencySketch mSketch;
+        size_t mBytes;
+        Statistics mStatistics;
+
+        explicit Shard(size_t expectedEntries);
+    };
+
+    static size_t EntrySize(const std::string& key, const std::string& value);
+    Shard& GetShard(uint64_t hash);
+    void Erase(Shard& shard, std::list<Entry>::iterator entry);
+
+    size_t mShardCapacity;
+    std::vector<std::unique_ptr<Shard> > mShards;
+};
+
+#endif
+
+// end of file @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
@@ -0,0 +1,618 @@
+/*
+blahtex: a TeX to MathML converter designed with MediaWiki in mind
+blahtexml: an extension of blahtex with XML processing in mind
+http://gva.noekeon.org/blahtexml
+
+Copyright (c) 2006, David Harvey
+Copyright (c) 2010, Gilles Van Assche
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the names of the authors nor the names of their affiliation may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "ResultStore.h"
+#include "ResultCache.h"
+#include <stdexcept>
+
+using namespace std;
+
+#ifdef _WIN32
+
+// No mmap() or flock() on Windows.
+
+ResultStore::ResultStore(
+    const string& path,
+    const string& generation,
+    size_t maxLogSize
+)
+{
+    throw runtime_error("The cache file is not available on Windows");
+}
+
+ResultStore::~ResultStore()
+{
+}
+
+bool ResultStore::Find(const string& key, string& value)
+{
+    return false;
+}
+
+bool ResultStore::Insert(const string& key, const string& value)
+{
+    return false;
+}
+
+void ResultStore::Compact()
+{
+}
+
+ResultStore::Statistics ResultStore::GetStatistics()
+{
+    return mStatistics;
+}
+
+#else
+
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// The layout of the file, in host byte order. mMagic, mFormatVersion and
+// mReplaced stay where they are in every version of the format, so that a
+// store of another version can be recognised and replaced.
+struct ResultStore::Header
+{
+    char mMagic[8];
+    uint32_t mFormatVersion;
+    uint32_t mReplaced;         // set once the file has been renamed over
+    char mGeneration[112];
+    uint64_t mSlots;            // the size of the index, a power of 2
+    uint64_t mLogStart;
+    uint64_t mLogEnd;
+    uint64_t mEntries;
+};
+
+struct ResultStore::Slot
+{
+    uint64_t mHash;
+    uint64_t mOffset;           // of the record; 0 if the slot is empty
+};
+
+// Followed by the key, the value, and padding to a multiple of 8 bytes.
+struct ResultStore::RecordHeader
+{
+    uint32_t mKeySize;
+    uint32_t mValueSize;
+    uint64_t mChecksum;
+};
+
+static const char cMagic[8] = { 'B', 'T', 'X', 'C', 'A', 'C', 'H', 'E' };
+static const uint32_t cFormatVersion = 1;
+static const uint64_t cHeaderSize = 4096;
+static const uint64_t cMinimumSlots = 4096;
+
+static uint64_t Align(uint64_t size, uint64_t alignment)
+{
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+static uint64_t RecordSize(uint64_t keySize, uint64_t valueSize)
+{
+    return Align(sizeof(uint32_t) * 2 + sizeof(uint64_t) + keySize + valueSize, 8);
+}
+
+// FNV-1a over the sizes, the key and the value.
+static uint64_t Checksum(uint32_t keySize, uint32_t valueSize, const char* data)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    uint64_t sizes = (uint64_t(keySize) << 32) | valueSize;
+    for (int k = 0; k < 8; k++)
+    {
+        hash ^= (sizes >> (8 * k)) & 0xff;
+        hash *= 1099511628211ULL;
+    }
+    for (uint64_t k = 0; k < uint64_t(keySize) + valueSize; k++)
+    {
+        hash ^= static_cast<unsigned char>(data[k]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+template<typename T> static T LoadAcquire(const T* location)
+{
+    return __atomic_load_n(location, __ATOMIC_ACQUIRE);
+}
+
+template<typename T> static void StoreRelease(T* location, T value)
+{
+    __atomic_store_n(location, value, __ATOMIC_RELEASE);
+}
+
+ResultStore::ResultStore(
+    const string& path,
+    const string& generation,
+    size_t maxLogSize
+)
+    : mPath(path), mGeneration(generation), mMaxLogSize(maxLogSize),
+    mFd(-1), mWritable(false), mMapping(NULL), mMappedSize(0)
+{
+    if (mGeneration.size() >= sizeof(Header().mGeneration))
+        mGeneration.resize(sizeof(Header().mGeneration) - 1);
+    memset(&mStatistics, 0, sizeof(mStatistics));
+    Open();
+}
+
+ResultStore::~ResultStore()
+{
+    Close();
+}
+
+void ResultStore::Open()
+{
+    mWritable = true;
+    mFd = open(mPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (mFd < 0 && (errno == EACCES || errno == EROFS))
+    {
+        mWritable = false;
+        mFd = open(mPath.c_str(), O_RDONLY | O_CLOEXEC);
+    }
+    if (mFd < 0)
+        throw runtime_error("Cannot open the cache file \"" + mPath + "\"");
+
+    // Never overwrite a file that isn't a store (an empty one is new).
+    char magic[sizeof(cMagic)];
+    ssize_t size = pread(mFd, magic, sizeof(magic), 0);
+    if (size != 0
+        && (size != sizeof(magic) || memcmp(magic, cMagic, sizeof(magic)))
+    )
+    {
+        Close();
+        throw runtime_error(
+            "\"" + mPath + "\" is not a blahtex cache file"
+        );
+    }
+    Remap();
+}
+
+void ResultStore::Close()
+{
+    if (mMapping)
+        munmap(mMapping, mMappedSize);
+    mMapping = NULL;
+    mMappedSize = 0;
+    if (mFd >= 0)
+        close(mFd);
+    mFd = -1;
+}
+
+bool ResultStore::Remap()
+{
+    struct stat status;
+    if (fstat(mFd, &status) != 0)
+        return false;
+    size_t size = status.st_size;
+    if (mMapping && size == mMappedSize)
+        return true;
+
+    if (mMapping)
+        munmap(mMapping, mMappedSize);
+    mMapping = NULL;
+    mMappedSize = 0;
+    if (size < cHeaderSize)
+        return false;
+
+    void* mapping = mmap(
+        NULL, size, PROT_READ | (mWritable ? PROT_WRITE : 0), MAP_SHARED,
+        mFd, 0
+    );
+    if (mapping == MAP_FAILED)
+        return false;
+    mMapping = static_cast<char*>(mapping);
+    mMappedSize = size;
+    return true;
+}
+
+void ResultStore::Refresh()
+{
+    if (mFd >= 0 && mMapping && !LoadAcquire(&GetHeader()->mReplaced))
+        return;
+
+    // A new store is initialised by renaming a file over the empty one, so
+    // an empty store has to be opened again too.
+    Close();
+    try
+    {
+        Open();
+    }
+    catch (runtime_error& e)
+    {
+        // Until it comes back, everything misses.
+    }
+}
+
+bool ResultStore::IsValid() const
+{
+    if (!mMapping)
+        return false;
+    const Header* header = GetHeader();
+    return memcmp(header->mMagic, cMagic, sizeof(cMagic)) == 0
+        && header->mFormatVersion == cFormatVersion
+        && strncmp(
+            header->mGeneration, mGeneration.c_str(),
+            sizeof(header->mGeneration)
+        ) == 0
+        && header->mSlots >= cMinimumSlots
+        && (header->mSlots & (header->mSlots - 1)) == 0
+        && header->mLogStart == cHeaderSize + header->mSlots * sizeof(Slot)
+        && header->mLogStart <= mMappedSize;
+}
+
+ResultStore::Header* ResultStore::GetHeader() const
+{
+    return reinterpret_cast<Header*>(mMapping);
+}
+
+ResultStore::Slot* ResultStore::GetSlots() const
+{
+    return reinterpret_cast<Slot*>(mMapping + cHeaderSize);
+}
+
+ResultStore::Slot* ResultStore::Probe(uint64_t hash) const
+{
+    Slot* slots = GetSlots();
+    uint64_t mask = GetHeader()->mSlots - 1;
+    for (uint64_t k = 0, i = hash & mask; k <= mask; k++, i = (i + 1) & mask)
+    {
+        if (!LoadAcquire(&slots[i].mOffset) || slots[i].mHash == hash)
+            return &slots[i];
+    }
+    return NULL;
+}
+
+const ResultStore::RecordHeader* ResultStore::GetRecord(
+    uint64_t offset,
+    uint64_t logEnd
+)
+{
+    if (offset < GetHeader()->mLogStart || offset % 8 != 0
+        || offset + sizeof(RecordHeader) > logEnd
+    )
+        return NULL;
+    // The log may have grown past the mapping.
+    if (logEnd > mMappedSize && (!Remap() || !IsValid() || logEnd > mMappedSize))
+        return NULL;
+
+    const RecordHeader* record
+        = reinterpret_cast<const RecordHeader*>(mMapping + offset);
+    if (offset + RecordSize(record->mKeySize, record->mValueSize) > logEnd
+        || record->mChecksum != Checksum(
+            record->mKeySize, record->mValueSize,
+            reinterpret_cast<const char*>(record + 1)
+        )
+    )
+        return NULL;
+    return record;
+}
+
+bool ResultStore::Find(const string& key, string& value)
+{
+    lock_guard<mutex> lock(mMutex);
+    Refresh();
+
+    if (IsValid())
+    {
+        uint64_t hash = ResultCache::Hash(key);
+        uint64_t logEnd = LoadAcquire(&GetHeader()->mLogEnd);
+        Slot* slot = Probe(hash);
+        uint64_t offset = slot ? LoadAcquire(&slot->mOffset) : 0;
+        const RecordHeader* record = offset ? GetRecord(offset, logEnd) : NULL;
+        if (record && record->mKeySize == key.size()
+            && memcmp(record + 1, key.data(), key.size()) == 0
+        )
+        {
+            value.assign(
+                reinterpret_cast<const char*>(record + 1) + record->mKeySize,
+                record->mValueSize
+            );
+            mStatistics.mHits++;
+            return true;
+        }
+    }
+    mStatistics.mMisses++;
+    return false;
+}
+
+bool ResultStore::LockFile()
+{
+    // The file may have been replaced before the lock was granted: then
+    // it's the new one that has to be locked.
+    for (;;)
+    {
+        if (mFd < 0)
+        {
+            Refresh();
+            if (mFd < 0)
+                return false;
+        }
+
+        int result;
+        do
+            result = flock(mFd, LOCK_EX);
+        while (result != 0 && errno == EINTR);
+        if (result != 0)
+            return false;
+
+        struct stat opened, current;
+        if (fstat(mFd, &opened) == 0 && stat(mPath.c_str(), &current) == 0
+            && opened.st_dev == current.st_dev
+            && opened.st_ino == current.st_ino
+        )
+        {
+            Remap();
+            return true;
+        }
+        Close();
+    }
+}
+
+void ResultStore::UnlockFile()
+{
+    flock(mFd, LOCK_UN);
+}
+
+bool ResultStore::Insert(const string& key, const string& value)
+{
+    if (key.size() > 0xffffffffU || value.size() > 0xffffffffU)
+        return false;
+
+    lock_guard<mutex> lock(mMutex);
+    Refresh();
+    if (!mWritable || !LockFile())
+        return false;
+
+    uint64_t hash = ResultCache::Hash(key);
+    bool done = false;
+    uint64_t recordSize = RecordSize(key.size(), value.size());
+    if (mMaxLogSize && recordSize > mMaxLogSize / 2)
+    {
+        UnlockFile();
+        return false;
+    }
+
+    if (IsValid() || Rebuild(0))
+    {
+        Header* header = GetHeader();
+        uint64_t logEnd = header->mLogEnd;
+        Slot* slot = Probe(hash);
+        const RecordHeader* old = slot && slot->mOffset
+            ? GetRecord(slot->mOffset, logEnd) : NULL;
+        if (old && old->mKeySize == key.size()
+            && memcmp(old + 1, key.data(), key.size()) == 0
+        )
+        {
+            // Another process got there first.
+            UnlockFile();
+            return true;
+        }
+
+        if (!slot || header->mEntries + 1 > header->mSlots / 4 * 3
+            || (mMaxLogSize
+                && logEnd - header->mLogStart + recordSize > mMaxLogSize)
+        )
+        {
+            if (Rebuild(header->mEntries + 1))
+            {
+                header = GetHeader();
+                logEnd = header->mLogEnd;
+                slot = Probe(hash);
+                old = slot && slot->mOffset
+                    ? GetRecord(slot->mOffset, logEnd) : NULL;
+            }
+            else
+                slot = NULL;
+        }
+
+        if (slot && logEnd + recordSize > mMappedSize)
+        {
+            uint64_t slotIndex = slot - GetSlots();
+            uint64_t size = Align(
+                logEnd + recordSize + mMappedSize / 4, 1 << 16
+            );
+            if (ftruncate(mFd, size) == 0 && Remap() && mMappedSize == size)
+            {
+                header = GetHeader();
+                slot = GetSlots() + slotIndex;
+                old = slot->mOffset ? GetRecord(slot->mOffset, logEnd) : NULL;
+            }
+            else
+                slot = NULL;
+        }
+
+        if (slot)
+        {
+            // The record, then the end of the log, then the slot: a reader
+            // never follows a slot to a record that isn't complete.
+            RecordHeader* record
+                = reinterpret_cast<RecordHeader*>(mMapping + logEnd);
+            record->mKeySize = key.size();
+            record->mValueSize = value.size();
+            char* data = reinterpret_cast<char*>(record + 1);
+            memcpy(data, key.data(), key.size());
+            memcpy(data + key.size(), value.data(), value.size());
+            record->mChecksum
+                = Checksum(record->mKeySize, record->mValueSize, data);
+            StoreRelease(&header->mLogEnd, logEnd + recordSize);
+
+            // A slot of another key with the same hash is taken over; its
+            // record goes at the next compaction.
+            if (!slot->mOffset)
+                header->mEntries++;
+            slot->mHash = hash;
+            StoreRelease(&slot->mOffset, logEnd);
+
+            mStatistics.mInsertions++;
+            done = true;
+        }
+    }
+    UnlockFile();
+    return done;
+}
+
+bool ResultStore::Rebuild(uint64_t minimumEntries)
+{
+    // The live records, in the order in which they were written.
+    vector<pair<uint64_t, uint64_t> > records;      // offset, hash
+    vector<uint64_t> sizes;
+    uint64_t liveBytes = 0;
+    bool compacting = IsValid();
+    if (compacting)
+    {
+        Header* header = GetHeader();
+        Slot* slots = GetSlots();
+        uint64_t logEnd = header->mLogEnd;
+        for (uint64_t i = 0; i < header->mSlots; i++)
+        {
+            const RecordHeader* record = slots[i].mOffset
+                ? GetRecord(slots[i].mOffset, logEnd) : NULL;
+            if (!record)
+                continue;
+            // GetRecord may have remapped the file.
+            header = GetHeader();
+            slots = GetSlots();
+            records.push_back(make_pair(slots[i].mOffset, slots[i].mHash));
+        }
+        sort(records.begin(), records.end());
+        for (size_t k = 0; k < records.size(); k++)
+        {
+            const RecordHeader* record = reinterpret_cast<const RecordHeader*>(
+                mMapping + records[k].first
+            );
+            sizes.push_back(RecordSize(record->mKeySize, record->mValueSize));
+            liveBytes += sizes.back();
+        }
+
+        // Over the budget, only the newest records that fill half of it
+        // are kept.
+        if (mMaxLogSize && liveBytes > mMaxLogSize / 2)
+        {
+            size_t first = 0;
+            while (liveBytes > mMaxLogSize / 2)
+                liveBytes -= sizes[first++];
+            records.erase(records.begin(), records.begin() + first);
+            sizes.erase(sizes.begin(), sizes.begin() + first);
+        }
+    }
+
+    minimumEntries = max<uint64_t>(minimumEntries, records.size());
+    uint64_t slotCount = cMinimumSlots;
+    while (slotCount < 4 * minimumEntries)
+        slotCount *= 2;
+
+    uint64_t logStart = cHeaderSize + slotCount * sizeof(Slot);
+    uint64_t size = Align(
+        logStart + liveBytes + max<uint64_t>(liveBytes / 4, 1 << 16), 1 << 16
+    );
+
+    vector<char> buffer(size, 0);
+    Header* header = reinterpret_cast<Header*>(&buffer[0]);
+    memcpy(header->mMagic, cMagic, sizeof(cMagic));
+    header->mFormatVersion = cFormatVersion;
+    memcpy(header->mGeneration, mGeneration.data(), mGeneration.size());
+    header->mSlots = slotCount;
+    header->mLogStart = logStart;
+    header->mEntries = records.size();
+
+    Slot* slots = reinterpret_cast<Slot*>(&buffer[cHeaderSize]);
+    uint64_t offset = logStart;
+    for (size_t k = 0; k < records.size(); k++)
+    {
+        uint64_t recordSize = sizes[k];
+        memcpy(&buffer[offset], mMapping + records[k].first, recordSize);
+
+        uint64_t i = records[k].second & (slotCount - 1);
+        while (slots[i].mOffset)
+            i = (i + 1) & (slotCount - 1);
+        slots[i].mHash = records[k].second;
+        slots[i].mOffset = offset;
+        offset += recordSize;
+    }
+    header->mLogEnd = offset;
+
+    // The new file is complete on disk before it replaces the old one.
+    string newPath = mPath + ".new" + to_string(getpid());
+    int fd = open(newPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0)
+        return false;
+    struct stat status;
+    if (fstat(mFd, &status) == 0)
+        fchmod(fd, status.st_mode & 07777);
+    size_t written = 0;
+    while (written < buffer.size())
+    {
+        ssize_t result
+            = write(fd, &buffer[written], buffer.size() - written);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            break;
+        written += result;
+    }
+    if (written < buffer.size() || fsync(fd) != 0
+        || rename(newPath.c_str(), mPath.c_str()) != 0
+    )
+    {
+        close(fd);
+        unlink(newPath.c_str());
+        return false;
+    }
+    close(fd);
+
+    if (mMapping)
+        StoreRelease(&GetHeader()->mReplaced, uint32_t(1));
+    if (compacting)
+        mStatistics.mCompactions++;
+
+    Close();
+    return LockFile();
+}
+
+void ResultStore::Compact()
+{
+    lock_guard<mutex> lock(mMutex);
+    Refresh();
+    if (!mWritable || !LockFile())
+        throw runtime_error("Cannot lock the cache file \"" + mPath + "\"");
+    bool done = Rebuild(IsValid() ? GetHeader()->mEntries : 0);
+    UnlockFile();
+    if (!done)
+        throw runtime_error(
+            "Cannot compact the cache file \"" + mPath + "\""
+        );
+}
+
+ResultStore::Statistics ResultStore::GetStatistics()
+{
+    lock_guard<mutex> lock(mMutex);
+    Refresh();
+    Statistics statistics = mStatistics;
+    statistics.mEntries = IsValid() ? GetHeader()->mEntries : 0;
+    statistics.mFileSize = mMappedSize;
+    return statistics;
+}
+
+#endif
+
+// end of file @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
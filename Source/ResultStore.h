@@ -0,0 +1,145 @@
+/*
+blahtex: a TeX to MathML converter designed with MediaWiki in mind
+blahtexml: an extension of blahtex with XML processing in mind
+http://gva.noekeon.org/blahtexml
+
+Copyright (c) 2006, David Harvey
+Copyright (c) 2010, Gilles Van Assche
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the names of the authors nor the names of their affiliation may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef BLAHTEX_RESULT_STORE_H
+#define BLAHTEX_RESULT_STORE_H
+
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// ResultStore keeps the outputs of conversions in a file, so that they
+// survive the process: a later run of blahtex, or another process running
+// at the same time, finds them there. The keys are those of ResultCache
+// (see ResultCacheKey in main.cpp).
+//
+// The file is mapped into memory. After a header of one page comes an
+// index, a hash table of (hash, offset) slots with open addressing, and
+// then a log of records (key and value, with a checksum), to which new
+// results are appended. Lookups take no lock: a writer appends the record,
+// then publishes the new end of the log, then the slot, so a reader sees
+// either the old or the new state; a lookup checks the record it is
+// pointed at against the end of the log, the key and the checksum all the
+// same, and treats anything that doesn't match as a miss. Writers take an
+// exclusive flock() on the file, so any number of processes may share it.
+// A writer that dies half way leaves at most some bytes past the end of
+// the log, which the next one writes over.
+//
+// When the index gets three quarters full, or when the log would outgrow
+// its budget, the writer compacts the store: it copies the live records
+// (over the budget, only the newest ones that fill half of it) to a new
+// file, renames it over the old one, and marks the old one as replaced, so
+// that the other processes reopen the file. The same
+// happens to a file written by a version of blahtex whose results differ:
+// the header records a generation string, and a store of another
+// generation (or another format) starts afresh.
+class ResultStore
+{
+public:
+    struct Statistics
+    {
+        unsigned long long mHits;
+        unsigned long long mMisses;
+        unsigned long long mInsertions;
+        unsigned long long mCompactions;
+        size_t mEntries;
+        size_t mFileSize;
+    };
+
+    // Opens the store at path, creating it if needed. generation names the
+    // version of the results that the store holds; maxLogSize is the
+    // budget of the log in bytes, or 0 for none. Throws runtime_error if
+    // the file can't be opened; a file that can only be read serves
+    // lookups, and insertions are ignored.
+    ResultStore(
+        const std::string& path,
+        const std::string& generation,
+        size_t maxLogSize = 0
+    );
+    ~ResultStore();
+
+    // Looks up key, and copies its value into value if it's there.
+    bool Find(const std::string& key, std::string& value);
+
+    // Appends an entry, unless key is already there. The store only speeds
+    // things up, so an entry that can't be written (the disk is full, say)
+    // is dropped; returns false in that case.
+    bool Insert(const std::string& key, const std::string& value);
+
+    // Rewrites the store without its superseded records, and within its
+    // budget. Throws runtime_error if it can't.
+    void Compact();
+
+    Statistics GetStatistics();
+
+private:
+    struct Header;
+    struct Slot;
+    struct RecordHeader;
+
+    ResultStore(const ResultStore&);
+    ResultStore& operator=(const ResultStore&);
+
+    // Opens (or reopens) the file and maps it.
+    void Open();
+    void Close();
+
+    // Maps the whole file again after it has grown. Returns false if it
+    // can't.
+    bool Remap();
+
+    // Reopens the file if another process has replaced it.
+    void Refresh();
+
+    // Whether the mapped file is a store of this generation.
+    bool IsValid() const;
+
+    Header* GetHeader() const;
+    Slot* GetSlots() const;
+
+    // The slot that holds hash, or the empty one where it would go.
+    Slot* Probe(uint64_t hash) const;
+
+    // The record at offset, if it lies within the log and its checksum is
+    // right.
+    const RecordHeader* GetRecord(uint64_t offset, uint64_t logEnd);
+
+    bool LockFile();
+    void UnlockFile();
+
+    // Writes a new store holding the live records of this one (if it is
+    // valid), with room for at least minimumEntries entries in its index,
+    // renames it over the file, and reopens it. Called with the file
+    // locked; returns false on failure.
+    bool Rebuild(uint64_t minimumEntries);
+
+    std::string mPath;
+    std::string mGeneration;
+    size_t mMaxLogSize;
+    std::mutex mMutex;
+    int mFd;
+    bool mWritable;
+    char* mMapping;
+    size_t mMappedSize;
+
+    Statistics mStatistics;
+};
+
+#endif
+
+// end of file @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
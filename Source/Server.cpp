@@ -0,0 +1,831 @@
+/*
+blahtex: a TeX to MathML converter designed with MediaWiki in mind
+blahtexml: an extension of blahtex with XML processing in mind
+http://gva.noekeon.org/blahtexml
+
+Copyright (c) 2006, David Harvey
+Copyright (c) 2010, Gilles Van Assche
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the names of the authors nor the names of their affiliation may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Server.h"
+#include <stdexcept>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#endif
+
+using namespace std;
+
+#ifndef _WIN32
+
+// The signal handler writes to this pipe, to wake up the server (see
+// StopSignals).
+static int gSignalPipe[2] = { -1, -1 };
+static struct sigaction gOldTerm, gOldInt, gOldPipe;
+
+static void HandleStopSignal(int)
+{
+    int savedErrno = errno;
+    ssize_t written = write(gSignalPipe[1], "x", 1);
+    (void) written;
+    errno = savedErrno;
+}
+
+StopSignals::StopSignals()
+{
+    if (pipe(gSignalPipe) != 0)
+        throw runtime_error("Cannot create a pipe");
+    fcntl(gSignalPipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(gSignalPipe[1], F_SETFD, FD_CLOEXEC);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = HandleStopSignal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGTERM, &action, &gOldTerm);
+    sigaction(SIGINT, &action, &gOldInt);
+
+    // A client that goes away mustn't kill us.
+    action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &action, &gOldPipe);
+}
+
+StopSignals::~StopSignals()
+{
+    sigaction(SIGTERM, &gOldTerm, NULL);
+    sigaction(SIGINT, &gOldInt, NULL);
+    sigaction(SIGPIPE, &gOldPipe, NULL);
+    close(gSignalPipe[0]);
+    close(gSignalPipe[1]);
+    gSignalPipe[0] = gSignalPipe[1] = -1;
+}
+
+int StopSignals::GetFd() const
+{
+    return gSignalPipe[0];
+}
+
+// Reads exactly size bytes; returns false at end of file or on an error.
+static bool ReadAll(int fd, char* buffer, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t count = read(fd, buffer, size);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return false;
+        buffer += count;
+        size -= count;
+    }
+    return true;
+}
+
+static bool WriteAll(int fd, const char* buffer, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t count = write(fd, buffer, size);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return false;
+        buffer += count;
+        size -= count;
+    }
+    return true;
+}
+
+// Returns body with its 4-byte length in front.
+static string MakeFrame(const string& body)
+{
+    string frame;
+    frame.reserve(4 + body.size());
+    frame += (char) (body.size() >> 24);
+    frame += (char) (body.size() >> 16);
+    frame += (char) (body.size() >> 8);
+    frame += (char) body.size();
+    return frame + body;
+}
+
+static size_t FrameSize(const string& header)
+{
+    const unsigned char* bytes = (const unsigned char*) header.data();
+    return ((size_t) bytes[0] << 24) | (bytes[1] << 16)
+        | (bytes[2] << 8) | bytes[3];
+}
+
+// Reads a frame; returns false at end of file, on an error, or if the
+// frame is too large.
+static bool ReadFrame(int fd, string& body)
+{
+    string header(4, '\0');
+    if (!ReadAll(fd, &header[0], 4))
+        return false;
+
+    size_t size = FrameSize(header);
+    if (size > Server::cMaxFrameSize)
+        return false;
+
+    body.assign(size, '\0');
+    return size == 0 || ReadAll(fd, &body[0], size);
+}
+
+#endif
+
+
+Server::Server(
+    const string& socketPath,
+    const Handler& handler,
+    const Refuser& overloaded,
+    unsigned numberOfWorkers,
+    size_t maxQueueDepth,
+    size_t maxConnections
+) :
+    mSocketPath(socketPath),
+    mHandler(handler),
+    mOverloaded(overloaded),
+    mNumberOfWorkers(numberOfWorkers),
+    mMaxQueueDepth(maxQueueDepth),
+    mMaxConnections(maxConnections),
+    mListenFd(-1),
+    mStopping(false)
+{
+    if (mNumberOfWorkers == 0)
+        mNumberOfWorkers = thread::hardware_concurrency();
+    if (mNumberOfWorkers == 0)
+        mNumberOfWorkers = 1;
+}
+
+
+Server::~Server()
+{
+}
+
+
+#ifdef _WIN32
+
+StopSignals::StopSignals()
+{
+    throw runtime_error("The server modes are not available on Windows");
+}
+
+StopSignals::~StopSignals() { }
+int StopSignals::GetFd() const { return -1; }
+
+void Server::Run()
+{
+    throw runtime_error("The server mode is not available on Windows");
+}
+
+void Server::Work(unsigned worker) { }
+void Server::Read(shared_ptr<Connection> connection) { }
+void Server::Write(shared_ptr<Connection> connection) { }
+void Server::ReapConnections() { }
+void Server::CutOffStuckConnections() { }
+
+ForkPool::ForkPool(
+    const Server::Handler& handler,
+    unsigned numberOfWorkers,
+    unsigned requestsPerChild,
+    const function<void ()>& childExit
+) :
+    mZygotePid(-1),
+    mZygoteFd(-1)
+{
+    throw runtime_error("The fork server is not available on Windows");
+}
+
+ForkPool::~ForkPool() { }
+
+string ForkPool::Handle(const string& request, unsigned worker)
+{
+    throw runtime_error("The fork server is not available on Windows");
+}
+
+void ForkPool::Stop() { }
+void ForkPool::RunZygote(int channel) { }
+void ForkPool::RunChild(int fd) { }
+int ForkPool::Spawn() { return -1; }
+
+#else
+
+// Returns a socket listening on the given path, or throws
+// std::runtime_error.
+static int ListenOnUnixSocket(const string& socketPath)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path))
+        throw runtime_error("The socket path is too long");
+    strcpy(address.sun_path, socketPath.c_str());
+
+    // A socket left behind by a server that was killed is in the way; but
+    // don't remove anything else.
+    struct stat info;
+    if (lstat(socketPath.c_str(), &info) == 0)
+    {
+        if (!S_ISSOCK(info.st_mode))
+            throw runtime_error(
+                "\"" + socketPath + "\" exists and is not a socket"
+            );
+        unlink(socketPath.c_str());
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        throw runtime_error("Cannot create a socket");
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    if (bind(fd, (sockaddr*) &address, sizeof(address)) != 0
+        || listen(fd, 64) != 0
+    )
+    {
+        close(fd);
+        throw runtime_error("Cannot listen on \"" + socketPath + "\"");
+    }
+    return fd;
+}
+
+
+void Server::Run()
+{
+    mListenFd = ListenOnUnixSocket(mSocketPath);
+
+    unique_ptr<StopSignals> stopSignals;
+    try
+    {
+        stopSignals.reset(new StopSignals);
+    }
+    catch (runtime_error&)
+    {
+        close(mListenFd);
+        mListenFd = -1;
+        unlink(mSocketPath.c_str());
+        throw;
+    }
+
+    mStopping = false;
+    for (unsigned worker = 0; worker < mNumberOfWorkers; worker++)
+        mWorkers.push_back(thread(&Server::Work, this, worker));
+
+    while (true)
+    {
+        // With mMaxConnections connections, new clients wait in the listen
+        // queue; we look more often for connections that have finished.
+        bool full = mConnections.size() >= mMaxConnections;
+        pollfd fds[2];
+        fds[0].fd = stopSignals->GetFd();
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = mListenFd;
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+
+        int ready = poll(fds, full ? 1 : 2, full ? 50 : 1000);
+        ReapConnections();
+        if (ready < 0 && errno != EINTR)
+            break;
+        if (ready <= 0)
+            continue;
+
+        if (fds[0].revents)
+            break;
+
+        if (fds[1].revents & POLLIN)
+        {
+            int fd = accept(mListenFd, NULL, NULL);
+            if (fd < 0)
+            {
+                // E.g. out of file descriptors: let connections finish.
+                if (errno == EMFILE || errno == ENFILE)
+                    usleep(100000);
+                continue;
+            }
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+            shared_ptr<Connection> connection(new Connection);
+            connection->mFd = fd;
+            connection->mReader = thread(&Server::Read, this, connection);
+            connection->mWriter = thread(&Server::Write, this, connection);
+            mConnections.push_back(connection);
+        }
+    }
+
+    // Stop accepting connections and reading requests, and wait for the
+    // responses to the requests already read.
+    close(mListenFd);
+    mListenFd = -1;
+    unlink(mSocketPath.c_str());
+
+    for (size_t i = 0; i < mConnections.size(); i++)
+    {
+        lock_guard<mutex> lock(mConnections[i]->mMutex);
+        if (mConnections[i]->mFd >= 0)
+            shutdown(mConnections[i]->mFd, SHUT_RD);
+    }
+    while (!mConnections.empty())
+    {
+        CutOffStuckConnections();
+        ReapConnections();
+        if (!mConnections.empty())
+            usleep(50000);
+    }
+
+    {
+        lock_guard<mutex> lock(mMutex);
+        mStopping = true;
+    }
+    mJobAvailable.notify_all();
+    for (size_t i = 0; i < mWorkers.size(); i++)
+        mWorkers[i].join();
+    mWorkers.clear();
+}
+
+
+future<string> Server::Submit(const string& request)
+{
+    shared_ptr<Job> job(new Job);
+    future<string> response = job->mResponse.get_future();
+
+    {
+        lock_guard<mutex> lock(mMutex);
+        if (mQueue.size() < mMaxQueueDepth)
+        {
+            job->mRequest = request;
+            mQueue.push_back(job);
+            mJobAvailable.notify_one();
+            return response;
+        }
+    }
+
+    job->mResponse.set_value(mOverloaded(request));
+    return response;
+}
+
+
+void Server::Work(unsigned worker)
+{
+    while (true)
+    {
+        shared_ptr<Job> job;
+        {
+            unique_lock<mutex> lock(mMutex);
+            while (mQueue.empty() && !mStopping)
+                mJobAvailable.wait(lock);
+            if (mQueue.empty())
+                return;
+            job = mQueue.front();
+            mQueue.pop_front();
+        }
+
+        try
+        {
+            job->mResponse.set_value(mHandler(job->mRequest, worker));
+        }
+        catch (...)
+        {
+            job->mResponse.set_exception(current_exception());
+        }
+    }
+}
+
+
+void Server::Read(shared_ptr<Connection> connection)
+{
+    while (true)
+    {
+        string request;
+        if (!ReadFrame(connection->mFd, request))
+            break;
+
+        future<string> response = Submit(request);
+
+        lock_guard<mutex> lock(connection->mMutex);
+        connection->mResponses.push_back(move(response));
+        connection->mResponseQueued.notify_one();
+    }
+
+    lock_guard<mutex> lock(connection->mMutex);
+    connection->mDoneReading = true;
+    connection->mResponseQueued.notify_one();
+}
+
+
+void Server::Write(shared_ptr<Connection> connection)
+{
+    bool connected = true;
+    while (true)
+    {
+        future<string> response;
+        {
+            unique_lock<mutex> lock(connection->mMutex);
+            while (connection->mResponses.empty()
+                && !connection->mDoneReading
+            )
+                connection->mResponseQueued.wait(lock);
+            if (connection->mResponses.empty())
+                break;
+            response = move(connection->mResponses.front());
+            connection->mResponses.pop_front();
+        }
+
+        // Even once the client is gone, wait for the responses it asked
+        // for, so that their jobs don't outlive the connection.
+        string frame;
+        try
+        {
+            frame = MakeFrame(response.get());
+        }
+        catch (...)
+        {
+            // The handler failed; there is no way to tell the client which
+            // response is missing, so drop the connection.
+            connected = false;
+            shutdown(connection->mFd, SHUT_RDWR);
+        }
+
+        if (connected)
+        {
+            {
+                lock_guard<mutex> lock(connection->mMutex);
+                connection->mWriting = true;
+                connection->mWriteStarted = chrono::steady_clock::now();
+            }
+            if (!WriteAll(connection->mFd, frame.data(), frame.size()))
+            {
+                connected = false;
+                shutdown(connection->mFd, SHUT_RDWR);
+            }
+            lock_guard<mutex> lock(connection->mMutex);
+            connection->mWriting = false;
+        }
+    }
+
+    lock_guard<mutex> lock(connection->mMutex);
+    close(connection->mFd);
+    connection->mFd = -1;
+    connection->mFinished = true;
+}
+
+
+// Joins the threads of the connections that are finished.
+void Server::ReapConnections()
+{
+    for (size_t i = 0; i < mConnections.size(); )
+    {
+        shared_ptr<Connection> connection = mConnections[i];
+        bool finished;
+        {
+            lock_guard<mutex> lock(connection->mMutex);
+            finished = connection->mFinished;
+        }
+
+        if (finished)
+        {
+            connection->mReader.join();
+            connection->mWriter.join();
+            mConnections.erase(mConnections.begin() + i);
+        }
+        else
+            i++;
+    }
+}
+
+
+// Shuts down the connections whose writer has been stuck in write() for
+// more than cStuckWriteTimeout seconds, because the client doesn't read,
+// so that the writer gives up.
+void Server::CutOffStuckConnections()
+{
+    chrono::steady_clock::time_point limit
+        = chrono::steady_clock::now() - chrono::seconds(cStuckWriteTimeout);
+    for (size_t i = 0; i < mConnections.size(); i++)
+    {
+        Connection& connection = *mConnections[i];
+        lock_guard<mutex> lock(connection.mMutex);
+        if (connection.mWriting && connection.mWriteStarted < limit
+            && connection.mFd >= 0
+        )
+            shutdown(connection.mFd, SHUT_RDWR);
+    }
+}
+
+
+
+// Sends a byte, and fd along with it unless it is negative, on a Unix
+// domain socket.
+static bool SendFd(int channel, int fd)
+{
+    char byte = fd < 0 ? 'n' : 'y';
+    iovec data;
+    data.iov_base = &byte;
+    data.iov_len = 1;
+
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+
+    union
+    {
+        cmsghdr mHeader;
+        char mBuffer[CMSG_SPACE(sizeof(int))];
+    }
+    control;
+    if (fd >= 0)
+    {
+        memset(&control, 0, sizeof(control));
+        message.msg_control = control.mBuffer;
+        message.msg_controllen = sizeof(control.mBuffer);
+        cmsghdr* header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(header), &fd, sizeof(int));
+    }
+
+    ssize_t count;
+    do
+        count = sendmsg(channel, &message, 0);
+    while (count < 0 && errno == EINTR);
+    return count == 1;
+}
+
+// Receives what SendFd sent: returns the descriptor, or -1 if there was
+// none or on an error.
+static int ReceiveFd(int channel)
+{
+    char byte;
+    iovec data;
+    data.iov_base = &byte;
+    data.iov_len = 1;
+
+    union
+    {
+        cmsghdr mHeader;
+        char mBuffer[CMSG_SPACE(sizeof(int))];
+    }
+    control;
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control.mBuffer;
+    message.msg_controllen = sizeof(control.mBuffer);
+
+    ssize_t count;
+    do
+        count = recvmsg(channel, &message, 0);
+    while (count < 0 && errno == EINTR);
+    if (count != 1)
+        return -1;
+
+    cmsghdr* header = CMSG_FIRSTHDR(&message);
+    if (header == NULL || header->cmsg_level != SOL_SOCKET
+        || header->cmsg_type != SCM_RIGHTS
+    )
+        return -1;
+
+    int fd;
+    memcpy(&fd, CMSG_DATA(header), sizeof(int));
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+
+ForkPool::ForkPool(
+    const Server::Handler& handler,
+    unsigned numberOfWorkers,
+    unsigned requestsPerChild,
+    const function<void ()>& childExit
+) :
+    mHandler(handler),
+    mRequestsPerChild(requestsPerChild),
+    mChildExit(childExit),
+    mZygotePid(-1),
+    mZygoteFd(-1)
+{
+    int channel[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, channel) != 0)
+        throw runtime_error("Cannot create a socket");
+    fcntl(channel[0], F_SETFD, FD_CLOEXEC);
+    fcntl(channel[1], F_SETFD, FD_CLOEXEC);
+
+    mZygotePid = fork();
+    if (mZygotePid == 0)
+    {
+        close(channel[0]);
+        RunZygote(channel[1]);
+    }
+    close(channel[1]);
+    if (mZygotePid < 0)
+    {
+        close(channel[0]);
+        throw runtime_error("Cannot start the zygote process");
+    }
+    mZygoteFd = channel[0];
+
+    Child child;
+    child.mFd = -1;
+    child.mServed = 0;
+    mChildren.assign(numberOfWorkers, child);
+    try
+    {
+        for (size_t i = 0; i < mChildren.size(); i++)
+            mChildren[i].mFd = Spawn();
+    }
+    catch (runtime_error&)
+    {
+        Stop();
+        throw;
+    }
+}
+
+
+ForkPool::~ForkPool()
+{
+    Stop();
+}
+
+
+void ForkPool::Stop()
+{
+    // The children and the zygote see end of file, and exit; the zygote
+    // waits for the children.
+    for (size_t i = 0; i < mChildren.size(); i++)
+        if (mChildren[i].mFd >= 0)
+        {
+            close(mChildren[i].mFd);
+            mChildren[i].mFd = -1;
+        }
+
+    if (mZygoteFd >= 0)
+    {
+        close(mZygoteFd);
+        mZygoteFd = -1;
+        while (waitpid(mZygotePid, NULL, 0) < 0 && errno == EINTR)
+            ;
+    }
+}
+
+
+string ForkPool::Handle(const string& request, unsigned worker)
+{
+    Child& child = mChildren[worker];
+    if (child.mFd < 0)
+    {
+        child.mFd = Spawn();
+        child.mServed = 0;
+    }
+
+    string frame = MakeFrame(request), response;
+    if (!WriteAll(child.mFd, frame.data(), frame.size())
+        || !ReadFrame(child.mFd, response)
+    )
+    {
+        close(child.mFd);
+        child.mFd = -1;
+        throw runtime_error("The conversion process died");
+    }
+
+    // A child that is done exits by itself; have the next one ready for
+    // the next request.
+    if (++child.mServed == mRequestsPerChild)
+    {
+        close(child.mFd);
+        child.mServed = 0;
+        try
+        {
+            child.mFd = Spawn();
+        }
+        catch (runtime_error&)
+        {
+            // Try again on the next request.
+            child.mFd = -1;
+        }
+    }
+    return response;
+}
+
+
+// Returns our end of the socket to a new child, or throws
+// std::runtime_error.
+int ForkPool::Spawn()
+{
+    lock_guard<mutex> lock(mZygoteMutex);
+    int fd = -1;
+    if (WriteAll(mZygoteFd, "f", 1))
+        fd = ReceiveFd(mZygoteFd);
+    if (fd < 0)
+        throw runtime_error("Cannot start a conversion process");
+    return fd;
+}
+
+
+// The zygote forks a child whenever the parent sends a byte on channel,
+// and sends back the parent's end of the socket to it. It exits, once its
+// children are gone, when the parent closes channel.
+void ForkPool::RunZygote(int channel)
+{
+    // Signals from the terminal go to the whole process group, but the
+    // parent decides when we stop.
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    char command;
+    while (ReadAll(channel, &command, 1))
+    {
+        // Children that are done.
+        while (waitpid(-1, NULL, WNOHANG) > 0)
+            ;
+
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0)
+        {
+            SendFd(channel, -1);
+            continue;
+        }
+        // Keep the sockets away from the programs the children run (such as
+        // latex), so that the parent sees a child die straight away.
+        fcntl(pair[0], F_SETFD, FD_CLOEXEC);
+        fcntl(pair[1], F_SETFD, FD_CLOEXEC);
+
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            close(channel);
+            close(pair[0]);
+            RunChild(pair[1]);
+        }
+        close(pair[1]);
+        SendFd(channel, pid < 0 ? -1 : pair[0]);
+        close(pair[0]);
+    }
+
+    while (wait(NULL) > 0 || errno == EINTR)
+        ;
+    _exit(0);
+}
+
+
+void ForkPool::RunChild(int fd)
+{
+    // Ignored signals stay ignored across exec(), so take back the
+    // zygote's SIG_IGN for these: a conversion process (and the latex it
+    // runs) must stop when told to, even if that means that a ^C from the
+    // terminal ends the requests in progress. SIGPIPE stays ignored, so
+    // that a parent that went away doesn't keep us from cleaning up;
+    // RunProcess gives the programs we run the default action.
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    unsigned served = 0;
+    string request;
+    while ((mRequestsPerChild == 0 || served < mRequestsPerChild)
+        && ReadFrame(fd, request)
+    )
+    {
+        string frame;
+        try
+        {
+            frame = MakeFrame(mHandler(request, 0));
+        }
+        catch (...)
+        {
+            // Like a crash: the parent reports it.
+            _exit(1);
+        }
+        served++;
+        if (!WriteAll(fd, frame.data(), frame.size()))
+            break;
+    }
+
+    close(fd);
+    if (mChildExit)
+        mChildExit();
+    _exit(0);
+}
+
+#endif
+
+// end of file @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
@@ -0,0 +1,236 @@
+/*
+blahtex: a TeX to MathML converter designed with MediaWiki in mind
+blahtexml: an extension of blahtex with XML processing in mind
+http://gva.noekeon.org/blahtexml
+
+Copyright (c) 2006, David Harvey
+Copyright (c) 2010, Gilles Van Assche
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the names of the authors nor the names of their affiliation may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef BLAHTEX_SERVER_H
+#define BLAHTEX_SERVER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Catches SIGTERM and SIGINT, and ignores SIGPIPE, while it exists, so
+// that a server can stop gracefully: GetFd() becomes readable once one of
+// the signals has arrived. Only one may exist at a time. Throws
+// std::runtime_error on failure (and always on Windows).
+class StopSignals
+{
+public:
+    StopSignals();
+    ~StopSignals();
+
+    int GetFd() const;
+
+private:
+    // Not copyable.
+    StopSignals(const StopSignals&);
+    StopSignals& operator=(const StopSignals&);
+};
+
+// Server answers requests that arrive on a Unix domain socket (see
+// "--server"), so that a client converting many formulas doesn't pay for
+// starting blahtex each time.
+//
+// On a connection, each request and each response is a frame: a 4-byte
+// length (big-endian) followed by that many bytes. A client may send
+// several requests without waiting; the responses come back in the same
+// order. The requests from all connections are handled by a fixed set of
+// worker threads. At most maxQueueDepth of them wait for a worker; any
+// more are refused straight away with the response made by Overloaded.
+// Each connection has a reading and a writing thread of its own; at most
+// maxConnections are served at a time, and further clients wait to be
+// accepted until one of them closes.
+//
+// SIGTERM (or SIGINT) stops the server gracefully: it stops accepting
+// connections and reading requests, sends the responses to the requests
+// already read, and returns from Run. A client that stops taking its
+// responses is cut off after cStuckWriteTimeout seconds, so that it can't
+// hold up the shutdown.
+//
+// Not available on Windows, where Run throws.
+class Server
+{
+public:
+    // Makes the response to a request; called on a worker thread, with the
+    // worker's number (from 0 to numberOfWorkers - 1), so that it can use
+    // per-worker objects.
+    typedef std::function<std::string (const std::string& request, unsigned worker)> Handler;
+
+    // Makes the response to a request that was refused because the queue
+    // is full; called on the connection's thread.
+    typedef std::function<std::string (const std::string& request)> Refuser;
+
+    // Requests larger than this are refused, and the connection closed.
+    static const size_t cMaxFrameSize = 16 * 1024 * 1024;
+
+    // How long a response may take to write while the server stops.
+    static const int cStuckWriteTimeout = 5;
+
+    // If numberOfWorkers is 0, there is one worker per processor core.
+    Server(
+        const std::string& socketPath,
+        const Handler& handler,
+        const Refuser& overloaded,
+        unsigned numberOfWorkers = 0,
+        size_t maxQueueDepth = 256,
+        size_t maxConnections = 128
+    );
+
+    ~Server();
+
+    // Listens on the socket until SIGTERM or SIGINT arrives. Throws
+    // std::runtime_error if the socket can't be set up.
+    void Run();
+
+    unsigned GetNumberOfWorkers() const
+    {
+        return mNumberOfWorkers;
+    }
+
+private:
+    struct Job
+    {
+        std::string mRequest;
+        std::promise<std::string> mResponse;
+    };
+
+    // One client connection: a thread reads the requests, another writes
+    // the responses, in order, as they become ready.
+    struct Connection
+    {
+        // Closed, and set to -1, by the writer (holding mMutex).
+        int mFd;
+        std::thread mReader;
+        std::thread mWriter;
+
+        std::mutex mMutex;
+        std::condition_variable mResponseQueued;
+        std::deque<std::future<std::string> > mResponses;
+        bool mDoneReading;
+        bool mFinished;
+
+        // Set while the writer is in write(), since mWriteStarted.
+        bool mWriting;
+        std::chrono::steady_clock::time_point mWriteStarted;
+
+        Connection() :
+            mFd(-1),
+            mDoneReading(false),
+            mFinished(false),
+            mWriting(false)
+        { }
+    };
+
+    void Work(unsigned worker);
+    void Read(std::shared_ptr<Connection> connection);
+    void Write(std::shared_ptr<Connection> connection);
+    std::future<std::string> Submit(const std::string& request);
+    void ReapConnections();
+    void CutOffStuckConnections();
+
+    std::string mSocketPath;
+    Handler mHandler;
+    Refuser mOverloaded;
+    unsigned mNumberOfWorkers;
+    size_t mMaxQueueDepth;
+    size_t mMaxConnections;
+    int mListenFd;
+
+    std::vector<std::thread> mWorkers;
+    std::mutex mMutex;
+    std::condition_variable mJobAvailable;
+    std::deque<std::shared_ptr<Job> > mQueue;
+    bool mStopping;
+
+    std::vector<std::shared_ptr<Connection> > mConnections;
+
+    // Not copyable.
+    Server(const Server&);
+    Server& operator=(const Server&);
+};
+
+// ForkPool runs a Server::Handler in child processes, so that a request
+// that crashes (or corrupts memory) takes down only its own process (see
+// "--fork-server"). It is made while the process is still single-threaded
+// and has warmed up whatever the handler needs: it then forks a "zygote"
+// process, which forks the children on demand, so that every child starts
+// as a copy-on-write image of the warm parent, and nothing is forked from
+// a process with threads.
+//
+// There is one child per worker, kept ready in advance; each child
+// handles requestsPerChild requests (0 means no limit), then exits and is
+// replaced. In a child, the handler is always called with worker 0, and
+// childExit, if set, is called before the child exits.
+//
+// Not available on Windows, where the constructor throws.
+class ForkPool
+{
+public:
+    ForkPool(
+        const Server::Handler& handler,
+        unsigned numberOfWorkers,
+        unsigned requestsPerChild = 1,
+        const std::function<void ()>& childExit = std::function<void ()>()
+    );
+
+    // Stops the children and the zygote.
+    ~ForkPool();
+
+    // Has the given worker's child make the response to a request. Throws
+    // std::runtime_error if the child dies first. Each worker must be used
+    // by one thread at a time.
+    std::string Handle(const std::string& request, unsigned worker);
+
+private:
+    void Stop();
+    void RunZygote(int channel);
+    void RunChild(int fd);
+    int Spawn();
+
+    Server::Handler mHandler;
+    unsigned mRequestsPerChild;
+    std::function<void ()> mChildExit;
+
+    int mZygotePid;
+    // Our end of the socket to the zygote, guarded by mZygoteMutex.
+    int mZygoteFd;
+    std::mutex mZygoteMutex;
+
+    struct Child
+    {
+        // Our end of the socket to the child, or -1.
+        int mFd;
+        unsigned mServed;
+    };
+    std::vector<Child> mChildren;
+
+    // Not copyable.
+    ForkPool(const ForkPool&);
+    ForkPool& operator=(const ForkPool&);
+};
+
+#endif
+
+// end of file @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
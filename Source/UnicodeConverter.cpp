@@ -30,6 +30,8 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 
 using namespace std;
 
+thread_local UnicodeConverter gUnicodeConverter;
+
 UnicodeConverter::~UnicodeConverter()
 {
 #ifndef WIN32_CODECONV
@@ -135,10 +137,7 @@ void UnicodeConverter::Open()
 wstring UnicodeConverter::ConvertIn(const string& input)
 {
     if (!mIsOpen)
-        throw logic_error(
-            "UnicodeConverter::ConvertIn called "
-            "before UnicodeConverter::Open"
-        );
+        Open();
 
     char* inputBuf  = new char[input.size()];
     memcpy(inputBuf, input.c_str(), input.size());
@@ -223,10 +222,7 @@ wstring UnicodeConverter::ConvertIn(const string& input)
 string UnicodeConverter::ConvertOut(const wstring& input)
 {
     if (!mIsOpen)
-        throw logic_error(
-            "UnicodeConverter::ConvertOut called "
-            "before UnicodeConverter::Open"
-        );
+        Open();
 
     wchar_t* inputBuf = new wchar_t[input.size()];
     wmemcpy(inputBuf, input.c_str(), input.size());
@@ -37,7 +37,8 @@ class UnicodeConverter
 
         ~UnicodeConverter();
 
-        // Open() must be called before using this object.
+        // Open() prepares this object for use. ConvertIn and ConvertOut
+        // call it if needed, but calling it first reports problems early.
         //
         // It will throw a std::runtime_error object if
         // (1) we are running on a platform with less than 4 bytes
@@ -66,6 +67,10 @@ class UnicodeConverter
 #endif
 };
 
+// Each thread has a gUnicodeConverter of its own, since the iconv handles
+// keep state between calls.
+extern thread_local UnicodeConverter gUnicodeConverter;
+
 #endif
 
 // end of file @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
@@ -0,0 +1,270 @@
+/*
+blahtex: a TeX to MathML converter designed with MediaWiki in mind
+blahtexml: an extension of blahtex with XML processing in mind
+http://gva.noekeon.org/blahtexml
+
+Copyright (c) 2006, David Harvey
+Copyright (c) 2010, Gilles Van Assche
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the names of the authors nor the names of their affiliation may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "WorkScheduler.h"
+#include <algorithm>
+
+using namespace std;
+
+
+WorkScheduler::WorkScheduler(
+    const Writer& writer,
+    unsigned numberOfWorkers,
+    size_t window
+) :
+    mWriter(writer),
+    mQueued(0),
+    mSubmitted(0),
+    mWritten(0),
+    mStopping(false),
+    mFinished(false)
+{
+    if (numberOfWorkers == 0)
+        numberOfWorkers = thread::hardware_concurrency();
+    if (numberOfWorkers == 0)
+        numberOfWorkers = 1;
+
+    mWindow = window ? window : 16 * numberOfWorkers;
+
+    for (unsigned worker = 0; worker < numberOfWorkers; worker++)
+        mQueues.push_back(unique_ptr<Queue>(new Queue));
+
+    for (unsigned worker = 0; worker < numberOfWorkers; worker++)
+        mThreads.push_back(thread(&WorkScheduler::Work, this, worker));
+    mWriterThread = thread(&WorkScheduler::Write, this);
+}
+
+
+WorkScheduler::~WorkScheduler()
+{
+    try
+    {
+        Finish();
+    }
+    catch (...)
+    {
+    }
+}
+
+
+void WorkScheduler::Submit(const Task& task, unsigned long cost)
+{
+    Item item;
+    item.mCost = cost;
+    item.mTask = task;
+
+    {
+        unique_lock<mutex> lock(mMutex);
+        while (mSubmitted >= mWritten + mWindow && !mError)
+            mSpaceAvailable.wait(lock);
+
+        // Finish() reports the error; the rest of the input is dropped.
+        if (mError)
+            return;
+
+        item.mIndex = mSubmitted++;
+    }
+
+    // Give it to the worker with the least work queued.
+    Queue* target = NULL;
+    unsigned long targetCost = 0;
+    for (size_t i = 0; i < mQueues.size(); i++)
+    {
+        lock_guard<mutex> lock(mQueues[i]->mMutex);
+        if (!target || mQueues[i]->mTotalCost < targetCost)
+        {
+            target = mQueues[i].get();
+            targetCost = target->mTotalCost;
+        }
+    }
+
+    {
+        lock_guard<mutex> lock(target->mMutex);
+        target->mItems.push_back(item);
+        push_heap(target->mItems.begin(), target->mItems.end());
+        target->mTotalCost += cost;
+    }
+
+    // A worker may take the item before it is counted here, so mQueued can
+    // briefly drop below zero.
+    {
+        lock_guard<mutex> lock(mMutex);
+        mQueued++;
+    }
+    mWorkAvailable.notify_one();
+}
+
+
+void WorkScheduler::Finish()
+{
+    {
+        lock_guard<mutex> lock(mMutex);
+        if (mFinished)
+            return;
+        mFinished = true;
+        mStopping = true;
+    }
+    mWorkAvailable.notify_all();
+    mResultAvailable.notify_all();
+
+    for (size_t i = 0; i < mThreads.size(); i++)
+        mThreads[i].join();
+    mWriterThread.join();
+
+    if (mError)
+        rethrow_exception(mError);
+}
+
+
+bool WorkScheduler::TakeFrom(Queue& queue, Item& item)
+{
+    lock_guard<mutex> lock(queue.mMutex);
+    if (queue.mItems.empty())
+        return false;
+
+    pop_heap(queue.mItems.begin(), queue.mItems.end());
+    item = queue.mItems.back();
+    queue.mItems.pop_back();
+    queue.mTotalCost -= item.mCost;
+    return true;
+}
+
+
+// Takes the most expensive task from the worker's own queue, or else from
+// the queue with the most work left.
+bool WorkScheduler::Take(unsigned worker, Item& item)
+{
+    bool found = TakeFrom(*mQueues[worker], item);
+
+    while (!found)
+    {
+        Queue* victim = NULL;
+        unsigned long victimCost = 0;
+        for (size_t i = 0; i < mQueues.size(); i++)
+        {
+            lock_guard<mutex> lock(mQueues[i]->mMutex);
+            if (!mQueues[i]->mItems.empty()
+                && (!victim || mQueues[i]->mTotalCost > victimCost)
+            )
+            {
+                victim = mQueues[i].get();
+                victimCost = victim->mTotalCost;
+            }
+        }
+        if (!victim)
+            return false;
+
+        // Another worker may have emptied it in the meantime.
+        found = TakeFrom(*victim, item);
+    }
+
+    lock_guard<mutex> lock(mMutex);
+    mQueued--;
+    return true;
+}
+
+
+void WorkScheduler::Work(unsigned worker)
+{
+    while (true)
+    {
+        Item item;
+        if (!Take(worker, item))
+        {
+            unique_lock<mutex> lock(mMutex);
+            if (mQueued <= 0)
+            {
+                if (mStopping)
+                    return;
+                mWorkAvailable.wait(lock);
+            }
+            continue;
+        }
+
+        string result;
+        try
+        {
+            result = item.mTask(worker);
+        }
+        catch (...)
+        {
+            Fail();
+            continue;
+        }
+
+        {
+            lock_guard<mutex> lock(mMutex);
+            mResults[item.mIndex].swap(result);
+        }
+        mResultAvailable.notify_one();
+    }
+}
+
+
+void WorkScheduler::Write()
+{
+    unique_lock<mutex> lock(mMutex);
+    while (true)
+    {
+        if (!mError && !mResults.empty() && mResults.begin()->first == mWritten)
+        {
+            string result;
+            result.swap(mResults.begin()->second);
+            mResults.erase(mResults.begin());
+
+            lock.unlock();
+            try
+            {
+                mWriter(result);
+            }
+            catch (...)
+            {
+                lock.lock();
+                if (!mError)
+                    mError = current_exception();
+                mSpaceAvailable.notify_all();
+                continue;
+            }
+            lock.lock();
+
+            mWritten++;
+            mSpaceAvailable.notify_all();
+            continue;
+        }
+
+        if (mStopping && (mError || mWritten == mSubmitted))
+            return;
+
+        mResultAvailable.wait(lock);
+    }
+}
+
+
+// Records the exception being handled, if it is the first one.
+void WorkScheduler::Fail()
+{
+    {
+        lock_guard<mutex> lock(mMutex);
+        if (!mError)
+            mError = current_exception();
+    }
+    mSpaceAvailable.notify_all();
+    mResultAvailable.notify_all();
+}
+
+// end of file @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
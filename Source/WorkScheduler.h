@@ -0,0 +1,132 @@
+/*
+blahtex: a TeX to MathML converter designed with MediaWiki in mind
+blahtexml: an extension of blahtex with XML processing in mind
+http://gva.noekeon.org/blahtexml
+
+Copyright (c) 2006, David Harvey
+Copyright (c) 2010, Gilles Van Assche
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the names of the authors nor the names of their affiliation may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef BLAHTEX_WORK_SCHEDULER_H
+#define BLAHTEX_WORK_SCHEDULER_H
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// WorkScheduler runs tasks on a fixed set of threads, and hands their
+// results (strings) to a writer in the order the tasks were submitted.
+//
+// Each task comes with an estimate of its cost. Every worker has a queue of
+// its own, ordered by cost, and always runs its most expensive task first;
+// Submit adds a task to the queue with the least work in it. A worker whose
+// queue is empty steals the most expensive task from the busiest queue. This
+// way the few expensive tasks start early, instead of keeping one thread
+// busy at the end while the others wait.
+//
+// Results that are ready before their predecessors wait in a reorder
+// buffer. At most "window" tasks are submitted but not yet written; Submit
+// blocks when there are that many, which bounds the buffer (and the memory
+// used by a long input).
+class WorkScheduler
+{
+public:
+    // A task is called with the number of the worker thread running it (from
+    // 0 to GetNumberOfWorkers() - 1), so that it can use per-worker objects.
+    typedef std::function<std::string (unsigned worker)> Task;
+
+    // Called with each result in turn, from a thread of its own.
+    typedef std::function<void (const std::string& result)> Writer;
+
+    // If numberOfWorkers is 0, there is one worker per processor core. If
+    // window is 0, it is 16 tasks per worker.
+    WorkScheduler(
+        const Writer& writer,
+        unsigned numberOfWorkers = 0,
+        size_t window = 0
+    );
+
+    // Calls Finish(), but ignores the exception it may throw.
+    ~WorkScheduler();
+
+    void Submit(const Task& task, unsigned long cost);
+
+    // Waits until all the results are written, and stops the threads. If a
+    // task or the writer threw an exception, it is rethrown here (and the
+    // results after it are dropped).
+    void Finish();
+
+    unsigned GetNumberOfWorkers() const
+    {
+        return mQueues.size();
+    }
+
+private:
+    struct Item
+    {
+        size_t mIndex;
+        unsigned long mCost;
+        Task mTask;
+
+        bool operator<(const Item& other) const
+        {
+            return mCost < other.mCost;
+        }
+    };
+
+    // A worker's tasks, as a heap with the most expensive at the front.
+    struct Queue
+    {
+        std::mutex mMutex;
+        std::vector<Item> mItems;
+        unsigned long mTotalCost;
+
+        Queue() :
+            mTotalCost(0)
+        { }
+    };
+
+    bool Take(unsigned worker, Item& item);
+    static bool TakeFrom(Queue& queue, Item& item);
+    void Work(unsigned worker);
+    void Write();
+    void Fail();
+
+    Writer mWriter;
+    size_t mWindow;
+    std::vector<std::unique_ptr<Queue> > mQueues;
+    std::vector<std::thread> mThreads;
+    std::thread mWriterThread;
+
+    // The following are protected by mMutex.
+    std::mutex mMutex;
+    std::condition_variable mWorkAvailable;
+    std::condition_variable mResultAvailable;
+    std::condition_variable mSpaceAvailable;
+    long mQueued;           // tasks in the queues
+    size_t mSubmitted;      // tasks submitted so far
+    size_t mWritten;        // results written so far
+    std::map<size_t, std::string> mResults;   // the reorder buffer
+    std::exception_ptr mError;
+    bool mStopping;
+    bool mFinished;
+};
+
+#endif
+
+// end of file @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
@@ -0,0 +1,642 @@
+/*
+blahtex: a TeX to MathML converter designed with MediaWiki in mind
+blahtexml: an extension of blahtex with XML processing in mind
+http://gva.noekeon.org/blahtexml
+
+Copyright (c) 2006, David Harvey
+Copyright (c) 2010, Gilles Van Assche
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the names of the authors nor the names of their affiliation may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "libblahtex.h"
+#include <algorithm>
+#include <new>
+#include <stdexcept>
+#include <stdlib.h>
+#include <string.h>
+#include "BlahtexCore/Interface.h"
+
+using namespace std;
+
+extern wstring GetErrorMessage(const blahtex::Exception& e);
+
+struct blahtex_context
+{
+    enum Output
+    {
+        cOutputMathml,
+        cOutputPurifiedTex,
+        cOutputPurifiedTexOnly,
+        cOutputCanonicalKey
+    };
+
+    blahtex::Interface mInterface;
+    bool mDisplayStyle;
+    Output mOutput;
+
+    string mErrorId;
+    string mErrorMessage;
+    vector<string> mErrorArgs;
+    bool mHasErrorSpan;
+    size_t mErrorStart;
+    size_t mErrorLength;
+
+    blahtex_context() :
+        mDisplayStyle(false),
+        mOutput(cOutputMathml),
+        mHasErrorSpan(false)
+    { }
+};
+
+namespace
+{
+
+// UTF-8 is converted here directly, rather than with UnicodeConverter, so
+// that the library needs no iconv and writes the output straight into the
+// caller's buffer.
+
+const wchar_t cReplacementCharacter = 0xFFFD;
+
+// Decodes UTF-8, rejecting overlong forms, surrogates and code points
+// above U+10FFFF. Returns false if the input is invalid.
+bool DecodeUtf8(const char* input, size_t length, wstring& output)
+{
+    const unsigned char* p = (const unsigned char*) input;
+    const unsigned char* end = p + length;
+    output.reserve(length);
+
+    while (p < end)
+    {
+        unsigned c = *p++;
+        if (c < 0x80)
+        {
+            output += (wchar_t) c;
+            continue;
+        }
+
+        int count;
+        unsigned minimum;
+        if ((c & 0xE0) == 0xC0)
+        {
+            count = 1;
+            minimum = 0x80;
+            c &= 0x1F;
+        }
+        else if ((c & 0xF0) == 0xE0)
+        {
+            count = 2;
+            minimum = 0x800;
+            c &= 0x0F;
+        }
+        else if ((c & 0xF8) == 0xF0)
+        {
+            count = 3;
+            minimum = 0x10000;
+            c &= 0x07;
+        }
+        else
+            return false;
+
+        if (end - p < count)
+            return false;
+        for (int i = 0; i < count; i++, p++)
+        {
+            if ((*p & 0xC0) != 0x80)
+                return false;
+            c = (c << 6) | (*p & 0x3F);
+        }
+        if (c < minimum || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+            return false;
+
+#ifdef WCHAR_T_IS_16BIT
+        if (c >= 0x10000)
+        {
+            c -= 0x10000;
+            output += (wchar_t) (0xD800 + (c >> 10));
+            output += (wchar_t) (0xDC00 + (c & 0x3FF));
+            continue;
+        }
+#endif
+        output += (wchar_t) c;
+    }
+    return true;
+}
+
+// Returns the code point at p (a surrogate pair with 16-bit wchar_t), and
+// advances p.
+unsigned NextCodePoint(const wchar_t*& p, const wchar_t* end)
+{
+    unsigned c = (unsigned) *p++;
+#ifdef WCHAR_T_IS_16BIT
+    c &= 0xFFFF;
+    if (c >= 0xD800 && c <= 0xDBFF && p < end
+        && (*p & 0xFC00) == 0xDC00
+    )
+        return 0x10000 + ((c - 0xD800) << 10) + (*p++ & 0x3FF);
+#endif
+    if (c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+        return cReplacementCharacter;
+    return c;
+}
+
+size_t Utf8Length(unsigned c)
+{
+    return c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+}
+
+// Writes c at out, which has room for it; returns the end.
+char* EncodeUtf8(unsigned c, char* out)
+{
+    if (c < 0x80)
+        *out++ = (char) c;
+    else if (c < 0x800)
+    {
+        *out++ = (char) (0xC0 | (c >> 6));
+        *out++ = (char) (0x80 | (c & 0x3F));
+    }
+    else if (c < 0x10000)
+    {
+        *out++ = (char) (0xE0 | (c >> 12));
+        *out++ = (char) (0x80 | ((c >> 6) & 0x3F));
+        *out++ = (char) (0x80 | (c & 0x3F));
+    }
+    else
+    {
+        *out++ = (char) (0xF0 | (c >> 18));
+        *out++ = (char) (0x80 | ((c >> 12) & 0x3F));
+        *out++ = (char) (0x80 | ((c >> 6) & 0x3F));
+        *out++ = (char) (0x80 | (c & 0x3F));
+    }
+    return out;
+}
+
+string ToUtf8(const wstring& text)
+{
+    string output;
+    output.reserve(text.size());
+    const wchar_t* p = text.data();
+    const wchar_t* end = p + text.size();
+    while (p < end)
+    {
+        char bytes[4];
+        output.append(bytes, EncodeUtf8(NextCodePoint(p, end), bytes));
+    }
+    return output;
+}
+
+// Returns how many bytes the first "count" characters of text take up in
+// UTF-8.
+size_t Utf8Length(const wstring& text, size_t count)
+{
+    size_t length = 0;
+    const wchar_t* p = text.data();
+    const wchar_t* end = p + min(count, text.size());
+    while (p < end)
+    {
+        char bytes[4];
+        length += EncodeUtf8(NextCodePoint(p, end), bytes) - bytes;
+    }
+    return length;
+}
+
+// Where a conversion's output goes.
+class Sink
+{
+public:
+    virtual ~Sink() { }
+
+    // Returns false if the output can't be written.
+    virtual bool Write(const wstring& text) = 0;
+};
+
+// Appends to a blahtex_buffer: measures the UTF-8 first, grows the buffer
+// once, and encodes straight into it.
+class BufferSink : public Sink
+{
+public:
+    BufferSink(blahtex_buffer* buffer) :
+        mBuffer(buffer)
+    { }
+
+    bool Write(const wstring& text)
+    {
+        const wchar_t* begin = text.data();
+        const wchar_t* end = begin + text.size();
+
+        size_t length = 0;
+        for (const wchar_t* p = begin; p < end; )
+            length += Utf8Length(NextCodePoint(p, end));
+
+        size_t needed = mBuffer->size + length + 1;
+        if (needed > mBuffer->capacity)
+        {
+            size_t capacity = mBuffer->capacity * 2;
+            if (capacity < needed)
+                capacity = needed;
+            char* data = (char*) realloc(mBuffer->data, capacity);
+            if (data == NULL)
+                throw bad_alloc();
+            mBuffer->data = data;
+            mBuffer->capacity = capacity;
+        }
+
+        char* out = mBuffer->data + mBuffer->size;
+        for (const wchar_t* p = begin; p < end; )
+            out = EncodeUtf8(NextCodePoint(p, end), out);
+        *out = '\0';
+        mBuffer->size += length;
+        return true;
+    }
+
+private:
+    blahtex_buffer* mBuffer;
+};
+
+// Passes the output to a blahtex_write_function, in pieces.
+class FunctionSink : public Sink
+{
+public:
+    FunctionSink(blahtex_write_function write, void* user) :
+        mWrite(write),
+        mUser(user)
+    { }
+
+    bool Write(const wstring& text)
+    {
+        char chunk[4096];
+        char* out = chunk;
+        const wchar_t* p = text.data();
+        const wchar_t* end = p + text.size();
+        while (p < end)
+        {
+            if (out > chunk + sizeof(chunk) - 4)
+            {
+                if (mWrite(mUser, chunk, out - chunk) != 0)
+                    return false;
+                out = chunk;
+            }
+            out = EncodeUtf8(NextCodePoint(p, end), out);
+        }
+        return out == chunk || mWrite(mUser, chunk, out - chunk) == 0;
+    }
+
+private:
+    blahtex_write_function mWrite;
+    void* mUser;
+};
+
+void ClearError(blahtex_context* context)
+{
+    context->mErrorId.clear();
+    context->mErrorMessage.clear();
+    context->mErrorArgs.clear();
+    context->mHasErrorSpan = false;
+}
+
+blahtex_status Fail(
+    blahtex_context* context,
+    blahtex_status status,
+    const string& id,
+    const string& message
+)
+{
+    context->mErrorId = id;
+    context->mErrorMessage = message;
+    return status;
+}
+
+blahtex_status Convert(
+    blahtex_context* context,
+    const char* input,
+    size_t length,
+    Sink& sink
+)
+{
+    ClearError(context);
+    try
+    {
+        wstring tex;
+        if (!DecodeUtf8(input, length, tex))
+            return Fail(
+                context, BLAHTEX_ERROR_ENCODING, "InvalidUtf8",
+                "The input is not valid UTF-8"
+            );
+
+        // The Try... methods spare invalid input (the common failure) the
+        // cost of an exception.
+        blahtex::Interface& interface = context->mInterface;
+        blahtex::Status status;
+        wstring output;
+        if (interface.TryProcessInput(tex, context->mDisplayStyle, status))
+            switch (context->mOutput)
+            {
+                case blahtex_context::cOutputMathml:
+                    interface.TryGetMathml(output, status);
+                    break;
+                case blahtex_context::cOutputPurifiedTex:
+                    interface.TryGetPurifiedTex(output, status);
+                    break;
+                case blahtex_context::cOutputPurifiedTexOnly:
+                    interface.TryGetPurifiedTexOnly(output, status);
+                    break;
+                case blahtex_context::cOutputCanonicalKey:
+                    interface.TryGetCanonicalKey(output, status);
+                    break;
+            }
+
+        if (!status.IsOk())
+        {
+            const blahtex::Exception& e = status.GetError();
+            context->mErrorId = ToUtf8(e.GetCode());
+            context->mErrorMessage = ToUtf8(GetErrorMessage(e));
+            for (size_t i = 0; i < e.GetArgs().size(); i++)
+                context->mErrorArgs.push_back(ToUtf8(e.GetArgs()[i]));
+            if (status.HasSpan())
+            {
+                size_t start = status.GetStartPos();
+                context->mErrorStart = Utf8Length(tex, start);
+                context->mErrorLength = Utf8Length(
+                    tex, start + status.GetLength()
+                ) - context->mErrorStart;
+                context->mHasErrorSpan = true;
+            }
+            return BLAHTEX_ERROR_INPUT;
+        }
+
+        if (!sink.Write(output))
+            return Fail(
+                context, BLAHTEX_ERROR_OUTPUT, "OutputFailed",
+                "The output could not be written"
+            );
+        return BLAHTEX_OK;
+    }
+    catch (bad_alloc&)
+    {
+        ClearError(context);
+        return Fail(context, BLAHTEX_ERROR_MEMORY, "OutOfMemory", "Out of memory");
+    }
+    catch (exception& e)
+    {
+        return Fail(context, BLAHTEX_ERROR_INTERNAL, "InternalError", e.what());
+    }
+    catch (...)
+    {
+        return Fail(
+            context, BLAHTEX_ERROR_INTERNAL, "InternalError", "Unknown error"
+        );
+    }
+}
+
+// Parses the value of a switch: NULL or "1" turns it on, "0" off.
+bool ParseSwitch(const char* value, bool& on)
+{
+    if (value == NULL || strcmp(value, "1") == 0)
+        on = true;
+    else if (strcmp(value, "0") == 0)
+        on = false;
+    else
+        return false;
+    return true;
+}
+
+blahtex_status SetOption(
+    blahtex_context* context,
+    const string& name,
+    const char* value
+)
+{
+    blahtex::Interface& interface = context->mInterface;
+    blahtex::MathmlOptions& mathml = interface.mMathmlOptions;
+    blahtex::EncodingOptions& encoding = interface.mEncodingOptions;
+    blahtex::PurifiedTexOptions& purified = interface.mPurifiedTexOptions;
+
+    bool* switchOption = NULL;
+    if (name == "displaymath")
+        switchOption = &context->mDisplayStyle;
+    else if (name == "texvc-compatible-commands")
+        switchOption = &interface.mTexvcCompatibility;
+    else if (name == "indented")
+        switchOption = &interface.mIndented;
+    else if (name == "mathml-version-1-fonts")
+        switchOption = &mathml.mUseVersion1FontAttributes;
+    else if (name == "use-ucs-package")
+        switchOption = &purified.mAllowUcs;
+    else if (name == "use-cjk-package")
+        switchOption = &purified.mAllowCJK;
+    else if (name == "use-preview-package")
+        switchOption = &purified.mAllowPreview;
+
+    bool on;
+    if (switchOption || name == "disallow-plane-1")
+    {
+        if (!ParseSwitch(value, on))
+            return Fail(
+                context, BLAHTEX_ERROR_OPTION, "IllegalOptionValue",
+                "Illegal value for \"" + name + "\""
+            );
+        if (switchOption)
+            *switchOption = on;
+        else
+            mathml.mAllowPlane1 = encoding.mAllowPlane1 = !on;
+        if (name == "displaymath")
+            purified.mDisplayMath = on;
+        return BLAHTEX_OK;
+    }
+
+    // The other options all need a value.
+    bool known = name == "spacing" || name == "mathml-encoding"
+        || name == "other-encoding" || name == "japanese-font"
+        || name == "png-latex-preamble" || name == "png-latex-before-math"
+        || name == "output";
+    if (!known)
+        return Fail(
+            context, BLAHTEX_ERROR_OPTION, "UnknownOption",
+            "Unknown option \"" + name + "\""
+        );
+
+    wstring text;
+    if (value == NULL || !DecodeUtf8(value, strlen(value), text))
+        return Fail(
+            context, BLAHTEX_ERROR_OPTION, "IllegalOptionValue",
+            "Illegal value for \"" + name + "\""
+        );
+    string word(value);
+
+    if (name == "japanese-font")
+        purified.mJapaneseFont = text;
+    else if (name == "png-latex-preamble")
+        purified.mLaTeXPreamble = text;
+    else if (name == "png-latex-before-math")
+        purified.mLaTeXBeforeMath = text;
+
+    else if (name == "spacing" && word == "strict")
+        mathml.mSpacingControl = blahtex::MathmlOptions::cSpacingControlStrict;
+    else if (name == "spacing" && word == "moderate")
+        mathml.mSpacingControl = blahtex::MathmlOptions::cSpacingControlModerate;
+    else if (name == "spacing" && word == "relaxed")
+        mathml.mSpacingControl = blahtex::MathmlOptions::cSpacingControlRelaxed;
+
+    else if (name == "mathml-encoding" && word == "raw")
+        encoding.mMathmlEncoding = blahtex::EncodingOptions::cMathmlEncodingRaw;
+    else if (name == "mathml-encoding" && word == "numeric")
+        encoding.mMathmlEncoding = blahtex::EncodingOptions::cMathmlEncodingNumeric;
+    else if (name == "mathml-encoding" && word == "short")
+        encoding.mMathmlEncoding = blahtex::EncodingOptions::cMathmlEncodingShort;
+    else if (name == "mathml-encoding" && word == "long")
+        encoding.mMathmlEncoding = blahtex::EncodingOptions::cMathmlEncodingLong;
+
+    else if (name == "other-encoding" && word == "raw")
+        encoding.mOtherEncodingRaw = true;
+    else if (name == "other-encoding" && word == "numeric")
+        encoding.mOtherEncodingRaw = false;
+
+    else if (name == "output" && word == "mathml")
+        context->mOutput = blahtex_context::cOutputMathml;
+    else if (name == "output" && word == "purified-tex")
+        context->mOutput = blahtex_context::cOutputPurifiedTex;
+    else if (name == "output" && word == "purified-tex-only")
+        context->mOutput = blahtex_context::cOutputPurifiedTexOnly;
+    else if (name == "output" && word == "canonical-key")
+        context->mOutput = blahtex_context::cOutputCanonicalKey;
+
+    else
+        return Fail(
+            context, BLAHTEX_ERROR_OPTION, "IllegalOptionValue",
+            "Illegal value for \"" + name + "\""
+        );
+    return BLAHTEX_OK;
+}
+
+}
+
+extern "C"
+{
+
+int blahtex_abi_version(void)
+{
+    return BLAHTEX_ABI_VERSION;
+}
+
+blahtex_context* blahtex_create(void)
+{
+    try
+    {
+        return new blahtex_context;
+    }
+    catch (...)
+    {
+        return NULL;
+    }
+}
+
+void blahtex_destroy(blahtex_context* context)
+{
+    delete context;
+}
+
+blahtex_status blahtex_set_option(
+    blahtex_context* context,
+    const char* name,
+    const char* value
+)
+{
+    if (context == NULL || name == NULL)
+        return BLAHTEX_ERROR_ARGUMENT;
+
+    ClearError(context);
+    try
+    {
+        return SetOption(context, name, value);
+    }
+    catch (...)
+    {
+        return Fail(context, BLAHTEX_ERROR_MEMORY, "OutOfMemory", "Out of memory");
+    }
+}
+
+blahtex_status blahtex_convert(
+    blahtex_context* context,
+    const char* input,
+    size_t length,
+    blahtex_buffer* output
+)
+{
+    if (context == NULL || output == NULL || (input == NULL && length > 0))
+        return BLAHTEX_ERROR_ARGUMENT;
+
+    BufferSink sink(output);
+    return Convert(context, input, length, sink);
+}
+
+blahtex_status blahtex_convert_to(
+    blahtex_context* context,
+    const char* input,
+    size_t length,
+    blahtex_write_function write,
+    void* user
+)
+{
+    if (context == NULL || write == NULL || (input == NULL && length > 0))
+        return BLAHTEX_ERROR_ARGUMENT;
+
+    FunctionSink sink(write, user);
+    return Convert(context, input, length, sink);
+}
+
+const char* blahtex_error_id(const blahtex_context* context)
+{
+    return context ? context->mErrorId.c_str() : "";
+}
+
+const char* blahtex_error_message(const blahtex_context* context)
+{
+    return context ? context->mErrorMessage.c_str() : "";
+}
+
+size_t blahtex_error_arg_count(const blahtex_context* context)
+{
+    return context ? context->mErrorArgs.size() : 0;
+}
+
+const char* blahtex_error_arg(const blahtex_context* context, size_t index)
+{
+    if (context == NULL || index >= context->mErrorArgs.size())
+        return "";
+    return context->mErrorArgs[index].c_str();
+}
+
+int blahtex_error_span(
+    const blahtex_context* context,
+    size_t* start,
+    size_t* length
+)
+{
+    if (context == NULL || !context->mHasErrorSpan)
+        return 0;
+    if (start)
+        *start = context->mErrorStart;
+    if (length)
+        *length = context->mErrorLength;
+    return 1;
+}
+
+void blahtex_buffer_free(blahtex_buffer* buffer)
+{
+    if (buffer == NULL)
+        return;
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->size = buffer->capacity = 0;
+}
+
+}
+
+// end of file @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
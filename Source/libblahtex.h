@@ -0,0 +1,171 @@
+/*
+blahtex: a TeX to MathML converter designed with MediaWiki in mind
+blahtexml: an extension of blahtex with XML processing in mind
+http://gva.noekeon.org/blahtexml
+
+Copyright (c) 2006, David Harvey
+Copyright (c) 2010, Gilles Van Assche
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the names of the authors nor the names of their affiliation may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef BLAHTEX_LIBBLAHTEX_H
+#define BLAHTEX_LIBBLAHTEX_H
+
+#include <stddef.h>
+
+// The C interface of libblahtex ("make libblahtex.so"), for programs that
+// want to convert formulas in-process, without C++ or wstring: everything
+// going in or out is UTF-8. No function throws; each returns a status, and
+// the details of an error stay available from the context until the next
+// call on it.
+//
+// A context holds the conversion options and the details of the last
+// error. Several contexts may be used at once, in different threads, but a
+// context must not be used by two threads at once.
+//
+// Within one major ABI version (BLAHTEX_ABI_VERSION), functions and status
+// codes are only ever added, never changed.
+
+#if defined(BLAHTEX_BUILDING_LIBRARY) && defined(_WIN32)
+#define BLAHTEX_API __declspec(dllexport)
+#elif defined(BLAHTEX_BUILDING_LIBRARY)
+#define BLAHTEX_API __attribute__((visibility("default")))
+#else
+#define BLAHTEX_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BLAHTEX_ABI_VERSION 1
+
+typedef enum
+{
+    BLAHTEX_OK = 0,
+    // The TeX is invalid, or can't be converted; see blahtex_error_id().
+    BLAHTEX_ERROR_INPUT = 1,
+    // The input is not valid UTF-8.
+    BLAHTEX_ERROR_ENCODING = 2,
+    // Unknown option, or illegal value for it.
+    BLAHTEX_ERROR_OPTION = 3,
+    // The write function returned non-zero.
+    BLAHTEX_ERROR_OUTPUT = 4,
+    BLAHTEX_ERROR_MEMORY = 5,
+    // A bug in blahtex (a failed debug assertion).
+    BLAHTEX_ERROR_INTERNAL = 6,
+    // A NULL context or buffer.
+    BLAHTEX_ERROR_ARGUMENT = 7
+}
+blahtex_status;
+
+typedef struct blahtex_context blahtex_context;
+
+// A growable buffer. The caller may start with all members zero, or hand
+// over memory of its own, which must come from malloc(); the library grows
+// it with realloc(). Output is appended at data + size and followed by a
+// NUL, which size doesn't count. Free data with free() or
+// blahtex_buffer_free().
+typedef struct
+{
+    char* data;
+    size_t size;
+    size_t capacity;
+}
+blahtex_buffer;
+
+// Receives output in pieces; returns 0 to go on, anything else to stop the
+// conversion with BLAHTEX_ERROR_OUTPUT.
+typedef int (*blahtex_write_function)(void* user, const char* data, size_t size);
+
+// Returns BLAHTEX_ABI_VERSION as the library was built, to check against
+// the header a program was built with.
+BLAHTEX_API int blahtex_abi_version(void);
+
+// Returns a new context with the default options, or NULL if out of
+// memory.
+BLAHTEX_API blahtex_context* blahtex_create(void);
+
+BLAHTEX_API void blahtex_destroy(blahtex_context* context);
+
+// Sets an option, named as the command-line option without "--". Options
+// that are switches on the command line take NULL, "1" or "0"; the
+// others take the same values as on the command line:
+//
+//     displaymath, texvc-compatible-commands, indented,
+//     mathml-version-1-fonts, disallow-plane-1, use-ucs-package,
+//     use-cjk-package, use-preview-package (switches);
+//     spacing, mathml-encoding, other-encoding, japanese-font,
+//     png-latex-preamble, png-latex-before-math.
+//
+// One more option, "output", chooses what a conversion produces: "mathml"
+// (the default: the MathML markup, as inside <markup> on the command
+// line), "purified-tex" (a complete LaTeX file), "purified-tex-only" (just
+// the formula) or "canonical-key" (see "--canonical-key").
+BLAHTEX_API blahtex_status blahtex_set_option(
+    blahtex_context* context,
+    const char* name,
+    const char* value
+);
+
+// Converts length bytes of UTF-8 TeX at input, appending the output to
+// output (see blahtex_buffer).
+BLAHTEX_API blahtex_status blahtex_convert(
+    blahtex_context* context,
+    const char* input,
+    size_t length,
+    blahtex_buffer* output
+);
+
+// Same, but passes the output to write instead.
+BLAHTEX_API blahtex_status blahtex_convert_to(
+    blahtex_context* context,
+    const char* input,
+    size_t length,
+    blahtex_write_function write,
+    void* user
+);
+
+// Details of the error reported by the last call on context, or "" (and
+// 0 arguments) if it succeeded. The id is the error code that the
+// command line shows in <id>, e.g. "UnrecognisedCommand", or for errors
+// outside the TeX one of "InvalidUtf8", "UnknownOption",
+// "IllegalOptionValue", "OutputFailed", "OutOfMemory" and
+// "InternalError". The message is in English. The strings stay valid
+// until the next call on context.
+BLAHTEX_API const char* blahtex_error_id(const blahtex_context* context);
+BLAHTEX_API const char* blahtex_error_message(const blahtex_context* context);
+BLAHTEX_API size_t blahtex_error_arg_count(const blahtex_context* context);
+BLAHTEX_API const char* blahtex_error_arg(
+    const blahtex_context* context,
+    size_t index
+);
+
+// For errors in the TeX that point at a token, e.g. "UnrecognisedCommand"
+// and "UnmatchedOpenBrace", stores where that token is in the input (in
+// bytes) and returns 1; otherwise returns 0 and leaves start and length
+// alone. The length is 0 for tokens that came out of macro expansion.
+BLAHTEX_API int blahtex_error_span(
+    const blahtex_context* context,
+    size_t* start,
+    size_t* length
+);
+
+// Frees buffer->data, and sets all the members to zero.
+BLAHTEX_API void blahtex_buffer_free(blahtex_buffer* buffer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+// end of file @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
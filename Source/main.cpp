@@ -19,11 +19,22 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 #include "BlahtexCore/Interface.h"
 #include "UnicodeConverter.h"
 #include "mainPng.h"
+#include "PngRenderPool.h"
+#include "PngStore.h"
+#include "Json.h"
+#include "WorkScheduler.h"
+#include "ResultCache.h"
+#include "ResultStore.h"
+#include "Server.h"
+#include "HttpServer.h"
+#include "md5Wrapper.h"
 #include <iostream>
 #include <stdio.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <sstream>
 #include <stdexcept>
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 
@@ -51,8 +62,10 @@ using namespace blahtex;
 
 string gBlahtexVersion = "1.0";
 
-// A single global instance of UnicodeConverter.
-UnicodeConverter gUnicodeConverter;
+// The version of the results kept in a "--cache-file". Bump it with every
+// change that makes the output of some conversion differ, so that the
+// cache files written before are started afresh.
+const unsigned cResultVersion = 1;
 
 // Imported from Messages.cpp:
 extern wstring GetErrorMessage(const blahtex::Exception& e);
@@ -143,6 +156,19 @@ void ShowUsage()
 "SUMMARY OF OPTIONS (see manual for details)\n"
 "\n"
 " --texvc-compatible-commands\n"
+" --canonical-key\n"
+" --batch\n"
+" --threads N\n"
+" --server socket-path\n"
+" --http port\n"
+" --max-queue N\n"
+" --max-connections N\n"
+" --fork-server\n"
+" --fork-requests N\n"
+" --cache-size size\n"
+" --cache-file path\n"
+" --cache-file-size size\n"
+" --cache-compact\n"
 "\n"
 " --mathml\n"
 " --displaymath\n"
@@ -163,6 +189,21 @@ void ShowUsage()
 " --shell-dvipng  command\n"
 " --temp-directory  directory\n"
 " --png-directory  directory\n"
+" --png-format-directory  directory\n"
+" --png-no-cache\n"
+" --png-workers  number\n"
+" --png-workspace  directory\n"
+" --png-shard-levels  number\n"
+" --png-dpi  number\n"
+" --png-resolutions  scale,scale,...\n"
+" --png-shard-existing\n"
+" --png-store-budget  size\n"
+" --png-evict\n"
+" --png-timeout  seconds\n"
+" --png-cpu-limit  seconds\n"
+" --png-memory-limit  size\n"
+" --png-persistent-latex\n"
+" --png-batch-size  number\n"
 " --png-latex-preamble content\n"
 " --png-latex-before-math content\n"
 "\n"
@@ -186,8 +227,6 @@ void ShowUsage()
 "More information available at http://gva.noekeon.org/blahtexml/\n"
 "\n";
 
-    // FIX: need command line option to select output DPI
-
     exit(0);
 }
 
@@ -211,7 +250,39 @@ void AddTrailingSlash(string& s)
         s += '/';
 }
 
+// Reads a size in bytes, possibly with a suffix K, M or G, from the
+// argument following option; throws CommandLineException if it's missing
+// or not a positive size.
+long long ReadSizeArgument(int& i, int argc, char* const argv[], const string& option)
+{
+    if (++i == argc)
+        throw CommandLineException(
+            "Missing size after \"" + option + "\""
+        );
+    istringstream sizeStream(argv[i]);
+    long long size;
+    string suffix;
+    if (!(sizeStream >> size) || size <= 0)
+        throw CommandLineException(
+            "Illegal size after \"" + option + "\""
+        );
+    sizeStream >> suffix;
+    if (suffix == "K" || suffix == "k")
+        size <<= 10;
+    else if (suffix == "M" || suffix == "m")
+        size <<= 20;
+    else if (suffix == "G" || suffix == "g")
+        size <<= 30;
+    else if (!suffix.empty())
+        throw CommandLineException(
+            "Illegal size after \"" + option + "\""
+        );
+    return size;
+}
+
 PngParams pngParams;
+unsigned pngWorkers = 0;
+bool useCanonicalKey = false;
 #ifdef BLAHTEXML_USING_XERCES
 SAX2Output::Doctype outputDoctype = SAX2Output::DoctypeNone;
 string outputPublicID;
@@ -241,65 +312,1478 @@ int batchXMLConversion(blahtex::Interface& interface)
     SAX2XMLReader* reader = XMLReaderFactory::createXMLReader();
     BlahtexFilter* parser = new BlahtexFilter(reader, interface);
 
-    parser->setFeature(XMLUni::fgSAX2CoreValidation, false);
-    parser->setFeature(XMLUni::fgSAX2CoreNameSpaces, true);
-    parser->setFeature(XMLUni::fgXercesSchema, false);
-    parser->setFeature(XMLUni::fgXercesSchemaFullChecking, false);
-    parser->setFeature(XMLUni::fgSAX2CoreNameSpacePrefixes, false);
+    parser->setFeature(XMLUni::fgSAX2CoreValidation, false);
+    parser->setFeature(XMLUni::fgSAX2CoreNameSpaces, true);
+    parser->setFeature(XMLUni::fgXercesSchema, false);
+    parser->setFeature(XMLUni::fgXercesSchemaFullChecking, false);
+    parser->setFeature(XMLUni::fgSAX2CoreNameSpacePrefixes, false);
+
+    XercesString _MathMLPrefix(MathMLPrefix.c_str());
+    wstring __MathMLPrefix = _MathMLPrefix.convertTowstring();
+    parser->setDesiredMathMLPrefixType(MathMLPrefixType, __MathMLPrefix);
+    parser->setAnnotatePNG(annotatePNG);
+    parser->setAnnotateTeX(annotateTeX);
+    parser->setUseCanonicalKey(useCanonicalKey);
+    parser->setPngParams(pngParams);
+
+    auto_ptr<PngRenderPool> pngRenderPool;
+    if (annotatePNG) {
+        pngRenderPool.reset(new PngRenderPool(pngParams, pngWorkers));
+        parser->setPngRenderPool(pngRenderPool.get());
+    }
+
+    int parserErrors = 0;
+    int result = 0;
+    {
+        StdInInputSource stdIn;
+        try {
+            XercesString publicID(outputPublicID.c_str());
+            XercesString DTD(outputDTD.c_str());
+            SAX2Output output(cout, "UTF-8", XMLFormatter::UnRep_CharRef, outputDoctype, publicID, DTD);
+            parser->setContentHandler(&output);
+            parser->setErrorHandler(&output);
+            parser->parse(stdIn);
+            parserErrors = parser->getErrorCount();
+        }
+        catch (const OutOfMemoryException&) {
+            cerr << endl;
+            cerr << "Out of memory exception" << endl;
+            result = 1;
+        }
+        catch (const XMLException& e) {
+            char *errorString = XMLString::transcode(e.getMessage());
+            cerr << endl;
+            cerr << "Error: " << errorString << endl;
+            XMLString::release(&errorString);
+            result = 1;
+        }
+    }
+    if (parserErrors > 0) {
+        cerr << "During the XML input parsing, ";
+        if (parserErrors == 1) cerr << "an error";
+        else cerr << parserErrors << " errors";
+        cerr << " occurred." << endl;
+    }
+    int pngErrors = parser->waitForPngs();
+    if (pngErrors > 0) {
+        cerr << "During the PNG generation, ";
+        if (pngErrors == 1) cerr << "an error";
+        else cerr << pngErrors << " errors";
+        cerr << " occurred." << endl;
+        result = 1;
+    }
+    int blahtexErrors = parser->getNumberOfErrors();
+    if (blahtexErrors > 0) {
+        cerr << "During the blahtex conversion, ";
+        if (blahtexErrors == 1) cerr << "an error";
+        else cerr << blahtexErrors << " errors";
+        cerr << " occurred.\nSee the output file for more information." << endl;
+        result = 1;
+    }
+    delete parser;
+    delete reader;
+    XMLPlatformUtils::Terminate();
+    return result;
+}
+#endif
+
+// The options of a single conversion that are not kept in the Interface,
+// as set on the command line, or for each request in batch mode.
+struct RequestOptions
+{
+    bool mDoPng;
+    bool mDoMathml;
+    bool mDisplayStyle;
+    bool mDebugLayoutTree;
+    bool mDebugParseTree;
+    bool mDebugPurifiedTex;
+
+    RequestOptions() :
+        mDoPng(false),
+        mDoMathml(false),
+        mDisplayStyle(false),
+        mDebugLayoutTree(false),
+        mDebugParseTree(false),
+        mDebugPurifiedTex(false)
+    { }
+};
+
+// Handles the command line option argv[i] if it only affects how each
+// input is converted (e.g. "--mathml" or "--spacing"), by setting it in
+// interface or request; an option followed by a value advances i. Returns
+// false if argv[i] is not such an option. Option values are converted from
+// UTF-8 with converter.
+bool ApplyConversionOption(
+    int& i,
+    int argc,
+    char* const argv[],
+    blahtex::Interface& interface,
+    RequestOptions& request,
+    UnicodeConverter& converter
+)
+{
+    string arg(argv[i]);
+
+    if (arg == "--displaymath") {
+        interface.mPurifiedTexOptions.mDisplayMath = true;
+        request.mDisplayStyle = true;
+    }
+
+    else if (arg == "--use-ucs-package")
+        interface.mPurifiedTexOptions.mAllowUcs = true;
+
+    else if (arg == "--use-cjk-package")
+        interface.mPurifiedTexOptions.mAllowCJK = true;
+
+    else if (arg == "--use-preview-package")
+        interface.mPurifiedTexOptions.mAllowPreview = true;
+
+    else if (arg == "--japanese-font")
+    {
+        if (++i == argc)
+            throw CommandLineException(
+                "Missing string after \"--japanese-font\""
+            );
+        interface.mPurifiedTexOptions.mJapaneseFont =
+            converter.ConvertIn(string(argv[i]));
+    }
+
+    else if (arg == "--indented")
+        interface.mIndented = true;
+
+    else if (arg == "--spacing")
+    {
+        if (++i == argc)
+            throw CommandLineException(
+                "Missing string after \"--spacing\""
+            );
+        arg = string(argv[i]);
+
+        if (arg == "strict")
+            interface.mMathmlOptions.mSpacingControl
+                = MathmlOptions::cSpacingControlStrict;
+
+        else if (arg == "moderate")
+            interface.mMathmlOptions.mSpacingControl
+                = MathmlOptions::cSpacingControlModerate;
+
+        else if (arg == "relaxed")
+            interface.mMathmlOptions.mSpacingControl
+                = MathmlOptions::cSpacingControlRelaxed;
+
+        else
+            throw CommandLineException(
+                "Illegal string after \"--spacing\""
+            );
+    }
+
+    else if (arg == "--mathml-version-1-fonts")
+        interface.mMathmlOptions.mUseVersion1FontAttributes = true;
+
+    else if (arg == "--texvc-compatible-commands")
+        interface.mTexvcCompatibility = true;
+
+    else if (arg == "--png")
+        request.mDoPng = true;
+
+    else if (arg == "--mathml")
+        request.mDoMathml = true;
+
+    else if (arg == "--mathml-encoding")
+    {
+        if (++i == argc)
+            throw CommandLineException(
+                "Missing string after \"--mathml-encoding\""
+            );
+        arg = string(argv[i]);
+
+        if (arg == "raw")
+            interface.mEncodingOptions.mMathmlEncoding
+                = EncodingOptions::cMathmlEncodingRaw;
+
+        else if (arg == "numeric")
+            interface.mEncodingOptions.mMathmlEncoding
+                = EncodingOptions::cMathmlEncodingNumeric;
+
+        else if (arg == "short")
+            interface.mEncodingOptions.mMathmlEncoding
+                = EncodingOptions::cMathmlEncodingShort;
+
+        else if (arg == "long")
+            interface.mEncodingOptions.mMathmlEncoding
+                = EncodingOptions::cMathmlEncodingLong;
+
+        else
+            throw CommandLineException(
+                "Illegal string after \"--mathml-encoding\""
+            );
+    }
+
+    else if (arg == "--disallow-plane-1")
+    {
+        interface.mMathmlOptions  .mAllowPlane1 = false;
+        interface.mEncodingOptions.mAllowPlane1 = false;
+    }
+
+    else if (arg == "--other-encoding")
+    {
+        if (++i == argc)
+            throw CommandLineException(
+                "Missing string after \"--other-encoding\""
+            );
+        arg = string(argv[i]);
+        if (arg == "raw")
+            interface.mEncodingOptions.mOtherEncodingRaw = true;
+        else if (arg == "numeric")
+            interface.mEncodingOptions.mOtherEncodingRaw = false;
+        else
+            throw CommandLineException(
+                "Illegal string after \"--other-encoding\""
+            );
+    }
+
+    else if (arg == "--debug")
+    {
+        if (++i == argc)
+            throw CommandLineException(
+                "Missing string after \"--debug\""
+            );
+        arg = string(argv[i]);
+        if (arg == "layout")
+            request.mDebugLayoutTree = true;
+        else if (arg == "parse")
+            request.mDebugParseTree = true;
+        else if (arg == "purified")
+            request.mDebugPurifiedTex = true;
+        else
+            throw CommandLineException(
+                "Illegal string after \"--debug\""
+            );
+    }
+
+    else if (arg == "--png-latex-preamble") {
+        if (++i == argc) {
+            throw CommandLineException(
+                "Missing string after \"--png-latex-preamble\""
+            );
+        }
+        interface.mPurifiedTexOptions.mLaTeXPreamble = converter.ConvertIn(string(argv[i]));
+    }
+    else if (arg == "--png-latex-before-math") {
+        if (++i == argc) {
+            throw CommandLineException(
+                "Missing string after \"--png-latex-before-math\""
+            );
+        }
+        interface.mPurifiedTexOptions.mLaTeXBeforeMath = converter.ConvertIn(string(argv[i]));
+    }
+    else
+        return false;
+
+    return true;
+}
+
+// Converts one input (in UTF-8), as set up by interface and request, and
+// returns the output: a <blahtex> block, in UTF-8. Errors in the input are
+// reported in the output, and so are the bugs that some assertion picked
+// up (std::logic_error). If the PNG is requested, it is rendered by
+// pngRenderPool. All the conversions between UTF-8 and wstring go through
+// converter, so that threads with a converter (and an interface) of their
+// own may call this at the same time.
+string ProcessRequest(
+    blahtex::Interface& interface,
+    const RequestOptions& request,
+    const string& inputUtf8,
+    PngRenderPool* pngRenderPool,
+    UnicodeConverter& converter
+)
+{
+    wostringstream mainOutput;
+
+    try
+    {
+        wstring input;
+
+        // This try block converts UnicodeConverter::Exception into an
+        // input syntax error, i.e. if the user supplies invalid UTF-8.
+        // (Later we treat such exceptions as debug assertions.)
+        try
+        {
+            input = converter.ConvertIn(inputUtf8);
+        }
+        catch (UnicodeConverter::Exception& e)
+        {
+            throw blahtex::Exception(L"InvalidUtf8Input");
+        }
+
+        // Build the parse and layout trees.
+        interface.ProcessInput(input, request.mDisplayStyle);
+
+        if (request.mDebugParseTree)
+        {
+            mainOutput << L"\n=== BEGIN PARSE TREE ===\n\n";
+            interface.GetManager()->GetParseTree()->Print(mainOutput);
+            mainOutput << L"\n=== END PARSE TREE ===\n\n";
+        }
+
+        if (request.mDebugLayoutTree)
+        {
+            mainOutput << L"\n=== BEGIN LAYOUT TREE ===\n\n";
+            wostringstream temp;
+            interface.GetManager()->GetLayoutTree()->Print(temp);
+            mainOutput << XmlEncode(temp.str(), EncodingOptions());
+            mainOutput << L"\n=== END LAYOUT TREE ===\n\n";
+        }
+
+        // The canonical key identifies the output (see
+        // Manager::GenerateCanonicalKey); the image key, which leaves out
+        // the MathML options, names the PNG.
+        string imageKey;
+        if (useCanonicalKey)
+        {
+            string canonicalKey = ComputeMd5(
+                converter.ConvertOut(interface.GetCanonicalKey())
+            );
+            mainOutput << L"<canonicalKey>"
+                << converter.ConvertIn(canonicalKey)
+                << L"</canonicalKey>\n";
+            imageKey = ComputeMd5(
+                converter.ConvertOut(interface.GetImageKey())
+            );
+        }
+
+        // Generate purified TeX if required. The PNG is rendered by
+        // a worker thread, while we go on with the MathML below.
+        wostringstream pngOutput;
+        shared_future<PngInfo> png;
+        if (request.mDoPng || request.mDebugPurifiedTex)
+        {
+            try
+            {
+                wstring purifiedTex = interface.GetPurifiedTex();
+
+                if (request.mDebugPurifiedTex)
+                {
+                    pngOutput << L"\n=== BEGIN PURIFIED TEX ===\n\n";
+                    pngOutput << purifiedTex;
+                    pngOutput << L"\n=== END PURIFIED TEX ===\n\n";
+                }
+
+                if (request.mDoPng)
+                {
+                    png = pngRenderPool->SubmitUtf8(
+                        converter.ConvertOut(purifiedTex),
+                        "", NULL, imageKey
+                    );
+                }
+            }
+
+            // Catching errors that occurred generating purified TeX:
+            catch (blahtex::Exception& e)
+            {
+                pngOutput.str(L"");
+                pngOutput << FormatError(e, interface.mEncodingOptions)
+                    << endl;
+            }
+        }
+
+        // This block generates MathML output if requested.
+        wostringstream mathmlOutput;
+        if (request.mDoMathml)
+        {
+            try
+            {
+                mathmlOutput << L"<markup>\n";
+                mathmlOutput << interface.GetMathml();
+                if (!interface.mIndented)
+                    mathmlOutput << L"\n";
+                mathmlOutput << L"</markup>\n";
+            }
+
+            // Catch errors in generating the MathML:
+            catch (blahtex::Exception& e)
+            {
+                mathmlOutput.str(L"");
+                mathmlOutput
+                    << FormatError(e, interface.mEncodingOptions)
+                    << endl;
+            }
+        }
+
+        // Wait for the PNG, if there is one.
+        if (png.valid())
+        {
+            try
+            {
+                PngInfo info = png.get();
+
+                // The height and depth measurements are only
+                // valid if the "preview" package is used:
+                if (interface.mPurifiedTexOptions.mAllowPreview
+                    && info.mDimensionsValid
+                )
+                {
+                    pngOutput << L"<height>"
+                        << info.mHeight << L"</height>\n";
+                    pngOutput << L"<depth>"
+                        << info.mDepth << L"</depth>\n";
+                }
+
+                pngOutput << L"<md5>"
+                    << converter.ConvertIn(info.mMd5)
+                    << L"</md5>\n";
+
+                for (size_t k = 0; k < info.mScaledImages.size(); k++)
+                {
+                    const PngScaledImage& image = info.mScaledImages[k];
+                    pngOutput << L"<resolution scale=\""
+                        << image.mScale << L"\">\n";
+                    if (interface.mPurifiedTexOptions.mAllowPreview
+                        && image.mDimensionsValid
+                    )
+                    {
+                        pngOutput << L"<height>"
+                            << image.mHeight << L"</height>\n";
+                        pngOutput << L"<depth>"
+                            << image.mDepth << L"</depth>\n";
+                    }
+                    pngOutput << L"</resolution>\n";
+                }
+            }
+
+            // Catching errors that occurred during PNG generation:
+            catch (blahtex::Exception& e)
+            {
+                pngOutput.str(L"");
+                pngOutput << FormatError(e, interface.mEncodingOptions)
+                    << endl;
+            }
+        }
+
+        if (request.mDoPng || request.mDebugPurifiedTex)
+            mainOutput << L"<png>\n" << pngOutput.str() << L"</png>\n";
+
+        if (request.mDoMathml)
+            mainOutput << L"<mathml>\n" << mathmlOutput.str()
+                << L"</mathml>\n";
+    }
+
+    catch (blahtex::TokenException& e)
+    {
+        mainOutput.str(L"");
+        mainOutput << FormatTokenError(e, interface.mEncodingOptions) << endl;
+    }
+
+    // This catches input syntax errors.
+    catch (blahtex::Exception& e)
+    {
+        mainOutput.str(L"");
+        mainOutput << FormatError(e, interface.mEncodingOptions) << endl;
+    }
+
+    // We still want to report these nicely to the user so that they can
+    // notify the developers.
+    catch (std::logic_error& e)
+    {
+        // WARNING: this doesn't XML-encode the message
+        // (We don't expect to the message to contain the characters &<>)
+        return string("<blahtex>\n<logicError>") + e.what()
+            + "</logicError>\n</blahtex>\n";
+    }
+
+    return "<blahtex>\n" + converter.ConvertOut(mainOutput.str())
+        + "</blahtex>\n";
+}
+
+// One request of batch mode (see batchJsonConversion).
+struct BatchRequest
+{
+    string mId;                 // the "id" member, as JSON text
+    string mInput;
+    vector<string> mOptions;
+    string mError;              // why the request can't be handled, if so
+};
+
+// Parses one line of batch mode input; a malformed request gets mError.
+BatchRequest ParseBatchRequest(const string& line)
+{
+    BatchRequest request;
+    request.mId = "null";
+    try
+    {
+        JsonValue value = ParseJson(line);
+        if (value.mType != JsonValue::cObject)
+            throw JsonException("the request is not an object");
+
+        if (const JsonValue* id = value.Find("id"))
+            request.mId = id->mText;
+
+        const JsonValue* input = value.Find("input");
+        if (!input || input->mType != JsonValue::cString)
+            throw JsonException("missing \"input\" string");
+        request.mInput = input->mString;
+
+        if (const JsonValue* options = value.Find("options"))
+        {
+            if (options->mType != JsonValue::cArray)
+                throw JsonException("\"options\" is not an array");
+
+            for (size_t k = 0; k < options->mArray.size(); k++)
+            {
+                if (options->mArray[k].mType != JsonValue::cString)
+                    throw JsonException("\"options\" must hold strings");
+                request.mOptions.push_back(options->mArray[k].mString);
+            }
+        }
+    }
+    catch (JsonException& e)
+    {
+        request.mError = "Malformed request: " + e.mMessage;
+    }
+    return request;
+}
+
+// A rough guess of how long a request takes to convert, so that the
+// expensive ones can be started first. It doesn't tokenise the input, but
+// counts commands and other characters; every cell of an array or matrix
+// counts extra, since the columns and rows are laid out together. Rendering
+// a PNG costs far more than any of that.
+unsigned long EstimateBatchCost(
+    const BatchRequest& batchRequest,
+    const RequestOptions& defaultRequest
+)
+{
+    unsigned long cost = 1;
+    unsigned long cells = 0;
+    const string& input = batchRequest.mInput;
+    for (size_t k = 0; k < input.size(); k++)
+    {
+        if (input[k] == '\\')
+        {
+            if (k + 1 < input.size() && input[k + 1] == '\\')
+            {
+                cells++;
+                k++;
+            }
+            cost += 4;
+        }
+        else if (input[k] == '&')
+            cells++;
+        else if (input[k] != ' ')
+            cost++;
+    }
+    cost += 16 * cells;
+
+    bool doPng = defaultRequest.mDoPng;
+    for (size_t k = 0; k < batchRequest.mOptions.size(); k++)
+        if (batchRequest.mOptions[k] == "--png")
+            doPng = true;
+    if (doPng)
+        cost += 1000000;
+
+    return cost;
+}
+
+// Copies the options that ApplyConversionOption sets.
+void CopyConversionOptions(
+    blahtex::Interface& interface,
+    const blahtex::Interface& source
+)
+{
+    interface.mMathmlOptions = source.mMathmlOptions;
+    interface.mEncodingOptions = source.mEncodingOptions;
+    interface.mPurifiedTexOptions = source.mPurifiedTexOptions;
+    interface.mTexvcCompatibility = source.mTexvcCompatibility;
+    interface.mIndented = source.mIndented;
+}
+
+// Returns the key under which the result caches keep the result of converting
+// input (in UTF-8) with the options of interface and displayStyle: the
+// input, and every option that affects the output. "kind" tells apart the
+// different results kept for the same input (a <blahtex> block, an HTTP
+// answer, ...). An option added to MathmlOptions, EncodingOptions or
+// PurifiedTexOptions has to be added here too.
+string ResultCacheKey(
+    const string& kind,
+    const blahtex::Interface& interface,
+    bool displayStyle,
+    const string& input,
+    UnicodeConverter& converter
+)
+{
+    const MathmlOptions& mathml = interface.mMathmlOptions;
+    const EncodingOptions& encoding = interface.mEncodingOptions;
+    const PurifiedTexOptions& purified = interface.mPurifiedTexOptions;
+
+    ostringstream key;
+    key << kind
+        << " display=" << displayStyle
+        << " texvc=" << interface.mTexvcCompatibility
+        << " indented=" << interface.mIndented
+        << " canonicalkey=" << useCanonicalKey
+        << " spacing=" << mathml.mSpacingControl
+        << " fonts1=" << mathml.mUseVersion1FontAttributes
+        << " plane1=" << mathml.mAllowPlane1
+        << " encoding=" << encoding.mMathmlEncoding
+        << " otherraw=" << encoding.mOtherEncodingRaw
+        << " plane1enc=" << encoding.mAllowPlane1
+        << " displaymath=" << purified.mDisplayMath
+        << " ucs=" << purified.mAllowUcs
+        << " cjk=" << purified.mAllowCJK
+        << " preview=" << purified.mAllowPreview << "\n";
+
+    // The strings go with their lengths, so that they can't run together.
+    const wstring* strings[] =
+    {
+        &purified.mJapaneseFont,
+        &purified.mLaTeXPreamble,
+        &purified.mLaTeXBeforeMath
+    };
+    for (size_t k = 0; k < sizeof(strings) / sizeof(strings[0]); k++)
+    {
+        string text = converter.ConvertOut(*strings[k]);
+        key << text.size() << ":" << text;
+    }
+    key << input.size() << ":" << input;
+    return key.str();
+}
+
+// The result caches of the command line, either of which may be missing:
+// one in memory ("--cache-size") and one on disk ("--cache-file"). A result
+// is looked up in memory first; one found on disk is copied into memory.
+struct ResultCaches
+{
+    ResultCache* mMemory;
+    ResultStore* mStore;
+
+    ResultCaches() : mMemory(NULL), mStore(NULL)
+    {
+    }
+
+    bool Find(const string& key, string& value)
+    {
+        if (mMemory && mMemory->Find(key, value))
+            return true;
+        if (!mStore || !mStore->Find(key, value))
+            return false;
+        if (mMemory)
+            mMemory->Insert(key, value);
+        return true;
+    }
+
+    void Insert(const string& key, const string& value)
+    {
+        if (mMemory)
+            mMemory->Insert(key, value);
+        if (mStore)
+            mStore->Insert(key, value);
+    }
+};
+
+// Writes the counters of the caches in resultCaches, if any, to standard
+// error.
+void ReportResultCache(const ResultCaches* resultCaches)
+{
+    if (!resultCaches)
+        return;
+    if (resultCaches->mMemory)
+    {
+        ResultCache::Statistics statistics
+            = resultCaches->mMemory->GetStatistics();
+        cerr << "blahtex: result cache: "
+            << statistics.mHits << " hits, "
+            << statistics.mMisses << " misses, "
+            << statistics.mInsertions << " insertions, "
+            << statistics.mEvictions << " evictions, "
+            << statistics.mRejections << " rejections, "
+            << statistics.mEntries << " entries, "
+            << statistics.mBytes << " bytes" << endl;
+    }
+    if (resultCaches->mStore)
+    {
+        ResultStore::Statistics statistics
+            = resultCaches->mStore->GetStatistics();
+        cerr << "blahtex: cache file: "
+            << statistics.mHits << " hits, "
+            << statistics.mMisses << " misses, "
+            << statistics.mInsertions << " insertions, "
+            << statistics.mCompactions << " compactions, "
+            << statistics.mEntries << " entries, "
+            << statistics.mFileSize << " bytes" << endl;
+    }
+}
+
+// The PNG render pool of batch mode, which is only started when a request
+// wants a PNG. Get() may be called from any thread.
+class BatchPngRenderPool
+{
+public:
+    PngRenderPool* Get()
+    {
+        call_once(mStarted, [this]() {
+            mPool.reset(new PngRenderPool(pngParams, pngWorkers));
+        });
+        return mPool.get();
+    }
+
+    // Stops the pool if it was started, e.g. before a child of the fork
+    // server exits. Nothing may use it any more.
+    void Stop()
+    {
+        mPool.reset();
+    }
+
+private:
+    once_flag mStarted;
+    unique_ptr<PngRenderPool> mPool;
+};
+
+// Sets up interface and request for a request of batch mode: resets them to
+// defaults and defaultRequest, and applies the request's own options. Throws
+// CommandLineException on a bad option.
+void ApplyBatchOptions(
+    const BatchRequest& batchRequest,
+    blahtex::Interface& interface,
+    const blahtex::Interface& defaults,
+    RequestOptions& request,
+    const RequestOptions& defaultRequest,
+    UnicodeConverter& converter
+)
+{
+    CopyConversionOptions(interface, defaults);
+    request = defaultRequest;
+
+    const vector<string>& arguments = batchRequest.mOptions;
+    vector<char*> argv;
+    for (size_t k = 0; k < arguments.size(); k++)
+        argv.push_back(const_cast<char*>(arguments[k].c_str()));
+    argv.push_back(NULL);
+
+    int argc = arguments.size();
+    for (int i = 0; i < argc; i++)
+        if (!ApplyConversionOption(
+            i, argc, &argv[0], interface, request, converter
+        ))
+            throw CommandLineException(
+                "Unrecognised option \"" + arguments[i] + "\""
+            );
+}
+
+// Returns the key of the output of ProcessRequest for input with interface
+// and request in the result caches; or "" if it isn't cached: the PNG might
+// have been removed from the PNG directory since, and the debugging output
+// is not worth keeping. A request of batch mode gets the same key as the
+// same request on the command line.
+string RequestResultCacheKey(
+    const string& input,
+    const blahtex::Interface& interface,
+    const RequestOptions& request,
+    UnicodeConverter& converter
+)
+{
+    if (request.mDoPng || request.mDebugLayoutTree
+        || request.mDebugParseTree || request.mDebugPurifiedTex
+    )
+        return "";
+    return ResultCacheKey(
+        request.mDoMathml ? "request-mathml" : "request", interface,
+        request.mDisplayStyle, input, converter
+    );
+}
+
+// Returns the line that batch mode writes for a request, with its output or
+// else its error.
+string BatchResponse(
+    const BatchRequest& batchRequest,
+    const string& output,
+    const string& error
+)
+{
+    string line = "{\"id\":" + batchRequest.mId;
+    if (error.empty())
+        line += ",\"output\":" + JsonQuote(output);
+    else
+        line += ",\"error\":" + JsonQuote(error);
+    return line + "}\n";
+}
+
+// Handles one request of batch mode with interface, whose options are first
+// reset to those of defaults, and returns the line to write. Sets failed if
+// the request couldn't be handled. The output is looked up in, and added to,
+// resultCaches if there are any.
+string ConvertBatchRequest(
+    const BatchRequest& batchRequest,
+    blahtex::Interface& interface,
+    const blahtex::Interface& defaults,
+    const RequestOptions& defaultRequest,
+    BatchPngRenderPool& pngRenderPool,
+    ResultCaches* resultCaches,
+    UnicodeConverter& converter,
+    bool& failed
+)
+{
+    string output, error = batchRequest.mError;
+    if (error.empty())
+    {
+        try
+        {
+            RequestOptions request;
+            ApplyBatchOptions(
+                batchRequest, interface, defaults, request, defaultRequest,
+                converter
+            );
+
+            string key;
+            if (resultCaches)
+                key = RequestResultCacheKey(
+                    batchRequest.mInput, interface, request, converter
+                );
+            if (key.empty() || !resultCaches->Find(key, output))
+            {
+                output = ProcessRequest(
+                    interface, request, batchRequest.mInput,
+                    request.mDoPng ? pngRenderPool.Get() : NULL, converter
+                );
+                if (!key.empty())
+                    resultCaches->Insert(key, output);
+            }
+        }
+        catch (CommandLineException& e)
+        {
+            error = e.mMessage;
+        }
+    }
+
+    if (!error.empty())
+        failed = true;
+    return BatchResponse(batchRequest, output, error);
+}
+
+// Batch mode ("--batch"): reads one JSON request per line from input, such
+// as
+//     {"id": 7, "input": "x^2", "options": ["--displaymath"]}
+// and writes one JSON result per line to standard output, in the same
+// order, as soon as it is ready:
+//     {"id":7,"output":"<blahtex>...</blahtex>\n"}
+// "options" holds conversion options (see ApplyConversionOption) that
+// apply to this request only, on top of those from the command line; "id"
+// is echoed back as it is. A request that can't be handled gets an "error"
+// member instead of "output". One PNG render pool serves all the requests.
+//
+// With several threads, the requests are converted by a WorkScheduler,
+// each worker with an Interface (and gUnicodeConverter) of its own; the
+// results still come out in input order. All of them share resultCaches, if
+// there are any (see "--cache-size" and "--cache-file"), whose counters are
+// reported at the end.
+int batchJsonConversion(
+    blahtex::Interface& interface,
+    const RequestOptions& defaultRequest,
+    istream& input,
+    unsigned numberOfThreads,
+    ResultCaches* resultCaches
+)
+{
+    blahtex::Interface defaults;
+    CopyConversionOptions(defaults, interface);
+
+    BatchPngRenderPool pngRenderPool;
+
+    if (numberOfThreads == 0)
+        numberOfThreads = thread::hardware_concurrency();
+
+    if (numberOfThreads <= 1)
+    {
+        bool failed = false;
+        string line;
+        while (getline(input, line))
+        {
+            if (!line.empty() && line[line.size() - 1] == '\r')
+                line.erase(line.size() - 1);
+            if (line.find_first_not_of(" \t") == string::npos)
+                continue;
+
+            cout << ConvertBatchRequest(
+                ParseBatchRequest(line), interface, defaults,
+                defaultRequest, pngRenderPool, resultCaches,
+                gUnicodeConverter, failed
+            ) << flush;
+        }
+        ReportResultCache(resultCaches);
+        return failed ? 1 : 0;
+    }
+
+    vector<unique_ptr<blahtex::Interface> > interfaces;
+    vector<char> failed(numberOfThreads, false);
+    for (unsigned worker = 0; worker < numberOfThreads; worker++)
+        interfaces.push_back(
+            unique_ptr<blahtex::Interface>(new blahtex::Interface)
+        );
+
+    WorkScheduler scheduler(
+        [](const string& result) {
+            cout << result << flush;
+        },
+        numberOfThreads
+    );
+
+    string line;
+    while (getline(input, line))
+    {
+        if (!line.empty() && line[line.size() - 1] == '\r')
+            line.erase(line.size() - 1);
+        if (line.find_first_not_of(" \t") == string::npos)
+            continue;
+
+        shared_ptr<BatchRequest> batchRequest(
+            new BatchRequest(ParseBatchRequest(line))
+        );
+        scheduler.Submit(
+            [&, batchRequest](unsigned worker) {
+                bool workerFailed = false;
+                string result = ConvertBatchRequest(
+                    *batchRequest, *interfaces[worker], defaults,
+                    defaultRequest, pngRenderPool, resultCaches,
+                    gUnicodeConverter, workerFailed
+                );
+                if (workerFailed)
+                    failed[worker] = true;
+                return result;
+            },
+            EstimateBatchCost(*batchRequest, defaultRequest)
+        );
+    }
+    scheduler.Finish();
+    ReportResultCache(resultCaches);
+
+    for (unsigned worker = 0; worker < numberOfThreads; worker++)
+        if (failed[worker])
+            return 1;
+    return 0;
+}
+
+// Converts a few formulas that between them use most of the core's tables
+// (which are built on first use) and gUnicodeConverter, so that the
+// children of the fork server inherit them ready-made.
+void WarmUpCore()
+{
+    static const wchar_t* formulas[] =
+    {
+        L"\\mathbin{+}\\mathrm{d}\\hat{x}\\Bigl("
+            L"\\begin{matrix}a&b\\end{matrix}\\Bigr)",
+        L"\\text{a \\textsf{b} \\bf \u00e9}\\mbox{\\it c}",
+        L"{\\displaystyle\\bf x}\\mathbb{R}\\leqslant\\sqrt[3]{x}"
+            L"\\color{red}{y}\\overbrace{ab}\\scriptstyle\\rm z"
+    };
+
+    blahtex::Interface interface;
+    for (size_t i = 0; i < sizeof(formulas) / sizeof(formulas[0]); i++)
+    {
+        try
+        {
+            interface.ProcessInput(formulas[i], true);
+            gUnicodeConverter.ConvertOut(interface.GetMathml());
+            gUnicodeConverter.ConvertOut(interface.GetPurifiedTex());
+        }
+        catch (blahtex::Exception&)
+        {
+        }
+    }
+}
+
+// Server mode ("--server"): answers the requests of batch mode, each in a
+// frame of its own, on a Unix domain socket (see Server.h). The response
+// is the same JSON object that batch mode writes, without the newline;
+// a request refused because too many are waiting has "overloaded":true.
+//
+// With "--fork-server", each request is converted in a child process (see
+// ForkPool), which handles requestsPerChild requests (0 means no limit);
+// a request whose process dies gets an error with "crashed":true.
+//
+// The results are kept in resultCaches, if there are any; with
+// "--fork-server", by the server process, so that they outlive the
+// children.
+int serverConversion(
+    blahtex::Interface& interface,
+    const RequestOptions& defaultRequest,
+    const string& socketPath,
+    unsigned numberOfThreads,
+    size_t maxQueueDepth,
+    size_t maxConnections,
+    bool forkServer,
+    unsigned requestsPerChild,
+    ResultCaches* resultCaches
+)
+{
+    blahtex::Interface defaults;
+    CopyConversionOptions(defaults, interface);
+
+    BatchPngRenderPool pngRenderPool;
+
+    vector<unique_ptr<blahtex::Interface> > interfaces;
+    unique_ptr<ForkPool> forkPool;
+
+    Server::Handler convert =
+        [&](const string& payload, unsigned worker) {
+            BatchRequest batchRequest = ParseBatchRequest(payload);
+            bool failed = false;
+            string response;
+            try
+            {
+                response = ConvertBatchRequest(
+                    batchRequest, *interfaces[worker], defaults,
+                    defaultRequest, pngRenderPool,
+                    forkServer ? NULL : resultCaches, gUnicodeConverter,
+                    failed
+                );
+                response.erase(response.size() - 1);
+            }
+            catch (std::exception& e)
+            {
+                response = "{\"id\":" + batchRequest.mId + ",\"error\":"
+                    + JsonQuote(string("Internal error: ") + e.what()) + "}";
+            }
+            return response;
+        };
+
+    Server server(
+        socketPath,
+        [&](const string& payload, unsigned worker) {
+            if (!forkPool)
+                return convert(payload, worker);
+
+            BatchRequest batchRequest = ParseBatchRequest(payload);
+            string key, output;
+            if (resultCaches && batchRequest.mError.empty())
+            {
+                try
+                {
+                    RequestOptions request;
+                    ApplyBatchOptions(
+                        batchRequest, *interfaces[worker], defaults,
+                        request, defaultRequest, gUnicodeConverter
+                    );
+                    key = RequestResultCacheKey(
+                        batchRequest.mInput, *interfaces[worker], request,
+                        gUnicodeConverter
+                    );
+                }
+                catch (CommandLineException& e)
+                {
+                    // The child reports it.
+                }
+                if (!key.empty() && resultCaches->Find(key, output))
+                {
+                    string response = BatchResponse(batchRequest, output, "");
+                    response.erase(response.size() - 1);
+                    return response;
+                }
+            }
+
+            try
+            {
+                string response = forkPool->Handle(payload, worker);
+                if (!key.empty())
+                {
+                    try
+                    {
+                        JsonValue value = ParseJson(response);
+                        const JsonValue* result = value.Find("output");
+                        if (result && result->mType == JsonValue::cString)
+                            resultCaches->Insert(key, result->mString);
+                    }
+                    catch (JsonException& e)
+                    {
+                        // Then it just isn't cached.
+                    }
+                }
+                return response;
+            }
+            catch (std::runtime_error& e)
+            {
+                return "{\"id\":" + ParseBatchRequest(payload).mId
+                    + ",\"error\":" + JsonQuote(e.what())
+                    + ",\"crashed\":true}";
+            }
+        },
+        [](const string& payload) {
+            return "{\"id\":" + ParseBatchRequest(payload).mId
+                + ",\"error\":\"The server is overloaded\""
+                + ",\"overloaded\":true}";
+        },
+        numberOfThreads,
+        maxQueueDepth,
+        maxConnections
+    );
+
+    for (unsigned worker = 0; worker < server.GetNumberOfWorkers(); worker++)
+        interfaces.push_back(
+            unique_ptr<blahtex::Interface>(new blahtex::Interface)
+        );
+
+    try
+    {
+        // Still single-threaded here, as ForkPool needs.
+        if (forkServer)
+        {
+            WarmUpCore();
+            forkPool.reset(new ForkPool(
+                convert, server.GetNumberOfWorkers(), requestsPerChild,
+                [&pngRenderPool]() {
+                    pngRenderPool.Stop();
+                }
+            ));
+        }
+        server.Run();
+    }
+    catch (std::runtime_error& e)
+    {
+        cerr << "blahtex: " << e.what() << endl;
+        return 1;
+    }
+    ReportResultCache(resultCaches);
+    return 0;
+}
+
+// Decodes a component of an application/x-www-form-urlencoded body.
+string UrlDecode(const string& text)
+{
+    string decoded;
+    for (size_t i = 0; i < text.size(); i++)
+    {
+        if (text[i] == '+')
+            decoded += ' ';
+        else if (text[i] == '%' && i + 2 < text.size()
+            && isxdigit((unsigned char) text[i + 1])
+            && isxdigit((unsigned char) text[i + 2])
+        )
+        {
+            decoded += (char) strtol(text.substr(i + 1, 2).c_str(), NULL, 16);
+            i += 2;
+        }
+        else
+            decoded += text[i];
+    }
+    return decoded;
+}
+
+// Reads the parameters of a POST request, from a form or a JSON object
+// body, e.g. "q=x%5E2&type=inline-tex" or {"q": "x^2", "type": "inline-tex"}.
+map<string, string> ReadHttpParameters(const HttpRequest& request)
+{
+    map<string, string> parameters;
+    if (request.GetHeader("content-type").find("json") != string::npos)
+    {
+        JsonValue value = ParseJson(request.mBody);
+        if (value.mType != JsonValue::cObject)
+            throw JsonException("the body is not an object");
+        for (size_t k = 0; k < value.mObject.size(); k++)
+            if (value.mObject[k].second.mType == JsonValue::cString)
+                parameters[value.mObject[k].first] =
+                    value.mObject[k].second.mString;
+        return parameters;
+    }
+
+    size_t begin = 0;
+    while (begin <= request.mBody.size())
+    {
+        size_t end = request.mBody.find('&', begin);
+        if (end == string::npos)
+            end = request.mBody.size();
+        string field = request.mBody.substr(begin, end - begin);
+        size_t equals = field.find('=');
+        if (!field.empty())
+            parameters[UrlDecode(field.substr(0, equals))] =
+                equals == string::npos ? "" : UrlDecode(field.substr(equals + 1));
+        begin = end + 1;
+    }
+    return parameters;
+}
+
+HttpResponse HttpJsonResponse(int status, const string& json)
+{
+    HttpResponse response(status);
+    response.mContentType = "application/json";
+    response.mBody = json;
+    return response;
+}
+
+HttpResponse HttpErrorResponse(int status, const string& id, const string& message)
+{
+    return HttpJsonResponse(
+        status,
+        "{\"success\":false,\"error\":{\"id\":" + JsonQuote(id)
+            + ",\"message\":" + JsonQuote(message) + "}}"
+    );
+}
+
+// Does the conversion asked for by a POST request of the HTTP server (see
+// HandleHttpRequest) to path, of tex (in UTF-8), with interface.
+HttpResponse ConvertHttpRequest(
+    const string& path,
+    blahtex::Interface& interface,
+    bool displayStyle,
+    const string& tex,
+    BatchPngRenderPool& pngRenderPool
+)
+{
+    try
+    {
+        wstring input;
+        try
+        {
+            input = gUnicodeConverter.ConvertIn(tex);
+        }
+        catch (UnicodeConverter::Exception& e)
+        {
+            throw blahtex::Exception(L"InvalidUtf8Input");
+        }
+
+        interface.ProcessInput(input, displayStyle);
+
+        if (path == "/texvcinfo")
+            return HttpJsonResponse(
+                200,
+                "{\"success\":true,\"checked\":" + JsonQuote(
+                    gUnicodeConverter.ConvertOut(interface.GetPurifiedTexOnly())
+                ) + "}"
+            );
+
+        if (path == "/mathml")
+        {
+            HttpResponse response;
+            response.mContentType = "application/mathml+xml; charset=utf-8";
+            response.mBody = string("<math xmlns=\"http://www.w3.org/1998/Math/MathML\"")
+                + (displayStyle ? " display=\"block\"" : "") + ">"
+                + gUnicodeConverter.ConvertOut(interface.GetMathml())
+                + "</math>";
+            return response;
+        }
+
+        string purifiedTex
+            = gUnicodeConverter.ConvertOut(interface.GetPurifiedTex());
+        string key;
+        if (useCanonicalKey)
+            key = ComputeMd5(
+                gUnicodeConverter.ConvertOut(interface.GetImageKey())
+            );
+
+        // The input is fine from here on, so a failure is ours: 503 if the
+        // render went over one of its limits, 500 otherwise.
+        PngInfo info;
+        try
+        {
+            info = pngRenderPool.Get()->SubmitUtf8(
+                purifiedTex, "", NULL, key
+            ).get();
+        }
+        catch (blahtex::Exception& e)
+        {
+            return HttpErrorResponse(
+                (e.GetCode() == L"RenderLimitExceeded") ? 503 : 500,
+                gUnicodeConverter.ConvertOut(e.GetCode()),
+                gUnicodeConverter.ConvertOut(GetErrorMessage(e))
+            );
+        }
+
+        HttpResponse response;
+        response.mContentType = "image/png";
+        response.mFile = info.fullFileName;
+        response.mHeaders.push_back(make_pair("ETag", "\"" + info.mMd5 + "\""));
+        if (interface.mPurifiedTexOptions.mAllowPreview && info.mDimensionsValid)
+        {
+            ostringstream height, depth;
+            height << info.mHeight;
+            depth << info.mDepth;
+            response.mHeaders.push_back(make_pair("X-Blahtex-Height", height.str()));
+            response.mHeaders.push_back(make_pair("X-Blahtex-Depth", depth.str()));
+        }
+        return response;
+    }
+    catch (blahtex::Exception& e)
+    {
+        return HttpErrorResponse(
+            400,
+            gUnicodeConverter.ConvertOut(e.GetCode()),
+            gUnicodeConverter.ConvertOut(GetErrorMessage(e))
+        );
+    }
+    catch (std::logic_error& e)
+    {
+        return HttpErrorResponse(500, "logicError", e.what());
+    }
+}
+
+// Handles a request of the HTTP server (see "--http"), with an Interface of
+// its own, whose options are first reset to those of defaults:
+//     POST /texvcinfo  checks the TeX; returns {"success":true,"checked":...}
+//     POST /mathml     returns the MathML
+//     POST /png        renders the image and returns it
+//     GET /png/<md5>   returns an image rendered before
+// The POST requests take the TeX in the "q" parameter; "type" is "tex"
+// (the default, for display style) or "inline-tex". Errors are reported as
+// {"success":false,"error":{"id":...,"message":...}}, with the status 400
+// for errors in the input, and 500 or 503 for failures to render it. The
+// answers to /texvcinfo and /mathml are kept in resultCaches, if there
+// are any.
+HttpResponse HandleHttpRequest(
+    const HttpRequest& request,
+    blahtex::Interface& interface,
+    const blahtex::Interface& defaults,
+    BatchPngRenderPool& pngRenderPool,
+    ResultCaches* resultCaches
+)
+{
+    const string& path = request.mPath;
+
+    if (path.compare(0, 5, "/png/") == 0)
+    {
+        if (request.mMethod != "GET" && request.mMethod != "HEAD")
+        {
+            HttpResponse response(405);
+            response.mHeaders.push_back(make_pair("Allow", "GET, HEAD"));
+            return response;
+        }
+
+        string md5 = path.substr(5);
+        if (md5.size() == 36 && md5.compare(32, 4, ".png") == 0)
+            md5.erase(32);
+        if (md5.size() != 32
+            || md5.find_first_not_of("0123456789abcdef") != string::npos
+        )
+            return HttpResponse(404);
+
+        string fileName = PngFullFileName(md5, pngParams);
+        if (access(fileName.c_str(), R_OK) != 0)
+            return HttpResponse(404);
+        RecordPngAccess(md5, pngParams);
+
+        // The image named by an md5 never changes, so its md5 serves as a
+        // strong ETag.
+        string etag = "\"" + md5 + "\"";
+        string ifNoneMatch = request.GetHeader("if-none-match");
+        HttpResponse response;
+        if (ifNoneMatch == "*" || ifNoneMatch.find(etag) != string::npos)
+            response.mStatus = 304;
+        else
+        {
+            response.mContentType = "image/png";
+            response.mFile = fileName;
+        }
+        response.mHeaders.push_back(make_pair("ETag", etag));
+        return response;
+    }
+
+    if (path != "/texvcinfo" && path != "/mathml" && path != "/png")
+        return HttpResponse(404);
+    if (request.mMethod != "POST")
+    {
+        HttpResponse response(405);
+        response.mHeaders.push_back(make_pair("Allow", "POST"));
+        return response;
+    }
+
+    map<string, string> parameters;
+    try
+    {
+        parameters = ReadHttpParameters(request);
+    }
+    catch (JsonException& e)
+    {
+        return HttpErrorResponse(400, "MalformedRequest", e.mMessage);
+    }
+
+    if (parameters.find("q") == parameters.end())
+        return HttpErrorResponse(400, "MalformedRequest", "missing \"q\" parameter");
+
+    string type = parameters.count("type") ? parameters["type"] : "tex";
+    if (type != "tex" && type != "inline-tex")
+        return HttpErrorResponse(400, "MalformedRequest", "unknown type \"" + type + "\"");
+    bool displayStyle = type == "tex";
+
+    CopyConversionOptions(interface, defaults);
+    if (displayStyle)
+        interface.mPurifiedTexOptions.mDisplayMath = true;
+
+    // A cached answer is kept as its status and content type on a line,
+    // followed by the body.
+    string key;
+    if (resultCaches && path != "/png")
+    {
+        key = ResultCacheKey(
+            "http" + path, interface, displayStyle, parameters["q"],
+            gUnicodeConverter
+        );
+        string value;
+        if (resultCaches->Find(key, value))
+        {
+            size_t space = value.find(' ');
+            size_t newline = value.find('\n');
+            HttpResponse response(atoi(value.c_str()));
+            response.mContentType
+                = value.substr(space + 1, newline - space - 1);
+            response.mBody = value.substr(newline + 1);
+            return response;
+        }
+    }
+
+    HttpResponse response = ConvertHttpRequest(
+        path, interface, displayStyle, parameters["q"], pngRenderPool
+    );
+
+    if (!key.empty() && response.mStatus != 500)
+    {
+        ostringstream value;
+        value << response.mStatus << " " << response.mContentType << "\n"
+            << response.mBody;
+        resultCaches->Insert(key, value.str());
+    }
+    return response;
+}
+
+// HTTP mode ("--http"): serves HandleHttpRequest on the given port of the
+// loopback interface, with a worker pool (see HttpServer.h).
+int httpConversion(
+    blahtex::Interface& interface,
+    int port,
+    unsigned numberOfThreads,
+    ResultCaches* resultCaches
+)
+{
+    blahtex::Interface defaults;
+    CopyConversionOptions(defaults, interface);
+
+    BatchPngRenderPool pngRenderPool;
+
+    vector<unique_ptr<blahtex::Interface> > interfaces;
 
-    XercesString _MathMLPrefix(MathMLPrefix.c_str());
-    wstring __MathMLPrefix = _MathMLPrefix.convertTowstring();
-    parser->setDesiredMathMLPrefixType(MathMLPrefixType, __MathMLPrefix);
-    parser->setAnnotatePNG(annotatePNG);
-    parser->setAnnotateTeX(annotateTeX);
-    parser->setPngParams(pngParams);
+    HttpServer server(
+        port,
+        [&](const HttpRequest& request, unsigned worker) {
+            return HandleHttpRequest(
+                request, *interfaces[worker], defaults, pngRenderPool,
+                resultCaches
+            );
+        },
+        numberOfThreads
+    );
 
-    int parserErrors = 0;
-    int result = 0;
+    for (unsigned worker = 0; worker < server.GetNumberOfWorkers(); worker++)
+        interfaces.push_back(
+            unique_ptr<blahtex::Interface>(new blahtex::Interface)
+        );
+
+    try
     {
-        StdInInputSource stdIn;
-        try {
-            XercesString publicID(outputPublicID.c_str());
-            XercesString DTD(outputDTD.c_str());
-            SAX2Output output(cout, "UTF-8", XMLFormatter::UnRep_CharRef, outputDoctype, publicID, DTD);
-            parser->setContentHandler(&output);
-            parser->setErrorHandler(&output);
-            parser->parse(stdIn);
-            parserErrors = parser->getErrorCount();
-        }
-        catch (const OutOfMemoryException&) {
-            cerr << endl;
-            cerr << "Out of memory exception" << endl;
-            result = 1;
-        }
-        catch (const XMLException& e) {
-            char *errorString = XMLString::transcode(e.getMessage());
-            cerr << endl;
-            cerr << "Error: " << errorString << endl;
-            XMLString::release(&errorString);
-            result = 1;
-        }
-    }
-    if (parserErrors > 0) {
-        cerr << "During the XML input parsing, ";
-        if (parserErrors == 1) cerr << "an error";
-        else cerr << parserErrors << " errors";
-        cerr << " occurred." << endl;
+        server.Run();
     }
-    int blahtexErrors = parser->getNumberOfErrors();
-    if (blahtexErrors > 0) {
-        cerr << "During the blahtex conversion, ";
-        if (blahtexErrors == 1) cerr << "an error";
-        else cerr << blahtexErrors << " errors";
-        cerr << " occurred.\nSee the output file for more information." << endl;
-        result = 1;
+    catch (std::runtime_error& e)
+    {
+        cerr << "blahtex: " << e.what() << endl;
+        return 1;
     }
-    delete parser;
-    delete reader;
-    XMLPlatformUtils::Terminate();
-    return result;
+    ReportResultCache(resultCaches);
+    return 0;
 }
-#endif
 
 int main (int argc, char* const argv[]) {
     // This outermost try block catches std::runtime_error
@@ -310,17 +1794,28 @@ int main (int argc, char* const argv[]) {
 
         blahtex::Interface interface;
 
-        bool doPng    = false;
-        bool doMathml = false;
+        RequestOptions request;
 #ifdef BLAHTEXML_USING_XERCES
         bool doXMLinput = false;
         annotatePNG = false;
         annotateTeX = false;
 #endif
 
-        bool debugLayoutTree  = false;
-        bool debugParseTree   = false;
-        bool debugPurifiedTex = false;
+        bool shardExisting    = false;
+        bool evictStore       = false;
+        bool batchMode        = false;
+        // 1 for batch mode, one per core for the server, unless given.
+        int threads           = -1;
+        const char* serverSocketPath = NULL;
+        int httpPort          = 0;
+        size_t maxQueueDepth  = 256;
+        size_t maxConnections = 128;
+        bool forkServer       = false;
+        unsigned forkRequests = 1;
+        long long cacheSize   = 0;
+        const char* cacheFilePath = NULL;
+        long long cacheFileSize = 0;
+        bool compactCacheFile = false;
 
         pngParams.deleteTempFiles  = true;
         pngParams.shellLatex    = "latex";
@@ -328,8 +1823,6 @@ int main (int argc, char* const argv[]) {
         pngParams.tempDirectory = "./";
         pngParams.pngDirectory  = "./";
         
-        bool displayStyle = false;
-        
         const char *inputFilePath = NULL;
         
 
@@ -338,9 +1831,113 @@ int main (int argc, char* const argv[]) {
         {
             string arg(argv[i]);
 
+            if (ApplyConversionOption(
+                i, argc, argv, interface, request, gUnicodeConverter
+            ))
+                continue;
+
             if (arg == "--help")
                 ShowUsage();
             
+            else if (arg == "--batch")
+                batchMode = true;
+
+            else if (arg == "--threads")
+            {
+                if (++i == argc)
+                    throw CommandLineException(
+                        "Missing number after \"--threads\""
+                    );
+                istringstream number(argv[i]);
+                if (!(number >> threads) || threads < 0)
+                    throw CommandLineException(
+                        "Illegal number after \"--threads\""
+                    );
+            }
+
+            else if (arg == "--server")
+            {
+                if (++i == argc)
+                    throw CommandLineException(
+                        "Missing socket path after \"--server\""
+                    );
+                serverSocketPath = argv[i];
+            }
+
+            else if (arg == "--http")
+            {
+                if (++i == argc)
+                    throw CommandLineException(
+                        "Missing port after \"--http\""
+                    );
+                istringstream number(argv[i]);
+                if (!(number >> httpPort) || httpPort <= 0 || httpPort > 65535)
+                    throw CommandLineException(
+                        "Illegal port after \"--http\""
+                    );
+            }
+
+            else if (arg == "--cache-size")
+                cacheSize = ReadSizeArgument(i, argc, argv, "--cache-size");
+
+            else if (arg == "--cache-file")
+            {
+                if (++i == argc)
+                    throw CommandLineException(
+                        "Missing path after \"--cache-file\""
+                    );
+                cacheFilePath = argv[i];
+            }
+
+            else if (arg == "--cache-file-size")
+                cacheFileSize
+                    = ReadSizeArgument(i, argc, argv, "--cache-file-size");
+
+            else if (arg == "--cache-compact")
+                compactCacheFile = true;
+
+            else if (arg == "--max-queue")
+            {
+                if (++i == argc)
+                    throw CommandLineException(
+                        "Missing number after \"--max-queue\""
+                    );
+                istringstream number(argv[i]);
+                if (!(number >> maxQueueDepth))
+                    throw CommandLineException(
+                        "Illegal number after \"--max-queue\""
+                    );
+            }
+
+            else if (arg == "--max-connections")
+            {
+                if (++i == argc)
+                    throw CommandLineException(
+                        "Missing number after \"--max-connections\""
+                    );
+                istringstream number(argv[i]);
+                if (!(number >> maxConnections) || maxConnections == 0)
+                    throw CommandLineException(
+                        "Illegal number after \"--max-connections\""
+                    );
+            }
+
+            else if (arg == "--fork-server")
+                forkServer = true;
+
+            else if (arg == "--fork-requests")
+            {
+                if (++i == argc)
+                    throw CommandLineException(
+                        "Missing number after \"--fork-requests\""
+                    );
+                istringstream number(argv[i]);
+                if (!(number >> forkRequests))
+                    throw CommandLineException(
+                        "Illegal number after \"--fork-requests\""
+                    );
+            }
+
             else if (arg == "--input-file")
             {
                 if (++i == argc)
@@ -397,143 +1994,160 @@ int main (int argc, char* const argv[]) {
                 AddTrailingSlash(pngParams.pngDirectory);
             }
 
-            else if (arg == "--displaymath") {
-                interface.mPurifiedTexOptions.mDisplayMath = true;
-                displayStyle = true;
+            else if (arg == "--png-format-directory")
+            {
+                if (++i == argc)
+                    throw CommandLineException(
+                        "Missing string after \"--png-format-directory\""
+                    );
+                pngParams.formatDirectory = string(argv[i]);
+                AddTrailingSlash(pngParams.formatDirectory);
             }
 
-            else if (arg == "--use-ucs-package")
-                interface.mPurifiedTexOptions.mAllowUcs = true;
-
-            else if (arg == "--use-cjk-package")
-                interface.mPurifiedTexOptions.mAllowCJK = true;
+            else if (arg == "--png-no-cache")
+                pngParams.useCache = false;
 
-            else if (arg == "--use-preview-package")
-                interface.mPurifiedTexOptions.mAllowPreview = true;
-
-            else if (arg == "--japanese-font")
+            else if (arg == "--png-workers")
             {
                 if (++i == argc)
                     throw CommandLineException(
-                        "Missing string after \"--japanese-font\""
+                        "Missing number after \"--png-workers\""
+                    );
+                istringstream workers(argv[i]);
+                if (!(workers >> pngWorkers))
+                    throw CommandLineException(
+                        "Illegal number after \"--png-workers\""
                     );
-                interface.mPurifiedTexOptions.mJapaneseFont =
-                    gUnicodeConverter.ConvertIn(string(argv[i]));
             }
 
-            else if (arg == "--indented")
-                interface.mIndented = true;
-
-            else if (arg == "--spacing")
+            else if (arg == "--png-shard-levels")
             {
                 if (++i == argc)
                     throw CommandLineException(
-                        "Missing string after \"--spacing\""
+                        "Missing number after \"--png-shard-levels\""
                     );
-                arg = string(argv[i]);
-
-                if (arg == "strict")
-                    interface.mMathmlOptions.mSpacingControl
-                        = MathmlOptions::cSpacingControlStrict;
-
-                else if (arg == "moderate")
-                    interface.mMathmlOptions.mSpacingControl
-                        = MathmlOptions::cSpacingControlModerate;
-
-                else if (arg == "relaxed")
-                    interface.mMathmlOptions.mSpacingControl
-                        = MathmlOptions::cSpacingControlRelaxed;
-
-                else
+                istringstream levels(argv[i]);
+                if (!(levels >> pngParams.shardLevels)
+                    || pngParams.shardLevels < 0
+                    || pngParams.shardLevels > 16
+                )
                     throw CommandLineException(
-                        "Illegal string after \"--spacing\""
+                        "Illegal number after \"--png-shard-levels\""
                     );
             }
 
-            else if (arg == "--mathml-version-1-fonts")
-                interface.mMathmlOptions.mUseVersion1FontAttributes = true;
-
-            else if (arg == "--texvc-compatible-commands")
-                interface.mTexvcCompatibility = true;
-
-            else if (arg == "--png")
-                doPng = true;
-
-            else if (arg == "--mathml")
-                doMathml = true;
-
-            else if (arg == "--mathml-encoding")
+            else if (arg == "--png-dpi")
             {
                 if (++i == argc)
                     throw CommandLineException(
-                        "Missing string after \"--mathml-encoding\""
+                        "Missing number after \"--png-dpi\""
                     );
-                arg = string(argv[i]);
-
-                if (arg == "raw")
-                    interface.mEncodingOptions.mMathmlEncoding
-                        = EncodingOptions::cMathmlEncodingRaw;
-
-                else if (arg == "numeric")
-                    interface.mEncodingOptions.mMathmlEncoding
-                        = EncodingOptions::cMathmlEncodingNumeric;
+                istringstream dpi(argv[i]);
+                if (!(dpi >> pngParams.dpi) || pngParams.dpi <= 0)
+                    throw CommandLineException(
+                        "Illegal number after \"--png-dpi\""
+                    );
+            }
 
-                else if (arg == "short")
-                    interface.mEncodingOptions.mMathmlEncoding
-                        = EncodingOptions::cMathmlEncodingShort;
+            else if (arg == "--png-resolutions")
+            {
+                if (++i == argc)
+                    throw CommandLineException(
+                        "Missing list after \"--png-resolutions\""
+                    );
+                // Scale 1 is always rendered, so it may be listed or not.
+                pngParams.scales.clear();
+                istringstream list(argv[i]);
+                string item;
+                while (getline(list, item, ','))
+                {
+                    istringstream itemStream(item);
+                    int scale;
+                    if (!(itemStream >> scale) || scale < 1 || scale > 16)
+                        throw CommandLineException(
+                            "Illegal scale \"" + item +
+                            "\" after \"--png-resolutions\""
+                        );
+                    if (scale != 1
+                        && find(pngParams.scales.begin(),
+                            pngParams.scales.end(), scale)
+                            == pngParams.scales.end()
+                    )
+                        pngParams.scales.push_back(scale);
+                }
+            }
 
-                else if (arg == "long")
-                    interface.mEncodingOptions.mMathmlEncoding
-                        = EncodingOptions::cMathmlEncodingLong;
+            else if (arg == "--png-persistent-latex")
+                pngParams.persistentLatex = true;
 
-                else
+            else if (arg == "--png-batch-size")
+            {
+                if (++i == argc)
+                    throw CommandLineException(
+                        "Missing number after \"--png-batch-size\""
+                    );
+                istringstream batchSize(argv[i]);
+                if (!(batchSize >> pngParams.batchSize)
+                    || pngParams.batchSize <= 0
+                )
                     throw CommandLineException(
-                        "Illegal string after \"--mathml-encoding\""
+                        "Illegal number after \"--png-batch-size\""
                     );
             }
 
-            else if (arg == "--disallow-plane-1")
+            else if (arg == "--png-shard-existing")
+                shardExisting = true;
+
+            else if (arg == "--png-store-budget")
+                pngParams.storeBudget =
+                    ReadSizeArgument(i, argc, argv, "--png-store-budget");
+
+            else if (arg == "--png-timeout")
             {
-                interface.mMathmlOptions  .mAllowPlane1 = false;
-                interface.mEncodingOptions.mAllowPlane1 = false;
+                if (++i == argc)
+                    throw CommandLineException(
+                        "Missing number after \"--png-timeout\""
+                    );
+                istringstream timeout(argv[i]);
+                if (!(timeout >> pngParams.timeout) || pngParams.timeout <= 0)
+                    throw CommandLineException(
+                        "Illegal number after \"--png-timeout\""
+                    );
             }
 
-            else if (arg == "--other-encoding")
+            else if (arg == "--png-cpu-limit")
             {
                 if (++i == argc)
                     throw CommandLineException(
-                        "Missing string after \"--other-encoding\""
+                        "Missing number after \"--png-cpu-limit\""
                     );
-                arg = string(argv[i]);
-                if (arg == "raw")
-                    interface.mEncodingOptions.mOtherEncodingRaw = true;
-                else if (arg == "numeric")
-                    interface.mEncodingOptions.mOtherEncodingRaw = false;
-                else
+                istringstream cpuLimit(argv[i]);
+                if (!(cpuLimit >> pngParams.cpuLimit) || pngParams.cpuLimit <= 0)
                     throw CommandLineException(
-                        "Illegal string after \"--other-encoding\""
+                        "Illegal number after \"--png-cpu-limit\""
                     );
             }
 
-            else if (arg == "--debug")
+            else if (arg == "--png-memory-limit")
+                pngParams.memoryLimit =
+                    ReadSizeArgument(i, argc, argv, "--png-memory-limit");
+
+            else if (arg == "--png-evict")
+                evictStore = true;
+
+            else if (arg == "--png-workspace")
             {
                 if (++i == argc)
                     throw CommandLineException(
-                        "Missing string after \"--debug\""
-                    );
-                arg = string(argv[i]);
-                if (arg == "layout")
-                    debugLayoutTree = true;
-                else if (arg == "parse")
-                    debugParseTree = true;
-                else if (arg == "purified")
-                    debugPurifiedTex = true;
-                else
-                    throw CommandLineException(
-                        "Illegal string after \"--debug\""
+                        "Missing string after \"--png-workspace\""
                     );
+                pngParams.workspaceDirectory = string(argv[i]);
+                AddTrailingSlash(pngParams.workspaceDirectory);
             }
 
+            else if (arg == "--canonical-key")
+                useCanonicalKey = true;
+
             else if (arg == "--keep-temp-files")
                 pngParams.deleteTempFiles = false;
 #ifdef BLAHTEXML_USING_XERCES
@@ -571,22 +2185,6 @@ int main (int argc, char* const argv[]) {
             else if (arg == "--annotate-TeX")
                 annotateTeX = true;
 #endif
-            else if (arg == "--png-latex-preamble") {
-                if (++i == argc) {
-                    throw CommandLineException(
-                        "Missing string after \"--png-latex-preamble\""
-                    );
-                }
-                interface.mPurifiedTexOptions.mLaTeXPreamble = gUnicodeConverter.ConvertIn(string(argv[i]));
-            }
-            else if (arg == "--png-latex-before-math") {
-                if (++i == argc) {
-                    throw CommandLineException(
-                        "Missing string after \"--png-latex-before-math\""
-                    );
-                }
-                interface.mPurifiedTexOptions.mLaTeXBeforeMath = gUnicodeConverter.ConvertIn(string(argv[i]));
-            }
             else
                 throw CommandLineException(
                     "Unrecognised command line option \"" + arg + "\""
@@ -595,177 +2193,171 @@ int main (int argc, char* const argv[]) {
 
         // Finished processing command line, now process the input
 
-#ifdef BLAHTEXML_USING_XERCES
-        if (doXMLinput)
-            return batchXMLConversion(interface);
-#endif
-        if (isatty(0) && !inputFilePath)
-            ShowUsage();
-
-        wostringstream mainOutput;
-
-        try
+        if (shardExisting)
         {
-            wstring input;
-
-            // Read input file
-            string inputUtf8;
+            int moved = ShardPngDirectory(pngParams);
+            if (moved < 0)
             {
-                if (inputFilePath)
-                {
-                    ifstream inputFile (inputFilePath, ifstream::in);
-                    
-                    if (inputFile.is_open())
-                    {
-                        char c;
-                        while (inputFile.get(c))
-                            inputUtf8 += c;
-                        inputFile.close();
-                    }
-                    
-                    else
-					{
-						throw CommandLineException("Could not open the input file!");
-					}
-                }
-                
-                else
-                {
-                    char c;
-                    while (cin.get(c))
-                        inputUtf8 += c;
-                    
-                }
+                cerr << "blahtex: cannot read the PNG directory \""
+                    << pngParams.pngDirectory << "\"" << endl;
+                return 1;
             }
+            cout << "Moved " << moved << " files" << endl;
+            return 0;
+        }
 
-            // This try block converts UnicodeConverter::Exception into an
-            // input syntax error, i.e. if the user supplies invalid UTF-8.
-            // (Later we treat such exceptions as debug assertions.)
-            try
-            {
-                input = gUnicodeConverter.ConvertIn(inputUtf8);
-            }
-            catch (UnicodeConverter::Exception& e)
+        if (evictStore)
+        {
+            if (pngParams.storeBudget <= 0)
+                throw CommandLineException(
+                    "\"--png-evict\" requires \"--png-store-budget\""
+                );
+            int evicted = EvictPngStore(pngParams, true);
+            if (evicted < 0)
             {
-                throw blahtex::Exception(L"InvalidUtf8Input");
+                cerr << "blahtex: cannot open the store index in \""
+                    << pngParams.pngDirectory << "\"" << endl;
+                return 1;
             }
+            cout << "Evicted " << evicted << " images" << endl;
+            return 0;
+        }
 
-            // Build the parse and layout trees.
-            interface.ProcessInput(input, displayStyle);
-
-            if (debugParseTree)
-            {
-                mainOutput << L"\n=== BEGIN PARSE TREE ===\n\n";
-                interface.GetManager()->GetParseTree()->Print(mainOutput);
-                mainOutput << L"\n=== END PARSE TREE ===\n\n";
-            }
+        if (cacheFileSize > 0 && !cacheFilePath)
+            throw CommandLineException(
+                "\"--cache-file-size\" requires \"--cache-file\""
+            );
+        unique_ptr<ResultStore> resultStore;
+        // A cache file written with another version of the results is
+        // started afresh.
+        if (cacheFilePath)
+            resultStore.reset(new ResultStore(
+                cacheFilePath,
+                "blahtex " + gBlahtexVersion + " results "
+                    + to_string(cResultVersion),
+                cacheFileSize
+            ));
+
+        if (compactCacheFile)
+        {
+            if (!resultStore)
+                throw CommandLineException(
+                    "\"--cache-compact\" requires \"--cache-file\""
+                );
+            resultStore->Compact();
+            cout << "Compacted the cache file to "
+                << resultStore->GetStatistics().mEntries << " entries" << endl;
+            return 0;
+        }
 
-            if (debugLayoutTree)
-            {
-                mainOutput << L"\n=== BEGIN LAYOUT TREE ===\n\n";
-                wostringstream temp;
-                interface.GetManager()->GetLayoutTree()->Print(temp);
-                mainOutput << XmlEncode(temp.str(), EncodingOptions());
-                mainOutput << L"\n=== END LAYOUT TREE ===\n\n";
-            }
+#ifdef BLAHTEXML_USING_XERCES
+        if (doXMLinput)
+            return batchXMLConversion(interface);
+#endif
+        unique_ptr<ResultCache> resultCache;
+        if (cacheSize > 0)
+        {
+            if (!batchMode && !serverSocketPath && !httpPort)
+                throw CommandLineException(
+                    "\"--cache-size\" requires \"--batch\", \"--server\" "
+                    "or \"--http\""
+                );
+            resultCache.reset(new ResultCache(cacheSize));
+        }
 
-            // Generate purified TeX if required.
-            if (doPng || debugPurifiedTex)
-            {
-                // This stream is where we build the PNG output block:
-                wostringstream pngOutput;
+        ResultCaches caches;
+        caches.mMemory = resultCache.get();
+        caches.mStore = resultStore.get();
+        ResultCaches* resultCaches
+            = (caches.mMemory || caches.mStore) ? &caches : NULL;
+
+        if (httpPort)
+            return httpConversion(
+                interface, httpPort, threads < 0 ? 0 : threads,
+                resultCaches
+            );
+
+        if (forkServer && !serverSocketPath)
+            throw CommandLineException(
+                "\"--fork-server\" requires \"--server\""
+            );
+
+        if (serverSocketPath)
+            return serverConversion(
+                interface, request, serverSocketPath,
+                threads < 0 ? 0 : threads, maxQueueDepth, maxConnections,
+                forkServer, forkRequests, resultCaches
+            );
+
+        if (batchMode)
+        {
+            unsigned batchThreads = threads < 0 ? 1 : threads;
+            if (!inputFilePath)
+                return batchJsonConversion(
+                    interface, request, cin, batchThreads,
+                    resultCaches
+                );
 
-                try
-                {
-                    wstring purifiedTex = interface.GetPurifiedTex();
+            ifstream inputFile(inputFilePath, ifstream::in);
+            if (!inputFile.is_open())
+                throw CommandLineException("Could not open the input file!");
+            return batchJsonConversion(
+                interface, request, inputFile, batchThreads,
+                resultCaches
+            );
+        }
 
-                    if (debugPurifiedTex)
-                    {
-                        pngOutput << L"\n=== BEGIN PURIFIED TEX ===\n\n";
-                        pngOutput << purifiedTex;
-                        pngOutput << L"\n=== END PURIFIED TEX ===\n\n";
-                    }
+        if (isatty(0) && !inputFilePath)
+            ShowUsage();
 
-                    // Make the system calls to generate the PNG image
-                    // if requested.
-                    if (doPng)
-                    {
-                        PngInfo info = MakePngFile(purifiedTex, "", pngParams);
-
-                        // The height and depth measurements are only
-                        // valid if the "preview" package is used:
-                        if (interface.mPurifiedTexOptions.mAllowPreview
-                            && info.mDimensionsValid
-                        )
-                        {
-                            pngOutput << L"<height>"
-                                << info.mHeight << L"</height>\n";
-                            pngOutput << L"<depth>"
-                                << info.mDepth << L"</depth>\n";
-                        }
-
-                        pngOutput << L"<md5>"
-                            << gUnicodeConverter.ConvertIn(info.mMd5)
-                            << L"</md5>\n";
-                    }
-                }
+        // Renders the PNG in single-request mode, in tempDirectory itself.
+        auto_ptr<PngRenderPool> pngRenderPool;
+        if (request.mDoPng)
+            pngRenderPool.reset(new PngRenderPool(pngParams, 1, false));
 
-                // Catching errors that occurred during PNG generation:
-                catch (blahtex::Exception& e)
+        // Read input file
+        string inputUtf8;
+        {
+            if (inputFilePath)
+            {
+                ifstream inputFile (inputFilePath, ifstream::in);
+                
+                if (inputFile.is_open())
                 {
-                    pngOutput.str(L"");
-                    pngOutput << FormatError(e, interface.mEncodingOptions)
-                        << endl;
+                    char c;
+                    while (inputFile.get(c))
+                        inputUtf8 += c;
+                    inputFile.close();
                 }
-
-                mainOutput << L"<png>\n" << pngOutput.str() << L"</png>\n";
+                
+                else
+                    throw CommandLineException("Could not open the input file!");
             }
-
-            // This block generates MathML output if requested.
-            if (doMathml)
+            
+            else
             {
-                // This stream is where we build the MathML output block:
-                wostringstream mathmlOutput;
-
-                try
-                {
-                    mathmlOutput << L"<markup>\n";
-                    mathmlOutput << interface.GetMathml();
-                    if (!interface.mIndented)
-                        mathmlOutput << L"\n";
-                    mathmlOutput << L"</markup>\n";
-                }
-
-                // Catch errors in generating the MathML:
-                catch (blahtex::Exception& e)
-                {
-                    mathmlOutput.str(L"");
-                    mathmlOutput
-                        << FormatError(e, interface.mEncodingOptions)
-                        << endl;
-                }
-
-                mainOutput << L"<mathml>\n" << mathmlOutput.str()
-                    << L"</mathml>\n";
+                char c;
+                while (cin.get(c))
+                    inputUtf8 += c;
+                
             }
         }
 
-        catch (blahtex::TokenException& e)
-        {
-            mainOutput.str(L"");
-            mainOutput << FormatTokenError(e, interface.mEncodingOptions) << endl;
-        }
-        
-        // This catches input syntax errors.
-        catch (blahtex::Exception& e)
+        string key, output;
+        if (resultCaches)
+            key = RequestResultCacheKey(
+                inputUtf8, interface, request, gUnicodeConverter
+            );
+        if (key.empty() || !resultCaches->Find(key, output))
         {
-            mainOutput.str(L"");
-            mainOutput << FormatError(e, interface.mEncodingOptions) << endl;
+            output = ProcessRequest(
+                interface, request, inputUtf8, pngRenderPool.get(),
+                gUnicodeConverter
+            );
+            if (!key.empty())
+                resultCaches->Insert(key, output);
         }
-
-        cout << "<blahtex>\n"
-            << gUnicodeConverter.ConvertOut(mainOutput.str())
-            << "</blahtex>\n";
+        cout << output;
     }
 
     // The following errors might occur if there's a bug in blahtex that
@@ -20,24 +20,35 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 #include "UnicodeConverter.h"
 #include "md5Wrapper.h"
 #include "mainPng.h"
+#include "Process.h"
+#include "PngStore.h"
+#include "LatexEngine.h"
 #include <cerrno>
+#include <ctype.h>
+#include <dirent.h>
 #include <sys/stat.h>
 #include <iostream>
 #include <fstream>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <sstream>
+#include <map>
+#include <memory>
+#include <vector>
+#include <utility>
+#include <atomic>
 
 #include <unistd.h>
+#include <fcntl.h>
+#ifndef _WIN32
+#include <sys/file.h>
+#endif
 
 using namespace std;
 using namespace blahtex;
 
 
-// From main.cpp:
-extern UnicodeConverter gUnicodeConverter;
-
-
 // TemporaryFile manages a temporary file; it deletes the named file when
 // the object goes out of scope.
 class TemporaryFile
@@ -73,61 +84,535 @@ bool FileExists(const string& filename)
 }
 
 
-// Attempts to run given command from the given directory.
-// Returns true if the system() call was successful, otherwise false.
-// Can throw a "CannotChangeDirectory" exception if problems occur.
+// Returns a string that differs between calls, and between processes, for
+// naming files under construction.
+string UniqueSuffix()
+{
+    static atomic<unsigned> counter(0);
+    ostringstream suffix;
+    suffix << getpid() << "-" << counter++;
+    return suffix.str();
+}
+
+
+// Moves the file src to dst, such that other processes either see no dst,
+// or the complete file. This is just rename(), unless src and dst are on
+// different filesystems, in which case the file is copied next to dst
+// first. Returns false on failure.
+bool PublishFile(const string& src, const string& dst)
+{
+    if (rename(src.c_str(), dst.c_str()) == 0)
+        return true;
+    if (errno != EXDEV)
+        return false;
+
+    ostringstream tempStream;
+    tempStream << dst << ".tmp" << UniqueSuffix();
+    string temp = tempStream.str();
+    {
+        ifstream in(src.c_str(), ios::in | ios::binary);
+        ofstream out(temp.c_str(), ios::out | ios::binary);
+        if (!in || !out || !(out << in.rdbuf()))
+        {
+            out.close();
+            unlink(temp.c_str());
+            return false;
+        }
+    }
+    if (rename(temp.c_str(), dst.c_str()) != 0)
+    {
+        unlink(temp.c_str());
+        return false;
+    }
+    unlink(src.c_str());
+    return true;
+}
+
+
+RenderLock::RenderLock(const string& filename, bool wait) :
+    mFilename(filename),
+    mFd(-1),
+    mBusy(false)
+{
+#ifndef _WIN32
+    while (true)
+    {
+        int fd = open(mFilename.c_str(), O_RDWR | O_CREAT, 0666);
+        if (fd < 0)
+            return;
+
+        int result;
+        do
+            result = flock(fd, wait ? LOCK_EX : (LOCK_EX | LOCK_NB));
+        while (result != 0 && errno == EINTR);
+        if (result != 0)
+        {
+            mBusy = (errno == EWOULDBLOCK);
+            close(fd);
+            return;
+        }
+
+        // The previous holder may have removed the file between our
+        // open() and flock(); in that case we locked a dead file and
+        // need to start again.
+        struct stat opened, current;
+        if (fstat(fd, &opened) == 0
+            && stat(mFilename.c_str(), &current) == 0
+            && opened.st_ino == current.st_ino
+            && opened.st_dev == current.st_dev
+        )
+        {
+            mFd = fd;
+            return;
+        }
+        close(fd);
+    }
+#endif
+}
+
+
+RenderLock::~RenderLock()
+{
+#ifndef _WIN32
+    if (mFd >= 0)
+    {
+        unlink(mFilename.c_str());
+        close(mFd);
+    }
+#endif
+}
+
+
+// Runs the program given by commandLine (e.g. the "--shell-latex" setting,
+// which may carry options of its own) with the given extra arguments, from
+// the given directory, within the limits set in params. Returns true if it
+// ran and exited successfully. If output is non-NULL, the program's
+// standard output is stored there.
+//
+// Throws a RenderLimitExceeded exception if the program was stopped for
+// going over one of the limits.
 bool Execute(
-    const string& command,
-    const string& directory = "./"
+    const string& commandLine,
+    const vector<string>& arguments,
+    const string& directory,
+    const PngParams& params,
+    string* output = NULL
 )
 {
-    char buffer[5000];
+    vector<string> argv = SplitCommandLine(commandLine);
+    argv.insert(argv.end(), arguments.begin(), arguments.end());
+
+    ProcessOptions options;
+    if (directory != "./")
+        options.mDirectory = directory;
+    options.mCaptureOutput = (output != NULL);
+    options.mTimeout = params.timeout;
+    options.mCpuLimit = params.cpuLimit;
+    options.mMemoryLimit = params.memoryLimit;
 
-    bool NeedToChange = (directory != "" && directory != "./");
+    ProcessResult result = RunProcess(argv, options);
+    if (output)
+        *output = result.mOutput;
 
-    if (NeedToChange)
+    wstring limit, value;
+    wostringstream valueStream;
+    switch (result.mLimitExceeded)
     {
-        if (getcwd(buffer, 5000) == NULL)
-            throw blahtex::Exception(L"CannotChangeDirectory");
+        case ProcessResult::cTimeLimit:
+            limit = L"time";
+            valueStream << params.timeout << L"s";
+            break;
 
-        if (chdir(directory.c_str()) != 0)
-            throw blahtex::Exception(L"CannotChangeDirectory");
+        case ProcessResult::cCpuLimit:
+            limit = L"CPU time";
+            valueStream << params.cpuLimit << L"s";
+            break;
+
+        case ProcessResult::cMemoryLimit:
+            limit = L"memory";
+            valueStream << params.memoryLimit << L" bytes";
+            break;
+
+        case ProcessResult::cNoLimit:
+            break;
     }
-    
-    bool result = (system(command.c_str()) == 0);
 
-    if (NeedToChange)
+    if (!limit.empty())
     {
-        if (chdir(buffer) != 0)
-            throw blahtex::Exception(L"CannotChangeDirectory");
+        string program = argv.empty() ? commandLine : argv[0];
+        size_t slash = program.rfind('/');
+        if (slash != string::npos)
+            program.erase(0, slash + 1);
+        throw blahtex::Exception(
+            L"RenderLimitExceeded",
+            wstring(program.begin(), program.end()),
+            limit,
+            valueStream.str()
+        );
     }
 
+    return result.Succeeded();
+}
+
+
+// Runs dvipng on dviFilename (in tempDirectory), writing the images to
+// outputFilename (which may contain "%d" for the page number) at the given
+// resolution. dvipng's report on the image dimensions is stored in report.
+// If page is positive, only that page (counting from 1, whatever its TeX
+// page number) is rendered.
+bool RunDvipng(
+    const string& dviFilename,
+    const string& outputFilename,
+    int dpi,
+    const PngParams& params,
+    string& report,
+    int page = 0
+)
+{
+    ostringstream dpiString;
+    dpiString << dpi;
+
+    vector<string> arguments;
+    arguments.push_back(dviFilename);
+    arguments.push_back("--picky");
+    arguments.push_back("--bg");
+    arguments.push_back("Transparent");
+    arguments.push_back("--gamma");
+    arguments.push_back("1.3");
+    arguments.push_back("-D");
+    arguments.push_back(dpiString.str());
+    arguments.push_back("-q");
+    arguments.push_back("-T");
+    arguments.push_back("tight");
+    arguments.push_back("--height");
+    arguments.push_back("--depth");
+    arguments.push_back("-o");
+    arguments.push_back(outputFilename);
+    if (page > 0)
+    {
+        ostringstream pageString;
+        pageString << "=" << page;
+        arguments.push_back("-p");
+        arguments.push_back(pageString.str());
+        arguments.push_back("-l");
+        arguments.push_back(pageString.str());
+    }
+
+    return Execute(
+        params.shellDvipng, arguments, params.tempDirectory, params, &report
+    );
+}
+
+
+// Parses dvipng's report (its output with "--height --depth"), and
+// returns the height and depth of each page, in page order.
+vector<pair<int, int> > ReadDvipngDimensions(const string& report)
+{
+    vector<pair<int, int> > dimensions;
+
+    // dvipng prints " depth=D height=H" for every page; we don't rely on
+    // the line structure, but just pair up the n-th height with the n-th
+    // depth.
+    vector<int> heights, depths;
+    string::size_type pos = 0;
+    while ((pos = report.find("height=", pos)) != string::npos)
+    {
+        pos += 7;
+        int value = 0;
+        istringstream(report.substr(pos, 20)) >> value;
+        heights.push_back(value);
+    }
+    pos = 0;
+    while ((pos = report.find("depth=", pos)) != string::npos)
+    {
+        pos += 6;
+        int value = 0;
+        istringstream(report.substr(pos, 20)) >> value;
+        depths.push_back(value);
+    }
+
+    for (size_t i = 0; i < heights.size() && i < depths.size(); i++)
+        dimensions.push_back(make_pair(heights[i], depths[i]));
+
+    return dimensions;
+}
+
+
+bool SplitPurifiedTex(
+    const string& purifiedTex,
+    string& preamble,
+    string& body
+)
+{
+    static const string beginDocument = "\\begin{document}\n";
+    static const string endDocument   = "\\end{document}\n";
+
+    string::size_type bodyStart = purifiedTex.find(beginDocument);
+    if (bodyStart == string::npos)
+        return false;
+    bodyStart += beginDocument.size();
+
+    string::size_type bodyEnd = purifiedTex.rfind(endDocument);
+    if (bodyEnd == string::npos || bodyEnd < bodyStart)
+        return false;
+
+    preamble = purifiedTex.substr(0, bodyStart);
+    body = purifiedTex.substr(bodyStart, bodyEnd - bodyStart);
+    return true;
+}
+
+
+// Writes the given contents to a file. Returns false on failure.
+bool WriteFile(const string& filename, const string& contents)
+{
+    ofstream file(filename.c_str(), ios::out | ios::binary);
+    if (!file)
+        return false;
+    file << contents;
+    return file.good();
+}
+
+
+// Turns a directory (with terminating slash) into an absolute path, so
+// that it still makes sense from within tempDirectory.
+string AbsoluteDirectory(const string& directory)
+{
+    if (!directory.empty() && directory[0] == '/')
+        return directory;
+
+    char buffer[5000];
+    if (getcwd(buffer, 5000) == NULL)
+        throw blahtex::Exception(L"CannotChangeDirectory");
+
+    string result = buffer;
+    if (result.empty() || result[result.size() - 1] != '/')
+        result += '/';
+    if (directory != "./")
+        result += directory;
     return result;
 }
 
 
-PngInfo MakePngFile(
-    const wstring& purifiedTex,
-    const string& pngFilename,
+// Returns something that changes when the program run by commandLine is
+// replaced, e.g. by a TeX upgrade: the file it resolves to (through PATH),
+// with its size and modification time. Returns an empty string if the
+// program can't be found.
+string ProgramIdentity(const string& commandLine)
+{
+    vector<string> argv = SplitCommandLine(commandLine);
+    if (argv.empty())
+        return "";
+
+    vector<string> candidates;
+    if (argv[0].find('/') != string::npos)
+        candidates.push_back(argv[0]);
+    else
+    {
+#ifdef _WIN32
+        const char separator = ';';
+#else
+        const char separator = ':';
+#endif
+        const char* path = getenv("PATH");
+        string directories = path ? path : "";
+        string::size_type start = 0;
+        while (start <= directories.size())
+        {
+            string::size_type end = directories.find(separator, start);
+            if (end == string::npos)
+                end = directories.size();
+            string directory = directories.substr(start, end - start);
+            candidates.push_back(
+                (directory.empty() ? "." : directory) + "/" + argv[0]
+            );
+            start = end + 1;
+        }
+    }
+
+    for (size_t k = 0; k < candidates.size(); k++)
+    {
+        struct stat status;
+        if (stat(candidates[k].c_str(), &status) == 0
+            && S_ISREG(status.st_mode)
+        )
+        {
+            ostringstream identity;
+            identity << candidates[k] << " " << status.st_size << " "
+                << status.st_mtime;
+            return identity.str();
+        }
+    }
+    return "";
+}
+
+
+// A format that could not be built is not tried again for this long (in
+// seconds), so that a failure that was only transient doesn't disable it
+// for good.
+static const time_t cFailedFormatRetryDelay = 600;
+
+// Whether the ".failed" marker of a format is there and recent enough to
+// be heeded.
+bool FormatRecentlyFailed(const string& markerFilename)
+{
+    struct stat status;
+    return stat(markerFilename.c_str(), &status) == 0
+        && time(NULL) - status.st_mtime < cFailedFormatRetryDelay;
+}
+
+
+// Returns the path (without the ".fmt" extension) of a LaTeX format file
+// which has the given preamble already loaded, dumping it into
+// params.formatDirectory the first time a preamble is seen. The file is
+// named after the md5 of the preamble, of the latex command and of the
+// identity of the latex program, so any change to the packages, to
+// --png-latex-preamble or to the TeX installation gets a fresh format.
+// Returns an empty string if no format is available; callers should then
+// just run latex on the complete file.
+string GetLatexFormat(const string& preamble, const PngParams& params)
+{
+    static const string beginDocument = "\\begin{document}\n";
+
+    string directory = AbsoluteDirectory(params.formatDirectory);
+    string formatName = "blahtex-" + ComputeMd5(
+        params.shellLatex + "\n" + ProgramIdentity(params.shellLatex) + "\n"
+        + preamble
+    );
+
+    if (FileExists(directory + formatName + ".fmt"))
+        return directory + formatName;
+
+    // If dumping this preamble failed lately, don't keep trying.
+    string failedMarker = directory + formatName + ".failed";
+    if (FormatRecentlyFailed(failedMarker))
+        return "";
+
+    // Only one renderer builds a given format; the others wait for it.
+    RenderLock lock(directory + formatName + ".lock");
+    if (FileExists(directory + formatName + ".fmt"))
+        return directory + formatName;
+    if (FormatRecentlyFailed(failedMarker))
+        return "";
+
+    // The format is built under a name unique to this attempt, and then
+    // renamed into place, so that concurrent blahtex processes (or render
+    // threads) never see a half-written format file.
+    ostringstream jobNameStream;
+    jobNameStream << formatName << "-" << UniqueSuffix();
+    string jobName = jobNameStream.str();
+
+    TemporaryFile texTemp(directory + jobName + ".tex", params.deleteTempFiles);
+    TemporaryFile logTemp(directory + jobName + ".log", params.deleteTempFiles);
+    TemporaryFile fmtTemp(directory + jobName + ".fmt");
+
+    string formatTex = preamble;
+    if (formatTex.size() >= beginDocument.size())
+        formatTex.erase(formatTex.size() - beginDocument.size());
+    formatTex += "\\dump\n";
+
+    vector<string> formatArguments;
+    formatArguments.push_back("-ini");
+    formatArguments.push_back("-jobname=" + jobName);
+    formatArguments.push_back("&latex");
+    formatArguments.push_back(jobName + ".tex");
+
+    // Going over a limit while dumping only means that this render goes
+    // without the format.
+    bool dumped = false;
+    try
+    {
+        dumped = WriteFile(directory + jobName + ".tex", formatTex)
+            && Execute(params.shellLatex, formatArguments, directory, params)
+            && FileExists(directory + jobName + ".fmt")
+            && rename(
+                (directory + jobName + ".fmt").c_str(),
+                (directory + formatName + ".fmt").c_str()
+            ) == 0;
+    }
+    catch (blahtex::Exception& e)
+    {
+    }
+
+    if (!dumped)
+    {
+        WriteFile(failedMarker, "");
+        return "";
+    }
+    unlink(failedMarker.c_str());
+    return directory + formatName;
+}
+
+
+// Whether latex loaded the given format (a path without ".fmt") in the run
+// that wrote logFilename. The first line of the log names the format (by
+// the job name it was dumped under, which starts with the format's name);
+// if the format can't be loaded at all, there is no log.
+bool LatexFormatWasLoaded(const string& logFilename, const string& formatFile)
+{
+    ifstream log(logFilename.c_str());
+    string firstLine;
+    if (!getline(log, firstLine))
+        return false;
+    string formatName = formatFile.substr(formatFile.rfind('/') + 1);
+    return firstLine.find("format=" + formatName) != string::npos;
+}
+
+
+// Runs latex on the given purified TeX file, producing baseName.dvi in
+// tempDirectory (via baseName.tex). If params.formatDirectory is set, the
+// preamble is loaded from a precompiled format instead of being processed
+// again.
+void RunLatex(
+    const string& purifiedTexUtf8,
+    const string& baseName,
     const PngParams& params
 )
 {
-    PngInfo info;
-    
-    string purifiedTexUtf8 = gUnicodeConverter.ConvertOut(purifiedTex);
-    
-    // This md5 is used for the temp filenames.
-    string md5 = ComputeMd5(purifiedTexUtf8);
+    string texFilename = params.tempDirectory + baseName + ".tex";
+    string dviFilename = params.tempDirectory + baseName + ".dvi";
 
-    string pngActualFilename =
-        pngFilename.empty() ? (md5 + ".png") : pngFilename;
+    string formatFile, preamble, body;
+    if (!params.formatDirectory.empty()
+        && SplitPurifiedTex(purifiedTexUtf8, preamble, body)
+    )
+        formatFile = GetLatexFormat(preamble, params);
+
+    if (!formatFile.empty())
+    {
+        if (!WriteFile(
+            texFilename,
+            "\\nonstopmode\n\\begin{document}\n" + body + "\\end{document}\n"
+        ))
+            throw blahtex::Exception(L"CannotWriteTexFile");
+
+        vector<string> arguments;
+        arguments.push_back("-fmt=" + formatFile);
+        arguments.push_back(baseName + ".tex");
+
+        // A log left by an earlier run would tell nothing about this one.
+        string logFilename = params.tempDirectory + baseName + ".log";
+        unlink(logFilename.c_str());
+
+        if (Execute(params.shellLatex, arguments, params.tempDirectory, params)
+            &&
+            FileExists(dviFilename)
+        )
+            return;
+
+        // With the format loaded, it's the formula that latex choked on,
+        // and the complete file would fail the same way.
+        if (LatexFormatWasLoaded(logFilename, formatFile))
+            throw blahtex::Exception(L"CannotRunLatex");
+
+        // The format is unusable (e.g. it was dumped by another version of
+        // TeX): remove it, so that the next render builds it again, and
+        // typeset the complete file.
+        unlink((formatFile + ".fmt").c_str());
+    }
 
     // Send output to tex file.
     {
-        ofstream texFile(
-            (params.tempDirectory + md5 + ".tex").c_str(),
-            ios::out | ios::binary
-        );
+        ofstream texFile(texFilename.c_str(), ios::out | ios::binary);
         if (!texFile)
             throw blahtex::Exception(
                 L"CannotCreateTexFile"
@@ -139,72 +624,676 @@ PngInfo MakePngFile(
             );
     }
 
-    // These are temporary files we want deleted when we're done.
-    TemporaryFile  texTemp(params.tempDirectory + md5 + ".tex",  params.deleteTempFiles);
-    TemporaryFile  auxTemp(params.tempDirectory + md5 + ".aux",  params.deleteTempFiles);
-    TemporaryFile  logTemp(params.tempDirectory + md5 + ".log",  params.deleteTempFiles);
-    TemporaryFile  dviTemp(params.tempDirectory + md5 + ".dvi",  params.deleteTempFiles);
-    TemporaryFile dataTemp(params.tempDirectory + md5 + ".data", params.deleteTempFiles);
-
-
     if (!Execute(
-            params.shellLatex + " " + md5 + ".tex >/dev/null 2>/dev/null",
-            params.tempDirectory
+            params.shellLatex,
+            vector<string>(1, baseName + ".tex"),
+            params.tempDirectory,
+            params
         )
         ||
-        !FileExists(params.tempDirectory + md5 + ".dvi")
+        !FileExists(dviFilename)
     )
         throw blahtex::Exception(L"CannotRunLatex");
+}
 
 
-    if (!Execute(
-            params.shellDvipng + " " + md5 + ".dvi " +
-                "--picky --bg Transparent --gamma 1.3 -D 120 -q -T tight " +
-                "--height --depth " +
-                "-o \"" + pngActualFilename +
-                "\" > " + md5 + ".data 2>/dev/null", 
-            params.tempDirectory
+// Returns the part of a file name that marks the given scale: "" for 1,
+// "@2x" for 2, etc.
+string ScaleSuffix(int scale)
+{
+    if (scale == 1)
+        return "";
+    ostringstream suffix;
+    suffix << "@" << scale << "x";
+    return suffix.str();
+}
+
+
+// Returns the name of the image at the given scale, given the name of the
+// image at scale 1, e.g. "X@2x.png" for "X.png".
+string ScaledFilename(const string& filename, int scale)
+{
+    string::size_type dot = filename.rfind('.');
+    if (dot == string::npos || filename.find('/', dot) != string::npos)
+        return filename + ScaleSuffix(scale);
+    return filename.substr(0, dot) + ScaleSuffix(scale) + filename.substr(dot);
+}
+
+
+string StoreDirectory(
+    const string& md5,
+    const PngParams& params,
+    bool create
+)
+{
+    string directory = params.pngDirectory;
+    for (int level = 0; level < params.shardLevels; level++)
+    {
+        directory += md5.substr(2 * level, 2) + "/";
+        if (create)
+        {
+#ifdef _WIN32
+            mkdir(directory.c_str());
+#else
+            mkdir(directory.c_str(), 0755);
+#endif
+        }
+    }
+    return directory;
+}
+
+
+// The render cache: an image made from purified TeX with md5 X is stored
+// in its store directory as X.png, and the dimensions dvipng reported when
+// making it are stored next to it in X.dim, as "height depth" (or "-" if
+// dvipng didn't report any), followed by "dpi N" for the resolution they
+// were made at. The copies at other scales (X@2x.png etc) get a line each,
+// "@2x height depth" (or "@2x -"). X.dim is written after the images, so
+// its presence marks a complete entry.
+
+// Looks for a complete cache entry for the given md5; if there is one,
+// fills in info and returns true.
+bool LookupRenderCache(
+    const string& md5,
+    const PngParams& params,
+    PngInfo& info
+)
+{
+    if (!params.useCache)
+        return false;
+
+    string directory = StoreDirectory(md5, params, false);
+    ifstream dimFile(
+        (directory + md5 + ".dim").c_str(),
+        ios::in | ios::binary
+    );
+    if (!dimFile || !FileExists(directory + md5 + ".png"))
+        return false;
+
+    info = PngInfo();
+    string line;
+    int height, depth;
+    if (getline(dimFile, line) && istringstream(line) >> height >> depth)
+    {
+        info.mDimensionsValid = true;
+        info.mHeight = height;
+        info.mDepth  = depth;
+    }
+
+    map<string, string> otherLines;
+    while (getline(dimFile, line))
+        otherLines[line.substr(0, line.find(' '))] = line;
+
+    // An image made at another resolution is no use.
+    map<string, string>::const_iterator dpiLine = otherLines.find("dpi");
+    string name;
+    int dpi;
+    if (dpiLine == otherLines.end()
+        || !(istringstream(dpiLine->second) >> name >> dpi)
+        || dpi != params.dpi
+    )
+        return false;
+
+    // Every requested scale must be there too.
+    for (size_t i = 0; i < params.scales.size(); i++)
+    {
+        PngScaledImage image;
+        image.mScale = params.scales[i];
+        image.fullFileName =
+            directory + md5 + ScaleSuffix(image.mScale) + ".png";
+
+        map<string, string>::const_iterator
+            scaledLine = otherLines.find(ScaleSuffix(image.mScale));
+        if (scaledLine == otherLines.end()
+            || !FileExists(image.fullFileName)
+        )
+            return false;
+
+        if (istringstream(scaledLine->second) >> name >> height >> depth)
+        {
+            image.mDimensionsValid = true;
+            image.mHeight = height;
+            image.mDepth  = depth;
+        }
+        info.mScaledImages.push_back(image);
+    }
+
+    info.fullFileName = PngFullFileName(md5, params);
+    info.mMd5 = md5;
+    info.mCacheHit = true;
+
+    RecordPngAccess(md5, params);
+    return true;
+}
+
+
+// Records the dimensions of a freshly rendered md5.png. Failing to do so
+// is not an error; the image just won't be reused.
+void WriteRenderCacheEntry(const PngInfo& info, const PngParams& params)
+{
+    if (!params.useCache)
+        return;
+
+    ostringstream contents;
+    if (info.mDimensionsValid)
+        contents << info.mHeight << " " << info.mDepth << "\n";
+    else
+        contents << "-\n";
+    contents << "dpi " << params.dpi << "\n";
+
+    for (size_t i = 0; i < info.mScaledImages.size(); i++)
+    {
+        const PngScaledImage& image = info.mScaledImages[i];
+        contents << ScaleSuffix(image.mScale) << " ";
+        if (image.mDimensionsValid)
+            contents << image.mHeight << " " << image.mDepth << "\n";
+        else
+            contents << "-\n";
+    }
+
+    // Write it in tempDirectory first, so that nobody can read a partial
+    // file from pngDirectory.
+    string tempFilename = params.tempDirectory + info.mMd5 + ".dim";
+    if (WriteFile(tempFilename, contents.str())
+        && PublishFile(
+            tempFilename,
+            StoreDirectory(info.mMd5, params, true) + info.mMd5 + ".dim"
+        )
+    )
+        return;
+
+    unlink(tempFilename.c_str());
+}
+
+
+string PngFullFileName(const string& md5, const PngParams& params)
+{
+    return StoreDirectory(md5, params, false) + md5 + ".png";
+}
+
+
+// Returns true if filename belongs to a render cache entry, i.e. starts
+// with an md5 followed by a dot (or "@" for the scaled images).
+bool IsStoreFilename(const string& filename)
+{
+    if (filename.size() < 33 || (filename[32] != '.' && filename[32] != '@'))
+        return false;
+    for (int i = 0; i < 32; i++)
+        if (!isxdigit(filename[i]))
+            return false;
+    return true;
+}
+
+
+int ShardPngDirectory(const PngParams& params)
+{
+    DIR* dir = opendir(params.pngDirectory.c_str());
+    if (!dir)
+        return -1;
+
+    // The .dim files are moved last, since their presence marks complete
+    // cache entries.
+    vector<string> filenames, dimFilenames;
+    while (struct dirent* entry = readdir(dir))
+    {
+        string filename = entry->d_name;
+        if (!IsStoreFilename(filename))
+            continue;
+        if (filename.size() > 4
+            && filename.substr(filename.size() - 4) == ".dim"
+        )
+            dimFilenames.push_back(filename);
+        else
+            filenames.push_back(filename);
+    }
+    closedir(dir);
+    filenames.insert(filenames.end(), dimFilenames.begin(), dimFilenames.end());
+
+    int moved = 0;
+    for (size_t i = 0; i < filenames.size(); i++)
+    {
+        string directory = StoreDirectory(filenames[i], params, true);
+        if (directory != params.pngDirectory
+            && rename(
+                (params.pngDirectory + filenames[i]).c_str(),
+                (directory + filenames[i]).c_str()
+            ) == 0
+        )
+            moved++;
+    }
+    return moved;
+}
+
+
+const string& LockDirectory(const PngParams& params)
+{
+    return params.lockDirectory.empty()
+        ? params.tempDirectory : params.lockDirectory;
+}
+
+
+// Runs dvipng on the given page of dviFilename (or its only page, if page
+// is 0) at each resolution, and moves the images into pngDirectory, as
+// pngActualFilename and its scaled variants. Fills in the dimensions and
+// mScaledImages of info.
+void RunDvipngForImage(
+    const string& dviFilename,
+    int page,
+    const string& pngActualFilename,
+    const string& pngDirectory,
+    const PngParams& params,
+    PngInfo& info
+)
+{
+    // The higher resolution copies come first, so that md5.png (and then
+    // md5.dim) only appear once everything is in place.
+    for (size_t i = 0; i < params.scales.size(); i++)
+    {
+        PngScaledImage image;
+        image.mScale = params.scales[i];
+        string scaledFilename = ScaledFilename(pngActualFilename, image.mScale);
+
+        string dvipngReport;
+        if (!RunDvipng(
+                dviFilename, scaledFilename,
+                params.dpi * image.mScale, params, dvipngReport, page
+            )
+            ||
+            !FileExists(params.tempDirectory + scaledFilename)
+        )
+            throw blahtex::Exception(L"CannotRunDvipng");
+
+        if (!PublishFile(
+            params.tempDirectory + scaledFilename,
+            pngDirectory + scaledFilename
+        ))
+            throw blahtex::Exception(L"CannotWritePngDirectory");
+
+        vector<pair<int, int> > dimensions =
+            ReadDvipngDimensions(dvipngReport);
+        if (!dimensions.empty())
+        {
+            image.mDimensionsValid = true;
+            image.mHeight = dimensions.back().first;
+            image.mDepth  = dimensions.back().second;
+        }
+        image.fullFileName = pngDirectory + scaledFilename;
+        info.mScaledImages.push_back(image);
+    }
+
+    string dvipngReport;
+    if (!RunDvipng(
+            dviFilename, pngActualFilename, params.dpi,
+            params, dvipngReport, page
         )
         ||
         !FileExists(params.tempDirectory + pngActualFilename)
     )
         throw blahtex::Exception(L"CannotRunDvipng");
-        
-    if (rename(
-        (params.tempDirectory + pngActualFilename).c_str(),
-        (params.pngDirectory + pngActualFilename).c_str()
+
+    if (!PublishFile(
+        params.tempDirectory + pngActualFilename,
+        pngDirectory + pngActualFilename
     ))
         throw blahtex::Exception(L"CannotWritePngDirectory");
 
 
     // Read the height and depth of the image from dvipng's output.
+    vector<pair<int, int> > dimensions = ReadDvipngDimensions(dvipngReport);
+    if (!dimensions.empty())
     {
-        ifstream dataFile(
-            (params.tempDirectory + md5 + ".data").c_str(),
-            ios::in | ios::binary
+        info.mDimensionsValid = true;
+        info.mHeight = dimensions.back().first;
+        info.mDepth  = dimensions.back().second;
+    }
+}
+
+
+string ImageKeyMd5(const wstring& imageKey)
+{
+    return ComputeMd5(gUnicodeConverter.ConvertOut(imageKey));
+}
+
+
+PngInfo MakePngFile(
+    const wstring& purifiedTex,
+    const string& pngFilename,
+    const PngParams& params,
+    const string& key
+)
+{
+    return MakePngFileUtf8(
+        gUnicodeConverter.ConvertOut(purifiedTex), pngFilename, params, key
+    );
+}
+
+
+PngInfo MakePngFileUtf8(
+    const string& purifiedTexUtf8,
+    const string& pngFilename,
+    const PngParams& params,
+    const string& key,
+    LatexEngine* engine
+)
+{
+    PngInfo info;
+
+    // This md5 is used for the temp filenames.
+    string md5 = key.empty() ? ComputeMd5(purifiedTexUtf8) : key;
+
+    if (pngFilename.empty() && LookupRenderCache(md5, params, info))
+        return info;
+
+    // Only one process at a time may use the temporary files for this md5.
+    // If somebody else was rendering the same image, it's probably there
+    // by the time we get the lock.
+    RenderLock lock(LockDirectory(params) + md5 + ".lock");
+    if (pngFilename.empty() && LookupRenderCache(md5, params, info))
+        return info;
+
+    string pngActualFilename =
+        pngFilename.empty() ? (md5 + ".png") : pngFilename;
+
+    // In a private workspace, the temporary files are just overwritten by
+    // the next render. Only the .dvi and .png files are removed beforehand,
+    // since their presence is what tells us that latex and dvipng worked.
+    bool reuseTempFiles = params.reuseTempFiles && params.deleteTempFiles;
+    bool deleteTempFiles = params.deleteTempFiles && !reuseTempFiles;
+    string baseName = reuseTempFiles ? "formula" : md5;
+    if (reuseTempFiles)
+    {
+        unlink((params.tempDirectory + baseName + ".dvi").c_str());
+        unlink((params.tempDirectory + pngActualFilename).c_str());
+        for (size_t i = 0; i < params.scales.size(); i++)
+            unlink((params.tempDirectory +
+                ScaledFilename(pngActualFilename, params.scales[i])).c_str());
+    }
+
+    // These are temporary files we want deleted when we're done.
+    TemporaryFile texTemp(params.tempDirectory + baseName + ".tex", deleteTempFiles);
+    TemporaryFile auxTemp(params.tempDirectory + baseName + ".aux", deleteTempFiles);
+    TemporaryFile logTemp(params.tempDirectory + baseName + ".log", deleteTempFiles);
+    TemporaryFile dviTemp(params.tempDirectory + baseName + ".dvi", deleteTempFiles);
+
+    // Images named after their md5 go to their store directory; explicitly
+    // named ones directly into pngDirectory.
+    string pngDirectory = pngFilename.empty()
+        ? StoreDirectory(md5, params, true) : params.pngDirectory;
+
+    bool rendered = false;
+    int page;
+    if (engine && engine->Typeset(purifiedTexUtf8, page))
+    {
+        try
+        {
+            RunDvipngForImage(
+                engine->GetDviFilename(), page, pngActualFilename,
+                pngDirectory, params, info
+            );
+            rendered = true;
+        }
+        catch (blahtex::Exception& e)
+        {
+            // Try again the usual way, in case it is the engine's DVI file
+            // that dvipng didn't like.
+            engine->Stop();
+            info.mScaledImages.clear();
+        }
+    }
+
+    if (!rendered)
+    {
+        RunLatex(purifiedTexUtf8, baseName, params);
+        RunDvipngForImage(
+            baseName + ".dvi", 0, pngActualFilename, pngDirectory, params, info
         );
-        
-        if (dataFile)
+    }
+
+    info.fullFileName = pngDirectory + pngActualFilename;
+    info.mMd5 = md5;
+
+    if (pngFilename.empty())
+    {
+        WriteRenderCacheEntry(info, params);
+        RecordPngRender(info, params);
+    }
+
+    return info;
+}
+
+
+// Renders a single item of a batch on its own, recording any error in the
+// item rather than throwing it.
+void MakePngFileForItem(PngBatchItem& item, const PngParams& params)
+{
+    try
+    {
+        item.mInfo = MakePngFileUtf8(
+            item.mPurifiedTexUtf8, "", params, item.mMd5
+        );
+    }
+    catch (...)
+    {
+        item.mError = current_exception();
+    }
+}
+
+
+// Runs dvipng at the given scale on the .dvi file of a batch, which should
+// have exactly count pages. Fills in the names of the page images (which
+// are added to pageTemps, to be deleted at the end) and their dimensions.
+// Returns false if dvipng failed or the number of pages is wrong, i.e. if
+// some formula didn't typeset as a single page, in which case we can't tell
+// which page belongs to which formula.
+bool RunDvipngOnBatch(
+    const string& batchName,
+    int scale,
+    size_t count,
+    const PngParams& params,
+    vector<string>& pageFilenames,
+    vector<pair<int, int> >& dimensions,
+    vector<unique_ptr<TemporaryFile> >& pageTemps
+)
+{
+    // dvipng writes page k to batchName-k.png (pages are numbered from 1).
+    string prefix = batchName + ScaleSuffix(scale) + "-";
+    for (size_t k = 0; k <= count; k++)
+    {
+        ostringstream pageFilename;
+        pageFilename << prefix << (k + 1) << ".png";
+        pageFilenames.push_back(pageFilename.str());
+        pageTemps.push_back(unique_ptr<TemporaryFile>(
+            new TemporaryFile(params.tempDirectory + pageFilename.str())
+        ));
+    }
+
+    string dvipngReport;
+    if (!RunDvipng(
+        batchName + ".dvi", prefix + "%d.png", params.dpi * scale,
+        params, dvipngReport
+    ))
+        return false;
+
+    for (size_t k = 0; k < count; k++)
+        if (!FileExists(params.tempDirectory + pageFilenames[k]))
+            return false;
+    if (FileExists(params.tempDirectory + pageFilenames.back()))
+        return false;
+
+    dimensions = ReadDvipngDimensions(dvipngReport);
+    return dimensions.empty() || dimensions.size() == count;
+}
+
+
+// Typesets the given items (which must all have the given preamble) in a
+// single latex/dvipng run. Returns false if the batch as a whole failed,
+// in which case the caller should fall back on rendering the items one by
+// one; nothing has been written to pngDirectory in that case.
+bool MakePngFilesTogether(
+    vector<PngBatchItem>& items,
+    const vector<size_t>& indices,
+    const string& preamble,
+    const vector<string>& bodies,
+    const PngParams& params
+)
+{
+    // With the preview package, each preview environment gets its own page
+    // anyway; otherwise we need to force page breaks ourselves.
+    bool usesPreview = (preamble.find("{preview}") != string::npos);
+
+    string batchTex = preamble;
+    string allMd5s;
+    for (size_t k = 0; k < indices.size(); k++)
+    {
+        if (k > 0 && !usesPreview)
+            batchTex += "\\clearpage\n";
+        batchTex += bodies[indices[k]];
+        allMd5s += items[indices[k]].mMd5;
+    }
+    batchTex += "\\end{document}\n";
+
+    string batchName = "batch-" + ComputeMd5(allMd5s);
+
+    TemporaryFile texTemp(params.tempDirectory + batchName + ".tex", params.deleteTempFiles);
+    TemporaryFile auxTemp(params.tempDirectory + batchName + ".aux", params.deleteTempFiles);
+    TemporaryFile logTemp(params.tempDirectory + batchName + ".log", params.deleteTempFiles);
+    TemporaryFile dviTemp(params.tempDirectory + batchName + ".dvi", params.deleteTempFiles);
+
+    // Scale 1 comes last, so that md5.png (and then md5.dim) only appear
+    // once everything is in place.
+    vector<int> scales = params.scales;
+    scales.push_back(1);
+
+    vector<vector<string> > pageFilenames(scales.size());
+    vector<vector<pair<int, int> > > dimensions(scales.size());
+    vector<unique_ptr<TemporaryFile> > pageTemps;
+
+    try
+    {
+        RunLatex(batchTex, batchName, params);
+
+        for (size_t r = 0; r < scales.size(); r++)
+            if (!RunDvipngOnBatch(
+                batchName, scales[r], indices.size(), params,
+                pageFilenames[r], dimensions[r], pageTemps
+            ))
+                return false;
+    }
+    catch (blahtex::Exception& e)
+    {
+        return false;
+    }
+
+    for (size_t k = 0; k < indices.size(); k++)
+    {
+        PngBatchItem& item = items[indices[k]];
+        string directory = StoreDirectory(item.mMd5, params, true);
+        item.mInfo = PngInfo();
+
+        bool published = true;
+        for (size_t r = 0; published && r < scales.size(); r++)
         {
-            string line, temp;
-            while (getline(dataFile, line))
+            PngScaledImage image;
+            image.mScale = scales[r];
+            image.fullFileName =
+                directory + item.mMd5 + ScaleSuffix(scales[r]) + ".png";
+            if (!dimensions[r].empty())
+            {
+                image.mDimensionsValid = true;
+                image.mHeight = dimensions[r][k].first;
+                image.mDepth  = dimensions[r][k].second;
+            }
+
+            if (!PublishFile(
+                params.tempDirectory + pageFilenames[r][k],
+                image.fullFileName
+            ))
+                published = false;
+            else if (image.mScale != 1)
+                item.mInfo.mScaledImages.push_back(image);
+            else
             {
-                string::size_type heightPos = line.find("height=");
-                string::size_type depthPos = line.find("depth=");
-                if (heightPos != string::npos && depthPos != string::npos)
-                {
-                    info.mDimensionsValid = true;
-                    temp = line.substr(heightPos + 7, 1000);
-                    istringstream(temp) >> info.mHeight;
-                    string temp = line.substr(depthPos + 6, 1000);
-                    istringstream(temp) >> info.mDepth;
-                }
+                item.mInfo.fullFileName = image.fullFileName;
+                item.mInfo.mDimensionsValid = image.mDimensionsValid;
+                item.mInfo.mHeight = image.mHeight;
+                item.mInfo.mDepth  = image.mDepth;
             }
         }
+        if (!published)
+        {
+            item.mError = make_exception_ptr(
+                blahtex::Exception(L"CannotWritePngDirectory")
+            );
+            continue;
+        }
+
+        item.mInfo.mMd5 = item.mMd5;
+        WriteRenderCacheEntry(item.mInfo, params);
+        RecordPngRender(item.mInfo, params);
+    }
+
+    return true;
+}
+
+
+void MakePngFiles(
+    vector<PngBatchItem>& items,
+    const PngParams& params
+)
+{
+    vector<string> bodies(items.size());
+
+    // Group the formulas by preamble; formulas with the same preamble can
+    // be typeset in the same latex run.
+    map<string, vector<size_t> > groups;
+    for (size_t i = 0; i < items.size(); i++)
+    {
+        if (LookupRenderCache(items[i].mMd5, params, items[i].mInfo))
+            continue;
+
+        string preamble;
+        if (SplitPurifiedTex(items[i].mPurifiedTexUtf8, preamble, bodies[i]))
+            groups[preamble].push_back(i);
+        else
+            MakePngFileForItem(items[i], params);
+    }
+
+    for (map<string, vector<size_t> >::const_iterator
+        group = groups.begin(); group != groups.end(); ++group
+    )
+    {
+        // Formulas that somebody else is rendering right now are left out
+        // of the batch; MakePngFile will wait for them below. (Not waiting
+        // here also means we can't deadlock with another batch.)
+        vector<size_t> indices, leftOut;
+        vector<unique_ptr<RenderLock> > locks;
+        for (size_t k = 0; k < group->second.size(); k++)
+        {
+            size_t i = group->second[k];
+            unique_ptr<RenderLock> lock(new RenderLock(
+                LockDirectory(params) + items[i].mMd5 + ".lock", false
+            ));
+            if (lock->IsBusy())
+                leftOut.push_back(i);
+            else if (!LookupRenderCache(items[i].mMd5, params, items[i].mInfo))
+            {
+                locks.push_back(move(lock));
+                indices.push_back(i);
+            }
+        }
+
+        bool batchSucceeded = (indices.size() > 1 && MakePngFilesTogether(
+            items, indices, group->first, bodies, params
+        ));
+        locks.clear();
+
+        // Either there is at most one formula, or the batch failed: isolate
+        // the formulas by rendering each of them on its own.
+        if (!batchSucceeded)
+            leftOut.insert(leftOut.end(), indices.begin(), indices.end());
+        for (size_t k = 0; k < leftOut.size(); k++)
+            MakePngFileForItem(items[leftOut[k]], params);
     }
-    info.fullFileName = params.pngDirectory + pngActualFilename;
-    info.mMd5 = md5;
-    return info;
 }
 
 // end of file @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
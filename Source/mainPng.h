@@ -19,7 +19,29 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 #ifndef BLAHTEX_MAINPNG_H
 #define BLAHTEX_MAINPNG_H
 
+#include <exception>
 #include <string>
+#include <vector>
+#include "BlahtexCore/Misc.h"
+
+// Records an additional, higher resolution copy of an image (see
+// PngParams::scales).
+struct PngScaledImage
+{
+    // The image was rendered at mScale times PngParams::dpi, and is
+    // stored in md5@<mScale>x.png.
+    int mScale;
+    std::string fullFileName;
+
+    bool mDimensionsValid;
+    int mHeight;
+    int mDepth;
+
+    PngScaledImage() :
+        mScale(1),
+        mDimensionsValid(false)
+    { }
+};
 
 // Records information about a PNG file generated by MakePngFile.
 struct PngInfo
@@ -33,9 +55,17 @@ struct PngInfo
     bool mDimensionsValid;
     int mHeight;
     int mDepth;
+
+    // Set if the PNG was already in pngDirectory, so that latex and dvipng
+    // didn't need to run.
+    bool mCacheHit;
+
+    // One entry for each of PngParams::scales, in the same order.
+    std::vector<PngScaledImage> mScaledImages;
     
     PngInfo() :
-        mDimensionsValid(false)
+        mDimensionsValid(false),
+        mCacheHit(false)
     { }
 };
 
@@ -46,20 +76,220 @@ struct PngParams
     std::string shellLatex;
     std::string shellDvipng;
     bool deleteTempFiles;
+
+    // If not empty, LaTeX format files with the preamble of the purified
+    // TeX already loaded are dumped into (and reused from) this directory,
+    // with a terminating slash. See "--png-format-directory".
+    std::string formatDirectory;
+
+    // If set, MakePngFile first looks in pngDirectory for an image made
+    // from the same purified TeX (i.e. with the same md5), and returns it
+    // without running latex or dvipng. The height and depth reported by
+    // dvipng are kept next to each image in a small "md5.dim" file.
+    bool useCache;
+
+    // Directory for the ".lock" files that keep two renderers from working
+    // on the same md5 at once, with a terminating slash. If empty,
+    // tempDirectory is used.
+    std::string lockDirectory;
+
+    // If not empty, each PngRenderPool worker keeps its temporary files in
+    // a private directory under this one (preferably RAM-backed, such as
+    // /dev/shm), with a terminating slash. See "--png-workspace".
+    std::string workspaceDirectory;
+
+    // Set by PngRenderPool for its private directories: the temporary
+    // files get the same names for every render, are overwritten by the
+    // next one rather than deleted, and are removed by the pool at the
+    // end. Ignored if deleteTempFiles is false, so that the files of each
+    // formula can still be inspected.
+    bool reuseTempFiles;
+
+    // Number of directory levels used to spread the images over
+    // subdirectories of pngDirectory, named after successive pairs of hex
+    // digits of the md5; e.g. with 2 levels, X.png is stored as
+    // pngDirectory/ab/cd/X.png if X starts with "abcd". 0 means that all
+    // images go directly into pngDirectory. See "--png-shard-levels".
+    int shardLevels;
+
+    // Resolution passed to dvipng, in dots per inch. See "--png-dpi".
+    int dpi;
+
+    // Additional resolutions, as multiples (at least 2) of dpi. The image
+    // at scale N is stored next to X.png as X@Nx.png; they are all made
+    // from the same latex run. See "--png-resolutions".
+    std::vector<int> scales;
+
+    // If positive, the images in pngDirectory are tracked in an index, and
+    // the least recently used ones are deleted to keep them under this
+    // many bytes (see PngStore.h and "--png-store-budget").
+    long long storeBudget;
+
+    // Limits on each latex and dvipng run: wall-clock time and CPU time in
+    // seconds, and address space in bytes; 0 means no limit. A run stopped
+    // by one of them fails with a RenderLimitExceeded error. See
+    // "--png-timeout", "--png-cpu-limit" and "--png-memory-limit".
+    double timeout;
+    int cpuLimit;
+    long long memoryLimit;
+
+    // If set, each PngRenderPool worker keeps a latex process running and
+    // feeds it one formula after the other (see LatexEngine.h and
+    // "--png-persistent-latex").
+    bool persistentLatex;
+
+    // Most formulas that a PngRenderPool worker typesets in one latex run,
+    // when several are queued (see MakePngFiles and "--png-batch-size").
+    // 1 renders every formula on its own.
+    int batchSize;
+
+    PngParams() :
+        deleteTempFiles(true),
+        useCache(true),
+        reuseTempFiles(false),
+        shardLevels(0),
+        dpi(120),
+        storeBudget(0),
+        timeout(0),
+        cpuLimit(0),
+        memoryLimit(0),
+        persistentLatex(false),
+        batchSize(16)
+    { }
 };
 
 // Generates a PNG file. Uses tempDirectory for storage of temporary files
-// (.tex, .dvi, .log, .data). Expects tempDirectory and pngDirectory to
+// (.tex, .dvi, .log, .aux). Expects tempDirectory and pngDirectory to
 // include a terminating slash. The output file will be stored in the
 // directory pngDirectory in the file pngFilename; if pngFilename is an
 // empty string, MakePngFile will just use the md5 that it computes (which
-// gets returned in PngInfo).
+// gets returned in PngInfo); only in that case can an image already present
+// in pngDirectory be reused (see PngParams::useCache).
+//
+// If key is not empty, it is used instead of the md5 of the purified TeX,
+// e.g. the md5 of Interface::GetImageKey (see "--canonical-key"). It
+// must be a 32 digit lowercase hex string, like an md5.
 extern PngInfo MakePngFile(
     const std::wstring& purifiedTex,
     const std::string& pngFilename,
+    const PngParams& params,
+    const std::string& key = ""
+);
+
+// Returns the md5 of an image key (see Interface::GetImageKey), which is
+// what names the image with "--canonical-key".
+extern std::string ImageKeyMd5(const std::wstring& imageKey);
+
+// Returns the name of the file in which MakePngFile stores the image with
+// the given md5, when called with an empty pngFilename. It is known before
+// the image is rendered.
+extern std::string PngFullFileName(
+    const std::string& md5,
+    const PngParams& params
+);
+
+// Returns the directory of pngDirectory in which the image with the given
+// md5 is stored (see PngParams::shardLevels), with a terminating slash. If
+// create is set, missing subdirectories are created.
+extern std::string StoreDirectory(
+    const std::string& md5,
+    const PngParams& params,
+    bool create
+);
+
+// Returns the directory holding the ".lock" files (see
+// PngParams::lockDirectory).
+extern const std::string& LockDirectory(const PngParams& params);
+
+// RenderLock holds an exclusive advisory lock on a lock file for as long as
+// it is in scope. MakePngFile uses one per md5, so that when several
+// processes want the same image at the same time, one renders it while
+// the others wait and then find it in the render cache; eviction (see
+// PngStore.h) only removes images whose lock it can get without waiting.
+// The lock file is removed again by whoever holds the lock when it gets
+// released.
+class RenderLock
+{
+    std::string mFilename;
+    int mFd;
+    bool mBusy;
+
+    RenderLock(const RenderLock&);
+    RenderLock& operator=(const RenderLock&);
+
+public:
+    // If wait is false and somebody else holds the lock, returns at once
+    // without it.
+    RenderLock(const std::string& filename, bool wait = true);
+    ~RenderLock();
+
+    // Returns true if wait was false and somebody else held the lock. (If
+    // the lock file can't be used at all, the lock isn't taken either, but
+    // nobody else can be holding it.)
+    bool IsBusy() const
+    {
+        return mBusy;
+    }
+};
+
+// Moves the images (and their .dim files) that are stored directly in
+// pngDirectory into the subdirectories given by shardLevels, e.g. after
+// turning on "--png-shard-levels" for an existing store. Returns the number
+// of files moved, or -1 if pngDirectory cannot be read.
+extern int ShardPngDirectory(const PngParams& params);
+
+class LatexEngine;
+
+// Same as MakePngFile, but takes the purified TeX already converted to
+// UTF-8. Both may be called from several threads at once (with distinct
+// tempDirectory).
+//
+// If engine is non-NULL, the formula is typeset by that running latex
+// process (see LatexEngine.h), whose tempDirectory must be the same; if
+// that fails, latex is run the usual way.
+extern PngInfo MakePngFileUtf8(
+    const std::string& purifiedTexUtf8,
+    const std::string& pngFilename,
+    const PngParams& params,
+    const std::string& key = "",
+    LatexEngine* engine = NULL
+);
+
+// Records one formula of a batch handled by MakePngFiles. The caller fills
+// in mPurifiedTexUtf8 and mMd5, which names the image as the key does for
+// MakePngFile; MakePngFiles fills in mInfo, or mError if this particular
+// formula failed.
+struct PngBatchItem
+{
+    std::string mPurifiedTexUtf8;
+    std::string mMd5;
+    PngInfo mInfo;
+    std::exception_ptr mError;
+};
+
+// Generates one PNG file per item, like MakePngFileUtf8 with an empty
+// pngFilename and mMd5 as the key; the md5s must be distinct. Formulas
+// whose purified TeX shares the same preamble (i.e. the same LatexFeatures
+// and PurifiedTexOptions) are typeset together: all their bodies go into
+// one .tex file as consecutive pages, latex runs once and dvipng runs once
+// per resolution, and page i is then moved to the image of the i-th
+// formula, with the height and depth dvipng reported for that page. If the
+// batch run fails, each formula of that batch is rendered again on its
+// own, so that one bad formula only affects itself.
+extern void MakePngFiles(
+    std::vector<PngBatchItem>& items,
     const PngParams& params
 );
 
+// Splits a purified TeX file, as generated by Manager::GeneratePurifiedTex,
+// into its preamble (everything up to and including "\begin{document}")
+// and its body (everything after that, excluding "\end{document}").
+// Returns false if the file doesn't have this shape.
+extern bool SplitPurifiedTex(
+    const std::string& purifiedTex,
+    std::string& preamble,
+    std::string& body
+);
 
 #endif
 
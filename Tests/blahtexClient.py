@@ -0,0 +1,120 @@
+#!/usr/bin/python
+
+# A client for "blahtex --server", for tests and benchmarks.
+#
+#   blahtexClient.py SOCKET [--repeat N] [--pipeline N] [OPTION...] < input
+#
+# converts the TeX read from standard input with the given conversion
+# options (e.g. --mathml --displaymath) and prints the result as blahtex
+# would. With --repeat N, it sends the same request N times instead, keeping
+# up to --pipeline requests (default 16) in flight, and reports the rate.
+
+import json
+import socket
+import struct
+import sys
+import time
+
+class BlahtexClient:
+	def __init__(self, path):
+		self.socket = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+		self.socket.connect(path)
+		self.nextId = 0
+
+	def close(self):
+		self.socket.close()
+
+	# Sends one request (a dict, as in batch mode) without waiting for the
+	# response; returns its id.
+	def send(self, request):
+		if 'id' not in request:
+			request = dict(request, id=self.nextId)
+			self.nextId += 1
+		self.sendRaw(json.dumps(request).encode())
+		return request['id']
+
+	def sendRaw(self, payload):
+		self.socket.sendall(struct.pack('>I', len(payload)) + payload)
+
+	def receiveRaw(self):
+		header = self.readExactly(4)
+		if header is None:
+			return None
+		return self.readExactly(struct.unpack('>I', header)[0])
+
+	# Returns the next response, as a dict, or None if the server closed
+	# the connection.
+	def receive(self):
+		payload = self.receiveRaw()
+		if payload is None:
+			return None
+		return json.loads(payload.decode())
+
+	def readExactly(self, size):
+		data = b''
+		while len(data) < size:
+			chunk = self.socket.recv(size - len(data))
+			if not chunk:
+				return None
+			data += chunk
+		return data
+
+	def convert(self, tex, options=[]):
+		self.send({'input': tex, 'options': options})
+		return self.receive()
+
+
+def main(argv):
+	if len(argv) < 2:
+		sys.stderr.write("usage: blahtexClient.py SOCKET [--repeat N] [--pipeline N] [OPTION...] < input\n")
+		return 2
+	path = argv[1]
+	repeat = 0
+	pipeline = 16
+	options = []
+	i = 2
+	while i < len(argv):
+		if argv[i] == '--repeat':
+			repeat = int(argv[i + 1])
+			i += 1
+		elif argv[i] == '--pipeline':
+			pipeline = int(argv[i + 1])
+			i += 1
+		else:
+			options.append(argv[i])
+		i += 1
+
+	tex = sys.stdin.read()
+	client = BlahtexClient(path)
+
+	if repeat == 0:
+		response = client.convert(tex, options)
+		if response is None:
+			sys.stderr.write('blahtexClient: the server closed the connection\n')
+			return 1
+		if 'error' in response:
+			sys.stderr.write('blahtexClient: ' + response['error'] + '\n')
+			return 1
+		sys.stdout.write(response['output'])
+		return 0
+
+	start = time.time()
+	sent = received = errors = 0
+	while received < repeat:
+		while sent < repeat and sent - received < pipeline:
+			client.send({'input': tex, 'options': options})
+			sent += 1
+		response = client.receive()
+		if response is None:
+			sys.stderr.write('blahtexClient: the server closed the connection\n')
+			return 1
+		if 'error' in response:
+			errors += 1
+		received += 1
+	elapsed = time.time() - start
+	print('%d requests in %.3f s: %.0f requests/s, %d errors' % (repeat, elapsed, repeat / elapsed, errors))
+	return 0
+
+
+if __name__ == '__main__':
+	sys.exit(main(sys.argv))
@@ -0,0 +1,82 @@
+#!/usr/bin/python
+
+# Stand-ins for latex and dvipng, so that PNG rendering can be tested
+# without a TeX installation.
+#
+# The latex stub writes a fake .dvi, .log and .aux for the .tex file it is
+# given; the dvipng stub writes a fake image for "-o" and prints the depth
+# and height that blahtex reads back. Tests that need more (a delay, a log
+# of runs, failures) pass extra shell commands to latexStub or dvipngStub,
+# or replace a stub altogether.
+
+import os
+import shutil
+import tempfile
+import unittest
+
+BLAHTEX = os.environ.get('BLAHTEX', '../Build/blahtex')
+
+# Runs body with $f set to the .tex file and $base to its name without the
+# extension, then writes the output files. The .dvi file holds the number
+# of pages: one per formula, as separated by MakePngFiles.
+def latexStub(body=''):
+	return """#!/bin/sh
+for a in "$@"; do case "$a" in *.tex) f="$a";; esac; done
+base="${f%.tex}"
+""" + body + """
+pages=$(grep -o 'end{preview}' "$f" | wc -l)
+[ "$pages" -gt 0 ] || pages=$(($(grep -o 'clearpage' "$f" | wc -l) + 1))
+echo $pages > "$base.dvi"; echo log > "$base.log"; echo aux > "$base.aux"
+"""
+
+# Runs write with $out set to the image to be written, $dpi to its
+# resolution, $dvi to the DVI file and $page to the page asked for with
+# "-p" (e.g. "=3"), if any. If the output name has a "%d" in it, write runs
+# for every page of the DVI file written by latexStub, with $k set to the
+# page number. write may change the $depth and $height reported.
+def dvipngStub(write='echo png > "$out"'):
+	return """#!/bin/sh
+dvi="$1"
+while [ $# -gt 0 ]; do case "$1" in -o) out="$2"; shift;; -D) dpi="$2"; shift;; -p) page="$2"; shift;; esac; shift; done
+pattern="$out"
+pages=1
+case "$pattern" in *%d*) pages=$(cat "$dvi");; esac
+k=1
+while [ $k -le $pages ]; do
+out=$(echo "$pattern" | sed "s/%d/$k/")
+depth=3; height=12
+""" + write + """
+echo " depth=$depth height=$height"
+k=$((k + 1))
+done
+"""
+
+def writeStub(directory, name, contents):
+	path = os.path.join(directory, name)
+	with open(path, 'w') as f:
+		f.write(contents)
+	os.chmod(path, 0o755)
+	return path
+
+# Gives each test a temporary directory self.dir holding the stubs
+# self.latex and self.dvipng (made from the class's LATEX and DVIPNG), and
+# removes it afterwards.
+class StubTestCase(unittest.TestCase):
+	LATEX = latexStub()
+	DVIPNG = dvipngStub()
+
+	def setUp(self):
+		print("")
+		self.dir = tempfile.mkdtemp()
+		self.latex = self.writeStub('latex', self.LATEX)
+		self.dvipng = self.writeStub('dvipng', self.DVIPNG)
+
+	def tearDown(self):
+		shutil.rmtree(self.dir)
+
+	def writeStub(self, name, contents):
+		return writeStub(self.dir, name, contents)
+
+	# The options that make blahtex use the stubs.
+	def stubOptions(self):
+		return ['--shell-latex', self.latex, '--shell-dvipng', self.dvipng]
@@ -0,0 +1,73 @@
+#!/usr/bin/python
+
+from subprocess import Popen, PIPE
+import json
+import os
+import unittest
+
+BLAHTEX = os.environ.get('BLAHTEX', '../Build/blahtex')
+
+class BatchTests(unittest.TestCase):
+	def setUp(self):
+		print("")
+
+	def runBatch(self, lines, options=[]):
+		p = Popen([BLAHTEX, '--batch', '--mathml'] + options, stdout=PIPE, stdin=PIPE)
+		output = p.communicate(("\n".join(lines) + "\n").encode())[0]
+		return [json.loads(line) for line in output.decode().splitlines()], p.returncode
+
+	def testResultsInOrder(self):
+		requests = [json.dumps({'id': i, 'input': 'x^{%d}' % i}) for i in range(50)]
+		results, status = self.runBatch(requests)
+		self.assertEqual(status, 0)
+		self.assertEqual([r['id'] for r in results], list(range(50)))
+		self.assertTrue('<mn>49</mn>' in results[49]['output'])
+
+	def testOutputMatchesSingleRun(self):
+		p = Popen([BLAHTEX, '--mathml'], stdout=PIPE, stdin=PIPE)
+		single = p.communicate(b"\\frac12 + \\sqrt{x}")[0].decode()
+		results, status = self.runBatch([json.dumps({'id': 'a', 'input': "\\frac12 + \\sqrt{x}"})])
+		self.assertEqual(results[0]['output'], single)
+
+	def testPerRequestOptions(self):
+		results, status = self.runBatch([
+			json.dumps({'id': 1, 'input': 'x', 'options': ['--displaymath']}),
+			json.dumps({'id': 2, 'input': 'x'})])
+		self.assertTrue('displaystyle' in results[0]['output'])
+		self.assertFalse('displaystyle' in results[1]['output'])
+
+	def testErrorsDoNotStopTheBatch(self):
+		results, status = self.runBatch([
+			'not json',
+			json.dumps({'id': 2, 'input': '\\frac'}),
+			json.dumps({'id': 3, 'input': 'y', 'options': ['--no-such-option']}),
+			json.dumps({'id': 4}),
+			json.dumps({'id': 5, 'input': 'z'})])
+		self.assertEqual(status, 1)
+		self.assertEqual([r['id'] for r in results], [None, 2, 3, 4, 5])
+		self.assertTrue('error' in results[0])
+		self.assertTrue('<id>NotEnoughArguments</id>' in results[1]['output'])
+		self.assertTrue('error' in results[2])
+		self.assertTrue('error' in results[3])
+		self.assertTrue('<mi>z</mi>' in results[4]['output'])
+
+	def testThreadsKeepOrder(self):
+		requests = []
+		for i in range(300):
+			if i % 50 == 0:
+				# a large matrix, which the scheduler starts first
+				row = '&'.join(['\\frac{a}{b}'] * 20)
+				tex = '\\begin{matrix}' + '\\\\'.join([row] * 20) + '\\end{matrix}'
+			else:
+				tex = 'x_{%d}' % i
+			options = ['--displaymath'] if i % 3 == 0 else []
+			requests.append(json.dumps({'id': i, 'input': tex, 'options': options}))
+		requests.append('not json')
+		single, status = self.runBatch(requests)
+		threaded, threadedStatus = self.runBatch(requests, ['--threads', '4'])
+		self.assertEqual(single, threaded)
+		self.assertEqual(status, threadedStatus)
+
+
+if __name__ == '__main__':
+	unittest.main()
@@ -0,0 +1,39 @@
+#!/usr/bin/python
+
+# Tests that "--canonical-key" gives equivalent inputs one key and one image,
+# and that the image is named after the options that affect it only.
+
+from subprocess import Popen, PIPE
+import unittest
+import xml.etree.ElementTree as ET
+from stubTools import BLAHTEX, StubTestCase
+
+class CanonicalKeyTests(StubTestCase):
+	def keys(self, tex, options=[]):
+		p = Popen([BLAHTEX, '--mathml', '--png', '--canonical-key'] + self.stubOptions() + [
+			'--temp-directory', self.dir + '/', '--png-directory', self.dir + '/'] + options,
+			stdin=PIPE, stdout=PIPE)
+		output = ET.fromstring(p.communicate(tex)[0])
+		return output.find('canonicalKey').text, output.find('png/md5').text
+
+	def testEquivalentInputsShareAKey(self):
+		key = self.keys(b'\\frac12')
+		self.assertEqual(self.keys(b'\\frac{1}{2}'), key)
+		self.assertEqual(self.keys(b'\\frac 1 2'), key)
+		self.assertNotEqual(self.keys(b'\\frac21')[0], key[0])
+
+	def testImageOptionChangesBothKeys(self):
+		canonical, image = self.keys(b'\\frac12')
+		displayCanonical, displayImage = self.keys(b'\\frac12', ['--displaymath'])
+		self.assertNotEqual(displayCanonical, canonical)
+		self.assertNotEqual(displayImage, image)
+
+	def testMathmlOptionSharesTheImage(self):
+		canonical, image = self.keys(b'\\frac12')
+		for options in [['--spacing', 'relaxed'], ['--mathml-encoding', 'long'], ['--mathml-version-1-fonts']]:
+			otherCanonical, otherImage = self.keys(b'\\frac12', options)
+			self.assertNotEqual(otherCanonical, canonical)
+			self.assertEqual(otherImage, image)
+
+if __name__ == '__main__':
+	unittest.main()
@@ -0,0 +1,116 @@
+#!/usr/bin/python
+
+from subprocess import Popen, PIPE
+import json
+import os
+import unittest
+import xml.etree.ElementTree as ET
+from stubTools import BLAHTEX, StubTestCase, latexStub, dvipngStub
+
+class ConcurrentPngTests(StubTestCase):
+	# Stubs that take a while, and a latex that logs every run.
+	LATEX = latexStub('echo "$(pwd)/$f" >> "$(dirname "$0")/latex.log"\nsleep 0.3')
+	DVIPNG = dvipngStub('echo png > "$out.partial"; sleep 0.1; mv "$out.partial" "$out"')
+
+	def setUp(self):
+		StubTestCase.setUp(self)
+		self.log = os.path.join(self.dir, 'latex.log')
+		self.temp = os.path.join(self.dir, 'temp')
+		self.png = os.path.join(self.dir, 'png')
+		os.mkdir(self.temp)
+		os.mkdir(self.png)
+
+	def startBlahtex(self, input, options=[]):
+		p = Popen([BLAHTEX, '--png', '--use-preview-package'] + self.stubOptions() + [
+			'--temp-directory', self.temp, '--png-directory', self.png] + options,
+			stdout=PIPE, stdin=PIPE)
+		p.stdin.write(input)
+		p.stdin.close()
+		return p
+
+	# Runs the given formulas in batch mode, with one image per latex run.
+	def runBatch(self, inputs, options):
+		requests = [json.dumps({'id': i, 'input': tex, 'options': ['--png']}) for i, tex in enumerate(inputs)]
+		p = Popen([BLAHTEX, '--batch', '--png-batch-size', '1'] + self.stubOptions() + [
+			'--temp-directory', self.temp + '/', '--png-directory', self.png + '/'] + options,
+			stdout=PIPE, stdin=PIPE)
+		output = p.communicate(("\n".join(requests) + "\n").encode())[0]
+		for line in output.decode().splitlines():
+			self.assertIn('<md5>', json.loads(line)['output'])
+		return p.pid
+
+	def latexRuns(self):
+		if not os.path.exists(self.log):
+			return []
+		with open(self.log) as f:
+			return f.read().split()
+
+	def testSameFormulaRendersOnce(self):
+		processes = [self.startBlahtex(b"x^2 + y^2") for i in range(40)]
+		md5s = set()
+		for p in processes:
+			rootNode = ET.fromstring(p.stdout.read())
+			p.wait()
+			self.assertEqual(rootNode.find("png/error"), None)
+			self.assertEqual(rootNode.find("png/height").text, "12")
+			self.assertEqual(rootNode.find("png/depth").text, "3")
+			md5s.add(rootNode.find("png/md5").text)
+
+		self.assertEqual(len(md5s), 1)
+		self.assertEqual(len(self.latexRuns()), 1)
+		md5 = md5s.pop()
+		self.assertEqual(sorted(os.listdir(self.png)), [md5 + ".dim", md5 + ".png"])
+		self.assertEqual(os.listdir(self.temp), [])
+
+	def testDifferentFormulasRenderInParallel(self):
+		processes = [self.startBlahtex(("x^{%d}" % (i % 8)).encode()) for i in range(40)]
+		for p in processes:
+			rootNode = ET.fromstring(p.stdout.read())
+			p.wait()
+			self.assertEqual(rootNode.find("png/error"), None)
+
+		self.assertEqual(len(self.latexRuns()), 8)
+		self.assertEqual(len(os.listdir(self.png)), 16)
+		self.assertEqual(os.listdir(self.temp), [])
+
+	def testKeptTempFilesAreInTheTempDirectory(self):
+		p = self.startBlahtex(b"z", ['--keep-temp-files'])
+		md5 = ET.fromstring(p.stdout.read()).find("png/md5").text
+		p.wait()
+		self.assertEqual(sorted(os.listdir(self.temp)), [md5 + e for e in ['.aux', '.dvi', '.log', '.tex']])
+
+	def testPoolRendersEachFormulaOnce(self):
+		self.runBatch(['x^{%d}' % (i % 4) for i in range(24)], ['--threads', '8', '--png-workers', '3'])
+		self.assertEqual(len(self.latexRuns()), 4)
+		self.assertEqual(len(os.listdir(self.png)), 8)
+
+	def testWorkersHaveTheirOwnDirectories(self):
+		pid = self.runBatch(['x^{%d}' % i for i in range(8)], ['--threads', '4', '--png-workers', '2'])
+		directories = set(os.path.dirname(run) for run in self.latexRuns())
+		temp = os.path.realpath(self.temp)
+		self.assertTrue(len(directories) >= 1)
+		for directory in directories:
+			self.assertIn(directory, [os.path.join(temp, 'worker-%d-%d' % (pid, n)) for n in range(2)])
+		# The private directories are removed at the end.
+		self.assertEqual(os.listdir(self.temp), [])
+	def testWorkspaceReusesFileNames(self):
+		workspace = os.path.join(self.dir, 'workspace')
+		os.mkdir(workspace)
+		pid = self.runBatch(['x^{%d}' % i for i in range(4)], ['--png-workers', '1', '--png-workspace', workspace + '/'])
+		directory = os.path.join(os.path.realpath(workspace), 'worker-%d-0' % pid)
+		self.assertEqual(self.latexRuns(), [os.path.join(directory, 'formula.tex')] * 4)
+		self.assertEqual(os.listdir(workspace), [])
+		self.assertEqual(os.listdir(self.temp), [])
+
+	def testWorkspaceKeepsTempFiles(self):
+		workspace = os.path.join(self.dir, 'workspace')
+		os.mkdir(workspace)
+		pid = self.runBatch(['x^{%d}' % i for i in range(2)],
+			['--png-workers', '1', '--png-workspace', workspace + '/', '--keep-temp-files'])
+		directory = os.path.join(workspace, 'worker-%d-0' % pid)
+		files = os.listdir(directory)
+		self.assertEqual(len([f for f in files if f.endswith('.tex')]), 2)
+		self.assertNotIn('formula.tex', files)
+
+if __name__ == '__main__':
+	unittest.main()
@@ -0,0 +1,131 @@
+#!/usr/bin/python
+
+from subprocess import Popen, PIPE
+import os
+import signal
+import socket
+import time
+import unittest
+from blahtexClient import BlahtexClient
+from stubTools import BLAHTEX, StubTestCase, latexStub
+
+class ForkServerTests(StubTestCase):
+	# A latex that notes which process ran it, and which signals it and that
+	# process ignore, and kills that process if the formula asks for it.
+	LATEX = latexStub("""echo $PPID >> "$(dirname "$0")/renderers"
+[ -e /proc/$$/status ] && grep -h SigIgn /proc/$$/status /proc/$PPID/status >> "$(dirname "$0")/ignored"
+grep -q CRASHME "$f" && kill -9 $PPID
+sleep 0.2""")
+
+	def setUp(self):
+		StubTestCase.setUp(self)
+		self.socket = os.path.join(self.dir, 'blahtex.sock')
+		self.server = None
+
+	def tearDown(self):
+		# Kill the forked children too, or they may still be cleaning up
+		# their directories while we remove them.
+		if self.server:
+			try:
+				os.killpg(self.server.pid, signal.SIGKILL)
+			except OSError:
+				pass
+			self.server.wait()
+		StubTestCase.tearDown(self)
+
+	def startServer(self, options):
+		self.server = Popen([BLAHTEX, '--server', self.socket, '--fork-server',
+			'--mathml'] + self.stubOptions() + [
+			'--temp-directory', self.dir, '--png-directory', self.dir] + options,
+			start_new_session=True)
+		for i in range(100):
+			try:
+				return BlahtexClient(self.socket)
+			except socket.error:
+				time.sleep(0.05)
+		self.fail('the server did not start')
+
+	def renderers(self):
+		with open(os.path.join(self.dir, 'renderers')) as f:
+			return f.read().split()
+
+	def testPipelinedResponsesInOrder(self):
+		client = self.startServer(['--threads', '3'])
+		ids = [client.send({'input': 'x^{%d}' % i}) for i in range(100)]
+		responses = [client.receive() for i in range(100)]
+		self.assertEqual([r['id'] for r in responses], ids)
+		self.assertTrue('<mn>99</mn>' in responses[99]['output'])
+		self.assertTrue('displaystyle' in client.convert('y', ['--displaymath'])['output'])
+		self.assertTrue('error' in client.convert('z', ['--no-such-option']))
+
+	def testProcessPerRequest(self):
+		client = self.startServer(['--threads', '1'])
+		for i in range(3):
+			self.assertTrue('<md5>' in client.convert('a_%d' % i, ['--png'])['output'])
+		self.assertEqual(len(set(self.renderers())), 3)
+
+	def testProcessReuse(self):
+		client = self.startServer(['--threads', '1', '--fork-requests', '0'])
+		for i in range(3):
+			self.assertTrue('<md5>' in client.convert('b_%d' % i, ['--png'])['output'])
+		self.assertEqual(len(set(self.renderers())), 1)
+
+	def testCrashIsContained(self):
+		client = self.startServer(['--threads', '1', '--fork-requests', '0'])
+		client.send({'input': 'c', 'options': ['--png']})
+		client.send({'input': '\\text{CRASHME}', 'options': ['--png']})
+		client.send({'input': 'd', 'options': ['--png']})
+		responses = [client.receive() for i in range(3)]
+		self.assertTrue('<md5>' in responses[0]['output'])
+		self.assertTrue(responses[1]['crashed'])
+		self.assertTrue('<md5>' in responses[2]['output'])
+		self.assertEqual(len(set(self.renderers())), 2)
+
+	def testGracefulShutdown(self):
+		client = self.startServer(['--threads', '2'])
+		for i in range(4):
+			client.send({'input': 'y_{%d}' % i, 'options': ['--png']})
+		time.sleep(0.1)
+		self.server.send_signal(signal.SIGTERM)
+
+		# The requests already sent are still answered, and the children
+		# are gone once the server has exited.
+		for i in range(4):
+			response = client.receive()
+			self.assertTrue('<md5>' in response['output'])
+		self.assertEqual(client.receive(), None)
+		self.assertEqual(self.server.wait(), 0)
+		self.assertFalse(os.path.exists(self.socket))
+		for pid in set(self.renderers()):
+			self.assertFalse(os.path.exists('/proc/%s' % pid))
+
+	# Checks that latex, and the conversion process that runs it, don't
+	# ignore the signals that stop them.
+	def checkSignalsAreNotIgnored(self, options):
+		if not os.path.exists('/proc/self/status'):
+			self.skipTest('no /proc')
+		client = self.startServer(['--threads', '1'] + options)
+		self.assertTrue('<md5>' in client.convert('e', ['--png'])['output'])
+		with open(os.path.join(self.dir, 'ignored')) as f:
+			latex, child = [int(line.split()[1], 16) for line in f.read().splitlines()]
+		for number in [signal.SIGINT, signal.SIGTERM, signal.SIGPIPE]:
+			self.assertFalse(latex & (1 << (number - 1)), signal.Signals(number).name)
+		for number in [signal.SIGINT, signal.SIGTERM]:
+			self.assertFalse(child & (1 << (number - 1)), signal.Signals(number).name)
+
+	def testSignalsAreNotIgnored(self):
+		# latex is started with posix_spawn.
+		self.checkSignalsAreNotIgnored([])
+
+	def testSignalsAreNotIgnoredWithLimits(self):
+		# latex is started with fork, to set its limits.
+		self.checkSignalsAreNotIgnored(['--png-cpu-limit', '10'])
+
+	def testRequiresServer(self):
+		process = Popen([BLAHTEX, '--fork-server', '--batch'], stdin=PIPE, stdout=PIPE, stderr=PIPE)
+		error = process.communicate(b'')[1]
+		self.assertTrue(b'requires "--server"' in error)
+
+
+if __name__ == '__main__':
+	unittest.main()
@@ -0,0 +1,128 @@
+#!/usr/bin/python
+
+from subprocess import Popen
+import http.client
+import json
+import os
+import signal
+import socket
+import time
+import unittest
+from urllib.parse import urlencode
+from stubTools import BLAHTEX, StubTestCase, latexStub, dvipngStub
+
+class HttpTests(StubTestCase):
+	# A latex that fails on the formula "ZZZ" and takes too long over "YYY".
+	LATEX = latexStub('''grep -q "Z Z Z" "$f" && exit 1
+grep -q "Y Y Y" "$f" && sleep 5''')
+	DVIPNG = dvipngStub('echo "png $out" > "$out"')
+
+	def setUp(self):
+		StubTestCase.setUp(self)
+		s = socket.socket()
+		s.bind(('127.0.0.1', 0))
+		self.port = s.getsockname()[1]
+		s.close()
+		self.server = Popen([BLAHTEX, '--http', str(self.port), '--threads', '2',
+			'--png-timeout', '1']
+			+ self.stubOptions() + [
+			'--temp-directory', self.dir + '/', '--png-directory', self.dir + '/'])
+		for i in range(100):
+			try:
+				socket.create_connection(('127.0.0.1', self.port)).close()
+				break
+			except socket.error:
+				time.sleep(0.05)
+		self.connection = http.client.HTTPConnection('127.0.0.1', self.port)
+
+	def tearDown(self):
+		self.connection.close()
+		if self.server.poll() is None:
+			self.server.kill()
+			self.server.wait()
+		StubTestCase.tearDown(self)
+
+	def post(self, path, parameters):
+		self.connection.request('POST', path, urlencode(parameters),
+			{'Content-Type': 'application/x-www-form-urlencoded'})
+		response = self.connection.getresponse()
+		return response, response.read()
+
+	def testMathml(self):
+		response, body = self.post('/mathml', {'q': 'x^2', 'type': 'inline-tex'})
+		self.assertEqual(response.status, 200)
+		self.assertEqual(body.decode(), '<math xmlns="http://www.w3.org/1998/Math/MathML"><msup><mi>x</mi><mn>2</mn></msup></math>')
+		response, body = self.post('/mathml', {'q': 'x'})
+		self.assertTrue(b'display="block"' in body)
+		response, body = self.post('/mathml', {'q': '\\frac'})
+		self.assertEqual(response.status, 400)
+		self.assertEqual(json.loads(body.decode())['error']['id'], 'NotEnoughArguments')
+
+	def testTexvcinfo(self):
+		self.connection.request('POST', '/texvcinfo', json.dumps({'q': '\\frac12'}),
+			{'Content-Type': 'application/json'})
+		response = self.connection.getresponse()
+		self.assertEqual(json.loads(response.read().decode()), {'success': True, 'checked': '{\\frac{1}{2}}'})
+
+	def testPng(self):
+		response, body = self.post('/png', {'q': 'y^3'})
+		self.assertEqual(response.status, 200)
+		self.assertEqual(response.getheader('Content-Type'), 'image/png')
+		etag = response.getheader('ETag')
+		md5 = etag.strip('"')
+		self.assertTrue(body.startswith(b'png '))
+
+		self.connection.request('GET', '/png/' + md5)
+		response = self.connection.getresponse()
+		self.assertEqual(response.read(), body)
+		self.assertEqual(response.getheader('ETag'), etag)
+
+		self.connection.request('GET', '/png/' + md5, headers={'If-None-Match': etag})
+		response = self.connection.getresponse()
+		self.assertEqual(response.status, 304)
+		self.assertEqual(response.read(), b'')
+
+		self.connection.request('GET', '/png/' + '0' * 32)
+		response = self.connection.getresponse()
+		response.read()
+		self.assertEqual(response.status, 404)
+		self.connection.request('GET', '/png/../latex')
+		response = self.connection.getresponse()
+		response.read()
+		self.assertEqual(response.status, 404)
+
+	def testRenderFailures(self):
+		response, body = self.post('/png', {'q': '\\frac'})
+		self.assertEqual(response.status, 400)
+		response, body = self.post('/png', {'q': 'ZZZ'})
+		self.assertEqual(response.status, 500)
+		self.assertEqual(json.loads(body.decode())['error']['id'], 'CannotRunLatex')
+		response, body = self.post('/png', {'q': 'YYY'})
+		self.assertEqual(response.status, 503)
+		self.assertEqual(response.reason, 'Service Unavailable')
+		self.assertEqual(json.loads(body.decode())['error']['id'], 'RenderLimitExceeded')
+
+	def testKeepAliveAndErrors(self):
+		# All of these go over one connection.
+		for i in range(20):
+			response, body = self.post('/mathml', {'q': 'x_{%d}' % i})
+			self.assertTrue(('<mn>%d</mn>' % i).encode() in body)
+		self.connection.request('GET', '/mathml')
+		response = self.connection.getresponse()
+		response.read()
+		self.assertEqual(response.status, 405)
+		self.connection.request('GET', '/nothing')
+		response = self.connection.getresponse()
+		response.read()
+		self.assertEqual(response.status, 404)
+		response, body = self.post('/mathml', {'type': 'tex'})
+		self.assertEqual(response.status, 400)
+
+	def testGracefulShutdown(self):
+		self.post('/mathml', {'q': 'x'})
+		self.server.send_signal(signal.SIGTERM)
+		self.assertEqual(self.server.wait(), 0)
+
+
+if __name__ == '__main__':
+	unittest.main()
@@ -0,0 +1,99 @@
+#!/usr/bin/python
+
+# Tests "--png-format-directory" with stand-ins for latex and dvipng.
+
+from subprocess import Popen, PIPE
+import os
+import time
+import unittest
+import xml.etree.ElementTree as ET
+from stubTools import BLAHTEX, StubTestCase
+
+# Dumps a format with "-ini" (unless the file "nodump" exists), loads one
+# with "-fmt=" (a format reading "stale" can't be loaded, and then no log
+# is written, as with TeX), and fails on the formula "ZZZ". Each run
+# is logged as "dump", "format" or "full".
+STUB_LATEX = """#!/bin/sh
+dir="$(dirname "$0")"
+fmt=""; job=""
+for a in "$@"; do case "$a" in -fmt=*) fmt="${a#-fmt=}";; -jobname=*) job="${a#-jobname=}";; *.tex) f="$a";; esac; done
+base="${f%%.tex}"
+if [ -n "$job" ]; then
+	echo dump >> "$dir/runs"
+	[ -e "$dir/nodump" ] && exit 1
+	echo format > "$job.fmt"; exit 0
+fi
+if [ -n "$fmt" ]; then
+	echo format >> "$dir/runs"
+	grep -q stale "$fmt.fmt" && exit 1
+	echo "This is stubTeX (preloaded format=$(basename "$fmt")-1-2 2026.10.19)" > "$base.log"
+else
+	echo full >> "$dir/runs"
+	echo "This is stubTeX (preloaded format=latex 2026.10.19)" > "$base.log"
+fi
+grep -q "Z Z Z" "$f" && exit 1
+echo dvi > "$base.dvi"; echo aux > "$base.aux"
+"""
+
+class LatexFormatTests(StubTestCase):
+	LATEX = STUB_LATEX
+
+	def setUp(self):
+		StubTestCase.setUp(self)
+		self.formats = os.path.join(self.dir, 'formats')
+		os.mkdir(self.formats)
+
+	def render(self, tex):
+		p = Popen([BLAHTEX, '--png'] + self.stubOptions() + [
+			'--temp-directory', self.dir + '/', '--png-directory', self.dir + '/',
+			'--png-format-directory', self.formats + '/'], stdin=PIPE, stdout=PIPE)
+		return ET.fromstring(p.communicate(tex)[0])
+
+	def runs(self):
+		path = os.path.join(self.dir, 'runs')
+		if not os.path.exists(path):
+			return []
+		with open(path) as f:
+			runs = f.read().split()
+		os.remove(path)
+		return runs
+
+	def formatFiles(self, extension):
+		return [os.path.join(self.formats, f) for f in os.listdir(self.formats) if f.endswith(extension)]
+
+	def testFormulaErrorRunsLatexOnce(self):
+		self.assertNotEqual(self.render(b'x').find('png/md5'), None)
+		self.assertEqual(self.runs(), ['dump', 'format'])
+		self.assertEqual(self.render(b'ZZZ').find('png/error/id').text, 'CannotRunLatex')
+		self.assertEqual(self.runs(), ['format'])
+		self.assertEqual(len(self.formatFiles('.fmt')), 1)
+
+	def testStaleFormatIsRebuilt(self):
+		self.render(b'x')
+		self.runs()
+		for path in self.formatFiles('.fmt'):
+			with open(path, 'w') as f:
+				f.write('stale\n')
+		self.assertNotEqual(self.render(b'y').find('png/md5'), None)
+		self.assertEqual(self.runs(), ['format', 'full'])
+		self.render(b'z')
+		self.assertEqual(self.runs(), ['dump', 'format'])
+
+	def testFailedDumpIsRetriedLater(self):
+		open(os.path.join(self.dir, 'nodump'), 'w').close()
+		self.render(b'x')
+		self.assertEqual(self.runs(), ['dump', 'full'])
+		self.render(b'y')
+		self.assertEqual(self.runs(), ['full'])
+
+		os.remove(os.path.join(self.dir, 'nodump'))
+		for path in self.formatFiles('.failed'):
+			past = time.time() - 3600
+			os.utime(path, (past, past))
+		self.render(b'z')
+		self.assertEqual(self.runs(), ['dump', 'format'])
+		self.assertEqual(self.formatFiles('.failed'), [])
+
+
+if __name__ == '__main__':
+	unittest.main()
@@ -0,0 +1,146 @@
+#!/usr/bin/python
+
+# Tests the C interface of libblahtex ("make libblahtex.so") through
+# ctypes, comparing its output with that of the command line.
+
+from subprocess import Popen, PIPE
+import ctypes
+import os
+import re
+import unittest
+
+BLAHTEX = os.environ.get('BLAHTEX', '../Build/blahtex')
+LIBBLAHTEX = os.environ.get('LIBBLAHTEX', '../libblahtex.so')
+
+class Buffer(ctypes.Structure):
+	_fields_ = [('data', ctypes.c_void_p), ('size', ctypes.c_size_t), ('capacity', ctypes.c_size_t)]
+
+WRITE_FUNCTION = ctypes.CFUNCTYPE(ctypes.c_int, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t)
+
+OK, ERROR_INPUT, ERROR_ENCODING, ERROR_OPTION, ERROR_OUTPUT = 0, 1, 2, 3, 4
+
+def loadLibrary():
+	library = ctypes.CDLL(LIBBLAHTEX)
+	library.blahtex_create.restype = ctypes.c_void_p
+	library.blahtex_destroy.argtypes = [ctypes.c_void_p]
+	library.blahtex_set_option.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_char_p]
+	library.blahtex_convert.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t, ctypes.POINTER(Buffer)]
+	library.blahtex_convert_to.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t, WRITE_FUNCTION, ctypes.c_void_p]
+	for name in ['blahtex_error_id', 'blahtex_error_message']:
+		getattr(library, name).argtypes = [ctypes.c_void_p]
+		getattr(library, name).restype = ctypes.c_char_p
+	library.blahtex_error_arg_count.argtypes = [ctypes.c_void_p]
+	library.blahtex_error_arg_count.restype = ctypes.c_size_t
+	library.blahtex_error_arg.argtypes = [ctypes.c_void_p, ctypes.c_size_t]
+	library.blahtex_error_arg.restype = ctypes.c_char_p
+	library.blahtex_error_span.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_size_t), ctypes.POINTER(ctypes.c_size_t)]
+	library.blahtex_buffer_free.argtypes = [ctypes.POINTER(Buffer)]
+	return library
+
+@unittest.skipUnless(os.path.exists(LIBBLAHTEX), 'needs ' + LIBBLAHTEX)
+class LibraryTests(unittest.TestCase):
+	def setUp(self):
+		self.library = loadLibrary()
+		self.context = self.library.blahtex_create()
+
+	def tearDown(self):
+		self.library.blahtex_destroy(self.context)
+
+	def convert(self, tex):
+		buffer = Buffer()
+		status = self.library.blahtex_convert(self.context, tex, len(tex), ctypes.byref(buffer))
+		output = b''
+		if status == OK:
+			output = ctypes.string_at(buffer.data, buffer.size)
+			self.assertEqual(ctypes.string_at(buffer.data + buffer.size, 1), b'\0')
+		self.library.blahtex_buffer_free(ctypes.byref(buffer))
+		return status, output
+
+	def commandLine(self, tex, options):
+		process = Popen([BLAHTEX, '--mathml'] + options, stdin=PIPE, stdout=PIPE)
+		output = process.communicate(tex)[0].decode('utf-8')
+		return re.search('<markup>\n(.*)\n</markup>', output, re.S).group(1)
+
+	def testSameAsCommandLine(self):
+		self.library.blahtex_set_option(self.context, b'displaymath', None)
+		self.library.blahtex_set_option(self.context, b'mathml-encoding', b'raw')
+		self.library.blahtex_set_option(self.context, b'other-encoding', b'raw')
+		for tex in ['x^2 + \\frac{1}{2}', '\\text{caf\u00e9} \\alpha', '\\mathbb{R}\\to\\mathcal{C}']:
+			status, output = self.convert(tex.encode('utf-8'))
+			self.assertEqual(status, OK)
+			expected = self.commandLine(tex.encode('utf-8'),
+				['--displaymath', '--mathml-encoding', 'raw', '--other-encoding', 'raw'])
+			self.assertEqual(output.decode('utf-8'), expected)
+
+	def testErrors(self):
+		status, output = self.convert(b'\\frac{a}{')
+		self.assertEqual(status, ERROR_INPUT)
+		self.assertEqual(output, b'')
+		self.assertEqual(self.library.blahtex_error_id(self.context), b'UnmatchedOpenBrace')
+
+		status, output = self.convert(b'\\foo')
+		self.assertEqual(status, ERROR_INPUT)
+		self.assertEqual(self.library.blahtex_error_id(self.context), b'UnrecognisedCommand')
+		self.assertEqual(self.library.blahtex_error_arg_count(self.context), 1)
+		self.assertEqual(self.library.blahtex_error_arg(self.context, 0), b'\\foo')
+		self.assertTrue(b'\\foo' in self.library.blahtex_error_message(self.context))
+
+		self.assertEqual(self.convert(b'a^b^c')[0], ERROR_INPUT)
+		self.assertEqual(self.errorSpan(), None)
+
+		self.assertEqual(self.convert(b'x\xff')[0], ERROR_ENCODING)
+		self.assertEqual(self.library.blahtex_error_id(self.context), b'InvalidUtf8')
+
+		self.assertEqual(self.library.blahtex_set_option(self.context, b'no-such-option', None), ERROR_OPTION)
+		self.assertEqual(self.library.blahtex_set_option(self.context, b'spacing', b'loose'), ERROR_OPTION)
+		self.assertEqual(self.library.blahtex_error_id(self.context), b'IllegalOptionValue')
+
+		# The context is still usable, and the error is cleared.
+		self.assertEqual(self.convert(b'y')[0], OK)
+		self.assertEqual(self.library.blahtex_error_id(self.context), b'')
+
+	def errorSpan(self):
+		start, length = ctypes.c_size_t(), ctypes.c_size_t()
+		if not self.library.blahtex_error_span(self.context, ctypes.byref(start), ctypes.byref(length)):
+			return None
+		return start.value, length.value
+
+	def testErrorSpan(self):
+		# The span is in bytes of the UTF-8 input.
+		tex = '\\text{\u00e9\u00e9} + \\foo'.encode('utf-8')
+		self.assertEqual(self.convert(tex)[0], ERROR_INPUT)
+		self.assertEqual(self.errorSpan(), (14, 4))
+		self.assertEqual(self.convert(b'x + y}')[0], ERROR_INPUT)
+		self.assertEqual(self.library.blahtex_error_id(self.context), b'UnmatchedCloseBrace')
+		self.assertEqual(self.errorSpan(), (5, 1))
+		self.assertEqual(self.convert(b'x')[0], OK)
+		self.assertEqual(self.errorSpan(), None)
+
+	def testWriteFunction(self):
+		pieces = []
+		def write(user, data, size):
+			pieces.append(ctypes.string_at(data, size))
+			return 0
+		tex = b'x_{1}' + b'+x_{1}' * 300
+		status = self.library.blahtex_convert_to(self.context, tex, len(tex), WRITE_FUNCTION(write), None)
+		self.assertEqual(status, OK)
+		self.assertTrue(len(pieces) > 1)
+		self.assertEqual(b''.join(pieces), self.convert(tex)[1])
+
+		stop = WRITE_FUNCTION(lambda user, data, size: 1)
+		self.assertEqual(self.library.blahtex_convert_to(self.context, b'x', 1, stop, None), ERROR_OUTPUT)
+
+	def testBufferAppendsAndOutputKinds(self):
+		buffer = Buffer()
+		self.library.blahtex_set_option(self.context, b'output', b'purified-tex-only')
+		self.library.blahtex_convert(self.context, b'a', 1, ctypes.byref(buffer))
+		self.library.blahtex_convert(self.context, b'b', 1, ctypes.byref(buffer))
+		self.assertEqual(ctypes.string_at(buffer.data, buffer.size), b'ab')
+		self.library.blahtex_buffer_free(ctypes.byref(buffer))
+
+		self.library.blahtex_set_option(self.context, b'output', b'purified-tex')
+		self.assertTrue(b'\\documentclass' in self.convert(b'a')[1])
+
+
+if __name__ == '__main__':
+	unittest.main()
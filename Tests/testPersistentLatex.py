@@ -0,0 +1,103 @@
+#!/usr/bin/python
+
+# Tests "--png-persistent-latex" with stand-ins for latex and dvipng.
+
+from subprocess import Popen, PIPE
+import json
+import os
+import unittest
+from stubTools import BLAHTEX, StubTestCase, dvipngStub
+
+# Run with a .tex file, this behaves like the usual latex stub. Otherwise it
+# is an engine: it answers every done marker that it is fed, and reports a
+# TeX error for a formula containing "ZZZ" (purified as "Z Z Z"). Both log
+# what they were started for in latex.log.
+LATEX = """#!/usr/bin/env python3
+import os, re, sys
+def note(what):
+	with open(os.path.join(os.path.dirname(sys.argv[0]), 'latex.log'), 'a') as f:
+		f.write(what + '\\n')
+tex = [a for a in sys.argv[1:] if a.endswith('.tex')]
+if tex:
+	note('run')
+	for extension in ['.dvi', '.log', '.aux']:
+		with open(tex[0][:-4] + extension, 'w') as f:
+			f.write('stub')
+	sys.exit(0)
+note('engine')
+with open('engine.dvi', 'w') as f:
+	f.write('stub')
+while True:
+	line = sys.stdin.readline()
+	if not line:
+		break
+	if 'Z Z Z' in line:
+		print('! Undefined control sequence.', flush=True)
+	done = re.search(r'blahtex-engine-done-[0-9]+', line)
+	if done:
+		print(done.group(0), flush=True)
+"""
+
+# Logs the DVI file and page of every run.
+DVIPNG = dvipngStub("""echo png > "$out"
+echo "$dvi $page" >> "$(dirname "$0")/dvipng.log"
+""")
+
+class PersistentLatexTests(StubTestCase):
+	LATEX = LATEX
+	DVIPNG = DVIPNG
+
+	def render(self, inputs):
+		requests = [json.dumps({'id': i, 'input': tex, 'options': ['--png']})
+			for i, tex in enumerate(inputs)]
+		p = Popen([BLAHTEX, '--batch', '--png-persistent-latex', '--png-workers', '1']
+			+ self.stubOptions() + ['--temp-directory', self.dir + '/', '--png-directory', self.dir + '/'],
+			stdin=PIPE, stdout=PIPE)
+		output = p.communicate(("\n".join(requests) + "\n").encode())[0]
+		results = [json.loads(line) for line in output.decode().splitlines()]
+		for result in results:
+			self.assertIn('<md5>', result['output'])
+		return results
+
+	def log(self, name):
+		with open(os.path.join(self.dir, name)) as f:
+			return f.read().split('\n')[:-1]
+
+	# The page of the engine's DVI file that each image came from, or 0 for
+	# images made the usual way.
+	def pages(self):
+		pages = []
+		for line in self.log('dvipng.log'):
+			dvi, page = line.split(' ')
+			pages.append(int(page[1:]) if dvi == 'engine.dvi' else 0)
+		return pages
+
+	def testOneEngineForSeveralFormulas(self):
+		self.render(['a', 'b', 'c', 'd'])
+		self.assertEqual(self.log('latex.log'), ['engine'])
+		# Each formula is followed by a padding page.
+		self.assertEqual(self.pages(), [1, 3, 5, 7])
+
+	def testRestartAfterTexError(self):
+		self.render(['a', 'b', 'ZZZ', 'c'])
+		# The failing formula is typeset again on its own, and the next one
+		# by a new engine.
+		self.assertEqual(self.log('latex.log'), ['engine', 'run', 'engine'])
+		self.assertEqual(self.pages(), [1, 3, 0, 1])
+
+	def testFallbackWhenDvipngFailsOnTheEngine(self):
+		self.writeStub('dvipng', dvipngStub("""[ "$dvi" = engine.dvi ] && exit 1
+echo png > "$out"
+echo "$dvi $page" >> "$(dirname "$0")/dvipng.log"
+"""))
+		self.render(['a', 'b'])
+		self.assertEqual(self.log('latex.log'), ['engine', 'run', 'engine', 'run'])
+		self.assertEqual(self.pages(), [0, 0])
+
+	def testRestartAfterManyFormulas(self):
+		self.render(['x_{%d}' % i for i in range(260)])
+		self.assertEqual(self.log('latex.log'), ['engine', 'engine'])
+		self.assertEqual(self.pages()[255:258], [511, 1, 3])
+
+if __name__ == '__main__':
+	unittest.main()
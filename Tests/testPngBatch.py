@@ -0,0 +1,82 @@
+#!/usr/bin/python
+
+# Tests that queued formulas are typeset together ("--png-batch-size"), with
+# stand-ins for latex and dvipng.
+
+from subprocess import Popen, PIPE
+import json
+import os
+import unittest
+import xml.etree.ElementTree as ET
+from stubTools import BLAHTEX, StubTestCase, dvipngStub, latexStub
+
+# Takes a while, so that formulas queue up behind the first one, and logs
+# its runs. It writes the subscripts of the formulas it is given, one per
+# page, to $base.pages, and fails on a formula containing "ZZZ" (purified
+# as "Z Z Z").
+LATEX = latexStub("""sleep 0.3
+grep -c 'begin{preview}' "$f" >> "$(dirname "$0")/latex.log"
+grep -o '_{[ 0-9]*}' "$f" | tr -dc '0-9\\n' > "$base.pages"
+grep -q 'Z Z Z' "$f" && exit 1
+""")
+
+# Reports the subscript of the formula on each page as its depth, so that
+# the dimensions can be traced back to their formula.
+DVIPNG = dvipngStub("""echo png > "$out"
+depth=$(sed -n "${k}p" "${dvi%.dvi}.pages")
+height=$((depth + 10))
+""")
+
+class PngBatchTests(StubTestCase):
+	LATEX = LATEX
+	DVIPNG = DVIPNG
+
+	def render(self, inputs, options=[]):
+		requests = [json.dumps({'id': i, 'input': tex, 'options': ['--png', '--use-preview-package']})
+			for i, tex in enumerate(inputs)]
+		p = Popen([BLAHTEX, '--batch', '--threads', '20', '--png-workers', '1'] + self.stubOptions() + [
+			'--temp-directory', self.dir + '/', '--png-directory', self.dir + '/'] + options,
+			stdin=PIPE, stdout=PIPE)
+		output = p.communicate(("\n".join(requests) + "\n").encode())[0]
+		return [ET.fromstring(json.loads(line)['output']).find('png')
+			for line in output.decode().splitlines()]
+
+	# The number of formulas in each latex run.
+	def latexRuns(self):
+		with open(os.path.join(self.dir, 'latex.log')) as f:
+			return [int(line) for line in f.read().split()]
+
+	def testPagesAreMappedBack(self):
+		pngs = self.render(['x_{%d}' % i for i in range(20)])
+		for i, png in enumerate(pngs):
+			self.assertEqual(png.find('depth').text, str(i))
+			self.assertEqual(png.find('height').text, str(i + 10))
+			self.assertTrue(os.path.exists(os.path.join(self.dir, png.find('md5').text + '.png')))
+		# At most the first formula is typeset on its own; the others queue
+		# up behind it, and go in batches of at most 16.
+		runs = self.latexRuns()
+		self.assertEqual(sum(runs), 20)
+		self.assertTrue(len(runs) <= 3)
+		self.assertTrue(max(runs) > 1)
+		self.assertTrue(max(runs) <= 16)
+
+	def testFailingFormulaIsIsolated(self):
+		inputs = ['x_{%d}' % i for i in range(6)]
+		inputs[3] = 'ZZZ_{3}'
+		pngs = self.render(inputs)
+		for i, png in enumerate(pngs):
+			if i == 3:
+				self.assertEqual(png.find('error/id').text, 'CannotRunLatex')
+			else:
+				self.assertEqual(png.find('depth').text, str(i))
+		# The batch with the failing formula is typeset again one by one.
+		runs = self.latexRuns()
+		self.assertTrue(max(runs) > 1)
+		self.assertEqual(runs[-5:], [1] * 5)
+
+	def testBatchSizeOne(self):
+		self.render(['x_{%d}' % i for i in range(5)], ['--png-batch-size', '1'])
+		self.assertEqual(self.latexRuns(), [1] * 5)
+
+if __name__ == '__main__':
+	unittest.main()
@@ -0,0 +1,79 @@
+#!/usr/bin/python
+
+# Tests "--png-dpi" and "--png-resolutions" with stand-ins for latex and
+# dvipng.
+
+from subprocess import Popen, PIPE
+import os
+import unittest
+import xml.etree.ElementTree as ET
+from stubTools import BLAHTEX, StubTestCase, dvipngStub
+
+# Records the resolution of every image it writes, both in the image and in
+# a log of its runs, and reports dimensions in proportion to it.
+DVIPNG = dvipngStub("""echo "$dpi" > "$out"
+echo "$dpi" >> "$(dirname "$0")/dvipng.log"
+height=$((dpi / 10)); depth=$((dpi / 40))
+""")
+
+class PngResolutionTests(StubTestCase):
+	DVIPNG = DVIPNG
+
+	def render(self, tex, options=[]):
+		p = Popen([BLAHTEX, '--png'] + self.stubOptions() + [
+			'--temp-directory', self.dir + '/', '--png-directory', self.dir + '/'] + options,
+			stdin=PIPE, stdout=PIPE)
+		return ET.fromstring(p.communicate(tex)[0]).find('png')
+
+	def dvipngRuns(self):
+		path = os.path.join(self.dir, 'dvipng.log')
+		if not os.path.exists(path):
+			return []
+		with open(path) as f:
+			runs = f.read().split()
+		os.unlink(path)
+		return runs
+
+	def image(self, name):
+		with open(os.path.join(self.dir, name)) as f:
+			return f.read().strip()
+
+	def testChangingDpiRendersAgain(self):
+		md5 = self.render(b'x^2').find('md5').text
+		self.assertEqual(self.dvipngRuns(), ['120'])
+		self.render(b'x^2')
+		self.assertEqual(self.dvipngRuns(), [])
+
+		self.assertEqual(self.render(b'x^2', ['--png-dpi', '300']).find('md5').text, md5)
+		self.assertEqual(self.dvipngRuns(), ['300'])
+		self.assertEqual(self.image(md5 + '.png'), '300')
+		self.render(b'x^2', ['--png-dpi', '300'])
+		self.assertEqual(self.dvipngRuns(), [])
+	def resolutions(self, png):
+		return [(r.get('scale'), r.find('height').text, r.find('depth').text)
+			for r in png.findall('resolution')]
+
+	def testResolutions(self):
+		options = ['--use-preview-package', '--png-resolutions', '1,2,3']
+		png = self.render(b'x^2', options)
+		md5 = png.find('md5').text
+		self.assertEqual((png.find('height').text, png.find('depth').text), ('12', '3'))
+		self.assertEqual(self.resolutions(png), [('2', '24', '6'), ('3', '36', '9')])
+		self.assertEqual(self.image(md5 + '.png'), '120')
+		self.assertEqual(self.image(md5 + '@2x.png'), '240')
+		self.assertEqual(self.image(md5 + '@3x.png'), '360')
+		# The scaled copies come first, from the same latex run.
+		self.assertEqual(self.dvipngRuns(), ['240', '360', '120'])
+
+		# A hit reports the same, from the .dim file.
+		png = self.render(b'x^2', options)
+		self.assertEqual(self.dvipngRuns(), [])
+		self.assertEqual(self.resolutions(png), [('2', '24', '6'), ('3', '36', '9')])
+
+		# A scale that wasn't rendered yet makes it a miss.
+		png = self.render(b'x^2', ['--use-preview-package', '--png-resolutions', '4'])
+		self.assertEqual(self.dvipngRuns(), ['480', '120'])
+		self.assertEqual(self.resolutions(png), [('4', '48', '12')])
+
+if __name__ == '__main__':
+	unittest.main()
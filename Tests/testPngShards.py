@@ -0,0 +1,61 @@
+#!/usr/bin/python
+
+# Tests "--png-shard-levels" and "--png-shard-existing" with stand-ins for
+# latex and dvipng.
+
+from subprocess import Popen, PIPE
+import os
+import unittest
+import xml.etree.ElementTree as ET
+from stubTools import BLAHTEX, StubTestCase, latexStub
+
+class PngShardTests(StubTestCase):
+	LATEX = latexStub('echo "$f" >> "$(dirname "$0")/latex.log"')
+
+	def setUp(self):
+		StubTestCase.setUp(self)
+		self.png = os.path.join(self.dir, 'png')
+		os.mkdir(self.png)
+
+	def blahtex(self, options, input=b''):
+		p = Popen([BLAHTEX, '--png'] + self.stubOptions() + [
+			'--temp-directory', self.dir + '/', '--png-directory', self.png + '/'] + options,
+			stdin=PIPE, stdout=PIPE)
+		return p.communicate(input)[0]
+
+	def render(self, tex, options=[]):
+		return ET.fromstring(self.blahtex(options, tex)).find('png/md5').text
+
+	def latexRuns(self):
+		with open(os.path.join(self.dir, 'latex.log')) as f:
+			return len(f.read().split())
+
+	def sharded(self, md5, name):
+		return os.path.join(self.png, md5[0:2], md5[2:4], name)
+
+	def testShardedLayout(self):
+		md5 = self.render(b'x^2', ['--png-shard-levels', '2'])
+		self.assertEqual(os.listdir(self.png), [md5[0:2]])
+		self.assertEqual(sorted(os.listdir(self.sharded(md5, ''))), [md5 + '.dim', md5 + '.png'])
+		# The sharded image is found again.
+		self.render(b'x^2', ['--png-shard-levels', '2'])
+		self.assertEqual(self.latexRuns(), 1)
+
+	def testMigrateFlatStore(self):
+		md5s = [self.render(tex) for tex in [b'a', b'b', b'c']]
+		self.assertEqual(len(os.listdir(self.png)), 6)
+
+		output = self.blahtex(['--png-shard-levels', '2', '--png-shard-existing'])
+		self.assertEqual(output.strip(), b'Moved 6 files')
+		for md5 in md5s:
+			self.assertTrue(os.path.exists(self.sharded(md5, md5 + '.png')))
+			self.assertTrue(os.path.exists(self.sharded(md5, md5 + '.dim')))
+		self.assertFalse([name for name in os.listdir(self.png) if name.endswith('.png')])
+
+		# The migrated images are still cache hits.
+		for tex in [b'a', b'b', b'c']:
+			self.render(tex, ['--png-shard-levels', '2'])
+		self.assertEqual(self.latexRuns(), 3)
+
+if __name__ == '__main__':
+	unittest.main()
@@ -0,0 +1,96 @@
+#!/usr/bin/python
+
+# Tests the "--png-store-budget" index with stand-ins for latex and dvipng.
+
+from subprocess import Popen, PIPE
+import fcntl
+import os
+import socket
+import time
+import unittest
+import xml.etree.ElementTree as ET
+from blahtexClient import BlahtexClient
+from stubTools import BLAHTEX, StubTestCase
+
+RECORD_SIZE = 40
+
+class PngStoreTests(StubTestCase):
+	def setUp(self):
+		StubTestCase.setUp(self)
+		self.png = os.path.join(self.dir, 'png')
+		os.mkdir(self.png)
+		self.index = os.path.join(self.png, 'blahtex-store.idx')
+
+	def blahtex(self, options, input=b''):
+		p = Popen([BLAHTEX, '--png'] + self.stubOptions() + [
+			'--temp-directory', self.dir + '/', '--png-directory', self.png + '/',
+			'--png-store-budget', '1M'] + options, stdin=PIPE, stdout=PIPE)
+		return p.communicate(input)[0]
+
+	def render(self, tex):
+		return ET.fromstring(self.blahtex([], tex)).find('png/md5').text
+
+	def testTornAppendIsSkipped(self):
+		first = self.render(b'a')
+		# What a writer that died halfway through a record leaves behind.
+		with open(self.index, 'ab') as f:
+			f.write(b'\x17' * 13)
+		second = self.render(b'b')
+		self.assertEqual(self.blahtex(['--png-evict']).strip(), b'Evicted 0 images')
+
+		with open(self.index, 'rb') as f:
+			index = f.read()
+		self.assertEqual(len(index), 2 * RECORD_SIZE)
+		self.assertIn(bytes.fromhex(first), index)
+		self.assertIn(bytes.fromhex(second), index)
+
+	def testDamagedRecordIsSkipped(self):
+		first = self.render(b'a')
+		second = self.render(b'b')
+		with open(self.index, 'r+b') as f:
+			f.seek(20)
+			f.write(b'\xff')
+		self.blahtex(['--png-evict'])
+
+		with open(self.index, 'rb') as f:
+			index = f.read()
+		self.assertEqual(len(index), RECORD_SIZE)
+		self.assertIn(bytes.fromhex(second), index)
+
+	def testBusyImageIsNotEvicted(self):
+		md5 = self.render(b'a')
+		image = os.path.join(self.png, md5 + '.png')
+		# What a renderer working on the same image holds.
+		with open(os.path.join(self.dir, md5 + '.lock'), 'w') as lock:
+			fcntl.flock(lock, fcntl.LOCK_EX)
+			output = self.blahtex(['--png-store-budget', '1', '--png-evict'])
+			self.assertEqual(output.strip(), b'Evicted 0 images')
+			self.assertTrue(os.path.exists(image))
+		output = self.blahtex(['--png-store-budget', '1', '--png-evict'])
+		self.assertEqual(output.strip(), b'Evicted 1 images')
+		self.assertFalse(os.path.exists(image))
+
+	def testRepeatedHitsAreRecordedOnce(self):
+		path = os.path.join(self.dir, 'blahtex.sock')
+		server = Popen([BLAHTEX, '--server', path] + self.stubOptions() + [
+			'--temp-directory', self.dir + '/', '--png-directory', self.png + '/',
+			'--png-store-budget', '1M'])
+		try:
+			for i in range(100):
+				try:
+					client = BlahtexClient(path)
+					break
+				except socket.error:
+					time.sleep(0.05)
+			for i in range(5):
+				self.assertIn('<md5>', client.convert('a', ['--png'])['output'])
+			client.close()
+		finally:
+			server.kill()
+			server.wait()
+
+		# One record for the render; the hits right after it add nothing.
+		self.assertEqual(os.path.getsize(self.index), RECORD_SIZE)
+
+if __name__ == '__main__':
+	unittest.main()
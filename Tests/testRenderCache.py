@@ -0,0 +1,58 @@
+#!/usr/bin/python
+
+# Tests that images already in the PNG directory are reused, with their
+# dimensions, using stand-ins for latex and dvipng.
+
+from subprocess import Popen, PIPE
+import os
+import unittest
+import xml.etree.ElementTree as ET
+from stubTools import BLAHTEX, StubTestCase, latexStub
+
+class RenderCacheTests(StubTestCase):
+	LATEX = latexStub('echo "$f" >> "$(dirname "$0")/latex.log"')
+
+	def render(self, tex, options=[]):
+		p = Popen([BLAHTEX, '--png', '--use-preview-package'] + self.stubOptions() + [
+			'--temp-directory', self.dir + '/', '--png-directory', self.dir + '/'] + options,
+			stdin=PIPE, stdout=PIPE)
+		return ET.fromstring(p.communicate(tex)[0]).find('png')
+
+	def latexRuns(self):
+		path = os.path.join(self.dir, 'latex.log')
+		if not os.path.exists(path):
+			return 0
+		with open(path) as f:
+			return len(f.read().split())
+
+	def testSecondRenderIsAHit(self):
+		first = self.render(b'x^2')
+		self.assertEqual(self.latexRuns(), 1)
+		second = self.render(b'x^2')
+		self.assertEqual(self.latexRuns(), 1)
+		for tag in ['md5', 'height', 'depth']:
+			self.assertEqual(second.find(tag).text, first.find(tag).text)
+
+	def testDimensionsComeFromTheDimFile(self):
+		md5 = self.render(b'x^2').find('md5').text
+		with open(os.path.join(self.dir, md5 + '.dim'), 'w') as f:
+			f.write('20 7\ndpi 120\n')
+		png = self.render(b'x^2')
+		self.assertEqual(png.find('height').text, '20')
+		self.assertEqual(png.find('depth').text, '7')
+		self.assertEqual(self.latexRuns(), 1)
+
+	def testIncompleteEntryIsRenderedAgain(self):
+		md5 = self.render(b'x^2').find('md5').text
+		os.unlink(os.path.join(self.dir, md5 + '.dim'))
+		self.assertEqual(self.render(b'x^2').find('height').text, '12')
+		self.assertEqual(self.latexRuns(), 2)
+		self.assertTrue(os.path.exists(os.path.join(self.dir, md5 + '.dim')))
+
+	def testNoCache(self):
+		self.render(b'x^2')
+		self.render(b'x^2', ['--png-no-cache'])
+		self.assertEqual(self.latexRuns(), 2)
+
+if __name__ == '__main__':
+	unittest.main()
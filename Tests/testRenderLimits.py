@@ -0,0 +1,79 @@
+#!/usr/bin/python
+
+# Tests that "--png-timeout", "--png-cpu-limit" and "--png-memory-limit" are
+# reported only when that limit was really hit, using stand-ins for latex.
+
+from subprocess import Popen, PIPE
+import unittest
+import xml.etree.ElementTree as ET
+from stubTools import BLAHTEX, StubTestCase
+
+SPIN = """#!/bin/sh
+while :; do :; done
+"""
+
+SLEEP = """#!/bin/sh
+sleep 30
+"""
+
+KILLED = """#!/bin/sh
+kill -9 $$
+"""
+
+FAIL = """#!/bin/sh
+exit 1
+"""
+
+# Allocates (and touches) memory until it runs out.
+ALLOCATE = """#!/usr/bin/env python3
+chunks = []
+while True:
+	chunks.append(b"x" * (8 << 20))
+"""
+
+# Uses a good part of its memory limit, then fails for another reason.
+ALLOCATE_THEN_FAIL = """#!/usr/bin/env python3
+import sys
+chunk = b"x" * (160 << 20)
+sys.exit(1)
+"""
+
+class RenderLimitTests(StubTestCase):
+	def render(self, latex, options):
+		path = self.writeStub('latex', latex)
+		p = Popen([BLAHTEX, '--png', '--shell-latex', path,
+			'--temp-directory', self.dir + '/', '--png-directory', self.dir + '/'] + options,
+			stdin=PIPE, stdout=PIPE)
+		error = ET.fromstring(p.communicate(b'x')[0]).find('png/error')
+		args = [arg.text for arg in error.findall('arg')]
+		return error.find('id').text, args
+
+	def testTimeout(self):
+		id, args = self.render(SLEEP, ['--png-timeout', '1'])
+		self.assertEqual(id, 'RenderLimitExceeded')
+		self.assertEqual(args[1], 'time')
+
+	def testCpuLimit(self):
+		id, args = self.render(SPIN, ['--png-cpu-limit', '1'])
+		self.assertEqual(id, 'RenderLimitExceeded')
+		self.assertEqual(args[1], 'CPU time')
+
+	def testMemoryLimit(self):
+		id, args = self.render(ALLOCATE, ['--png-memory-limit', '256M'])
+		self.assertEqual(id, 'RenderLimitExceeded')
+		self.assertEqual(args[1], 'memory')
+
+	def testFailureBelowMemoryLimitIsNotALimit(self):
+		id, args = self.render(ALLOCATE_THEN_FAIL, ['--png-memory-limit', '256M'])
+		self.assertEqual(id, 'CannotRunLatex')
+
+	def testKillIsNotALimit(self):
+		id, args = self.render(KILLED, ['--png-cpu-limit', '5', '--png-memory-limit', '256M'])
+		self.assertEqual(id, 'CannotRunLatex')
+
+	def testFailureIsNotALimit(self):
+		id, args = self.render(FAIL, ['--png-cpu-limit', '5', '--png-memory-limit', '256M'])
+		self.assertEqual(id, 'CannotRunLatex')
+
+if __name__ == '__main__':
+	unittest.main()
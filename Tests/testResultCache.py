@@ -0,0 +1,124 @@
+#!/usr/bin/python
+
+from subprocess import Popen, PIPE
+import http.client
+import json
+import os
+import re
+import shutil
+import signal
+import socket
+import tempfile
+import time
+import unittest
+from blahtexClient import BlahtexClient
+
+BLAHTEX = os.environ.get('BLAHTEX', '../Build/blahtex')
+
+def statistics(stderr):
+	match = re.search(r'result cache: (\d+) hits, (\d+) misses, (\d+) insertions, (\d+) evictions, (\d+) rejections', stderr)
+	return dict(zip(['hits', 'misses', 'insertions', 'evictions', 'rejections'], map(int, match.groups())))
+
+class ResultCacheTests(unittest.TestCase):
+	def setUp(self):
+		print("")
+
+	def runBatch(self, requests, options=[]):
+		lines = [json.dumps(r) for r in requests]
+		p = Popen([BLAHTEX, '--batch', '--mathml'] + options, stdout=PIPE, stdin=PIPE, stderr=PIPE)
+		output, error = p.communicate(("\n".join(lines) + "\n").encode())
+		return [json.loads(line) for line in output.decode().splitlines()], error.decode()
+
+	def testSameOutputAsWithoutCache(self):
+		requests = [{'id': i, 'input': t} for i in range(3) for t in ['x^2', '\\frac12', '\\foo', 'a_{']]
+		requests += [{'id': 'd', 'input': 'x^2', 'options': ['--displaymath']},
+			{'id': 'e', 'input': 'x^2', 'options': ['--mathml-encoding', 'long']}]
+		expected, error = self.runBatch(requests)
+		self.assertEqual(error, '')
+		for threads in ['1', '3']:
+			results, error = self.runBatch(requests, ['--cache-size', '1M', '--threads', threads])
+			self.assertEqual(results, expected)
+			counts = statistics(error)
+			self.assertEqual(counts['hits'] + counts['misses'], len(requests))
+			# Requests that differ in their options only are told apart.
+			# With several threads, two workers may both miss a key before
+			# either has added it.
+			if threads == '1':
+				self.assertEqual(counts['misses'], 6)
+
+	def testOneOffFormulasDoNotEvictHotOnes(self):
+		# Between two rounds of the hot formulas come more one-off formulas
+		# than the cache holds, so an LRU cache would never hit.
+		requests = []
+		for round in range(20):
+			requests += [{'id': 0, 'input': 'h_{%d}^2' % k} for k in range(30)]
+			requests += [{'id': 0, 'input': 's_{%d}' % (round * 400 + k)} for k in range(400)]
+		results, error = self.runBatch(requests, ['--cache-size', '64K'])
+		counts = statistics(error)
+		self.assertTrue(counts['rejections'] > 0)
+		self.assertTrue(counts['hits'] > 0.5 * 30 * 20, counts)
+
+	def testForkServerCachesInTheServer(self):
+		directory = tempfile.mkdtemp()
+		path = os.path.join(directory, 'blahtex.sock')
+		server = Popen([BLAHTEX, '--server', path, '--fork-server', '--mathml', '--cache-size', '1M'], stderr=PIPE)
+		try:
+			for i in range(100):
+				try:
+					client = BlahtexClient(path)
+					break
+				except socket.error:
+					time.sleep(0.05)
+			first = client.convert('x^2')
+			second = client.convert('x^2')
+			self.assertEqual(first['output'], second['output'])
+			self.assertTrue('error' in client.convert('x', ['--no-such-option']))
+			server.send_signal(signal.SIGTERM)
+			counts = statistics(server.communicate()[1].decode())
+			self.assertEqual((counts['hits'], counts['insertions']), (1, 1))
+		finally:
+			if server.poll() is None:
+				server.kill()
+				server.wait()
+			shutil.rmtree(directory)
+
+	def testHttpAnswersAreCached(self):
+		s = socket.socket()
+		s.bind(('127.0.0.1', 0))
+		port = s.getsockname()[1]
+		s.close()
+		server = Popen([BLAHTEX, '--http', str(port), '--cache-size', '1M'], stderr=PIPE)
+		try:
+			for i in range(100):
+				try:
+					socket.create_connection(('127.0.0.1', port)).close()
+					break
+				except socket.error:
+					time.sleep(0.05)
+			connection = http.client.HTTPConnection('127.0.0.1', port)
+			answers = []
+			for body in ['q=x%5E2', 'q=x%5E2', 'q=%5Cfoo', 'q=%5Cfoo', 'q=x%5E2&type=inline-tex']:
+				connection.request('POST', '/mathml', body, {'Content-Type': 'application/x-www-form-urlencoded'})
+				response = connection.getresponse()
+				answers.append((response.status, response.getheader('Content-Type'), response.read()))
+			connection.close()
+			self.assertEqual(answers[0], answers[1])
+			self.assertEqual(answers[2], answers[3])
+			self.assertEqual(answers[2][0], 400)
+			self.assertNotEqual(answers[0][2], answers[4][2])
+			server.send_signal(signal.SIGTERM)
+			counts = statistics(server.communicate()[1].decode())
+			self.assertEqual((counts['hits'], counts['misses']), (2, 3))
+		finally:
+			if server.poll() is None:
+				server.kill()
+				server.wait()
+
+	def testRequiresAServingMode(self):
+		p = Popen([BLAHTEX, '--mathml', '--cache-size', '1M'], stdin=PIPE, stdout=PIPE, stderr=PIPE)
+		error = p.communicate(b'x')[1]
+		self.assertTrue(b'requires "--batch"' in error)
+
+
+if __name__ == '__main__':
+	unittest.main()
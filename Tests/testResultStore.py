@@ -0,0 +1,109 @@
+#!/usr/bin/python
+
+from subprocess import Popen, PIPE
+import json
+import os
+import re
+import shutil
+import tempfile
+import unittest
+
+BLAHTEX = os.environ.get('BLAHTEX', '../Build/blahtex')
+
+def statistics(stderr):
+	match = re.search(r'cache file: (\d+) hits, (\d+) misses, (\d+) insertions, (\d+) compactions, (\d+) entries', stderr)
+	return dict(zip(['hits', 'misses', 'insertions', 'compactions', 'entries'], map(int, match.groups())))
+
+class ResultStoreTests(unittest.TestCase):
+	def setUp(self):
+		print("")
+		self.dir = tempfile.mkdtemp()
+		self.path = os.path.join(self.dir, 'results.cache')
+
+	def tearDown(self):
+		shutil.rmtree(self.dir)
+
+	# The requests and the results go through files, so that several
+	# processes can run at once.
+	def startBatch(self, requests, options=[]):
+		input, output, error = [tempfile.TemporaryFile(dir=self.dir) for i in range(3)]
+		input.write(("\n".join(json.dumps(r) for r in requests) + "\n").encode())
+		input.seek(0)
+		p = Popen([BLAHTEX, '--batch', '--mathml', '--cache-file', self.path] + options, stdin=input, stdout=output, stderr=error)
+		p.files = (input, output, error)
+		return p
+
+	def finishBatch(self, p):
+		p.wait()
+		input, output, error = p.files
+		output.seek(0)
+		error.seek(0)
+		results = [json.loads(line) for line in output.read().decode().splitlines()], error.read().decode()
+		for f in p.files:
+			f.close()
+		return results
+
+	def runBatch(self, requests, options=[]):
+		return self.finishBatch(self.startBatch(requests, options))
+
+	def testResultsOutliveTheProcess(self):
+		requests = [{'id': i, 'input': t} for i, t in enumerate(['x^2', '\\frac12', '\\foo', 'a_{'])]
+		requests.append({'id': 'd', 'input': 'x^2', 'options': ['--displaymath']})
+		first, error = self.runBatch(requests)
+		self.assertEqual(statistics(error)['insertions'], 5)
+		second, error = self.runBatch(requests)
+		self.assertEqual(second, first)
+		self.assertEqual(statistics(error)['hits'], 5)
+
+		# The command line shares the results of batch mode.
+		p = Popen([BLAHTEX, '--mathml', '--cache-file', self.path], stdin=PIPE, stdout=PIPE, stderr=PIPE)
+		output = p.communicate(b'\\frac12')[0].decode()
+		self.assertEqual(output, first[1]['output'])
+
+	def testConcurrentProcesses(self):
+		processes = [self.startBatch([{'id': k, 'input': 'x_{%d}' % k} for k in range(j * 1000, j * 1000 + 2000)]) for j in range(4)]
+		for p in processes:
+			results, error = self.finishBatch(p)
+			self.assertEqual(len(results), 2000)
+			for r in results:
+				self.assertTrue('<mn>%d</mn>' % r['id'] in r['output'])
+		# 5000 entries take more than one compaction to fit in the index.
+		results, error = self.runBatch([{'id': k, 'input': 'x_{%d}' % k} for k in range(5000)])
+		counts = statistics(error)
+		self.assertEqual((counts['hits'], counts['entries']), (5000, 5000))
+
+	def testAnotherGenerationStartsAfresh(self):
+		self.runBatch([{'id': 0, 'input': 'y'}])
+		with open(self.path, 'r+b') as f:
+			f.seek(16)
+			f.write(b'blahtex 0.9')
+		results, error = self.runBatch([{'id': 0, 'input': 'y'}])
+		counts = statistics(error)
+		self.assertEqual((counts['hits'], counts['insertions'], counts['entries']), (0, 1, 1))
+		self.assertTrue('<mi>y</mi>' in results[0]['output'])
+
+	def testBudgetKeepsTheNewestResults(self):
+		requests = [{'id': k, 'input': 'z_{%d}' % k} for k in range(2000)]
+		results, error = self.runBatch(requests, ['--cache-file-size', '64K'])
+		self.assertTrue(statistics(error)['compactions'] > 0)
+		results, error = self.runBatch(requests[-20:] + requests[:20], ['--cache-file-size', '64K'])
+		self.assertEqual(statistics(error)['hits'], 20)
+		self.assertTrue(os.path.getsize(self.path) < 300000)
+
+	def testCompact(self):
+		self.runBatch([{'id': k, 'input': 'w_{%d}' % k} for k in range(100)])
+		p = Popen([BLAHTEX, '--cache-file', self.path, '--cache-compact'], stdout=PIPE)
+		self.assertEqual(p.communicate()[0], b'Compacted the cache file to 100 entries\n')
+
+	def testRefusesOtherFiles(self):
+		with open(self.path, 'w') as f:
+			f.write('not a cache\n')
+		p = Popen([BLAHTEX, '--mathml', '--cache-file', self.path], stdin=PIPE, stdout=PIPE, stderr=PIPE)
+		error = p.communicate(b'x')[1]
+		self.assertTrue(b'is not a blahtex cache file' in error)
+		with open(self.path) as f:
+			self.assertEqual(f.read(), 'not a cache\n')
+
+
+if __name__ == '__main__':
+	unittest.main()
@@ -0,0 +1,103 @@
+#!/usr/bin/python
+
+from subprocess import Popen
+import os
+import signal
+import socket
+import time
+import unittest
+from blahtexClient import BlahtexClient
+from stubTools import BLAHTEX, StubTestCase, latexStub
+
+class ServerTests(StubTestCase):
+	# A latex that takes a while, so that requests for PNG images pile up.
+	LATEX = latexStub('sleep 0.5')
+
+	def setUp(self):
+		StubTestCase.setUp(self)
+		self.socket = os.path.join(self.dir, 'blahtex.sock')
+		self.server = None
+
+	def tearDown(self):
+		if self.server and self.server.poll() is None:
+			self.server.kill()
+			self.server.wait()
+		StubTestCase.tearDown(self)
+
+	def startServer(self, options):
+		self.server = Popen([BLAHTEX, '--server', self.socket, '--mathml']
+			+ self.stubOptions() + [
+			'--temp-directory', self.dir, '--png-directory', self.dir] + options)
+		for i in range(100):
+			try:
+				return BlahtexClient(self.socket)
+			except socket.error:
+				time.sleep(0.05)
+		self.fail('the server did not start')
+
+	def testPipelinedResponsesInOrder(self):
+		client = self.startServer(['--threads', '4'])
+		ids = [client.send({'input': 'x^{%d}' % i}) for i in range(200)]
+		responses = [client.receive() for i in range(200)]
+		self.assertEqual([r['id'] for r in responses], ids)
+		self.assertTrue('<mn>199</mn>' in responses[199]['output'])
+
+		# Several connections at once, with their own options.
+		other = BlahtexClient(self.socket)
+		self.assertTrue('displaystyle' in other.convert('y', ['--displaymath'])['output'])
+		self.assertFalse('displaystyle' in client.convert('y')['output'])
+		self.assertTrue('error' in client.convert('z', ['--no-such-option']))
+		client.sendRaw(b'not json')
+		self.assertTrue('Malformed' in client.receive()['error'])
+
+	def testOverload(self):
+		client = self.startServer(['--threads', '1', '--max-queue', '1'])
+		for i in range(6):
+			client.send({'input': 'x_{%d}' % i, 'options': ['--png']})
+		responses = [client.receive() for i in range(6)]
+		overloaded = [r for r in responses if r.get('overloaded')]
+		converted = [r for r in responses if 'output' in r]
+		self.assertTrue(len(overloaded) >= 3)
+		self.assertTrue(len(converted) >= 1)
+		self.assertEqual(len(overloaded) + len(converted), 6)
+
+	def testGracefulShutdown(self):
+		client = self.startServer(['--threads', '1'])
+		for i in range(3):
+			client.send({'input': 'y_{%d}' % i, 'options': ['--png']})
+		time.sleep(0.2)
+		self.server.send_signal(signal.SIGTERM)
+
+		# The requests already sent are still answered.
+		for i in range(3):
+			response = client.receive()
+			self.assertTrue('<md5>' in response['output'])
+		self.assertEqual(client.receive(), None)
+		self.assertEqual(self.server.wait(), 0)
+		self.assertFalse(os.path.exists(self.socket))
+
+	def testConnectionLimit(self):
+		first = self.startServer(['--threads', '1', '--max-connections', '1'])
+		self.assertTrue('<mi>a</mi>' in first.convert('a')['output'])
+
+		# The second client waits to be accepted until the first one leaves.
+		second = BlahtexClient(self.socket)
+		second.send({'input': 'b'})
+		second.socket.settimeout(0.5)
+		self.assertRaises(socket.timeout, second.receive)
+		second.socket.settimeout(None)
+		first.close()
+		self.assertTrue('<mi>b</mi>' in second.receive()['output'])
+
+	def testClientThatDoesNotReadDoesNotHoldUpShutdown(self):
+		client = self.startServer(['--threads', '1'])
+		# Far more output than the socket can hold.
+		for i in range(40):
+			client.send({'input': 'x+' * 1500 + 'x'})
+		time.sleep(1)
+		self.server.send_signal(signal.SIGTERM)
+		self.assertEqual(self.server.wait(timeout=20), 0)
+
+
+if __name__ == '__main__':
+	unittest.main()
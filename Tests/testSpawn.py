@@ -0,0 +1,47 @@
+#!/usr/bin/python
+
+# Tests how latex and dvipng are started (see Process.h), using stand-ins
+# that log their working directory and arguments.
+
+from subprocess import Popen, PIPE
+import os
+import unittest
+import xml.etree.ElementTree as ET
+from stubTools import BLAHTEX, StubTestCase, latexStub, dvipngStub
+
+class SpawnTests(StubTestCase):
+	LATEX = latexStub('echo "latex $(pwd) $1" >> "$(dirname "$0")/run.log"')
+	DVIPNG = dvipngStub('echo png > "$out"; echo "dvipng $(pwd)" >> "$(dirname "$0")/run.log"')
+
+	def setUp(self):
+		StubTestCase.setUp(self)
+		os.mkdir(os.path.join(self.dir, 'temp'))
+		os.mkdir(os.path.join(self.dir, 'png'))
+
+	# Runs blahtex from self.dir, with relative directories.
+	def render(self, tex, latex=None):
+		p = Popen([os.path.abspath(BLAHTEX), '--png', '--use-preview-package',
+			'--shell-latex', latex or self.latex, '--shell-dvipng', self.dvipng,
+			'--temp-directory', 'temp/', '--png-directory', 'png/'],
+			stdin=PIPE, stdout=PIPE, cwd=self.dir)
+		return ET.fromstring(p.communicate(tex)[0]).find('png')
+
+	def runs(self):
+		with open(os.path.join(self.dir, 'run.log')) as f:
+			return [line.split(' ') for line in f.read().splitlines()]
+
+	def testRunsInTheTempDirectory(self):
+		png = self.render(b'x^2')
+		self.assertEqual(png.find('depth').text, '3')
+		temp = os.path.realpath(os.path.join(self.dir, 'temp'))
+		self.assertEqual([run[:2] for run in self.runs()], [['latex', temp], ['dvipng', temp]])
+		# blahtex itself stayed where it was.
+		self.assertTrue(os.path.exists(os.path.join(self.dir, 'png', png.find('md5').text + '.png')))
+		self.assertEqual(os.listdir(os.path.join(self.dir, 'temp')), [])
+
+	def testCommandWithOptions(self):
+		self.render(b'x^2', self.latex + ' -interaction=nonstopmode')
+		self.assertEqual(self.runs()[0][2], '-interaction=nonstopmode')
+
+if __name__ == '__main__':
+	unittest.main()
@@ -0,0 +1,78 @@
+#!/usr/bin/python
+
+# Converts a corpus of formulas from many threads at once, with a blahtex
+# built with ThreadSanitizer ("make blahtex-tsan"), which reports any data
+# race it sees on standard error.
+
+from subprocess import Popen, PIPE
+import json
+import os
+import unittest
+from stubTools import StubTestCase
+
+BLAHTEX_TSAN = os.environ.get('BLAHTEX_TSAN', '../blahtex-tsan')
+
+CORPUS = [
+	'x^2 + y^2 = z^2',
+	'\\frac{1}{2} \\sqrt[3]{x}',
+	'\\sum_{k=1}^\\infty \\frac{x^k}{k!}',
+	'\\int_0^1 f(t)\\,dt',
+	'\\begin{pmatrix} a & b \\\\ c & d \\end{pmatrix}',
+	'\\begin{cases} 1 & x > 0 \\\\ 0 & \\text{otherwise} \\end{cases}',
+	'\\mathbb{R} \\to \\mathcal{C}',
+	'\\R \\Complex \\alef',
+	'\\left( \\frac{a}{b} \\right)^{\\!n}',
+	'\\operatorname{sin} x \\not= \\overbrace{a+b}^{n}',
+	'\\text{caf\u00e9} \; \\mathrm{d}x',
+	'\\newcommand{\\f}[1]{#1^2} \\f{x}',
+	'\\frac',
+	'x^{',
+	'\\unknowncommand',
+]
+
+OPTIONS = [
+	[],
+	['--displaymath'],
+	['--texvc-compatible-commands'],
+	['--indented', '--spacing', 'strict'],
+	['--debug', 'purified'],
+	['--png'],
+]
+
+# The stub latex and dvipng are there so that the PNG render pool is used
+# too.
+class ThreadSafetyTests(StubTestCase):
+	def setUp(self):
+		if not os.path.exists(BLAHTEX_TSAN):
+			self.skipTest('no ThreadSanitizer build at ' + BLAHTEX_TSAN)
+		StubTestCase.setUp(self)
+
+	def runBatch(self, threads):
+		requests = []
+		for i in range(20):
+			for j in range(len(CORPUS)):
+				options = OPTIONS[(i + j) % len(OPTIONS)]
+				requests.append(json.dumps({'id': len(requests), 'input': CORPUS[j], 'options': options}))
+		env = dict(os.environ)
+		env['TSAN_OPTIONS'] = 'halt_on_error=0 exitcode=66'
+		p = Popen([BLAHTEX_TSAN, '--batch', '--mathml', '--threads', str(threads),
+			'--png-workers', '4'] + self.stubOptions() + [
+			'--temp-directory', self.dir, '--png-directory', self.dir],
+			stdin=PIPE, stdout=PIPE, stderr=PIPE, env=env)
+		output, errors = p.communicate(("\n".join(requests) + "\n").encode())
+		return output.decode(), errors.decode(), p.returncode
+
+	def testNoDataRaces(self):
+		output, errors, status = self.runBatch(8)
+		self.assertFalse('ThreadSanitizer' in errors, errors)
+		self.assertEqual(status, 0)
+		self.assertEqual(len(output.splitlines()), 20 * len(CORPUS))
+
+	def testSameOutputAsOneThread(self):
+		single = self.runBatch(1)[0]
+		threaded = self.runBatch(8)[0]
+		self.assertEqual(single, threaded)
+
+
+if __name__ == '__main__':
+	unittest.main()